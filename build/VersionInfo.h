@@ -0,0 +1,7 @@
+#ifndef VERSIONINFO_H
+#define VERSIONINFO_H
+
+#define BUILD_TIMESTAMP "Mon Oct 19 12:06:56 UTC 2026"
+#define CLIENT_VERSION  "1.1.0"
+
+#endif /* VERSIONINFO_H */
@@ -22,6 +22,7 @@
 
 
 #include "Clients.h"
+#include "SocketBuffer.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -53,3 +54,23 @@ int clientSocketCompare(void* a, void* b)
 	/*printf("comparing %d with %d\n", (char*)a, (char*)b); */
 	return client->net.socket == *(int*)b;
 }
+
+
+/**
+ * Get the gauges for a client, other than #METRIC_QUEUED_COMMANDS, which is set to -1.
+ * The caller must hold the lock which protects the client's state.
+ * @param client the client
+ * @param gauges the gauges to fill in, indexed by METRIC_GAUGES
+ */
+void Clients_getGauges(Clients* client, int* gauges)
+{
+	pending_writes* pw = NULL;
+
+	gauges[METRIC_QUEUED_MESSAGES] = client->messageQueue->count;
+	gauges[METRIC_INFLIGHT_MESSAGES] = client->outboundMsgs->count;
+	gauges[METRIC_INBOUND_MESSAGES] = client->inboundMsgs->count;
+	gauges[METRIC_PENDING_WRITE_BYTES] = 0;
+	if (client->net.socket > 0 && (pw = SocketBuffer_getWrite(client->net.socket)) != NULL)
+		gauges[METRIC_PENDING_WRITE_BYTES] = (int)(pw->total - pw->bytes);
+	gauges[METRIC_QUEUED_COMMANDS] = -1;
+}
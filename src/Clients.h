@@ -29,6 +29,7 @@
 #include "MQTTClient.h"
 #include "LinkedList.h"
 #include "MQTTClientPersistence.h"
+#include "Metrics.h"
 /*BE
 include "LinkedList"
 BE*/
@@ -52,6 +53,7 @@ typedef struct
 	char* payload;
 	int payloadlen;
 	int refcount;
+	ListElement link;	/**< for the publications list: see ListZeroIntrusive */
 } Publications;
 
 /*BE
@@ -88,6 +90,7 @@ typedef struct
 	time_t lastTouch;		/**> used for retry and expiry */
 	char nextMessageType;	/**> PUBREC, PUBREL, PUBCOMP */
 	int len;				/**> length of the whole structure+data */
+	ListElement link;		/**> for the inboundMsgs or outboundMsgs list: see ListZeroIntrusive */
 } Messages;
 
 
@@ -155,6 +158,8 @@ typedef struct
 	SSL* ssl;
 	SSL_CTX* ctx;
 #endif
+	Metrics* metrics;	/**< the client's counters and histograms */
+	long long* stamps;	/**< the stage times of the publication being written, if it is being traced */
 } networkHandles;
 
 /**
@@ -184,14 +189,15 @@ typedef struct
 	MQTTClient_persistence* persistence; /* a persistence implementation */
 	void* context; /* calling context - used when calling disconnect_internal */
 	int MQTTVersion;
+	int compressPersistence; /* compress queued messages and commands when persisting them */
 #if defined(OPENSSL)
 	MQTTClient_SSLOptions *sslopts;
-	SSL_SESSION* session;    /***< SSL session pointer for fast handhake */
 #endif
 } Clients;
 
 int clientIDCompare(void* a, void* b);
 int clientSocketCompare(void* a, void* b);
+void Clients_getGauges(Clients* client, int* gauges);
 
 /**
  * Configuration data related to all clients
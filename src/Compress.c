@@ -0,0 +1,267 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Fast, self-contained block compression used for persisted records
+ *
+ * The encoded form is the LZ4 block format: a sequence of tokens, each made up
+ * of a run of literal bytes followed by a back reference (2 byte little endian
+ * offset, length) into the data already decoded.  The last sequence holds
+ * literals only.  The encoder is a single pass greedy matcher with a small
+ * hash table, which favours speed over compression ratio.
+ */
+
+#include <string.h>
+
+#include "Compress.h"
+#include "StackTrace.h"
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define LAST_LITERALS 5		/**< the last bytes of a block are always literals */
+#define MATCH_FIND_LIMIT 12	/**< a match must start at least this far from the end */
+
+
+static unsigned int Compress_hash(const unsigned char* p)
+{
+	unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+	return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+
+static unsigned char* Compress_writeLength(unsigned char* op, int len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+
+/**
+ * Compress a block of data.
+ * @param src the data to compress
+ * @param srclen the length of the data to compress
+ * @param dest the buffer to write the compressed data to
+ * @param destlen the size of dest.  Compress_bound(srclen) is always enough.
+ * @return the length of the compressed data, or 0 if it did not fit in dest
+ */
+int Compress_encode(const char* src, int srclen, char* dest, int destlen)
+{
+	const unsigned char* in = (const unsigned char*)src;
+	const unsigned char* ip = in;
+	const unsigned char* anchor = in;
+	const unsigned char* end = in + srclen;
+	unsigned char* op = (unsigned char*)dest;
+	unsigned char* oend = op + destlen;
+	int table[1 << HASH_LOG];
+	int litlen;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	memset(table, '\0', sizeof(table));
+	if (srclen > MATCH_FIND_LIMIT)
+	{
+		const unsigned char* mflimit = end - MATCH_FIND_LIMIT;
+		const unsigned char* matchlimit = end - LAST_LITERALS;
+
+		while (ip < mflimit)
+		{
+			unsigned int h = Compress_hash(ip);
+			const unsigned char* ref = in + table[h];
+
+			table[h] = (int)(ip - in);
+			if (ref < ip && ip - ref <= MAX_OFFSET && memcmp(ref, ip, MIN_MATCH) == 0)
+			{
+				const unsigned char* mp = ip + MIN_MATCH;
+				const unsigned char* rp = ref + MIN_MATCH;
+				unsigned char* token = NULL;
+				int offset = (int)(ip - ref);
+				int matchlen;
+
+				while (mp < matchlimit && *mp == *rp)
+				{
+					++mp;
+					++rp;
+				}
+				litlen = (int)(ip - anchor);
+				matchlen = (int)(mp - ip) - MIN_MATCH;
+
+				if (op + 1 + litlen + (litlen / 255) + 1 + 2 + (matchlen / 255) + 1 > oend)
+					goto exit;
+				token = op++;
+				*token = (unsigned char)(((litlen >= 15) ? 15 : litlen) << 4);
+				if (litlen >= 15)
+					op = Compress_writeLength(op, litlen - 15);
+				memcpy(op, anchor, litlen);
+				op += litlen;
+				*op++ = (unsigned char)(offset & 0xFF);
+				*op++ = (unsigned char)(offset >> 8);
+				*token |= (unsigned char)((matchlen >= 15) ? 15 : matchlen);
+				if (matchlen >= 15)
+					op = Compress_writeLength(op, matchlen - 15);
+				ip = anchor = mp;
+			}
+			else
+				++ip;
+		}
+	}
+
+	/* the remaining bytes are written as a literal only sequence */
+	litlen = (int)(end - anchor);
+	if (op + 1 + litlen + (litlen / 255) + 1 > oend)
+		goto exit;
+	*op++ = (unsigned char)(((litlen >= 15) ? 15 : litlen) << 4);
+	if (litlen >= 15)
+		op = Compress_writeLength(op, litlen - 15);
+	memcpy(op, anchor, litlen);
+	op += litlen;
+	rc = (int)(op - (unsigned char*)dest);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Decompress a block of data produced by Compress_encode.  The input is treated as
+ * untrusted: it is never read or written outside the buffers supplied.
+ * @param src the compressed data
+ * @param srclen the length of the compressed data
+ * @param dest the buffer to write the decompressed data to
+ * @param destlen the expected length of the decompressed data
+ * @return 0 if exactly destlen bytes were decoded, -1 otherwise
+ */
+int Compress_decode(const char* src, int srclen, char* dest, int destlen)
+{
+	const unsigned char* ip = (const unsigned char*)src;
+	const unsigned char* iend = ip + srclen;
+	unsigned char* out = (unsigned char*)dest;
+	unsigned char* op = out;
+	unsigned char* oend = out + destlen;
+	int rc = -1;
+
+	FUNC_ENTRY;
+	while (ip < iend)
+	{
+		unsigned int token = *ip++;
+		size_t litlen = token >> 4;
+		size_t matchlen = token & 0x0F;
+		size_t offset;
+		unsigned char* match = NULL;
+
+		if (litlen == 15)
+		{
+			unsigned int b;
+			do
+			{
+				if (ip >= iend)
+					goto exit;
+				b = *ip++;
+				litlen += b;
+			} while (b == 255);
+		}
+		if (litlen > (size_t)(iend - ip) || litlen > (size_t)(oend - op))
+			goto exit;
+		memcpy(op, ip, litlen);
+		ip += litlen;
+		op += litlen;
+
+		if (ip == iend)
+			break; /* last sequence: literals only */
+
+		if (iend - ip < 2)
+			goto exit;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - out))
+			goto exit;
+		if (matchlen == 15)
+		{
+			unsigned int b;
+			do
+			{
+				if (ip >= iend)
+					goto exit;
+				b = *ip++;
+				matchlen += b;
+			} while (b == 255);
+		}
+		matchlen += MIN_MATCH;
+		if (matchlen > (size_t)(oend - op))
+			goto exit;
+		/* byte by byte, as the match may overlap the bytes being written */
+		match = op - offset;
+		while (matchlen--)
+			*op++ = *match++;
+	}
+	if (op == oend)
+		rc = 0;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+#if defined(UNIT_TESTS)
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int roundtrip(const char* data, int len)
+{
+	int destlen = Compress_bound(len);
+	char* comp = malloc(destlen);
+	char* decomp = malloc(len + 1);
+	int clen = Compress_encode(data, len, comp, destlen);
+	int rc = 0;
+
+	if (clen == 0 || Compress_decode(comp, clen, decomp, len) != 0 || memcmp(data, decomp, len) != 0)
+		rc = -1;
+	else if (len > 0 && Compress_decode(comp, clen, decomp, len - 1) == 0)
+		rc = -1; /* a short output buffer must be detected */
+	printf("length %d compressed %d %s\n", len, clen, (rc == 0) ? "ok" : "FAILED");
+	free(comp);
+	free(decomp);
+	return rc;
+}
+
+
+int main(int argc, char *argv[])
+{
+	char* buf = malloc(100000);
+	int i, rc = 0;
+
+	rc += roundtrip("", 0);
+	rc += roundtrip("a", 1);
+	rc += roundtrip("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 62);
+	for (i = 0; i < 100000; ++i)
+		buf[i] = "{\"temperature\": 21.5, \"humidity\": 40}"[i % 37];
+	rc += roundtrip(buf, 100000);
+	srand(1);
+	for (i = 0; i < 100000; ++i)
+		buf[i] = (char)rand();
+	rc += roundtrip(buf, 100000);
+	free(buf);
+	return rc;
+}
+
+#endif
@@ -0,0 +1,26 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#if !defined(COMPRESS_H)
+#define COMPRESS_H
+
+/** worst case size of the output of Compress_encode for an input of length len */
+#define Compress_bound(len) ((len) + ((len) / 255) + 16)
+
+int Compress_encode(const char* src, int srclen, char* dest, int destlen);
+int Compress_decode(const char* src, int srclen, char* dest, int destlen);
+
+#endif
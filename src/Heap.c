@@ -26,7 +26,6 @@
  *
  * */
 
-#include "Tree.h"
 #include "Log.h"
 #include "StackTrace.h"
 #include "Thread.h"
@@ -46,27 +45,63 @@ char* Broker_recordFFDC(char* symptoms);
 
 #if defined(WIN32) || defined(WIN64)
 mutex_type heap_mutex;
+#define Heap_lock(m) WaitForSingleObject(m, INFINITE)
+#define Heap_unlock(m) ReleaseMutex(m)
+#define Heap_atomic_add(p, v) ((size_t)InterlockedExchangeAddSizeT((p), (v)) + (v))
+#define Heap_atomic_sub(p, v) ((size_t)InterlockedExchangeAddSizeT((p), -(SSIZE_T)(v)) - (v))
 #else
 static pthread_mutex_t heap_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static mutex_type heap_mutex = &heap_mutex_store;
+#define Heap_lock(m) pthread_mutex_lock(m)
+#define Heap_unlock(m) pthread_mutex_unlock(m)
+#define Heap_atomic_add(p, v) __sync_add_and_fetch((p), (v))
+#define Heap_atomic_sub(p, v) __sync_sub_and_fetch((p), (v))
 #endif
 
 static heap_info state = {0, 0}; /**< global heap state information */
 static int eyecatcher = 0x88888888;
 
 /**
- * Each item on the heap is recorded with this structure.
+ * Each item on the heap is preceded by this structure, in the same allocation,
+ * followed by the start eyecatcher.
  */
-typedef struct
+typedef struct storageElement_s
 {
-	char* file;		/**< the name of the source file where the storage was allocated */
-	int line;		/**< the line no in the source file where it was allocated */
-	void* ptr;		/**< pointer to the allocated storage */
-	size_t size;    /**< size of the allocated storage */
+	struct storageElement_s* next;	/**< next item in the same hash bucket */
+	const char* file;	/**< the source file where the storage was allocated: __FILE__, so not copied */
+	int line;			/**< the line no in the source file where it was allocated */
+	size_t size;		/**< size of the allocated storage, without header or eyecatchers */
 } storageElement;
 
-static Tree heap;	/**< Tree that holds the allocation records */
+/**
+ * The record of heap items is split into shards, each with its own lock and hash table,
+ * so that threads allocating and freeing at the same time rarely contend.  The shard and
+ * hash bucket of an item are chosen from its address, so that free and Heap_findItem find
+ * it directly whichever thread allocated it.
+ */
+typedef struct
+{
+	mutex_type mutex;
+	storageElement** buckets;	/**< hash table of items, allocated on first use */
+	size_t nbuckets;			/**< always a power of 2 */
+	size_t count;				/**< number of items in this shard */
+} heap_shard;
+
+#define HEAP_SHARDS 16
+#define HEAP_INITIAL_BUCKETS 256
+
+#if defined(WIN32) || defined(WIN64)
+static heap_shard shards[HEAP_SHARDS];
+#else
+#define HEAP_MUTEX_INITIALIZER4 PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, \
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+static pthread_mutex_t shard_mutexes[HEAP_SHARDS] = { HEAP_MUTEX_INITIALIZER4, HEAP_MUTEX_INITIALIZER4,
+	HEAP_MUTEX_INITIALIZER4, HEAP_MUTEX_INITIALIZER4 };
+static heap_shard shards[HEAP_SHARDS];
+#endif
+
 static char* errmsg = "Memory allocation error";
+static int terminated = 0; /**< whether Heap_terminate has been called since Heap_initialize */
 
 /**
  * Round allocation size up to a multiple of the size of an int.  Apart from possibly reducing fragmentation,
@@ -84,52 +119,155 @@ size_t Heap_roundup(size_t size)
 	return size;
 }
 
+/** the space taken before the user's data: the header plus the start eyecatcher, keeping alignment */
+#define HEAP_HEADER_SIZE Heap_roundup(sizeof(storageElement) + sizeof(int))
 
-/**
- * List callback function for comparing storage elements
- * @param a pointer to the current content in the tree (storageElement*)
- * @param b pointer to the memory to free
- * @return boolean indicating whether a and b are equal
- */
-int ptrCompare(void* a, void* b, int value)
+/** from a pointer returned to the user to the item header */
+#define Heap_header(p) ((storageElement*)(((char*)(p)) - HEAP_HEADER_SIZE))
+
+/** from an item header to the pointer returned to the user */
+#define Heap_user(s) ((void*)(((char*)(s)) + HEAP_HEADER_SIZE))
+
+
+static size_t Heap_hash(void* p)
 {
-	a = ((storageElement*)a)->ptr;
-	if (value)
-		b = ((storageElement*)b)->ptr;
+	size_t h = (size_t)p >> 4;
 
-	return (a > b) ? -1 : (a == b) ? 0 : 1;
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h;
 }
 
 
-void Heap_check(char* string, void* ptr)
+static heap_shard* Heap_shard(void* p)
 {
-	return;
-	/*Node* curnode = NULL;
-	storageElement* prev, *s = NULL;
+	heap_shard* shard = &shards[Heap_hash(p) % HEAP_SHARDS];
+
+#if !defined(WIN32) && !defined(WIN64)
+	if (shard->mutex == NULL)
+		shard->mutex = &shard_mutexes[shard - shards];
+#endif
+	return shard;
+}
+
 
-	printf("Heap_check start %p\n", ptr);
-	while ((curnode = TreeNextElement(&heap, curnode)) != NULL)
+static storageElement** Heap_bucket(heap_shard* shard, void* p)
+{
+	return &shard->buckets[(Heap_hash(p) / HEAP_SHARDS) & (shard->nbuckets - 1)];
+}
+
+
+/**
+ * Add an item to its shard, growing the hash table if needed.  The shard must be locked.
+ * @param shard the shard
+ * @param s the item header
+ * @return 0 on success, -1 if the hash table could not be allocated
+ */
+static int Heap_link(heap_shard* shard, storageElement* s)
+{
+	storageElement** bucket = NULL;
+
+	if (shard->count >= shard->nbuckets * 2)
 	{
-		prev = s;
-		s = (storageElement*)(curnode->content);
+		size_t newsize = (shard->nbuckets == 0) ? HEAP_INITIAL_BUCKETS : shard->nbuckets * 2;
+		storageElement** newbuckets = calloc(newsize, sizeof(storageElement*));
+		size_t i;
 
-		if (prev)
-		{
-		if (ptrCompare(s, prev, 1) != -1)
+		if (newbuckets == NULL)
 		{
-			printf("%s: heap order error %d %p %p\n", string, ptrCompare(s, prev, 1), prev->ptr, s->ptr);
-			exit(99);
+			if (shard->nbuckets == 0)
+				return -1;
 		}
 		else
-			printf("%s: heap order good %d %p %p\n", string, ptrCompare(s, prev, 1), prev->ptr, s->ptr);
+		{
+			storageElement** oldbuckets = shard->buckets;
+			size_t oldsize = shard->nbuckets;
+
+			shard->buckets = newbuckets;
+			shard->nbuckets = newsize;
+			for (i = 0; i < oldsize; ++i)
+			{
+				storageElement* cur = oldbuckets[i];
+				while (cur)
+				{
+					storageElement* next = cur->next;
+					bucket = Heap_bucket(shard, Heap_user(cur));
+					cur->next = *bucket;
+					*bucket = cur;
+					cur = next;
+				}
+			}
+			if (oldbuckets)
+				free(oldbuckets);
 		}
-	}*/
+	}
+	bucket = Heap_bucket(shard, Heap_user(s));
+	s->next = *bucket;
+	*bucket = s;
+	++shard->count;
+	return 0;
+}
+
+
+/**
+ * Find an item in its shard, and optionally remove it.  The shard must be locked.
+ * @param shard the shard
+ * @param p pointer to the user's data
+ * @param remove boolean - remove the item from the shard if found
+ * @return the item header, or NULL if the pointer is not one of ours
+ */
+static storageElement* Heap_lookup(heap_shard* shard, void* p, int remove)
+{
+	storageElement** prev = NULL;
+	storageElement* s = NULL;
+
+	if (shard->nbuckets == 0)
+		return NULL;
+	prev = Heap_bucket(shard, p);
+	for (s = *prev; s && Heap_user(s) != p; s = s->next)
+		prev = &s->next;
+	if (s && remove)
+	{
+		*prev = s->next;
+		--shard->count;
+	}
+	return s;
+}
+
+
+/**
+ * Free the hash table of a shard, which is allocated again if the shard is used.
+ * The shard must be locked.
+ * @param shard the shard
+ */
+static void Heap_freeBuckets(heap_shard* shard)
+{
+	if (shard->buckets)
+		free(shard->buckets);
+	shard->buckets = NULL;
+	shard->nbuckets = 0;
+}
+
+
+void Heap_check(char* string, void* ptr)
+{
+	return;
+}
+
+
+static void Heap_addSize(size_t size)
+{
+	size_t current = Heap_atomic_add(&state.current_size, size);
+
+	if (current > state.max_size) /* statistics only, so an occasional lost update doesn't matter */
+		state.max_size = current;
 }
 
 
 /**
  * Allocates a block of memory.  A direct replacement for malloc, but keeps track of items
- * allocated in a list, so that free can check that a item is being freed correctly and that
+ * allocated, so that free can check that a item is being freed correctly and that
  * we can check that all memory is freed at shutdown.
  * @param file use the __FILE__ macro to indicate which file this item was allocated in
  * @param line use the __LINE__ macro to indicate which line this item was allocated at
@@ -139,44 +277,36 @@ void Heap_check(char* string, void* ptr)
 void* mymalloc(char* file, int line, size_t size)
 {
 	storageElement* s = NULL;
-	size_t space = sizeof(storageElement);
-	size_t filenamelen = strlen(file)+1;
+	heap_shard* shard = NULL;
+	void* p = NULL;
 
-	Thread_lock_mutex(heap_mutex);
 	size = Heap_roundup(size);
-	if ((s = malloc(sizeof(storageElement))) == NULL)
+	/* Add space for the header and an eyecatcher at each end */
+	if ((s = malloc(HEAP_HEADER_SIZE + size + sizeof(int))) == NULL)
 	{
 		Log(LOG_ERROR, 13, errmsg);
 		return NULL;
 	}
-	s->size = size; /* size without eyecatchers */
-	if ((s->file = malloc(filenamelen)) == NULL)
-	{
-		Log(LOG_ERROR, 13, errmsg);
-		free(s);
-		return NULL;
-	}
-	space += filenamelen;
-	strcpy(s->file, file);
+	s->file = file;
 	s->line = line;
-	/* Add space for eyecatcher at each end */
-	if ((s->ptr = malloc(size + 2*sizeof(int))) == NULL)
+	s->size = size; /* size without eyecatchers */
+	p = Heap_user(s);
+	*(((int*)p) - 1) = eyecatcher; /* start eyecatcher */
+	*(int*)(((char*)p) + size) = eyecatcher; /* end eyecatcher */
+
+	shard = Heap_shard(p);
+	Heap_lock(shard->mutex);
+	if (Heap_link(shard, s) != 0)
 	{
+		Heap_unlock(shard->mutex);
 		Log(LOG_ERROR, 13, errmsg);
-		free(s->file);
 		free(s);
 		return NULL;
 	}
-	space += size + 2*sizeof(int);
-	*(int*)(s->ptr) = eyecatcher; /* start eyecatcher */
-	*(int*)(((char*)(s->ptr)) + (sizeof(int) + size)) = eyecatcher; /* end eyecatcher */
-	Log(TRACE_MAX, -1, "Allocating %d bytes in heap at file %s line %d ptr %p\n", size, file, line, s->ptr);
-	TreeAdd(&heap, s, space);
-	state.current_size += size;
-	if (state.current_size > state.max_size)
-		state.max_size = state.current_size;
-	Thread_unlock_mutex(heap_mutex);		
-	return ((int*)(s->ptr)) + 1;	/* skip start eyecatcher */
+	Heap_unlock(shard->mutex);
+	Heap_addSize(size);
+	Log(TRACE_MAX, -1, "Allocating %d bytes in heap at file %s line %d ptr %p\n", size, file, line, p);
+	return p;
 }
 
 
@@ -198,33 +328,31 @@ void checkEyecatchers(char* file, int line, void* p, size_t size)
 
 /**
  * Remove an item from the recorded heap without actually freeing it.
- * Use sparingly!
  * @param file use the __FILE__ macro to indicate which file this item was allocated in
  * @param line use the __LINE__ macro to indicate which line this item was allocated at
  * @param p pointer to the item to be removed
+ * @return the item header, or NULL if the item was not found
  */
-int Internal_heap_unlink(char* file, int line, void* p)
+static storageElement* Internal_heap_unlink(char* file, int line, void* p)
 {
-	Node* e = NULL;
-	int rc = 0;
+	heap_shard* shard = Heap_shard(p);
+	storageElement* s = NULL;
 
-	e = TreeFind(&heap, ((int*)p)-1);
-	if (e == NULL)
+	Heap_lock(shard->mutex);
+	s = Heap_lookup(shard, p, 1);
+	if (s && terminated && shard->count == 0)
+		Heap_freeBuckets(shard); /* the last item left after Heap_terminate */
+	Heap_unlock(shard->mutex);
+	if (s == NULL)
 		Log(LOG_ERROR, 13, "Failed to remove heap item at file %s line %d", file, line);
 	else
 	{
-		storageElement* s = (storageElement*)(e->content);
+		Heap_atomic_sub(&state.current_size, s->size);
 		Log(TRACE_MAX, -1, "Freeing %d bytes in heap at file %s line %d, heap use now %d bytes\n",
 											 s->size, file, line, state.current_size);
 		checkEyecatchers(file, line, p, s->size);
-		//free(s->ptr);
-		free(s->file);
-		state.current_size -= s->size;
-		TreeRemoveNodeIndex(&heap, e, 0);
-		free(s);
-		rc = 1;
 	}
-	return rc;
+	return s;
 }
 
 
@@ -237,34 +365,35 @@ int Internal_heap_unlink(char* file, int line, void* p)
  */
 void myfree(char* file, int line, void* p)
 {
-	Thread_lock_mutex(heap_mutex);
-	if (Internal_heap_unlink(file, line, p))
-		free(((int*)p)-1);
-	Thread_unlock_mutex(heap_mutex);
+	storageElement* s = NULL;
+
+	if (p == NULL)
+		return;
+	if ((s = Internal_heap_unlink(file, line, p)) != NULL)
+		free(s);
 }
 
 
 /**
  * Remove an item from the recorded heap without actually freeing it.
- * Use sparingly!
+ * Use sparingly!  As the record of the item is held in the same allocation,
+ * the storage can no longer be freed.
  * @param file use the __FILE__ macro to indicate which file this item was allocated in
  * @param line use the __LINE__ macro to indicate which line this item was allocated at
  * @param p pointer to the item to be removed
  */
 void Heap_unlink(char* file, int line, void* p)
 {
-	Thread_lock_mutex(heap_mutex);
 	Internal_heap_unlink(file, line, p);
-	Thread_unlock_mutex(heap_mutex);
 }
 
 
 /**
  * Reallocates a block of memory.  A direct replacement for realloc, but keeps track of items
- * allocated in a list, so that free can check that a item is being freed correctly and that
+ * allocated, so that free can check that a item is being freed correctly and that
  * we can check that all memory is freed at shutdown.
- * We have to remove the item from the tree, as the memory is in order and so it needs to
- * be reinserted in the correct place.
+ * We have to remove the item from its shard, as it may move, and so needs to be
+ * recorded again under its new address.
  * @param file use the __FILE__ macro to indicate which file this item was reallocated in
  * @param line use the __LINE__ macro to indicate which line this item was reallocated at
  * @param p pointer to the item to be reallocated
@@ -275,40 +404,45 @@ void *myrealloc(char* file, int line, void* p, size_t size)
 {
 	void* rc = NULL;
 	storageElement* s = NULL;
-	
-	Thread_lock_mutex(heap_mutex);
-	s = TreeRemoveKey(&heap, ((int*)p)-1);
+	heap_shard* shard = NULL;
+
+	if (p == NULL)
+		return mymalloc(file, line, size);
+
+	shard = Heap_shard(p);
+	Heap_lock(shard->mutex);
+	s = Heap_lookup(shard, p, 1);
+	Heap_unlock(shard->mutex);
 	if (s == NULL)
+	{
 		Log(LOG_ERROR, 13, "Failed to reallocate heap item at file %s line %d", file, line);
+		return NULL;
+	}
+
+	checkEyecatchers(file, line, p, s->size);
+	size = Heap_roundup(size);
+	if ((rc = realloc(s, HEAP_HEADER_SIZE + size + sizeof(int))) == NULL)
+		Log(LOG_ERROR, 13, errmsg); /* the original item is still valid, so keep recording it */
 	else
 	{
-		size_t space = sizeof(storageElement);
-		size_t filenamelen = strlen(file)+1;
-
-		checkEyecatchers(file, line, p, s->size);
-		size = Heap_roundup(size);
-		state.current_size += size - s->size;
-		if (state.current_size > state.max_size)
-			state.max_size = state.current_size;
-		if ((s->ptr = realloc(s->ptr, size + 2*sizeof(int))) == NULL)
-		{
-			Log(LOG_ERROR, 13, errmsg);
-			return NULL;
-		}
-		space += size + 2*sizeof(int) - s->size;
-		*(int*)(s->ptr) = eyecatcher; /* start eyecatcher */
-		*(int*)(((char*)(s->ptr)) + (sizeof(int) + size)) = eyecatcher; /* end eyecatcher */
+		s = (storageElement*)rc;
+		if (size > s->size)
+			Heap_addSize(size - s->size);
+		else
+			Heap_atomic_sub(&state.current_size, s->size - size);
 		s->size = size;
-		space -= strlen(s->file);
-		s->file = realloc(s->file, filenamelen);
-		space += filenamelen;
-		strcpy(s->file, file);
+		s->file = file;
 		s->line = line;
-		rc = s->ptr;
-		TreeAdd(&heap, s, space);
+		*(int*)(((char*)Heap_user(s)) + size) = eyecatcher; /* end eyecatcher */
+		rc = Heap_user(s);
 	}
-	Thread_unlock_mutex(heap_mutex);
-	return (rc == NULL) ? NULL : ((int*)(rc)) + 1;	/* skip start eyecatcher */
+
+	shard = Heap_shard(Heap_user(s));
+	Heap_lock(shard->mutex);
+	if (Heap_link(shard, s) != 0)
+		Log(LOG_ERROR, 13, errmsg);
+	Heap_unlock(shard->mutex);
+	return rc;
 }
 
 
@@ -320,12 +454,13 @@ void *myrealloc(char* file, int line, void* p, size_t size)
  */
 void* Heap_findItem(void* p)
 {
-	Node* e = NULL;
+	heap_shard* shard = Heap_shard(p);
+	storageElement* s = NULL;
 
-	Thread_lock_mutex(heap_mutex);
-	e = TreeFind(&heap, ((int*)p)-1);
-	Thread_unlock_mutex(heap_mutex);
-	return (e == NULL) ? NULL : e->content;
+	Heap_lock(shard->mutex);
+	s = Heap_lookup(shard, p, 0);
+	Heap_unlock(shard->mutex);
+	return s;
 }
 
 
@@ -335,18 +470,32 @@ void* Heap_findItem(void* p)
  */
 void HeapScan(int log_level)
 {
-	Node* current = NULL;
-	
-	Thread_lock_mutex(heap_mutex);
+	int i;
+
+	Heap_lock(heap_mutex);
 	Log(log_level, -1, "Heap scan start, total %d bytes", state.current_size);
-	while ((current = TreeNextElement(&heap, current)) != NULL)
+	for (i = 0; i < HEAP_SHARDS; ++i)
 	{
-		storageElement* s = (storageElement*)(current->content);
-		Log(log_level, -1, "Heap element size %d, line %d, file %s, ptr %p", s->size, s->line, s->file, s->ptr);
-		Log(log_level, -1, "  Content %*.s", (10 > current->size) ? s->size : 10, (char*)(((int*)s->ptr) + 1));
+		heap_shard* shard = &shards[i];
+		size_t b;
+
+		if (shard->mutex == NULL)
+			continue;
+		Heap_lock(shard->mutex);
+		for (b = 0; b < shard->nbuckets; ++b)
+		{
+			storageElement* s = NULL;
+
+			for (s = shard->buckets[b]; s; s = s->next)
+			{
+				Log(log_level, -1, "Heap element size %d, line %d, file %s, ptr %p", s->size, s->line, s->file, Heap_user(s));
+				Log(log_level, -1, "  Content %*.s", (10 > s->size) ? s->size : 10, (char*)Heap_user(s));
+			}
+		}
+		Heap_unlock(shard->mutex);
 	}
 	Log(log_level, -1, "Heap scan end");
-	Thread_unlock_mutex(heap_mutex);
+	Heap_unlock(heap_mutex);
 }
 
 
@@ -355,23 +504,50 @@ void HeapScan(int log_level)
  */
 int Heap_initialize()
 {
-	TreeInitializeNoMalloc(&heap, ptrCompare);
-	heap.heap_tracking = 0; /* no recursive heap tracking! */
+	int i;
+
+	for (i = 0; i < HEAP_SHARDS; ++i)
+	{
+#if defined(WIN32) || defined(WIN64)
+		if (shards[i].mutex == NULL)
+			shards[i].mutex = CreateMutex(NULL, 0, NULL);
+#else
+		shards[i].mutex = &shard_mutexes[i];
+#endif
+	}
+	terminated = 0;
 	return 0;
 }
 
 
 /**
- * Heap termination.
+ * Heap termination.  The hash tables of the shards which are empty are freed.  Items
+ * still allocated, such as the log list freed after this function is called, keep their
+ * shard's table so that they can be freed, and the table goes with the last of them.
+ * The shard mutexes are kept, as they are statically initialized or created once.
  */
 void Heap_terminate()
 {
+	int i;
+
 	Log(TRACE_MIN, -1, "Maximum heap use was %d bytes", state.max_size);
 	if (state.current_size > 20) /* One log list is freed after this function is called */
 	{
 		Log(LOG_ERROR, -1, "Some memory not freed at shutdown, possible memory leak");
 		HeapScan(LOG_ERROR);
 	}
+	terminated = 1;
+	for (i = 0; i < HEAP_SHARDS; ++i)
+	{
+		heap_shard* shard = &shards[i];
+
+		if (shard->mutex == NULL)
+			continue;
+		Heap_lock(shard->mutex);
+		if (shard->count == 0)
+			Heap_freeBuckets(shard);
+		Heap_unlock(shard->mutex);
+	}
 }
 
 
@@ -412,18 +588,33 @@ int HeapDumpString(FILE* file, char* str)
 int HeapDump(FILE* file)
 {
 	int rc = 0;
-	Node* current = NULL;
+	int i;
 
-	while (rc == 0 && (current = TreeNextElement(&heap, current)))
+	for (i = 0; rc == 0 && i < HEAP_SHARDS; ++i)
 	{
-		storageElement* s = (storageElement*)(current->content);
-
-		if (fwrite(&(s->ptr), sizeof(s->ptr), 1, file) != 1)
-			rc = -1;
-		else if (fwrite(&(current->size), sizeof(current->size), 1, file) != 1)
-			rc = -1;
-		else if (fwrite(s->ptr, current->size, 1, file) != 1)
-			rc = -1;
+		heap_shard* shard = &shards[i];
+		size_t b;
+
+		if (shard->mutex == NULL)
+			continue;
+		Heap_lock(shard->mutex);
+		for (b = 0; rc == 0 && b < shard->nbuckets; ++b)
+		{
+			storageElement* s = NULL;
+
+			for (s = shard->buckets[b]; rc == 0 && s; s = s->next)
+			{
+				void* p = Heap_user(s);
+
+				if (fwrite(&p, sizeof(p), 1, file) != 1)
+					rc = -1;
+				else if (fwrite(&(s->size), sizeof(s->size), 1, file) != 1)
+					rc = -1;
+				else if (fwrite(p, s->size, 1, file) != 1)
+					rc = -1;
+			}
+		}
+		Heap_unlock(shard->mutex);
 	}
 	return rc;
 }
@@ -463,6 +654,22 @@ int main(int argc, char *argv[])
 	h = realloc(h, 22225);
     printf("freeing h\n");
 	free(h);
+
+	{
+		char* items[1000];
+		int i;
+
+		for (i = 0; i < 1000; ++i)
+			items[i] = malloc(i % 100 + 1);
+		for (i = 0; i < 1000; ++i)
+			if (Heap_findItem(items[i]) == NULL)
+				printf("item %d not found\n", i);
+		if (Heap_findItem(&i) != NULL)
+			printf("stack item found\n");
+		for (i = 0; i < 1000; ++i)
+			free(items[i]);
+		printf("heap use after frees %d\n", (int)Heap_get_info()->current_size);
+	}
 	Heap_terminate();
 	printf("Finishing\n");
 	return 0;
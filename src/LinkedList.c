@@ -22,6 +22,11 @@
  * These linked lists can hold data of any sort, pointed to by the content pointer of the
  * ListElement structure.  ListElements hold the points to the next and previous items in the
  * list.
+ *
+ * In an intrusive list, the ListElement is a field of each item rather than being allocated
+ * separately, so adding and removing items does not touch the heap, and the link and the
+ * item share cache lines when the list is searched.  An item can only be in one intrusive
+ * list at a time for each ListElement field it has.
  * */
 
 #include "LinkedList.h"
@@ -30,6 +35,7 @@
 #include <string.h>
 #include <memory.h>
 
+#include "Pool.h"
 #include "Heap.h"
 
 
@@ -47,6 +53,19 @@ void ListZero(List* newl)
 }
 
 
+/**
+ * Sets a list structure to empty, as an intrusive list.  Does not remove any items from the list.
+ * @param newl a pointer to the list structure to be initialized
+ * @param link_offset the offset of the ListElement field in the items, from offsetof
+ */
+void ListZeroIntrusive(List* newl, size_t link_offset)
+{
+	ListZero(newl);
+	newl->link_offset = link_offset;
+	newl->intrusive = 1;
+}
+
+
 /**
  * Allocates and initializes a new list structure.
  * @return a pointer to the new list structure
@@ -59,6 +78,45 @@ List* ListInitialize(void)
 }
 
 
+/**
+ * Allocates and initializes a new intrusive list structure.
+ * @param link_offset the offset of the ListElement field in the items, from offsetof
+ * @return a pointer to the new list structure
+ */
+List* ListInitializeIntrusive(size_t link_offset)
+{
+	List* newl = malloc(sizeof(List));
+	ListZeroIntrusive(newl, link_offset);
+	return newl;
+}
+
+
+/**
+ * Get a ListElement to hold an item: the item's own for an intrusive list, otherwise a new one.
+ * @param aList the list to which the item is to be added
+ * @param content the list item content itself
+ * @return the ListElement
+ */
+static ListElement* ListNewElement(List* aList, void* content)
+{
+	if (aList->intrusive)
+		return (ListElement*)((char*)content + aList->link_offset);
+	return Pool_malloc(POOL_LISTELEMENT, sizeof(ListElement));
+}
+
+
+/**
+ * Release a ListElement obtained from ListNewElement, once it is no longer in the list.
+ * @param aList the list from which the item has been removed
+ * @param elem the ListElement
+ */
+static void ListFreeElement(List* aList, ListElement* elem)
+{
+	if (!aList->intrusive)
+		Pool_free(POOL_LISTELEMENT, elem);
+}
+
+
 /**
  * Append an already allocated ListElement and content to a list.  Can be used to move
  * an item from one list to another.
@@ -90,7 +148,7 @@ void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t s
  */
 void ListAppend(List* aList, void* content, size_t size)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = ListNewElement(aList, content);
 	ListAppendNoMalloc(aList, content, newel, size);
 }
 
@@ -105,7 +163,7 @@ void ListAppend(List* aList, void* content, size_t size)
  */
 void ListInsert(List* aList, void* content, size_t size, ListElement* index)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = ListNewElement(aList, content);
 
 	if ( index == NULL )
 		ListAppendNoMalloc(aList, content, newel, size);
@@ -219,7 +277,7 @@ int ListUnlink(List* aList, void* content, int(*callback)(void*, void*), int fre
 		free(aList->current->content);
 	if (saved == aList->current)
 		saveddeleted = 1;
-	free(aList->current);
+	ListFreeElement(aList, aList->current);
 	if (saveddeleted)
 		aList->current = next;
 	else
@@ -272,7 +330,7 @@ void* ListDetachHead(List* aList)
 		aList->first = aList->first->next;
 		if (aList->first)
 			aList->first->prev = NULL;
-		free(first);
+		ListFreeElement(aList, first);
 		--(aList->count);
 	}
 	return content;
@@ -310,7 +368,7 @@ void* ListPopTail(List* aList)
 		aList->last = aList->last->prev;
 		if (aList->last)
 			aList->last->next = NULL;
-		free(last);
+		ListFreeElement(aList, last);
 		--(aList->count);
 	}
 	return content;
@@ -354,10 +412,10 @@ void ListEmpty(List* aList)
 	while (aList->first != NULL)
 	{
 		ListElement* first = aList->first;
+		aList->first = first->next; /* before the content is freed, which may hold the element */
 		if (first->content != NULL)
 			free(first->content);
-		aList->first = first->next;
-		free(first);
+		ListFreeElement(aList, first);
 	}
 	aList->count = 0;
 	aList->size = 0;
@@ -385,7 +443,7 @@ void ListFreeNoContent(List* aList)
 	{
 		ListElement* first = aList->first;
 		aList->first = first->next;
-		free(first);
+		ListFreeElement(aList, first);
 	}
 	free(aList);
 }
@@ -443,6 +501,15 @@ int stringcompare(void* a, void* b)
 
 #if defined(UNIT_TESTS)
 
+#include <stdio.h>
+#include <stddef.h>
+
+typedef struct
+{
+	int value;
+	ListElement link;
+} intrusive_int;
+
 
 int main(int argc, char *argv[])
 {
@@ -488,6 +555,28 @@ int main(int argc, char *argv[])
 
 	ListFree(l);
 	printf("List freed\n");
+
+	l = ListInitializeIntrusive(offsetof(intrusive_int, link));
+	printf("Intrusive list initialized\n");
+	for (i = 0; i < 10; i++)
+	{
+		intrusive_int* ii = malloc(sizeof(intrusive_int));
+		ii->value = i;
+		ListAppend(l, ii, sizeof(intrusive_int));
+		if (l->last != &ii->link)
+			printf("Intrusive list element %d not linked through its own link\n", i);
+	}
+	i = 5;
+	ListRemoveItem(l, &i, intcompare);
+	free(ListDetachHead(l));
+	free(ListPopTail(l));
+	printf("Intrusive list contents having deleted elements 0, 5 and 9, count now %d:\n", l->count);
+	current = NULL;
+	while (ListNextElement(l, &current) != NULL)
+		printf("List element: %d\n", *((int*)(current->content)));
+	ListFree(l);
+	printf("Intrusive list freed\n");
+	return 0;
 }
 
 #endif
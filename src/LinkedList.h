@@ -41,6 +41,8 @@ def T concat List
 	n32 ptr T concat Item suppress "current"
 	n32 dec "count"
 	n32 suppress "size"
+	n32 suppress "link_offset"
+	n32 dec "intrusive"
 }
 endm
 
@@ -71,10 +73,14 @@ typedef struct
 				*current;	/**< current element in the list, for iteration */
 	int count;  /**< no of items */
 	size_t size;  /**< heap storage used */
+	size_t link_offset;  /**< offset of the ListElement within each item, for intrusive lists */
+	int intrusive;  /**< boolean: the ListElements are part of the items, not allocated separately */
 } List;
 
 void ListZero(List*);
+void ListZeroIntrusive(List*, size_t link_offset);
 List* ListInitialize(void);
+List* ListInitializeIntrusive(size_t link_offset);
 
 void ListAppend(List* aList, void* content, size_t size);
 void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t size);
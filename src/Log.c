@@ -20,7 +20,17 @@
  * @file
  * \brief Logging and tracing module
  *
- * 
+ * Each thread records its trace entries in its own ring buffer, so that tracing does not
+ * make threads wait for each other.  Only the owning thread writes to a ring, and entries
+ * are stamped with a cheap monotonic clock so that Log_dumpTrace can merge the rings
+ * back into one timeline.  A lock is only taken when a ring is first claimed, and when
+ * an entry is actually written to the trace destination or callback.
+ *
+ * Entries are kept in binary form: function entries and exits keep a pointer to the function
+ * name, and messages a pointer to their format and their arguments as TraceRecord_encodeArgs
+ * stores them.  They are only formatted as text when they are written to the trace destination
+ * or callback, or dumped.  A ring is made of 64 byte slots.  An entry takes one slot, plus one
+ * for each 56 bytes of arguments.
  */
 
 #include "Log.h"
@@ -31,6 +41,7 @@
 #include "LinkedList.h"
 #include "StackTrace.h"
 #include "Thread.h"
+#include "TraceRecord.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,6 +57,17 @@
 #define snprintf _snprintf
 #endif
 
+#if defined(__ATOMIC_RELEASE)
+#define Log_release_fence() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define Log_acquire_fence() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#elif defined(WIN32) || defined(WIN64)
+#define Log_release_fence() MemoryBarrier()
+#define Log_acquire_fence() MemoryBarrier()
+#else
+#define Log_release_fence() __sync_synchronize()
+#define Log_acquire_fence() __sync_synchronize()
+#endif
+
 #if defined(GETTIMEOFDAY)
 	#include <sys/time.h>
 #else
@@ -67,34 +89,78 @@
 trace_settings_type trace_settings =
 {
 	TRACE_MINIMUM,
-	400,
+	2000,
 	-1
 };
 
-#define MAX_FUNCTION_NAME_LENGTH 256
+#define TRACE_SLOT_SIZE 64
+#define TRACE_SLOT_DATA (TRACE_SLOT_SIZE - 8)	/**< bytes of arguments in a slot */
+#define MIN_TRACE_SLOTS 16	/**< the smallest ring, which must hold the largest entry */
 
+/** The first slot of a trace entry */
 typedef struct
 {
-#if defined(GETTIMEOFDAY)
-	struct timeval ts;
-#else
-	struct timeb ts;
-#endif
+	unsigned int seq;	/**< which slot of the ring this is, from 1.  0 while it is being written */
+	unsigned short slots;	/**< the number of slots in this entry */
+	unsigned short args_len;	/**< the length of the arguments of a message, in the following slots */
+	Log_stamp_type stamp;
+	const char* name;	/**< the function name, or the format of a message */
 	int sametime_count;
 	int number;
 	int thread_id;
 	int depth;
-	char name[MAX_FUNCTION_NAME_LENGTH + 1];
 	int line;
-	int has_rc;
 	int rc;
-	int level;
+	char has_rc;	/**< 0 or 1 for a function entry or exit, 2 for a message */
+	char level;
 } traceEntry;
 
-static int start_index = -1,
-			next_index = 0;
-static traceEntry* trace_queue = NULL;
-static int trace_queue_size = 0;
+/** A slot holding the arguments of a message, following its traceEntry */
+typedef struct
+{
+	unsigned int seq;
+	unsigned short slots;	/**< always 0 */
+	unsigned short unused;
+	unsigned char data[TRACE_SLOT_DATA];
+} traceArgs;
+
+typedef union
+{
+	traceEntry entry;
+	traceArgs args;
+	char pad[TRACE_SLOT_SIZE];
+} traceSlot;
+
+/**
+ * The trace entries of one thread.  Only the owning thread adds entries, so that needs
+ * no lock.  Rings are kept until Log_terminate, and are reused once their thread has ended.
+ */
+typedef struct trace_ring_s
+{
+	struct trace_ring_s* next;	/**< next in the list of all rings */
+	traceSlot* slots;
+	int size;					/**< number of slots */
+	volatile unsigned int count; /**< number of slots written: slot n is at index (n - 1) % size */
+	int in_use;					/**< owned by a live thread? */
+	int thread_id;				/**< of the thread which owns it */
+	Log_stamp_type last_stamp;
+	int sametime_count;
+} trace_ring;
+
+static trace_ring* rings = NULL; /**< all the rings, changed under log_mutex */
+static int rings_initialized = 0;
+static Log_stamp_type start_stamp;	/**< the stamp corresponding to start_time */
+#if defined(GETTIMEOFDAY)
+static struct timeval start_time;
+#else
+static struct timeb start_time;
+#endif
+
+#if defined(WIN32) || defined(WIN64)
+static DWORD ring_key = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t ring_key;
+#endif
 
 static FILE* trace_destination = NULL;	/**< flag to indicate if trace is to be sent to a stream */
 static char* trace_destination_name = NULL; /**< the name of the trace file */
@@ -105,14 +171,6 @@ static int trace_output_level = -1;
 static Log_traceCallback* trace_callback = NULL;
 static void Log_output(int log_level, char* msg);
 
-static int sametime_count = 0;
-#if defined(GETTIMEOFDAY)
-struct timeval ts, last_ts;
-#else
-struct timeb ts, last_ts;
-#endif
-static char msg_buf[512];
-
 #if defined(WIN32) || defined(WIN64)
 mutex_type log_mutex;
 #else
@@ -121,14 +179,144 @@ static mutex_type log_mutex = &log_mutex_store;
 #endif
 
 
+/**
+ * Get the time now from a cheap monotonic clock, only used to order trace entries.
+ * The resolution is a few milliseconds at worst.
+ * @return the time in nanoseconds from an arbitrary start point
+ */
+Log_stamp_type Log_stamp(void)
+{
+#if defined(WIN32) || defined(WIN64)
+	return (Log_stamp_type)GetTickCount64() * 1000000;
+#elif defined(CLOCK_MONOTONIC_COARSE) || defined(CLOCK_MONOTONIC)
+	struct timespec now;
+
+#if defined(CLOCK_MONOTONIC_COARSE)
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+	return (Log_stamp_type)now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (Log_stamp_type)now.tv_sec * 1000000000 + now.tv_usec * 1000;
+#endif
+}
+
+
+/**
+ * Mark a thread's ring as free for another thread, when its thread ends.
+ * @param ring the ring
+ */
+static void Log_releaseRing(trace_ring* ring)
+{
+	trace_ring* cur = NULL;
+
+	Thread_lock_mutex(log_mutex);
+	for (cur = rings; cur; cur = cur->next)
+	{
+		if (cur == ring) /* it may have been freed by Log_terminate */
+		{
+			cur->in_use = 0;
+			break;
+		}
+	}
+	Thread_unlock_mutex(log_mutex);
+}
+
+#if defined(WIN32) || defined(WIN64)
+static VOID WINAPI Log_threadEnd(PVOID ring)
+#else
+static void Log_threadEnd(void* ring)
+#endif
+{
+	if (ring)
+		Log_releaseRing((trace_ring*)ring);
+}
+
+
+/**
+ * Get the calling thread's ring, claiming one the first time a thread traces.
+ * @return the ring, or NULL if tracing is not initialized
+ */
+static trace_ring* Log_getRing(void)
+{
+	trace_ring* ring = NULL;
+
+	if (!rings_initialized)
+		goto exit;
+#if defined(WIN32) || defined(WIN64)
+	ring = FlsGetValue(ring_key);
+#else
+	ring = pthread_getspecific(ring_key);
+#endif
+	if (ring)
+		goto exit;
+
+	Thread_lock_mutex(log_mutex);
+	for (ring = rings; ring; ring = ring->next)
+	{
+		if (!ring->in_use)
+			break;
+	}
+	if (ring == NULL && (ring = calloc(1, sizeof(trace_ring))) != NULL)
+	{
+		if ((ring->slots = calloc(trace_settings.max_trace_entries, sizeof(traceSlot))) == NULL)
+		{
+			free(ring);
+			ring = NULL;
+		}
+		else
+		{
+			ring->size = trace_settings.max_trace_entries;
+			ring->next = rings;
+			rings = ring;
+		}
+	}
+	if (ring)
+	{
+		ring->in_use = 1;
+		ring->thread_id = (int)Thread_getid();
+	}
+	Thread_unlock_mutex(log_mutex);
+	if (ring)
+	{
+#if defined(WIN32) || defined(WIN64)
+		FlsSetValue(ring_key, ring);
+#else
+		pthread_setspecific(ring_key, ring);
+#endif
+	}
+exit:
+	return ring;
+}
+
+
 int Log_initialize(Log_nameValue* info)
 {
 	int rc = -1;
 	char* envval = NULL;
+	char msg_buf[512];
 
-	if ((trace_queue = malloc(sizeof(traceEntry) * trace_settings.max_trace_entries)) == NULL)
-		return rc;
-	trace_queue_size = trace_settings.max_trace_entries;
+	if (!rings_initialized)
+	{
+#if defined(WIN32) || defined(WIN64)
+		if ((ring_key = FlsAlloc(Log_threadEnd)) == FLS_OUT_OF_INDEXES)
+			return rc;
+#else
+		if (pthread_key_create(&ring_key, Log_threadEnd) != 0)
+			return rc;
+#endif
+#if defined(GETTIMEOFDAY)
+		gettimeofday(&start_time, NULL);
+#else
+		ftime(&start_time);
+#endif
+		start_stamp = Log_stamp();
+		rings_initialized = 1;
+	}
 
 	if ((envval = getenv("MQTT_C_CLIENT_TRACE")) != NULL && strlen(envval) > 0)
 	{
@@ -148,6 +336,13 @@ int Log_initialize(Log_nameValue* info)
 		if (max_lines_per_file <= 0)
 			max_lines_per_file = 1000;
 	}
+	if ((envval = getenv("MQTT_C_CLIENT_TRACE_ENTRIES")) != NULL && strlen(envval) > 0)
+	{
+		int slots = atoi(envval);
+
+		if (slots >= MIN_TRACE_SLOTS)
+			trace_settings.max_trace_entries = slots;
+	}
 	if ((envval = getenv("MQTT_C_CLIENT_TRACE_LEVEL")) != NULL && strlen(envval) > 0)
 	{
 		if (strcmp(envval, "MAXIMUM") == 0 || strcmp(envval, "TRACE_MAXIMUM") == 0)
@@ -212,9 +407,25 @@ void Log_setTraceLevel(enum LOG_LEVELS level)
 
 void Log_terminate()
 {
-	free(trace_queue);
-	trace_queue = NULL;
-	trace_queue_size = 0;
+	if (rings_initialized)
+	{
+		rings_initialized = 0;
+#if defined(WIN32) || defined(WIN64)
+		FlsFree(ring_key);
+#else
+		pthread_key_delete(ring_key);
+#endif
+		Thread_lock_mutex(log_mutex);
+		while (rings)
+		{
+			trace_ring* ring = rings;
+
+			rings = ring->next;
+			free(ring->slots);
+			free(ring);
+		}
+		Thread_unlock_mutex(log_mutex);
+	}
 	if (trace_destination)
 	{
 		if (trace_destination != stdout)
@@ -225,104 +436,130 @@ void Log_terminate()
 		free(trace_destination_name);
 	if (trace_destination_backup_name)
 		free(trace_destination_backup_name);
-	start_index = -1;
-	next_index = 0;
 	trace_output_level = -1;
-	sametime_count = 0;
 }
 
 
-static traceEntry* Log_pretrace()
+/**
+ * Get the wall clock time at which tracing started, which corresponds to start_stamp.
+ * @param seconds set to the seconds since the epoch
+ * @param micros set to the microseconds part of the time
+ */
+static void Log_startTime(long long* seconds, long* micros)
 {
-	traceEntry *cur_entry = NULL;
-
-	/* calling ftime/gettimeofday seems to be comparatively expensive, so we need to limit its use */
-	if (++sametime_count % 20 == 0)
-	{
 #if defined(GETTIMEOFDAY)
-		gettimeofday(&ts, NULL);
-		if (ts.tv_sec != last_ts.tv_sec || ts.tv_usec != last_ts.tv_usec)
+	*seconds = start_time.tv_sec;
+	*micros = (long)start_time.tv_usec;
 #else
-		ftime(&ts);
-		if (ts.time != last_ts.time || ts.millitm != last_ts.millitm)
+	*seconds = start_time.time;
+	*micros = start_time.millitm * 1000L;
 #endif
-		{
-			sametime_count = 0;
-			last_ts = ts;
-		}
-	}
+}
 
-	if (trace_queue_size != trace_settings.max_trace_entries)
-	{
-		traceEntry* new_trace_queue = malloc(sizeof(traceEntry) * trace_settings.max_trace_entries);
 
-		memcpy(new_trace_queue, trace_queue, min(trace_queue_size, trace_settings.max_trace_entries) * sizeof(traceEntry));
-		free(trace_queue);
-		trace_queue = new_trace_queue;
-		trace_queue_size = trace_settings.max_trace_entries;
+/**
+ * Start a new entry in the calling thread's ring.  The slots of the entry are marked as being
+ * written until Log_posttrace, so that Log_dumpTrace can tell if it reads a partly written entry.
+ * @param ring the calling thread's ring
+ * @param slots the number of slots the entry needs, at most MIN_TRACE_SLOTS
+ * @return the entry to fill in
+ */
+static traceEntry* Log_pretrace(trace_ring* ring, int slots)
+{
+	traceEntry *cur_entry = NULL;
+	Log_stamp_type stamp = Log_stamp();
+	int i;
 
-		if (start_index > trace_settings.max_trace_entries + 1 ||
-				next_index > trace_settings.max_trace_entries + 1)
-		{
-			start_index = -1;
-			next_index = 0;
+	if (ring->size != trace_settings.max_trace_entries)
+	{
+		traceSlot* new_slots = calloc(trace_settings.max_trace_entries, sizeof(traceSlot));
+
+		if (new_slots)
+		{	/* the old entries are dropped, as the order of a ring depends on its size */
+			Thread_lock_mutex(log_mutex);
+			free(ring->slots);
+			ring->slots = new_slots;
+			ring->size = trace_settings.max_trace_entries;
+			ring->count = 0;
+			Thread_unlock_mutex(log_mutex);
 		}
 	}
 
-	/* add to trace buffer */
-	cur_entry = &trace_queue[next_index];
-	if (next_index == start_index) /* means the buffer is full */
+	if (stamp == ring->last_stamp)
+		++ring->sametime_count;
+	else
 	{
-		if (++start_index == trace_settings.max_trace_entries)
-			start_index = 0;
-	} else if (start_index == -1)
-		start_index = 0;
-	if (++next_index == trace_settings.max_trace_entries)
-		next_index = 0;
+		ring->last_stamp = stamp;
+		ring->sametime_count = 0;
+	}
 
+	for (i = 0; i < slots; ++i)
+		ring->slots[(ring->count + i) % ring->size].entry.seq = 0;
+	Log_release_fence();
+	cur_entry = &ring->slots[ring->count % ring->size].entry;
+	cur_entry->slots = (unsigned short)slots;
+	cur_entry->args_len = 0;
+	cur_entry->stamp = stamp;
+	cur_entry->sametime_count = ring->sametime_count;
+	cur_entry->thread_id = ring->thread_id;
 	return cur_entry;
 }
 
 
-static char* Log_formatTraceEntry(traceEntry* cur_entry)
+/**
+ * Describe a trace entry for TraceRecord_format.
+ * @param entry the entry
+ * @param args the arguments of a message
+ * @param record the description to fill in
+ */
+static void Log_toRecord(traceEntry* entry, const unsigned char* args, TraceRecord* record)
 {
-	struct tm *timeinfo;
-	int buf_pos = 31;
-
-#if defined(GETTIMEOFDAY)
-	timeinfo = localtime(&cur_entry->ts.tv_sec);
-#else
-	timeinfo = localtime(&cur_entry->ts.time);
-#endif
-	strftime(&msg_buf[7], 80, "%Y%m%d %H%M%S ", timeinfo);
-#if defined(GETTIMEOFDAY)
-	sprintf(&msg_buf[22], ".%.3lu ", cur_entry->ts.tv_usec / 1000L);
-#else
-	sprintf(&msg_buf[22], ".%.3hu ", cur_entry->ts.millitm);
-#endif
-	buf_pos = 27;
-
-	sprintf(msg_buf, "(%.4d)", cur_entry->sametime_count);
-	msg_buf[6] = ' ';
-
-	if (cur_entry->has_rc == 2)
-		strncpy(&msg_buf[buf_pos], cur_entry->name, sizeof(msg_buf)-buf_pos);
+	record->has_rc = entry->has_rc;
+	record->thread_id = entry->thread_id;
+	record->depth = entry->depth;
+	record->line = entry->line;
+	record->rc = entry->rc;
+	if (entry->has_rc == 2)
+	{
+		record->format = entry->name;
+		record->name = NULL;
+	}
 	else
 	{
-		char* format = Messages_get(cur_entry->number, cur_entry->level);
-		if (cur_entry->has_rc == 1)
-			snprintf(&msg_buf[buf_pos], sizeof(msg_buf)-buf_pos, format, cur_entry->thread_id,
-					cur_entry->depth, "", cur_entry->depth, cur_entry->name, cur_entry->line, cur_entry->rc);
-		else
-			snprintf(&msg_buf[buf_pos], sizeof(msg_buf)-buf_pos, format, cur_entry->thread_id,
-					cur_entry->depth, "", cur_entry->depth, cur_entry->name, cur_entry->line);
+		record->format = Messages_get(entry->number, entry->level);
+		record->name = entry->name;
 	}
+	record->args = args;
+	record->args_len = entry->args_len;
+}
+
+
+/**
+ * Format a trace entry for output
+ * @param cur_entry the entry
+ * @param args the arguments of a message
+ * @param msg_buf the buffer to format into
+ * @param size the size of the buffer
+ * @return the formatted entry
+ */
+static char* Log_formatTraceEntry(traceEntry* cur_entry, const unsigned char* args, char* msg_buf, int size)
+{
+	TraceRecord record;
+	long long seconds;
+	long micros;
+	int len;
+
+	Log_startTime(&seconds, &micros);
+	len = TraceRecord_formatTime(seconds, micros, (long long)(cur_entry->stamp - start_stamp), msg_buf, size);
+	Log_toRecord(cur_entry, args, &record);
+	TraceRecord_format(&record, &msg_buf[len], size - len);
 	return msg_buf;
 }
 
 
 static void Log_output(int log_level, char* msg)
 {
+	Thread_lock_mutex(log_mutex);
 	if (trace_destination)
 	{
 		fprintf(trace_destination, "%s\n", msg);
@@ -344,71 +581,87 @@ static void Log_output(int log_level, char* msg)
 		
 	if (trace_callback)
 		(*trace_callback)(log_level, msg);
+	Thread_unlock_mutex(log_mutex);
 }
 
 
-static void Log_posttrace(int log_level, traceEntry* cur_entry)
-{
-	if (((trace_output_level == -1) ? log_level >= trace_settings.trace_level : log_level >= trace_output_level))
-	{
-		char* msg = NULL;
-		
-		if (trace_destination || trace_callback)
-			msg = &Log_formatTraceEntry(cur_entry)[7];
-		
-		Log_output(log_level, msg);
-	}
-}
-
-
-static void Log_trace(int log_level, char* buf)
+/**
+ * Complete an entry started by Log_pretrace, and write it out if its level is high enough.
+ * @param ring the calling thread's ring
+ * @param log_level the level of the entry
+ * @param cur_entry the entry
+ * @param args the arguments of a message, args_len bytes of which are copied into the
+ * slots following the entry
+ */
+static void Log_posttrace(trace_ring* ring, int log_level, traceEntry* cur_entry, const unsigned char* args)
 {
-	traceEntry *cur_entry = NULL;
+	unsigned int count = ring->count;
+	int slots = cur_entry->slots;
+	int i;
 
-	if (trace_queue == NULL)
-		return;
-
-	cur_entry = Log_pretrace();
+	for (i = 1; i < slots; ++i)
+	{
+		traceArgs* cur_args = &ring->slots[(count + i) % ring->size].args;
+		int offset = (i - 1) * TRACE_SLOT_DATA;
 
-	memcpy(&(cur_entry->ts), &ts, sizeof(ts));
-	cur_entry->sametime_count = sametime_count;
+		cur_args->slots = 0;
+		memcpy(cur_args->data, &args[offset], min(cur_entry->args_len - offset, TRACE_SLOT_DATA));
+	}
+	Log_release_fence();
+	for (i = 0; i < slots; ++i)
+		ring->slots[(count + i) % ring->size].entry.seq = count + 1 + i;
+	ring->count = count + slots;
 
-	cur_entry->has_rc = 2;
-	strncpy(cur_entry->name, buf, sizeof(cur_entry->name));
-	cur_entry->name[MAX_FUNCTION_NAME_LENGTH] = '\0';
+	if ((trace_destination || trace_callback) &&
+		((trace_output_level == -1) ? log_level >= trace_settings.trace_level : log_level >= trace_output_level))
+	{
+		char msg_buf[512];
 
-	Log_posttrace(log_level, cur_entry);
+		Log_output(log_level, Log_formatTraceEntry(cur_entry, args, msg_buf, sizeof(msg_buf)));
+	}
 }
 
 
 /**
  * Log a message.  If possible, all messages should be indexed by message number, and
  * the use of the format string should be minimized or negated altogether.  If format is
- * provided, the message number is only used as a message label.
+ * provided, the message number is only used as a message label.  The arguments are stored,
+ * and only formatted if the message is output.
  * @param log_level the log level of the message
  * @param msgno the id of the message to use if the format string is NULL
- * @param aFormat the printf format string to be used if the message id does not exist
+ * @param aFormat the printf format string to be used if the message id does not exist.
+ * This must be a constant, as it is formatted later.
  * @param ... the printf inserts
+ * The name is in brackets so that it is not expanded by the Log macro of Log.h.
  */
-void Log(int log_level, int msgno, char* format, ...)
+void (Log)(int log_level, int msgno, char* format, ...)
 {
 	if (log_level >= trace_settings.trace_level)
 	{
-		char* temp = NULL;
-		static char msg_buf[512];
-		va_list args;
-
-		/* we're using a static character buffer, so we need to make sure only one thread uses it at a time */
-		Thread_lock_mutex(log_mutex); 
-		if (format == NULL && (temp = Messages_get(msgno, log_level)) != NULL)
-			format = temp;
-
-		va_start(args, format);
-		vsnprintf(msg_buf, sizeof(msg_buf), format, args);
-
-		Log_trace(log_level, msg_buf);
-		va_end(args);
-		Thread_unlock_mutex(log_mutex); 
+		unsigned char args[TRACE_MAX_ARGS_LENGTH];
+		trace_ring* ring = NULL;
+		traceEntry* cur_entry = NULL;
+		va_list ap;
+		int args_len;
+
+		if ((ring = Log_getRing()) == NULL)
+			return;
+		if (format == NULL && (format = Messages_get(msgno, log_level)) == NULL)
+			return;
+
+		va_start(ap, format);
+		args_len = TraceRecord_encodeArgs(format, &ap, args, sizeof(args));
+		va_end(ap);
+
+		cur_entry = Log_pretrace(ring, 1 + (args_len + TRACE_SLOT_DATA - 1) / TRACE_SLOT_DATA);
+		cur_entry->name = format;
+		cur_entry->args_len = (unsigned short)args_len;
+		cur_entry->number = msgno;
+		cur_entry->depth = cur_entry->line = cur_entry->rc = 0;
+		cur_entry->has_rc = 2;
+		cur_entry->level = (char)log_level;
+
+		Log_posttrace(ring, log_level, cur_entry, args);
 	}
 
 	/*if (log_level >= LOG_ERROR)
@@ -423,7 +676,8 @@ void Log(int log_level, int msgno, char* format, ...)
 /**
  * The reason for this function is to make trace logging as fast as possible so that the
  * function exit/entry history can be captured by default without unduly impacting
- * performance.  Therefore it must do as little as possible.
+ * performance.  Therefore it must do as little as possible: the function name is not
+ * copied, as it is always a constant.
  * @param log_level the log level of the message
  * @param msgno the id of the message to use if the format string is NULL
  * @param aFormat the printf format string to be used if the message id does not exist
@@ -431,35 +685,34 @@ void Log(int log_level, int msgno, char* format, ...)
  */
 void Log_stackTrace(int log_level, int msgno, int thread_id, int current_depth, const char* name, int line, int* rc)
 {
+	trace_ring* ring = NULL;
 	traceEntry *cur_entry = NULL;
 
-	if (trace_queue == NULL)
-		return;
-
 	if (log_level < trace_settings.trace_level)
 		return;
 
-	Thread_lock_mutex(log_mutex);
-	cur_entry = Log_pretrace();
+	if ((ring = Log_getRing()) == NULL)
+		return;
 
-	memcpy(&(cur_entry->ts), &ts, sizeof(ts));
-	cur_entry->sametime_count = sametime_count;
+	cur_entry = Log_pretrace(ring, 1);
 	cur_entry->number = msgno;
 	cur_entry->thread_id = thread_id;
 	cur_entry->depth = current_depth;
-	strcpy(cur_entry->name, name);
-	cur_entry->level = log_level;
+	cur_entry->name = name;
+	cur_entry->level = (char)log_level;
 	cur_entry->line = line;
 	if (rc == NULL)
+	{
 		cur_entry->has_rc = 0;
+		cur_entry->rc = 0;
+	}
 	else
 	{
 		cur_entry->has_rc = 1;
 		cur_entry->rc = *rc;
 	}
 
-	Log_posttrace(log_level, cur_entry);
-	Thread_unlock_mutex(log_mutex);
+	Log_posttrace(ring, log_level, cur_entry, NULL);
 }
 
 
@@ -482,80 +735,275 @@ FILE* Log_destToFile(char* dest)
 }
 
 
-int Log_compareEntries(char* entry1, char* entry2)
+/**
+ * Copy the complete slots of a ring, oldest first.  Slots being written while they are
+ * copied are left out.  log_mutex must be held, so the ring is not resized.
+ * @param ring the ring to copy
+ * @param dest where to copy the slots to, room for ring->size slots
+ * @return the number of slots copied
+ */
+static int Log_copyRing(trace_ring* ring, traceSlot* dest)
 {
-	int comp = strncmp(&entry1[7], &entry2[7], 19);
+	unsigned int count = ring->count;
+	unsigned int seq = (count > (unsigned int)ring->size) ? count - ring->size + 1 : 1;
+	int copied = 0;
+
+	Log_acquire_fence();
+	for (; seq <= count; ++seq)
+	{
+		traceSlot* slot = &ring->slots[(seq - 1) % ring->size];
+
+		if (slot->entry.seq != seq)
+			continue;
+		Log_acquire_fence();
+		dest[copied] = *slot;
+		Log_acquire_fence();
+		if (slot->entry.seq == seq)
+			++copied;
+	}
+	return copied;
+}
 
-	/* if timestamps are equal, use the sequence numbers */
-	if (comp == 0)
-		comp = strncmp(&entry1[1], &entry2[1], 4);
 
-	return comp;
+/**
+ * Find the next entry in a copy of a ring which was copied whole.
+ * @param slots the copied slots
+ * @param count the number of slots copied
+ * @param pos the slot to start looking from
+ * @return the index of the first slot of the entry, or count if there is none
+ */
+static int Log_nextEntry(traceSlot* slots, int count, int pos)
+{
+	for (; pos < count; ++pos)
+	{
+		traceEntry* entry = &slots[pos].entry;
+		int i = 1;
+
+		if (entry->slots == 0 || pos + entry->slots > count)
+			continue;
+		while (i < entry->slots && slots[pos + i].args.slots == 0 && slots[pos + i].args.seq == entry->seq + i)
+			++i;
+		if (i == entry->slots)
+			break;
+	}
+	return pos;
+}
+
+
+/**
+ * Put the arguments of a copied entry back together.
+ * @param first the first slot of the entry, followed by its other slots
+ * @param args where to put the arguments, room for TRACE_MAX_ARGS_LENGTH bytes
+ */
+static void Log_gatherArgs(traceSlot* first, unsigned char* args)
+{
+	int i;
+
+	for (i = 1; i < first->entry.slots; ++i)
+	{
+		int offset = (i - 1) * TRACE_SLOT_DATA;
+
+		memcpy(&args[offset], first[i].args.data, min(first->entry.args_len - offset, TRACE_SLOT_DATA));
+	}
 }
 
 
-#if 0
 /**
- * Write the contents of the stored trace to a stream
+ * Write a string to a binary trace dump, the first time it is used.
+ * @param file the dump
+ * @param str the string
+ * @param strings the strings written so far, the index of each being its id
+ * @param count the number of strings written so far
+ * @return the id of the string
+ */
+static unsigned int Log_writeString(FILE* file, const char* str, const char*** strings, int* count)
+{
+	unsigned char header[7];
+	size_t len;
+	int i;
+
+	if (str == NULL)
+		return TRACE_NO_STRING;
+	for (i = 0; i < *count; ++i)
+	{
+		if ((*strings)[i] == str)
+			return i;
+	}
+	if (*count % 64 == 0)
+	{
+		const char** new_strings = realloc(*strings, (*count + 64) * sizeof(char*));
+
+		if (new_strings == NULL)
+			return TRACE_NO_STRING;
+		*strings = new_strings;
+	}
+	(*strings)[*count] = str;
+	if ((len = strlen(str)) > 0xFFFF)
+		len = 0xFFFF;
+	header[0] = TRACE_RECORD_STRING;
+	TraceRecord_writeInt(&header[1], *count, 4);
+	TraceRecord_writeInt(&header[5], len, 2);
+	fwrite(header, 1, sizeof(header), file);
+	fwrite(str, 1, len, file);
+	return (*count)++;
+}
+
+
+/**
+ * Write an entry to a binary trace dump.
+ * @param file the dump
+ * @param entry the entry
+ * @param args the arguments of a message
+ * @param strings the strings written so far
+ * @param count the number of strings written so far
+ */
+static void Log_writeBinaryEntry(FILE* file, traceEntry* entry, const unsigned char* args, const char*** strings, int* count)
+{
+	unsigned char buf[TRACE_ENTRY_LENGTH];
+	TraceRecord record;
+
+	Log_toRecord(entry, args, &record);
+	buf[0] = TRACE_RECORD_ENTRY;
+	buf[1] = (unsigned char)entry->has_rc;
+	buf[2] = (unsigned char)entry->level;
+	TraceRecord_writeInt(&buf[3], (unsigned long long)(entry->stamp - start_stamp), 8);
+	TraceRecord_writeInt(&buf[11], (unsigned int)entry->thread_id, 4);
+	TraceRecord_writeInt(&buf[15], (unsigned int)entry->depth, 4);
+	TraceRecord_writeInt(&buf[19], (unsigned int)entry->line, 4);
+	TraceRecord_writeInt(&buf[23], (unsigned int)entry->rc, 4);
+	TraceRecord_writeInt(&buf[27], Log_writeString(file, record.format, strings, count), 4);
+	TraceRecord_writeInt(&buf[31], Log_writeString(file, record.name, strings, count), 4);
+	TraceRecord_writeInt(&buf[35], entry->args_len, 2);
+	fwrite(buf, 1, sizeof(buf), file);
+	fwrite(args, 1, entry->args_len, file);
+}
+
+
+/**
+ * Write the contents of the stored trace to a stream, merging the entries of all threads
+ * in time order.
  * @param dest string which contains a file name or the special strings stdout or stderr
+ * @param binary write the binary form read by MQTTTraceDecode, rather than text?
+ * @return 0 on success
  */
-int Log_dumpTrace(char* dest)
+static int Log_writeTrace(char* dest, int binary)
 {
 	FILE* file = NULL;
-	ListElement* cur_trace_entry = NULL;
-	const int msgstart = 7;
-	int rc = -1;
-	int trace_queue_index = 0;
+	trace_ring* ring = NULL;
+	traceSlot** ring_slots = NULL;
+	int* ring_counts = NULL;
+	int* ring_pos = NULL;
+	int ring_count = 0;
+	const char** strings = NULL;
+	int string_count = 0;
+	int i, rc = -1;
 
 	if ((file = Log_destToFile(dest)) == NULL)
 	{
-		Log(LOG_ERROR, 9, NULL, "trace", dest, "trace entries");
+		Log(LOG_ERROR, -1, "Unable to open %s to dump the trace", dest);
 		goto exit;
 	}
 
-	fprintf(file, "=========== Start of trace dump ==========\n");
-	/* Interleave the log and trace entries together appropriately */
-	ListNextElement(trace_buffer, &cur_trace_entry);
-	trace_queue_index = start_index;
-	if (trace_queue_index == -1)
-		trace_queue_index = next_index;
-	else
+	Thread_lock_mutex(log_mutex);
+	for (ring = rings; ring; ring = ring->next)
+		++ring_count;
+	ring_slots = calloc(ring_count + 1, sizeof(traceSlot*));
+	ring_counts = calloc(ring_count + 1, sizeof(int));
+	ring_pos = calloc(ring_count + 1, sizeof(int));
+	if (ring_slots && ring_counts && ring_pos)
 	{
-		Log_formatTraceEntry(&trace_queue[trace_queue_index++]);
-		if (trace_queue_index == trace_settings.max_trace_entries)
-			trace_queue_index = 0;
+		for (i = 0, ring = rings; ring; ring = ring->next, ++i)
+		{
+			if ((ring_slots[i] = malloc(ring->size * sizeof(traceSlot))) != NULL)
+				ring_counts[i] = Log_copyRing(ring, ring_slots[i]);
+		}
 	}
-	while (cur_trace_entry || trace_queue_index != next_index)
+	Thread_unlock_mutex(log_mutex);
+	if (ring_slots == NULL || ring_counts == NULL || ring_pos == NULL)
+		goto free_exit;
+
+	if (binary)
 	{
-		if (cur_trace_entry && trace_queue_index != -1)
-		{	/* compare these timestamps */
-			if (Log_compareEntries((char*)cur_trace_entry->content, msg_buf) > 0)
-				cur_trace_entry = NULL;
-		}
+		unsigned char header[TRACE_FILE_HEADER_LENGTH];
+		long long seconds;
+		long micros;
+
+		Log_startTime(&seconds, &micros);
+		memcpy(header, TRACE_FILE_MAGIC, TRACE_FILE_MAGIC_LENGTH);
+		TraceRecord_writeInt(&header[TRACE_FILE_MAGIC_LENGTH], (unsigned long long)seconds, 8);
+		TraceRecord_writeInt(&header[TRACE_FILE_MAGIC_LENGTH + 8], (unsigned long long)micros, 4);
+		fwrite(header, 1, sizeof(header), file);
+	}
+	else
+		fprintf(file, "=========== Start of trace dump ==========\n");
+	for (i = 0; i < ring_count; ++i)
+		ring_pos[i] = Log_nextEntry(ring_slots[i], ring_counts[i], 0);
+	while (1)
+	{
+		unsigned char args[TRACE_MAX_ARGS_LENGTH];
+		traceEntry* entry = NULL;
+		int next = -1;
 
-		if (cur_trace_entry)
+		/* each ring is already in time order, so the next entry is the earliest at the head of a ring */
+		for (i = 0; i < ring_count; ++i)
 		{
-			fprintf(file, "%s\n", &((char*)(cur_trace_entry->content))[msgstart]);
-			ListNextElement(trace_buffer, &cur_trace_entry);
+			if (ring_pos[i] < ring_counts[i] && (next == -1 ||
+					ring_slots[i][ring_pos[i]].entry.stamp < ring_slots[next][ring_pos[next]].entry.stamp))
+				next = i;
 		}
+		if (next == -1)
+			break;
+		entry = &ring_slots[next][ring_pos[next]].entry;
+		Log_gatherArgs(&ring_slots[next][ring_pos[next]], args);
+		if (binary)
+			Log_writeBinaryEntry(file, entry, args, &strings, &string_count);
 		else
 		{
-			fprintf(file, "%s\n", &msg_buf[7]);
-			if (trace_queue_index != next_index)
-			{
-				Log_formatTraceEntry(&trace_queue[trace_queue_index++]);
-				if (trace_queue_index == trace_settings.max_trace_entries)
-					trace_queue_index = 0;
-			}
+			char msg_buf[512];
+
+			fprintf(file, "%s\n", Log_formatTraceEntry(entry, args, msg_buf, sizeof(msg_buf)));
 		}
+		ring_pos[next] = Log_nextEntry(ring_slots[next], ring_counts[next], ring_pos[next] + entry->slots);
 	}
-	fprintf(file, "========== End of trace dump ==========\n\n");
+	if (!binary)
+		fprintf(file, "========== End of trace dump ==========\n\n");
+	rc = ferror(file) ? -1 : 0;
+free_exit:
+	if (ring_slots)
+	{
+		for (i = 0; i < ring_count; ++i)
+			free(ring_slots[i]);
+		free(ring_slots);
+	}
+	free(ring_counts);
+	free(ring_pos);
+	free(strings);
 	if (file != stdout && file != stderr && file != NULL)
 		fclose(file);
-	rc = 0;
 exit:
 	return rc;
 }
-#endif
 
 
+/**
+ * Write the contents of the stored trace to a stream as text, merging the entries of all
+ * threads in time order.
+ * @param dest string which contains a file name or the special strings stdout or stderr
+ * @return 0 on success
+ */
+int Log_dumpTrace(char* dest)
+{
+	return Log_writeTrace(dest, 0);
+}
+
+
+/**
+ * Write the contents of the stored trace to a file in binary form, which is smaller and
+ * quicker to write than text.  MQTTTraceDecode turns it into text.
+ * @param dest the file name
+ * @return 0 on success
+ */
+int Log_dumpTraceBinary(char* dest)
+{
+	return Log_writeTrace(dest, 1);
+}
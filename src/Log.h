@@ -54,7 +54,7 @@ BE*/
 typedef struct
 {
 	int trace_level;			/**< trace level */
-	int max_trace_entries;		/**< max no of entries in the trace buffer */
+	int max_trace_entries;		/**< max no of 64 byte slots in each thread's trace buffer */
 	int trace_output_level;		/**< trace level to output to destination */
 } trace_settings_type;
 
@@ -71,12 +71,30 @@ typedef struct
 	const char* value;
 } Log_nameValue;
 
+/** time from a cheap monotonic clock, in nanoseconds */
+typedef unsigned long long Log_stamp_type;
+
 int Log_initialize(Log_nameValue*);
 void Log_terminate();
+Log_stamp_type Log_stamp(void);
+int Log_dumpTrace(char* dest);
+int Log_dumpTraceBinary(char* dest);
 
 void Log(int, int, char *, ...);
 void Log_stackTrace(int, int, int, int, const char*, int, int*);
 
+/*
+ * When PAHO_TRACE_MIN_LEVEL is defined (make TRACE_MIN_LEVEL=..., or cmake -DPAHO_TRACE_MIN_LEVEL=...),
+ * Log calls with a constant level below it are removed by the compiler, arguments and all, so
+ * MQTT_C_CLIENT_TRACE_LEVEL can not bring them back.  LOG_ERROR and above are always kept.
+ */
+#if defined(PAHO_TRACE_MIN_LEVEL)
+#define Log_compiledIn(level) ((level) >= PAHO_TRACE_MIN_LEVEL || (level) >= LOG_ERROR)
+#define Log(level, ...) do { if (Log_compiledIn(level)) (Log)(level, __VA_ARGS__); } while (0)
+#else
+#define Log_compiledIn(level) 1
+#endif
+
 typedef void Log_traceCallback(enum LOG_LEVELS level, char* message);
 void Log_setTraceCallback(Log_traceCallback* callback);
 void Log_setTraceLevel(enum LOG_LEVELS level);
@@ -40,6 +40,7 @@
 
 #define _GNU_SOURCE /* for pthread_mutexattr_settype */
 #include <stdlib.h>
+#include <stddef.h>
 #if !defined(WIN32) && !defined(WIN64)
 	#include <sys/time.h>
 #endif
@@ -53,6 +54,10 @@
 #include "MQTTProtocolOut.h"
 #include "Thread.h"
 #include "SocketBuffer.h"
+#include "Pool.h"
+#include "Probes.h"
+#include "Resolver.h"
+#include "TopicTrie.h"
 #include "StackTrace.h"
 #include "Heap.h"
 
@@ -94,7 +99,6 @@ static mutex_type mqttasync_mutex = NULL;
 static mutex_type socket_mutex = NULL;
 static mutex_type mqttcommand_mutex = NULL;
 static sem_type send_sem = NULL;
-extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
 extern mutex_type log_mutex;
 BOOL APIENTRY DllMain(HANDLE hModule,
@@ -115,7 +119,6 @@ BOOL APIENTRY DllMain(HANDLE hModule,
 		        FALSE,              /* initial state is nonsignaled */
 		        NULL                /* object name */
 		        );
-				stack_mutex = CreateMutex(NULL, 0, NULL);
 				heap_mutex = CreateMutex(NULL, 0, NULL);
 				log_mutex = CreateMutex(NULL, 0, NULL);
 				socket_mutex = CreateMutex(NULL, 0, NULL);
@@ -142,7 +145,9 @@ static mutex_type mqttcommand_mutex = &mqttcommand_mutex_store;
 static cond_type_struct send_cond_store = { PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
 static cond_type send_cond = &send_cond_store;
 
-void MQTTAsync_init()
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void MQTTAsync_init_once(void)
 {
 	pthread_mutexattr_t attr;
 	int rc;
@@ -156,16 +161,25 @@ void MQTTAsync_init()
 	if ((rc = pthread_mutex_init(socket_mutex, &attr)) != 0)
 		printf("MQTTClient: error %d initializing socket_mutex\n", rc);
 
-	if ((rc = pthread_cond_init(&send_cond->cond, NULL)) != 0)
-		printf("MQTTAsync: error %d initializing send_cond cond\n", rc);
-	if ((rc = pthread_mutex_init(&send_cond->mutex, &attr)) != 0)
-		printf("MQTTAsync: error %d initializing send_cond mutex\n", rc);
+	if ((rc = Thread_init_cond(send_cond, &attr)) != 0)
+		printf("MQTTAsync: error %d initializing send_cond\n", rc);
+}
+
+/**
+ * Initialize the mutexes and send_cond.  Only the Makefile build runs this when the library
+ * is loaded, so MQTTAsync_createWithOptions and MQTTAsync_global_init call it too.  send_cond must be set up by
+ * Thread_init_cond, as its timed waits are measured on the clock set there.
+ */
+void MQTTAsync_init()
+{
+	pthread_once(&init_once, MQTTAsync_init_once);
 }
 
 #define WINAPI
 #endif
 
 static volatile int initialized = 0;
+static int useMemoryPools = 0; /* set by MQTTAsync_global_init */
 static List* handles = NULL;
 static int tostop = 0;
 static List* commands = NULL;
@@ -178,6 +192,7 @@ void MQTTAsync_closeOnly(Clients* client);
 void MQTTAsync_closeSession(Clients* client);
 void MQTTProtocol_closeSession(Clients* client, int sendwill);
 void MQTTAsync_writeComplete(int socket);
+void MQTTAsync_lookupComplete(void);
 
 #if defined(WIN32) || defined(WIN64)
 #define START_TIME_TYPE DWORD
@@ -237,6 +252,7 @@ typedef struct
 	char* topicName;
 	int topicLen;
 	unsigned int seqno; /* only used on restore */
+	ListElement link; /* for the messageQueue list.  Must match MQTTPersistence_qEntry */
 } qEntry;
 
 typedef struct
@@ -247,6 +263,7 @@ typedef struct
 	MQTTAsync_token token;
 	void* context;
 	START_TIME_TYPE start_time;
+	long long* stamps; /* the stage times of a publish, if latency tracing is on */
 	union
 	{
 		struct
@@ -296,12 +313,15 @@ typedef struct MQTTAsync_struct
 
 	MQTTAsync_connected* connected;
 	void* connected_context; /* the context to be associated with the connected callback*/
+
+	TopicTrie* subscriptions; /* messageArrived callbacks of topic filters, created when first needed */
 	
 	/* Each time connect is called, we store the options that were used.  These are reused in
 	   any call to reconnect, or an automatic reconnect attempt */
 	MQTTAsync_command connect;		/* Connect operation properties */
 	MQTTAsync_command disconnect;		/* Disconnect operation properties */
 	MQTTAsync_command* pending_write;       /* Is there a socket write pending? */
+	long long* pending_stamps;              /* the stage times of a traced publish whose write is pending */
 	
 	List* responses;
 	unsigned int command_seqno;						
@@ -328,16 +348,28 @@ typedef struct MQTTAsync_struct
 } MQTTAsyncs;
 
 
+/** The messageArrived callback of a topic filter, set by subscribe */
+typedef struct
+{
+	MQTTAsync_messageArrived* ma;
+	void* context;
+} MQTTAsync_subscriptionCallback;
+
+
 typedef struct
 {
 	MQTTAsync_command command;
 	MQTTAsyncs* client;
 	unsigned int seqno; /* only used on restore */
+	ListElement link; /* for the commands list, or the client's responses list */
 } MQTTAsync_queuedCommand;
 
 void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command);
 void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command);
 int MQTTAsync_deliverMessage(MQTTAsyncs* m, char* topicName, size_t topicLen, MQTTAsync_message* mm);
+int MQTTAsync_connecting(MQTTAsyncs* m);
+static void MQTTAsync_setSubscriptionCallbacks(MQTTAsyncs* m, int count, char* const* topic,
+		MQTTAsync_messageArrived* ma, void* context);
 #if !defined(NO_PERSISTENCE)
 int MQTTAsync_restoreCommands(MQTTAsyncs* client);
 #endif
@@ -392,7 +424,7 @@ int MQTTAsync_checkConn(MQTTAsync_command* command, MQTTAsyncs* client)
 	int rc;
 
 	FUNC_ENTRY;
-	rc = command->details.conn.currentURI < client->serverURIcount ||
+	rc = command->details.conn.currentURI + 1 < client->serverURIcount ||
 		(command->details.conn.MQTTVersion == 4 && client->c->MQTTVersion == MQTTVERSION_DEFAULT);
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -406,6 +438,9 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 	MQTTAsyncs *m = NULL;
 
 	FUNC_ENTRY;
+#if !defined(WIN32) && !defined(WIN64)
+	MQTTAsync_init();
+#endif
 	MQTTAsync_lock_mutex(mqttasync_mutex);
 
 	if (serverURI == NULL || clientId == NULL)
@@ -420,7 +455,8 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 		goto exit;
 	}
 
-	if (options && (strncmp(options->struct_id, "MQCO", 4) != 0 || options->struct_version != 0))
+	if (options && (strncmp(options->struct_id, "MQCO", 4) != 0 ||
+		options->struct_version < 0 || options->struct_version > 2))
 	{
 		rc = MQTTASYNC_BAD_STRUCTURE;
 		goto exit;
@@ -431,12 +467,17 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 		#if defined(HEAP_H)
 			Heap_initialize();
 		#endif
+		Pool_initialize();
+		if (useMemoryPools)
+			Pool_enable();
 		Log_initialize((Log_nameValue*)MQTTAsync_getVersionInfo());
 		bstate->clients = ListInitialize();
+		ListZeroIntrusive(&(state.publications), offsetof(Publications, link));
 		Socket_outInitialize();
 		Socket_setWriteCompleteCallback(MQTTAsync_writeComplete);
+		Resolver_setCompleteCallback(MQTTAsync_lookupComplete);
 		handles = ListInitialize();
-		commands = ListInitialize();
+		commands = ListInitializeIntrusive(offsetof(MQTTAsync_queuedCommand, link));
 #if defined(OPENSSL)
 		SSLSocket_initialize();
 #endif
@@ -455,22 +496,27 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 	}
 #endif
 	m->serverURI = MQTTStrdup(serverURI);
-	m->responses = ListInitialize();
+	m->responses = ListInitializeIntrusive(offsetof(MQTTAsync_queuedCommand, link));
 	ListAppend(handles, m, sizeof(MQTTAsyncs));
 
 	m->c = malloc(sizeof(Clients));
 	memset(m->c, '\0', sizeof(Clients));
 	m->c->context = m;
-	m->c->outboundMsgs = ListInitialize();
-	m->c->inboundMsgs = ListInitialize();
-	m->c->messageQueue = ListInitialize();
+	m->c->outboundMsgs = ListInitializeIntrusive(offsetof(Messages, link));
+	m->c->inboundMsgs = ListInitializeIntrusive(offsetof(Messages, link));
+	m->c->messageQueue = ListInitializeIntrusive(offsetof(qEntry, link));
 	m->c->clientID = MQTTStrdup(clientId);
+	m->c->net.metrics = Metrics_create();
 
 	m->shouldBeConnected = 0;
 	if (options)
 	{
 		m->createOptions = malloc(sizeof(MQTTAsync_createOptions));
-		memcpy(m->createOptions, options, sizeof(MQTTAsync_createOptions));
+		memset(m->createOptions, '\0', sizeof(MQTTAsync_createOptions));
+		memcpy(m->createOptions, options, (options->struct_version == 0) ?
+				offsetof(MQTTAsync_createOptions, compressPersistence) : (options->struct_version == 1) ?
+				offsetof(MQTTAsync_createOptions, traceLatency) : sizeof(MQTTAsync_createOptions));
+		m->c->compressPersistence = m->createOptions->compressPersistence;
 	}
 
 #if !defined(NO_PERSISTENCE)
@@ -502,23 +548,40 @@ int MQTTAsync_create(MQTTAsync* handle, const char* serverURI, const char* clien
 }
 
 
+void MQTTAsync_global_init(MQTTAsync_init_options* inits)
+{
+	FUNC_ENTRY;
+#if !defined(WIN32) && !defined(WIN64)
+	MQTTAsync_init();
+#endif
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	useMemoryPools = (inits && strncmp(inits->struct_id, "MQTG", 4) == 0 && inits->struct_version == 0) ?
+			inits->useMemoryPools : 0;
+	if (initialized && useMemoryPools)
+		Pool_enable(); /* clients already exist: items allocated until now are freed to the heap as usual */
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	FUNC_EXIT;
+}
+
+
 void MQTTAsync_terminate(void)
 {
 	FUNC_ENTRY;
 	MQTTAsync_stop();
 	if (initialized)
 	{
-		ListElement* elem = NULL;
+		MQTTAsync_queuedCommand* command = NULL;
 		ListFree(bstate->clients);
 		ListFree(handles);
-		while (ListNextElement(commands, &elem))
-			MQTTAsync_freeCommand1((MQTTAsync_queuedCommand*)(elem->content));
+		while ((command = ListDetachHead(commands)) != NULL)
+			MQTTAsync_freeCommand(command);
 		ListFree(commands);
 		handles = NULL;
 		Socket_outTerminate();
 #if defined(OPENSSL)
 		SSLSocket_terminate();
 #endif
+		Pool_terminate();
 		#if defined(HEAP_H)
 			Heap_terminate();
 		#endif
@@ -637,7 +700,7 @@ int MQTTAsync_persistCommand(MQTTAsync_queuedCommand* qcmd)
 	}
 	if (nbufs > 0)
 	{
-		if ((rc = aclient->c->persistence->pput(aclient->c->phandle, key, nbufs, (char**)bufs, lens)) != 0)
+		if ((rc = MQTTPersistence_putRecord(aclient->c, key, nbufs, (char**)bufs, lens)) != 0)
 			Log(LOG_ERROR, 0, "Error persisting command, rc %d", rc);
 		qcmd->seqno = aclient->command_seqno;
 	}
@@ -659,7 +722,7 @@ MQTTAsync_queuedCommand* MQTTAsync_restoreCommand(char* buffer, int buflen)
 	size_t data_size;
 	
 	FUNC_ENTRY;
-	qcommand = malloc(sizeof(MQTTAsync_queuedCommand));
+	qcommand = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 	memset(qcommand, '\0', sizeof(MQTTAsync_queuedCommand));
 	command = &qcommand->command;
 	
@@ -724,7 +787,7 @@ MQTTAsync_queuedCommand* MQTTAsync_restoreCommand(char* buffer, int buflen)
 			break;
 			
 		default:
-			free(qcommand);
+			Pool_free(POOL_COMMAND, qcommand);
 			qcommand = NULL;
 			
 	}
@@ -772,17 +835,19 @@ int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 				;
 			else if ((rc = c->persistence->pget(c->phandle, msgkeys[i], &buffer, &buflen)) == 0)
 			{
-				MQTTAsync_queuedCommand* cmd = MQTTAsync_restoreCommand(buffer, buflen);
+				MQTTAsync_queuedCommand* cmd = NULL;
 				
+				if (MQTTPersistence_decodeRecord(&buffer, &buflen) == 0)
+					cmd = MQTTAsync_restoreCommand(buffer, buflen);
 				if (cmd)
 				{
 					cmd->client = client;	
 					cmd->seqno = atoi(msgkeys[i]+2);
 					MQTTPersistence_insertInOrder(commands, cmd, sizeof(MQTTAsync_queuedCommand));
-					free(buffer);
 					client->command_seqno = max(client->command_seqno, cmd->seqno);
 					commands_restored++;
 				}
+				free(buffer);
 			}
 			if (msgkeys[i])
 				free(msgkeys[i]);
@@ -804,6 +869,7 @@ int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
 	
 	FUNC_ENTRY;
 	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	PROBE3(command__queued, command->client->c->clientID, command->command.type, command->command.token);
 	command->command.start_time = MQTTAsync_start_clock();
 	if (command->command.type == CONNECT || 
 		(command->command.type == DISCONNECT && command->command.details.dis.internal))
@@ -880,7 +946,7 @@ int MQTTAsync_reconnect(MQTTAsync handle)
 	else
 	{
 		/* to reconnect, put the connect command to the head of the command queue */
-		MQTTAsync_queuedCommand* conn = malloc(sizeof(MQTTAsync_queuedCommand));
+		MQTTAsync_queuedCommand* conn = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 		memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
 		conn->client = m;
 		conn->command = m->connect;
@@ -992,13 +1058,46 @@ void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command)
 		if (command->command.details.pub.destinationName)
 			free(command->command.details.pub.destinationName); 
 		free(command->command.details.pub.payload);
+		if (command->command.stamps)
+		{
+			if (command->client && command->client->pending_stamps == command->command.stamps)
+				command->client->pending_stamps = NULL;
+			free(command->command.stamps);
+		}
 	}
 }
 
 void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command)
 {
 	MQTTAsync_freeCommand1(command);
-	free(command);
+	Pool_free(POOL_COMMAND, command);
+}
+
+
+/**
+ * Called on a resolver thread when a host name lookup has finished, so that the
+ * send thread can carry on with any connects which were waiting for it
+ */
+void MQTTAsync_lookupComplete(void)
+{
+#if !defined(WIN32) && !defined(WIN64)
+	Thread_signal_cond(send_cond);
+#else
+	if (!Thread_check_sem(send_sem))
+		Thread_post_sem(send_sem);
+#endif
+}
+
+
+/**
+ * Record the completion of a traced publication in the stage histograms
+ * @param m the client
+ * @param stamps the stage times of the publication
+ */
+static void MQTTAsync_stagesComplete(MQTTAsyncs* m, long long* stamps)
+{
+	stamps[STAGE_CALLBACK] = Metrics_now();
+	Metrics_recordStages(m->c->net.metrics, stamps);
 }
 
 
@@ -1017,6 +1116,11 @@ void MQTTAsync_writeComplete(int socket)
 		MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
 		
 		time(&(m->c->net.lastSent));
+		if (m->pending_stamps)
+		{
+			m->pending_stamps[STAGE_WRITTEN] = Metrics_now();
+			m->pending_stamps = NULL;
+		}
 				
 		/* see if there is a pending write flagged */
 		if (m->pending_write)
@@ -1032,6 +1136,8 @@ void MQTTAsync_writeComplete(int socket)
 					break;
 			}
 					
+			if (cur_response && command->stamps)
+				MQTTAsync_stagesComplete(m, command->stamps);
 			if (cur_response && command->onSuccess)
 			{
 				MQTTAsync_successData data;
@@ -1042,6 +1148,7 @@ void MQTTAsync_writeComplete(int socket)
 				data.alt.pub.message.payloadlen = command->details.pub.payloadlen;
 				data.alt.pub.message.qos = command->details.pub.qos;
 				data.alt.pub.message.retained = command->details.pub.retained;
+				data.alt.pub.stages = command->stamps;
 				Log(TRACE_MIN, -1, "Calling publish success for client %s", m->c->clientID);
 				(*(command->onSuccess))(command->context, &data);
 			}		
@@ -1097,6 +1204,7 @@ int MQTTAsync_processCommand()
 	ListFreeNoContent(ignored_clients);
 	if (command)
 	{
+		PROBE3(command__dequeued, command->client->c->clientID, command->command.type, command->command.token);
 		ListDetach(commands, command);
 #if !defined(NO_PERSISTENCE)
 		if (command->client->c->persistence)
@@ -1126,8 +1234,8 @@ int MQTTAsync_processCommand()
 						command->command.details.conn.MQTTVersion = MQTTVERSION_DEFAULT;
 					}
 				}
-				else
-					command->command.details.conn.currentURI++;
+				else if (command->command.details.conn.MQTTVersion != 0)
+					command->command.details.conn.currentURI++; /* not the first attempt */
 
 				serverURI = command->client->serverURIs[command->command.details.conn.currentURI];
 
@@ -1153,20 +1261,29 @@ int MQTTAsync_processCommand()
 				command->command.details.conn.MQTTVersion = command->client->c->MQTTVersion;
 
 			Log(TRACE_MIN, -1, "Connecting to serverURI %s with MQTT version %d", serverURI, command->command.details.conn.MQTTVersion);
+			if (MQTTProtocol_resolve(serverURI) == TCPSOCKET_INTERRUPTED)
+			{
+				/* don't wait for the host name lookup here: MQTTAsync_resumeConnects carries on when it is done */
+				command->client->c->connect_state = 4;
+				rc = 0;
+			}
+			else
+			{
 #if defined(OPENSSL)
-			rc = MQTTProtocol_connect(serverURI, command->client->c, command->client->ssl, command->command.details.conn.MQTTVersion);
+				rc = MQTTProtocol_connect(serverURI, command->client->c, command->client->ssl, command->command.details.conn.MQTTVersion);
 #else
-			rc = MQTTProtocol_connect(serverURI, command->client->c, command->command.details.conn.MQTTVersion);
+				rc = MQTTProtocol_connect(serverURI, command->client->c, command->command.details.conn.MQTTVersion);
 #endif
-			if (command->client->c->connect_state == 0)
-				rc = SOCKET_ERROR;
-			
-			/* if the TCP connect is pending, then we must call select to determine when the connect has completed,
-			which is indicated by the socket being ready *either* for reading *or* writing.  The next couple of lines
-			make sure we check for writeability as well as readability, otherwise we wait around longer than we need to
-			in Socket_getReadySocket() */ 
-			if (rc == EINPROGRESS)
-				Socket_addPendingWrite(command->client->c->net.socket);
+				if (command->client->c->connect_state == 0)
+					rc = SOCKET_ERROR;
+
+				/* if the TCP connect is pending, then we must call select to determine when the connect has completed,
+				which is indicated by the socket being ready *either* for reading *or* writing.  The next couple of lines
+				make sure we check for writeability as well as readability, otherwise we wait around longer than we need to
+				in Socket_getReadySocket() */
+				if (rc == EINPROGRESS)
+					Socket_addPendingWrite(command->client->c->net.socket);
+			}
 		}
 	}
 	else if (command->command.type == SUBSCRIBE)
@@ -1200,19 +1317,29 @@ int MQTTAsync_processCommand()
 		Messages* msg = NULL;
 		Publish* p = NULL;
 	
-		p = malloc(sizeof(Publish));
+		p = Pool_malloc(POOL_PUBLISH, sizeof(Publish));
 
 		p->payload = command->command.details.pub.payload;
 		p->payloadlen = command->command.details.pub.payloadlen;
 		p->topic = command->command.details.pub.destinationName;
 		p->msgId = command->command.token;
 
+		if (command->command.stamps)
+		{
+			command->command.stamps[STAGE_DEQUEUED] = Metrics_now();
+			command->client->c->net.stamps = command->command.stamps;
+		}
 		rc = MQTTProtocol_startPublish(command->client->c, p, command->command.details.pub.qos, command->command.details.pub.retained, &msg);
+		command->client->c->net.stamps = NULL;
+		if (rc == TCPSOCKET_INTERRUPTED)
+			command->client->pending_stamps = command->command.stamps;
 		
 		if (command->command.details.pub.qos == 0)
 		{ 
 			if (rc == TCPSOCKET_COMPLETE)
 			{		
+				if (command->command.stamps)
+					MQTTAsync_stagesComplete(command->client, command->command.stamps);
 				if (command->command.onSuccess)
 				{
 					MQTTAsync_successData data;
@@ -1223,6 +1350,7 @@ int MQTTAsync_processCommand()
 					data.alt.pub.message.payloadlen = command->command.details.pub.payloadlen;
 					data.alt.pub.message.qos = command->command.details.pub.qos;
 					data.alt.pub.message.retained = command->command.details.pub.retained;
+					data.alt.pub.stages = command->command.stamps;
 					Log(TRACE_MIN, -1, "Calling publish success for client %s", command->client->c->clientID);
 					(*(command->command.onSuccess))(command->command.context, &data);
 				}
@@ -1235,7 +1363,7 @@ int MQTTAsync_processCommand()
 		}
 		else
 			command->command.details.pub.destinationName = NULL; /* this will be freed by the protocol code */
-		free(p); /* should this be done if the write isn't complete? */
+		Pool_free(POOL_PUBLISH, p); /* should this be done if the write isn't complete? */
 	}
 	else if (command->command.type == DISCONNECT)
 	{
@@ -1334,7 +1462,7 @@ void MQTTAsync_checkTimeouts()
 				
 				MQTTAsync_closeOnly(m->c);
 				/* put the connect command back to the head of the command queue, using the next serverURI */
-				conn = malloc(sizeof(MQTTAsync_queuedCommand));
+				conn = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 				memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
 				conn->client = m;
 				conn->command = m->connect;
@@ -1379,14 +1507,14 @@ void MQTTAsync_checkTimeouts()
 			}
 		}
 		for (i = 0; i < timed_out_count; ++i)
-			ListRemoveHead(m->responses);	/* remove the first response in the list */
+			Pool_free(POOL_COMMAND, ListDetachHead(m->responses));	/* remove the first response in the list */
 
 		if (m->automaticReconnect && m->retrying)
 		{
 			if (m->reconnectNow || MQTTAsync_elapsed(m->lastConnectionFailedTime) > (m->currentInterval * 1000))
 			{
 				/* to reconnect put the connect command to the head of the command queue */
-				MQTTAsync_queuedCommand* conn = malloc(sizeof(MQTTAsync_queuedCommand));
+				MQTTAsync_queuedCommand* conn = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 				memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
 				conn->client = m;
 				conn->command = m->connect;
@@ -1405,6 +1533,29 @@ exit:
 }
 
 
+/**
+ * Carry on with the connects which were waiting for host name lookups.  If a lookup,
+ * or the TCP connect after it, has failed, MQTTAsync_connecting goes on to the next
+ * server URI or calls onFailure, as it does for the connects the receive thread completes.
+ */
+void MQTTAsync_resumeConnects()
+{
+	ListElement* current = NULL;
+
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	while (ListNextElement(handles, &current))
+	{
+		MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
+
+		if (m->c->connect_state == 4)
+			MQTTAsync_connecting(m);
+	}
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	FUNC_EXIT;
+}
+
+
 thread_return_type WINAPI MQTTAsync_sendThread(void* n)
 {
 	FUNC_ENTRY;
@@ -1429,6 +1580,7 @@ thread_return_type WINAPI MQTTAsync_sendThread(void* n)
 			Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
 #endif
 			
+		MQTTAsync_resumeConnects();
 		MQTTAsync_checkTimeouts();
 	}
 	sendThread_state = STOPPING;
@@ -1470,12 +1622,10 @@ void MQTTAsync_removeResponsesAndCommands(MQTTAsyncs* m)
 	FUNC_ENTRY;
 	if (m->responses)
 	{
-		ListElement* cur_response = NULL;
+		MQTTAsync_queuedCommand* command = NULL;
 
-		while (ListNextElement(m->responses, &cur_response))
+		while ((command = ListDetachHead(m->responses)) != NULL)
 		{
-			MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(cur_response->content);
-
 			if (command->command.onFailure)
 			{
 				MQTTAsync_failureData data;
@@ -1489,7 +1639,7 @@ void MQTTAsync_removeResponsesAndCommands(MQTTAsyncs* m)
 				(*(command->command.onFailure))(command->command.context, &data);
 			}
 
-			MQTTAsync_freeCommand1(command);
+			MQTTAsync_freeCommand(command);
 			count++;
 		}
 	}
@@ -1565,6 +1715,8 @@ void MQTTAsync_destroy(MQTTAsync* handle)
 		free(m->serverURI);
 	if (m->createOptions)
 		free(m->createOptions);
+	if (m->subscriptions)
+		TopicTrie_free(m->subscriptions);
 	MQTTAsync_freeServerURIs(m);
 	if (!ListRemove(handles, m))
 		Log(LOG_ERROR, -1, "free error");
@@ -1701,7 +1853,7 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 				if (strlen(qe->topicName) == topicLen)
 					topicLen = 0;
 
-				if (m->ma)
+				if (m->ma || m->subscriptions)
 					rc = MQTTAsync_deliverMessage(m, qe->topicName, topicLen, qe->msg);
 				else 
 					rc = 1;
@@ -1760,7 +1912,7 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 							
 							MQTTAsync_closeOnly(m->c);
 							/* put the connect command back to the head of the command queue, using the next serverURI */
-							conn = malloc(sizeof(MQTTAsync_queuedCommand));
+							conn = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 							memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
 							conn->client = m;
 							conn->command = m->connect; 
@@ -1798,6 +1950,20 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 							if (!ListDetach(m->responses, command)) /* remove the response from the list */
 								Log(LOG_ERROR, -1, "Subscribe command not removed from command list");
 
+							if (m->subscriptions && sub->qoss->count == command->command.details.sub.count)
+							{
+								ListElement* cur_qos = NULL;
+								int i = 0;
+
+								/* the broker refused these filters, so their messageArrived callbacks are not needed */
+								while (ListNextElement(sub->qoss, &cur_qos))
+								{
+									if (*(int*)(cur_qos->content) == MQTT_BAD_SUBSCRIBE)
+										MQTTAsync_setSubscriptionCallbacks(m, 1, &command->command.details.sub.topics[i], NULL, NULL);
+									++i;
+								}
+							}
+
 							/* Call the failure callback if there is one subscribe in the MQTT packet and
 							 * the return code is 0x80 (failure).  If the MQTT packet contains >1 subscription
 							 * request, then we call onSuccess with the list of returned QoSs, which inelegantly,
@@ -1983,6 +2149,7 @@ void MQTTAsync_closeOnly(Clients* client)
 	client->ping_outstanding = 0;
 	if (client->net.socket > 0)
 	{
+		PROBE1(disconnect, client->clientID);
 		if (client->connected)
 			MQTTPacket_send_disconnect(&client->net, client->clientID);
 		Thread_lock_mutex(socket_mutex);
@@ -2056,10 +2223,35 @@ int MQTTAsync_cleanSession(Clients* client)
 int MQTTAsync_deliverMessage(MQTTAsyncs* m, char* topicName, size_t topicLen, MQTTAsync_message* mm)
 {
 	int rc;
+	long long start = Metrics_now();
+	MQTTAsync_messageArrived* ma = m->ma;
+	void* context = m->context;
+
+	if (m->subscriptions)
+	{
+		MQTTAsync_subscriptionCallback* callback = TopicTrie_match(m->subscriptions, topicName);
+
+		if (callback)
+		{
+			ma = callback->ma;
+			context = callback->context;
+		}
+	}
+	if (ma == NULL)
+	{
+		Log(TRACE_MIN, -1, "No messageArrived callback for topic %s on client %s, discarding message",
+					topicName, m->c->clientID);
+		MQTTAsync_freeMessage(&mm);
+		MQTTAsync_free(topicName);
+		return 1;
+	}
 					
 	Log(TRACE_MIN, -1, "Calling messageArrived for client %s, queue depth %d",
 					m->c->clientID, m->c->messageQueue->count);
-	rc = (*(m->ma))(m->context, topicName, (int)topicLen, mm);
+	PROBE2(callback__entry, m->c->clientID, "messageArrived");
+	rc = (*ma)(context, topicName, (int)topicLen, mm);
+	PROBE2(callback__return, m->c->clientID, "messageArrived");
+	Metrics_record(m->c->net.metrics, METRIC_CALLBACK, start);
 	/* if 0 (false) is returned by the callback then it failed, so we don't remove the message from
 	 * the queue, and it will be retried later.  If 1 is returned then the message data may have been freed,
 	 * so we must be careful how we use it.
@@ -2106,7 +2298,7 @@ void Protocol_processPublication(Publish* publish, Clients* client)
 		{
 			MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
 
-			if (m->ma)
+			if (m->ma || m->subscriptions)
 				rc = MQTTAsync_deliverMessage(m, publish->topic, publish->topiclen, mm);
 		} 
 	}
@@ -2161,7 +2353,7 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	}
 	if (options->struct_version != 0 && options->ssl) /* check validity of SSL options structure */
 	{
-		if (strncmp(options->ssl->struct_id, "MQTS", 4) != 0 || options->ssl->struct_version != 0)
+		if (strncmp(options->ssl->struct_id, "MQTS", 4) != 0 || options->ssl->struct_version < 0 || options->ssl->struct_version > 2)
 		{
 			rc = MQTTASYNC_BAD_STRUCTURE;
 			goto exit;
@@ -2239,6 +2431,8 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 			free((void*)m->c->sslopts->privateKeyPassword);
 		if (m->c->sslopts->enabledCipherSuites)
 			free((void*)m->c->sslopts->enabledCipherSuites);
+		if (m->c->sslopts->sessionCacheFile)
+			free((void*)m->c->sslopts->sessionCacheFile);
 		free((void*)m->c->sslopts);
 		m->c->sslopts = NULL;
 	}
@@ -2258,6 +2452,10 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 		if (options->ssl->enabledCipherSuites)
 			m->c->sslopts->enabledCipherSuites = MQTTStrdup(options->ssl->enabledCipherSuites);
 		m->c->sslopts->enableServerCertAuth = options->ssl->enableServerCertAuth;
+		if (options->ssl->struct_version >= 1 && options->ssl->sessionCacheFile)
+			m->c->sslopts->sessionCacheFile = MQTTStrdup(options->ssl->sessionCacheFile);
+		if (options->ssl->struct_version >= 2)
+			m->c->sslopts->enableKernelTLS = options->ssl->enableKernelTLS;
 	}
 #endif
 
@@ -2280,7 +2478,7 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	}
 	
 	/* Add connect request to operation queue */
-	conn = malloc(sizeof(MQTTAsync_queuedCommand));
+	conn = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 	memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
 	conn->client = m;
 	if (options)
@@ -2320,7 +2518,7 @@ int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOptions* o
 	}
 	
 	/* Add disconnect request to operation queue */
-	dis = malloc(sizeof(MQTTAsync_queuedCommand));
+	dis = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 	memset(dis, '\0', sizeof(MQTTAsync_queuedCommand));
 	dis->client = m;
 	if (options)
@@ -2426,6 +2624,48 @@ int MQTTAsync_assignMsgId(MQTTAsyncs* m)
 }
 
 
+/**
+ * Set or remove the messageArrived callbacks of topic filters, as they are subscribed to or
+ * unsubscribed from.  The mqttasync mutex must be held.
+ * @param m a client structure
+ * @param count the number of topic filters
+ * @param topic the topic filters
+ * @param ma the callback, or NULL to remove the callbacks
+ * @param context the context to pass to the callback
+ */
+static void MQTTAsync_setSubscriptionCallbacks(MQTTAsyncs* m, int count, char* const* topic,
+		MQTTAsync_messageArrived* ma, void* context)
+{
+	int i;
+
+	FUNC_ENTRY;
+	if (ma && m->subscriptions == NULL)
+		m->subscriptions = TopicTrie_initialize();
+	for (i = 0; i < count && m->subscriptions; ++i)
+	{
+		MQTTAsync_subscriptionCallback* callback = NULL;
+
+		if (ma)
+		{
+			callback = malloc(sizeof(MQTTAsync_subscriptionCallback));
+			callback->ma = ma;
+			callback->context = context;
+			callback = TopicTrie_add(m->subscriptions, topic[i], callback);
+		}
+		else
+			callback = TopicTrie_remove(m->subscriptions, topic[i]);
+		if (callback)
+			free(callback);
+	}
+	if (m->subscriptions && m->subscriptions->count == 0)
+	{
+		TopicTrie_free(m->subscriptions);
+		m->subscriptions = NULL;
+	}
+	FUNC_EXIT;
+}
+
+
 int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, int* qos, MQTTAsync_responseOptions* response)
 {
 	MQTTAsyncs* m = handle;
@@ -2433,6 +2673,8 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, int
 	int rc = MQTTASYNC_FAILURE;
 	MQTTAsync_queuedCommand* sub;
 	int msgid = 0;
+	thread_id_type thread_id = 0;
+	int locked = 0;
 
 	FUNC_ENTRY;
 	if (m == NULL || m->c == NULL)
@@ -2465,7 +2707,7 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, int
 	}
 
 	/* Add subscribe request to operation queue */
-	sub = malloc(sizeof(MQTTAsync_queuedCommand));
+	sub = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 	memset(sub, '\0', sizeof(MQTTAsync_queuedCommand));
 	sub->client = m;
 	sub->command.token = msgid;
@@ -2485,7 +2727,25 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, int
 		sub->command.details.sub.topics[i] = MQTTStrdup(topic[i]);
 		sub->command.details.sub.qoss[i] = qos[i];	
 	}
-	rc = MQTTAsync_addCommand(sub, sizeof(sub));
+
+	/* The callbacks are set with the mutex held, so that the subscribe can't be sent, nor
+	 * messages for it arrive, before they are.  We might be called in a callback, in which
+	 * case the mutex is already locked. */
+	thread_id = Thread_getid();
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
+	{
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
+	}
+	if ((rc = MQTTAsync_addCommand(sub, sizeof(sub))) == MQTTASYNC_SUCCESS)
+	{
+		if (response && response->struct_version >= 1)
+			MQTTAsync_setSubscriptionCallbacks(m, count, topic, response->onMessage, response->onMessageContext);
+		else
+			MQTTAsync_setSubscriptionCallbacks(m, count, topic, NULL, NULL);
+	}
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
 
 exit:
 	FUNC_EXIT_RC(rc);
@@ -2511,6 +2771,8 @@ int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, M
 	int rc = SOCKET_ERROR;
 	MQTTAsync_queuedCommand* unsub;
 	int msgid = 0;
+	thread_id_type thread_id = 0;
+	int locked = 0;
 
 	FUNC_ENTRY;
 	if (m == NULL || m->c == NULL)
@@ -2536,9 +2798,19 @@ int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, M
 		rc = MQTTASYNC_NO_MORE_MSGIDS;
 		goto exit;
 	}
+	/* We might be called in a callback. In which case, this mutex will be already locked. */
+	thread_id = Thread_getid();
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
+	{
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
+	}
+	MQTTAsync_setSubscriptionCallbacks(m, count, topic, NULL, NULL);
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
 	
 	/* Add unsubscribe request to operation queue */
-	unsub = malloc(sizeof(MQTTAsync_queuedCommand));
+	unsub = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 	memset(unsub, '\0', sizeof(MQTTAsync_queuedCommand));
 	unsub->client = m;
 	unsub->command.type = UNSUBSCRIBE;
@@ -2616,7 +2888,7 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 		goto exit;
 	
 	/* Add publish request to operation queue */
-	pub = malloc(sizeof(MQTTAsync_queuedCommand));
+	pub = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 	memset(pub, '\0', sizeof(MQTTAsync_queuedCommand));
 	pub->client = m;
 	pub->command.type = PUBLISH;
@@ -2634,6 +2906,12 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 	memcpy(pub->command.details.pub.payload, payload, payloadlen);
 	pub->command.details.pub.qos = qos;
 	pub->command.details.pub.retained = retained;
+	if (m->createOptions && m->createOptions->traceLatency)
+	{
+		pub->command.stamps = malloc(STAGE_COUNT * sizeof(long long));
+		memset(pub->command.stamps, '\0', STAGE_COUNT * sizeof(long long));
+		pub->command.stamps[STAGE_ENQUEUED] = Metrics_now();
+	}
 	rc = MQTTAsync_addCommand(pub, sizeof(pub));
 
 exit:
@@ -2687,12 +2965,55 @@ void MQTTAsync_retry(void)
 }
 
 
+/**
+ * Get the address of the server being connected to, as passed to MQTTProtocol_connect
+ * @param m the client
+ * @return the address, without any tcp:// or ssl:// prefix
+ */
+static const char* MQTTAsync_serverAddress(MQTTAsyncs* m)
+{
+	const char* serverURI = m->serverURI;
+
+	if (m->serverURIcount > 0)
+	{
+		serverURI = m->serverURIs[m->connect.details.conn.currentURI];
+		if (strncmp(URI_TCP, serverURI, strlen(URI_TCP)) == 0)
+			serverURI += strlen(URI_TCP);
+#if defined(OPENSSL)
+		else if (strncmp(URI_SSL, serverURI, strlen(URI_SSL)) == 0)
+			serverURI += strlen(URI_SSL);
+#endif
+	}
+	return serverURI;
+}
+
+
 int MQTTAsync_connecting(MQTTAsyncs* m)
 {
 	int rc = -1;
 
 	FUNC_ENTRY;
-	if (m->c->connect_state == 1) /* TCP connect started - check for completion */
+	if (m->c->connect_state == 4) /* host name lookup started - check for completion */
+	{
+		const char* serverURI = MQTTAsync_serverAddress(m);
+
+		if ((rc = MQTTProtocol_resolve(serverURI)) == TCPSOCKET_INTERRUPTED)
+			goto exit;
+		m->c->connect_state = 0;
+#if defined(OPENSSL)
+		rc = MQTTProtocol_connect(serverURI, m->c, m->ssl, m->connect.details.conn.MQTTVersion);
+#else
+		rc = MQTTProtocol_connect(serverURI, m->c, m->connect.details.conn.MQTTVersion);
+#endif
+		if (m->c->connect_state == 0)
+			rc = SOCKET_ERROR;
+		else if (rc == EINPROGRESS || rc == EWOULDBLOCK)
+		{
+			Socket_addPendingWrite(m->c->net.socket);
+			rc = 0;
+		}
+	}
+	else if (m->c->connect_state == 1) /* TCP connect started - check for completion */
 	{
 		int error;
 		socklen_t len = sizeof(error);
@@ -2708,22 +3029,14 @@ int MQTTAsync_connecting(MQTTAsyncs* m)
 #if defined(OPENSSL)
 		if (m->ssl)
 		{
-			if (SSLSocket_setSocketForSSL(&m->c->net, m->c->sslopts) != MQTTASYNC_SUCCESS)
+			if (SSLSocket_setSocketForSSL(&m->c->net, m->c->sslopts, MQTTAsync_serverAddress(m)) != MQTTASYNC_SUCCESS)
 			{
-				if (m->c->session != NULL)
-					if ((rc = SSL_set_session(m->c->net.ssl, m->c->session)) != 1)
-						Log(TRACE_MIN, -1, "Failed to set SSL session with stored data, non critical");
 				rc = SSLSocket_connect(m->c->net.ssl, m->c->net.socket);
 				if (rc == TCPSOCKET_INTERRUPTED)
 				{
 					rc = MQTTCLIENT_SUCCESS; /* the connect is still in progress */
 					m->c->connect_state = 2;
 				}
-				else if (rc == SSL_FATAL)
-				{
-					rc = SOCKET_ERROR;
-					goto exit;
-				}
 				else if (rc == 1) 
 				{
 					rc = MQTTCLIENT_SUCCESS;
@@ -2733,8 +3046,11 @@ int MQTTAsync_connecting(MQTTAsyncs* m)
 						rc = SOCKET_ERROR;
 						goto exit;
 					}
-					if (!m->c->cleansession && m->c->session == NULL)
-						m->c->session = SSL_get1_session(m->c->net.ssl);
+				}
+				else
+				{
+					rc = SOCKET_ERROR;
+					goto exit;
 				}
 			}
 			else
@@ -2757,10 +3073,12 @@ int MQTTAsync_connecting(MQTTAsyncs* m)
 	else if (m->c->connect_state == 2) /* SSL connect sent - wait for completion */
 	{
 		if ((rc = SSLSocket_connect(m->c->net.ssl, m->c->net.socket)) != 1)
+		{
+			if (rc != TCPSOCKET_INTERRUPTED)
+				rc = SSL_FATAL; /* the handshake has failed, not just stopped to wait for the socket */
 			goto exit;
+		}
 
-		if(!m->c->cleansession && m->c->session == NULL)
-			m->c->session = SSL_get1_session(m->c->net.ssl);
 		m->c->connect_state = 3; /* SSL connect completed, in which case send the MQTT connect packet */
 		if ((rc = MQTTPacket_send_connect(m->c, m->connect.details.conn.MQTTVersion)) == SOCKET_ERROR)
 			goto exit;
@@ -2776,7 +3094,7 @@ exit:
 				
 			MQTTAsync_closeOnly(m->c);
 			/* put the connect command back to the head of the command queue, using the next serverURI */
-			conn = malloc(sizeof(MQTTAsync_queuedCommand));
+			conn = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 			memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
 			conn->client = m;
 			conn->command = m->connect; 
@@ -2851,7 +3169,7 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 
 					MQTTAsync_closeOnly(m->c);
 					/* put the connect command back to the head of the command queue, using the next serverURI */
-					conn = malloc(sizeof(MQTTAsync_queuedCommand));
+					conn = Pool_malloc(POOL_COMMAND, sizeof(MQTTAsync_queuedCommand));
 					memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
 					conn->client = m;
 					conn->command = m->connect;
@@ -2884,6 +3202,7 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 				*rc = MQTTProtocol_handlePublishes(pack, *sock);
 			else if (pack->header.bits.type == PUBACK || pack->header.bits.type == PUBCOMP)
 			{
+				long long acknowledged = (m && m->createOptions && m->createOptions->traceLatency) ? Metrics_now() : 0;
 				int msgid;
 
 				ack = (pack->header.bits.type == PUBCOMP) ? *(Pubcomp*)pack : *(Puback*)pack;
@@ -2898,8 +3217,13 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 					
 					if (m->dc)
 					{
+						long long start = Metrics_now();
+
 						Log(TRACE_MIN, -1, "Calling deliveryComplete for client %s, msgid %d", m->c->clientID, msgid);
+						PROBE2(callback__entry, m->c->clientID, "deliveryComplete");
 						(*(m->dc))(m->context, msgid);
+						PROBE2(callback__return, m->c->clientID, "deliveryComplete");
+						Metrics_record(m->c->net.metrics, METRIC_CALLBACK, start);
 					}
 					/* use the msgid to find the callback to be called */
 					while (ListNextElement(m->responses, &current))
@@ -2909,6 +3233,11 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 						{		
 							if (!ListDetach(m->responses, command)) /* then remove the response from the list */
 								Log(LOG_ERROR, -1, "Publish command not removed from command list");
+							if (command->command.stamps)
+							{
+								command->command.stamps[STAGE_ACKNOWLEDGED] = acknowledged;
+								MQTTAsync_stagesComplete(m, command->command.stamps);
+							}
 							if (command->command.onSuccess)
 							{
 								MQTTAsync_successData data;
@@ -2919,6 +3248,7 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 								data.alt.pub.message.payloadlen = command->command.details.pub.payloadlen;
 								data.alt.pub.message.qos = command->command.details.pub.qos;
 								data.alt.pub.message.retained = command->command.details.pub.retained;
+								data.alt.pub.stages = command->command.stamps;
 								Log(TRACE_MIN, -1, "Calling publish success for client %s", m->c->clientID);
 								(*(command->command.onSuccess))(command->command.context, &data);
 							}
@@ -3015,6 +3345,135 @@ exit:
 }
 
 
+/**
+ * Count the commands queued for a client.  The caller must hold mqttasync_mutex.
+ * @param m the client
+ * @return the number of commands
+ */
+static int MQTTAsync_queuedCommands(MQTTAsyncs* m)
+{
+	ListElement* current = NULL;
+	int count = 0;
+
+	while (ListNextElement(commands, &current))
+	{
+		if (((MQTTAsync_queuedCommand*)(current->content))->client == m)
+			count++;
+	}
+	return count;
+}
+
+
+static void MQTTAsync_getHistogram(Metrics* metrics, int histogram, MQTTAsync_histogram* h)
+{
+	Metrics_histogram snapshot;
+	int i;
+
+	Metrics_getHistogram(metrics, histogram, &snapshot);
+	h->count = snapshot.count;
+	h->sum = snapshot.sum;
+	h->max = snapshot.max;
+	h->p50 = Metrics_percentile(&snapshot, 0.5);
+	h->p90 = Metrics_percentile(&snapshot, 0.9);
+	h->p99 = Metrics_percentile(&snapshot, 0.99);
+	h->p999 = Metrics_percentile(&snapshot, 0.999);
+	for (i = 0; i < MQTTASYNC_HISTOGRAM_BUCKETS; ++i)
+		h->buckets[i] = snapshot.buckets[i];
+}
+
+
+int MQTTAsync_getMetrics(MQTTAsync handle, MQTTAsync_metrics* metrics)
+{
+	MQTTAsyncs* m = handle;
+	Metrics* counters = NULL;
+	int gauges[METRIC_GAUGE_COUNT];
+	int rc = MQTTASYNC_SUCCESS;
+	int i;
+
+	FUNC_ENTRY;
+	if (m == NULL || m->c == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	if (metrics == NULL || strncmp(metrics->struct_id, "MQME", 4) != 0 || metrics->struct_version < 0 ||
+			metrics->struct_version > 1)
+	{
+		rc = MQTTASYNC_BAD_STRUCTURE;
+		goto exit;
+	}
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	counters = m->c->net.metrics;
+	metrics->bytes_in = Metrics_get(counters, METRIC_BYTES_IN);
+	metrics->bytes_out = Metrics_get(counters, METRIC_BYTES_OUT);
+	for (i = 0; i < 16; ++i)
+	{
+		metrics->packets_in[i] = Metrics_get(counters, METRIC_PACKETS_IN + i);
+		metrics->packets_out[i] = Metrics_get(counters, METRIC_PACKETS_OUT + i);
+	}
+	metrics->retries = Metrics_get(counters, METRIC_RETRIES);
+	metrics->partial_writes = Metrics_get(counters, METRIC_PARTIAL_WRITES);
+	Clients_getGauges(m->c, gauges);
+	metrics->pending_write_bytes = gauges[METRIC_PENDING_WRITE_BYTES];
+	metrics->queued_commands = MQTTAsync_queuedCommands(m);
+	metrics->queued_messages = gauges[METRIC_QUEUED_MESSAGES];
+	metrics->inflight_messages = gauges[METRIC_INFLIGHT_MESSAGES];
+	metrics->inbound_messages = gauges[METRIC_INBOUND_MESSAGES];
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_getHistogram(counters, METRIC_PERSISTENCE_PUT, &metrics->persistence_put);
+	MQTTAsync_getHistogram(counters, METRIC_PERSISTENCE_REMOVE, &metrics->persistence_remove);
+	MQTTAsync_getHistogram(counters, METRIC_CALLBACK, &metrics->callbacks);
+	for (i = 0; metrics->struct_version >= 1 && i < STAGE_COUNT; ++i)
+		MQTTAsync_getHistogram(counters, METRIC_STAGE + i, &metrics->stages[i]);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_getOpenMetrics(char* buffer, int buflen)
+{
+	ListElement* current = NULL;
+	Metrics_client* clients = NULL;
+	int count = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if (handles && handles->count > 0)
+		clients = malloc(sizeof(Metrics_client) * handles->count);
+	while (clients && ListNextElement(handles, &current))
+	{
+		MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
+
+		clients[count].clientID = m->c->clientID;
+		clients[count].metrics = m->c->net.metrics;
+		Clients_getGauges(m->c, clients[count].gauges);
+		clients[count].gauges[METRIC_QUEUED_COMMANDS] = MQTTAsync_queuedCommands(m);
+		count++;
+	}
+	rc = Metrics_format(clients, count, buffer, buflen);
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	if (clients)
+		free(clients);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_dumpTrace(const char* filename)
+{
+	int rc = MQTTASYNC_SUCCESS;
+
+	FUNC_ENTRY;
+	if (filename == NULL || Log_dumpTraceBinary((char*)filename) != 0)
+		rc = MQTTASYNC_FAILURE;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+
 int MQTTAsync_isComplete(MQTTAsync handle, MQTTAsync_token dt)
 {
 	int rc = MQTTASYNC_SUCCESS;
@@ -350,6 +350,30 @@ typedef struct
 	char* message;
 } MQTTAsync_failureData;
 
+/**
+ * The stages of a publication which are timed when the client was created with
+ * MQTTAsync_createOptions.traceLatency set.  The times are in nanoseconds, from a monotonic
+ * clock with an arbitrary start point, so only the differences between them are meaningful.
+ */
+enum MQTTASYNC_PUBLISH_STAGES
+{
+	/** MQTTAsync_send or MQTTAsync_sendMessage added the publication to the command queue */
+	MQTTASYNC_STAGE_ENQUEUED,
+	/** the library's send thread took the publication from the command queue */
+	MQTTASYNC_STAGE_DEQUEUED,
+	/** the message was written to persistence, if it is QoS 1 or 2 */
+	MQTTASYNC_STAGE_PERSISTED,
+	/** the first write of the PUBLISH packet to the socket started */
+	MQTTASYNC_STAGE_WRITE_STARTED,
+	/** the last byte of the PUBLISH packet was written to the socket */
+	MQTTASYNC_STAGE_WRITTEN,
+	/** the PUBACK or PUBCOMP was received, for QoS 1 or 2 */
+	MQTTASYNC_STAGE_ACKNOWLEDGED,
+	/** the publication completed, and onSuccess was called if there is one */
+	MQTTASYNC_STAGE_CALLBACK,
+	MQTTASYNC_STAGE_COUNT
+};
+
 /** The data returned on completion of a successful API call in the response callback onSuccess. */
 typedef struct
 {
@@ -367,6 +391,9 @@ typedef struct
 		{          
 			MQTTAsync_message message;
 			char* destinationName;
+			/** The time of each of the ::MQTTASYNC_PUBLISH_STAGES, 0 for those which were
+			 * not reached, or NULL if latency tracing is off. */
+			long long* stages;
 		} pub;
 		/* For connect, the server connected to, MQTT version used, and sessionPresent flag */
 		struct
@@ -406,7 +433,8 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  Must be MQTR */
 	char struct_id[4];
-	/** The version number of this structure.  Must be 0 */
+	/** The version number of this structure.  Must be 0 or 1.  0 means no onMessage
+	 * or onMessageContext */
 	int struct_version;	
 	/** 
     * A pointer to a callback function to be called if the API call successfully
@@ -427,9 +455,26 @@ typedef struct
     */
 	void* context; 
 	MQTTAsync_token token;   /* output */
+	/**
+	* For MQTTAsync_subscribe() and MQTTAsync_subscribeMany() only, a pointer to a
+	* callback function to be called instead of the messageArrived callback set by
+	* MQTTAsync_setCallbacks(), for messages matching the topic filters subscribed to.
+	* It is called in the same way, and has the same responsibilities for freeing the
+	* message and topic name.  If a message matches the filters of more than one subscription,
+	* only the callback of the most specific filter is called: comparing their levels from
+	* the first, a level without a wildcard is more specific than +, and + than #.
+	* The callback stays set until the topic filter is unsubscribed from, or subscribed to
+	* again.  Can be set to NULL, in which case messages matching the filters are passed to
+	* the messageArrived callback set by MQTTAsync_setCallbacks().
+	*/
+	MQTTAsync_messageArrived* onMessage;
+	/**
+	* A pointer to any application-specific context, passed to the onMessage callback.
+	*/
+	void* onMessageContext;
 } MQTTAsync_responseOptions;
 
-#define MQTTAsync_responseOptions_initializer { {'M', 'Q', 'T', 'R'}, 0, NULL, NULL, 0, 0 }
+#define MQTTAsync_responseOptions_initializer { {'M', 'Q', 'T', 'R'}, 1, NULL, NULL, 0, 0, NULL, NULL }
 
 
 /**
@@ -540,20 +585,59 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  must be MQCO. */
 	const char struct_id[4];
-	/** The version number of this structure.  Must be 0 */
+	/** The version number of this structure.  Must be 0, 1 or 2.
+	 * 0 means no compressPersistence or traceLatency, 1 means no traceLatency */
 	int struct_version;
 	/** Whether to allow messages to be sent when the client library is not connected. */
 	int sendWhileDisconnected;
 	/** the maximum number of messages allowed to be buffered while not connected. */
 	int maxBufferedMessages;
+	/** Whether to compress buffered commands and queued messages when writing them to
+	 * persistence.  Compressed and uncompressed records can both be restored whatever
+	 * this setting, so it can be changed between runs of an application. */
+	int compressPersistence;
+	/** Whether to time the stages of each publication, which are then passed to onSuccess
+	 * in MQTTAsync_successData.alt.pub.stages, and added to the stage histograms of
+	 * ::MQTTAsync_metrics.  When this is off, the stages cost nothing. */
+	int traceLatency;
 } MQTTAsync_createOptions;
 
-#define MQTTAsync_createOptions_initializer { {'M', 'Q', 'C', 'O'}, 0, 0, 100 }
+#define MQTTAsync_createOptions_initializer { {'M', 'Q', 'C', 'O'}, 2, 0, 100, 0, 0 }
 
 
 DLLExport int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const char* clientId,
 		int persistence_type, void* persistence_context, MQTTAsync_createOptions* options);
 
+/**
+ * Settings which apply to the whole library rather than to one client, passed to
+ * MQTTAsync_global_init().
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  Must be MQTG. */
+	const char struct_id[4];
+	/** The version number of this structure.  Must be 0. */
+	int struct_version;
+	/** Whether to allocate the library's fixed size per-message structures (list elements,
+	 * message records, packets and queued commands) from pools which are kept for reuse,
+	 * rather than from the heap each time.  The pools are shared by every client in the
+	 * process, so this can't be set for one client only.  Each message still has some heap
+	 * allocations of its own: the copies of its topic and payload, and the buffers of the
+	 * packets written for it.  The pools are freed when the last client is destroyed. */
+	int useMemoryPools;
+} MQTTAsync_init_options;
+
+#define MQTTAsync_init_options_initializer { {'M', 'Q', 'T', 'G'}, 0, 0 }
+
+/**
+ * Set the global options of the library, which apply to all the clients in the process.
+ * This should be called before any clients are created.  The settings are kept until
+ * this is called again, so clients created after the last one has been destroyed get
+ * them too.
+ * @param inits the options.  If NULL, or not a valid structure, the defaults are used.
+ */
+DLLExport void MQTTAsync_global_init(MQTTAsync_init_options* inits);
+
 /**
  * MQTTAsync_willOptions defines the MQTT "Last Will and Testament" (LWT) settings for
  * the client. In the event that a client unexpectedly loses its connection to
@@ -605,7 +689,8 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  Must be MQTS */
 	const char struct_id[4];
-	/** The version number of this structure.  Must be 0 */
+	/** The version number of this structure.  Must be 0, 1 or 2.  0 means no sessionCacheFile,
+	  * 0 or 1 means no enableKernelTLS */
 	int struct_version;	
 	
 	/** The file in PEM format containing the public digital certificates trusted by the client. */
@@ -635,10 +720,32 @@ typedef struct
 
     /** True/False option to enable verification of the server certificate **/
     int enableServerCertAuth;
+
+	/**
+	* TLS sessions are cached for each server address, so that a reconnect, or a connect to
+	* another server in the serverURIs list which has been connected to before, can use an
+	* abbreviated handshake.  The cache is shared by all the clients in the process.  If this
+	* is set, the sessions for this client are also saved to this file, and loaded from it the
+	* first time it is used, so that they survive a restart of the application.  Expired sessions
+	* are not loaded.  New sessions are saved when the connection which received them is closed.
+	* The file contains secret session keys, so must be protected like a private key.
+	*/
+	const char* sessionCacheFile;
+
+	/**
+	* True/False option to use kernel TLS on Linux.  Once the handshake is complete, the session
+	* keys are passed to the kernel, which then encrypts the data written to the socket, so packets
+	* are written straight from the client's buffers, without the copies through OpenSSL's.  Data
+	* received is still read through OpenSSL, which handles the TLS 1.3 session tickets, key updates
+	* and alerts which the kernel cannot pass on as data.  Needs OpenSSL 3.0 or later built with kTLS
+	* support, the Linux tls module, and a cipher the kernel supports, such as AES-GCM.  Falls back to
+	* OpenSSL if the keys cannot be passed to the kernel.
+	*/
+	int enableKernelTLS;
   
 } MQTTAsync_SSLOptions;
 
-#define MQTTAsync_SSLOptions_initializer { {'M', 'Q', 'T', 'S'}, 0, NULL, NULL, NULL, NULL, NULL, 1 }
+#define MQTTAsync_SSLOptions_initializer { {'M', 'Q', 'T', 'S'}, 2, NULL, NULL, NULL, NULL, NULL, 1, NULL, 0 }
 
 /**
  * MQTTAsync_connectOptions defines several settings that control the way the
@@ -877,7 +984,8 @@ DLLExport int MQTTAsync_isConnected(MQTTAsync handle);
   * MQTTAsync_create(). 
   * @param topic The subscription topic, which may include wildcards.
   * @param qos The requested quality of service for the subscription.
-  * @param response A pointer to a response options structure. Used to set callback functions.
+  * @param response A pointer to a response options structure. Used to set callback functions,
+  * including the callback for messages matching the topic.
   * @return ::MQTTASYNC_SUCCESS if the subscription request is successful. 
   * An error code is returned if there was a problem registering the 
   * subscription. 
@@ -897,7 +1005,8 @@ DLLExport int MQTTAsync_subscribe(MQTTAsync handle, const char* topic, int qos,
   * topics, each of which may include wildcards.
   * @param qos An array (of length <i>count</i>) of @ref qos
   * values. qos[n] is the requested QoS for topic[n].
-  * @param response A pointer to a response options structure. Used to set callback functions.
+  * @param response A pointer to a response options structure. Used to set callback functions,
+  * including the callback for messages matching the topics.
   * @return ::MQTTASYNC_SUCCESS if the subscription request is successful. 
   * An error code is returned if there was a problem registering the 
   * subscriptions. 
@@ -1050,6 +1159,98 @@ DLLExport void MQTTAsync_free(void* ptr);
 DLLExport void MQTTAsync_destroy(MQTTAsync* handle);
 
 
+/** The number of buckets in a ::MQTTAsync_histogram */
+#define MQTTASYNC_HISTOGRAM_BUCKETS 144
+
+/**
+  * A latency histogram, in nanoseconds.  Values below 4 have a bucket each.  Above that,
+  * each power of two is split into 4 equal buckets, so bucket 4 holds 4, bucket 5 holds 5,
+  * bucket 8 holds 8 and 9, and so on.  Values of 2^37 nanoseconds (about 137 seconds) and
+  * more all go in the last bucket.  The percentiles are estimated from the buckets, so are
+  * accurate to within 25%.
+  */
+typedef struct
+{
+	long long count;	/**< the number of operations recorded */
+	long long sum;		/**< the total time taken by all the operations */
+	long long max;		/**< the longest time taken */
+	long long p50;		/**< the estimated median */
+	long long p90;		/**< the estimated 90th percentile */
+	long long p99;		/**< the estimated 99th percentile */
+	long long p999;		/**< the estimated 99.9th percentile */
+	long long buckets[MQTTASYNC_HISTOGRAM_BUCKETS];	/**< the number of operations in each bucket */
+} MQTTAsync_histogram;
+
+/**
+  * The runtime metrics of a client, filled in by MQTTAsync_getMetrics().  The counters
+  * are cumulative from the creation of the client, and are kept across reconnections.
+  */
+typedef struct
+{
+	/** The eyecatcher for this structure.  must be MQME. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 or 1.  0 means no stages. */
+	int struct_version;
+	long long bytes_in;			/**< the number of bytes of MQTT packets received */
+	long long bytes_out;		/**< the number of bytes of MQTT packets written */
+	long long packets_in[16];	/**< the number of packets received, indexed by MQTT packet type */
+	long long packets_out[16];	/**< the number of packets written, indexed by MQTT packet type */
+	long long retries;			/**< the number of PUBLISH and PUBREL packets resent */
+	long long partial_writes;	/**< the number of packets which could not be written in one go */
+	int pending_write_bytes;	/**< the bytes of a partly written packet still to be written */
+	int queued_commands;		/**< the number of API calls waiting to be sent */
+	int queued_messages;		/**< the number of messages received but not yet delivered */
+	int inflight_messages;		/**< the number of outbound QoS 1 and 2 messages not yet completed */
+	int inbound_messages;		/**< the number of inbound QoS 2 messages not yet completed */
+	MQTTAsync_histogram persistence_put;		/**< the time taken to persist messages */
+	MQTTAsync_histogram persistence_remove;	/**< the time taken to remove messages from persistence */
+	MQTTAsync_histogram callbacks;			/**< the time spent in the message arrived and delivery complete callbacks */
+	/** The publication stages, when latency tracing is on.  stages[i] is the time taken to reach
+	 * stage i of ::MQTTASYNC_PUBLISH_STAGES from the previous stage reached, except for
+	 * stages[MQTTASYNC_STAGE_ENQUEUED], which is the whole time from enqueue to completion. */
+	MQTTAsync_histogram stages[MQTTASYNC_STAGE_COUNT];
+} MQTTAsync_metrics;
+
+#define MQTTAsync_metrics_initializer { {'M', 'Q', 'M', 'E'}, 1, }
+
+/**
+  * This function gets the runtime metrics of a client.  It can be called from any
+  * thread, at any time between MQTTAsync_create() and MQTTAsync_destroy().
+  * @param handle A valid client handle from a successful call to MQTTAsync_create().
+  * @param metrics A pointer to an ::MQTTAsync_metrics structure, initialized with
+  * ::MQTTAsync_metrics_initializer, which is filled in.
+  * @return ::MQTTASYNC_SUCCESS if the metrics were retrieved, ::MQTTASYNC_FAILURE if the handle
+  * is not valid, or ::MQTTASYNC_BAD_STRUCTURE if the structure is not valid.
+  */
+DLLExport int MQTTAsync_getMetrics(MQTTAsync handle, MQTTAsync_metrics* metrics);
+
+/**
+  * This function writes the metrics of all the clients which have been created, and not
+  * yet destroyed, in the OpenMetrics text format, which can be scraped by Prometheus.
+  * Each sample is labelled with the client id.  The counters and gauges are those of
+  * ::MQTTAsync_metrics, and the histograms are in seconds, with one bucket for each power of two
+  * nanoseconds.
+  * @param buffer the buffer to write the text into.  It is always null terminated if
+  * buflen is greater than 0.
+  * @param buflen the length of the buffer
+  * @return the length of the whole text, not including the null terminator.  If this is
+  * buflen or more, the text has been truncated, and the call can be repeated with a buffer
+  * of this length plus one.
+  */
+DLLExport int MQTTAsync_getOpenMetrics(char* buffer, int buflen);
+
+/**
+  * This function writes the trace entries which the library keeps in memory to a file, in a
+  * compact binary form.  Each thread keeps its most recent entries, at the level set by
+  * MQTT_C_CLIENT_TRACE_LEVEL (MINIMUM by default), whether or not tracing is switched on, and
+  * they are only formatted as text when this file is decoded, by the MQTTTraceDecode program.
+  * So this can be called when a problem is detected, to see what led up to it.
+  * @param filename the name of the file to write
+  * @return ::MQTTASYNC_SUCCESS if the file was written, otherwise ::MQTTASYNC_FAILURE.
+  */
+DLLExport int MQTTAsync_dumpTrace(const char* filename);
+
+
 
 enum MQTTASYNC_TRACE_LEVELS 
 {
@@ -1118,7 +1319,8 @@ DLLExport MQTTAsync_nameValue* MQTTAsync_getVersionInfo();
   * MQTTAsync_setCallbacks() (see MQTTAsync_messageArrived(), 
   * MQTTAsync_connectionLost() and MQTTAsync_deliveryComplete()).
   * In addition, some functions allow success and failure callbacks to be set
-  * for individual requests, in the ::MQTTAsync_responseOptions structure.  Applications
+  * for individual requests, in the ::MQTTAsync_responseOptions structure, and
+  * subscriptions can have their own callbacks for the messages matching them.  Applications
   * can be written as a chain of callback functions. Note that it is a theoretically
   * possible but unlikely event, that a success or failure callback could be called
   * before function requesting the callback has returned.  In this case the token
@@ -1530,6 +1732,16 @@ exit:
   * to a file.  Two files are used at most, when they are full, the last one is overwritten with the
   * new trace entries.  The default size is 1000 lines.
   *
+  * Each thread also keeps its most recent trace entries in memory, in binary form, whether or
+  * not tracing is switched on.  MQTTAsync_dumpTrace() writes them to a file, which the MQTTTraceDecode
+  * program turns into text:
+  * @code
+    MQTTTraceDecode [-l level] dumpfile
+  * @endcode
+  * The variable MQTT_C_CLIENT_TRACE_ENTRIES sets the size of each thread's memory, in 64 byte
+  * slots.  A function entry or exit takes one slot, and a message one or more depending on its
+  * arguments.  The default is 2000 slots.
+  *
   * #### Trace API calls
   *
   * MQTTAsync_traceCallback() is used to set a callback function which is called whenever trace
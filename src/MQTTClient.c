@@ -39,6 +39,7 @@
 
 #define _GNU_SOURCE /* for pthread_mutexattr_settype */
 #include <stdlib.h>
+#include <stddef.h>
 #if !defined(WIN32) && !defined(WIN64)
 	#include <sys/time.h>
 #endif
@@ -53,6 +54,8 @@
 #include "MQTTProtocolOut.h"
 #include "Thread.h"
 #include "SocketBuffer.h"
+#include "Pool.h"
+#include "Probes.h"
 #include "StackTrace.h"
 #include "Heap.h"
 
@@ -83,7 +86,6 @@ static mutex_type socket_mutex = NULL;
 static mutex_type subscribe_mutex = NULL;
 static mutex_type unsubscribe_mutex = NULL;
 static mutex_type connect_mutex = NULL;
-extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
 extern mutex_type log_mutex;
 BOOL APIENTRY DllMain(HANDLE hModule,
@@ -100,7 +102,6 @@ BOOL APIENTRY DllMain(HANDLE hModule,
 				subscribe_mutex = CreateMutex(NULL, 0, NULL);
 				unsubscribe_mutex = CreateMutex(NULL, 0, NULL);
 				connect_mutex = CreateMutex(NULL, 0, NULL);
-				stack_mutex = CreateMutex(NULL, 0, NULL);
 				heap_mutex = CreateMutex(NULL, 0, NULL);
 				log_mutex = CreateMutex(NULL, 0, NULL);
 				socket_mutex = CreateMutex(NULL, 0, NULL);
@@ -173,6 +174,7 @@ typedef struct
 	char* topicName;
 	int topicLen;
 	unsigned int seqno; /* only used on restore */
+	ListElement link; /* for the messageQueue list.  Must match MQTTPersistence_qEntry */
 } qEntry;
 
 
@@ -287,8 +289,10 @@ int MQTTClient_create(MQTTClient* handle, const char* serverURI, const char* cli
 		#if defined(HEAP_H)
 			Heap_initialize();
 		#endif
+		Pool_initialize();
 		Log_initialize((Log_nameValue*)MQTTClient_getVersionInfo());
 		bstate->clients = ListInitialize();
+		ListZeroIntrusive(&(state.publications), offsetof(Publications, link));
 		Socket_outInitialize();
 		Socket_setWriteCompleteCallback(MQTTClient_writeComplete);
 		handles = ListInitialize();
@@ -315,10 +319,11 @@ int MQTTClient_create(MQTTClient* handle, const char* serverURI, const char* cli
 	m->c = malloc(sizeof(Clients));
 	memset(m->c, '\0', sizeof(Clients));
 	m->c->context = m;
-	m->c->outboundMsgs = ListInitialize();
-	m->c->inboundMsgs = ListInitialize();
-	m->c->messageQueue = ListInitialize();
+	m->c->outboundMsgs = ListInitializeIntrusive(offsetof(Messages, link));
+	m->c->inboundMsgs = ListInitializeIntrusive(offsetof(Messages, link));
+	m->c->messageQueue = ListInitializeIntrusive(offsetof(qEntry, link));
 	m->c->clientID = MQTTStrdup(clientId);
+	m->c->net.metrics = Metrics_create();
 	m->connect_sem = Thread_create_sem();
 	m->connack_sem = Thread_create_sem();
 	m->suback_sem = Thread_create_sem();
@@ -355,6 +360,7 @@ void MQTTClient_terminate(void)
 #if defined(OPENSSL)
 		SSLSocket_terminate();
 #endif
+		Pool_terminate();
 		#if defined(HEAP_H)
 			Heap_terminate();
 		#endif
@@ -554,6 +560,7 @@ thread_return_type WINAPI MQTTClient_run(void* n)
 			{
 				qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
 				int topicLen = qe->topicLen;
+				long long start;
 
 				if (strlen(qe->topicName) == topicLen)
 					topicLen = 0;
@@ -561,7 +568,11 @@ thread_return_type WINAPI MQTTClient_run(void* n)
 				Log(TRACE_MIN, -1, "Calling messageArrived for client %s, queue depth %d",
 					m->c->clientID, m->c->messageQueue->count);
 				Thread_unlock_mutex(mqttclient_mutex);
+				start = Metrics_now();
+				PROBE2(callback__entry, m->c->clientID, "messageArrived");
 				rc = (*(m->ma))(m->context, qe->topicName, topicLen, qe->msg);
+				PROBE2(callback__return, m->c->clientID, "messageArrived");
+				Metrics_record(m->c->net.metrics, METRIC_CALLBACK, start);
 				Thread_lock_mutex(mqttclient_mutex);
 				/* if 0 (false) is returned by the callback then it failed, so we don't remove the message from
 				 * the queue, and it will be retried later.  If 1 is returned then the message data may have been freed,
@@ -610,8 +621,6 @@ thread_return_type WINAPI MQTTClient_run(void* n)
 				rc = SSLSocket_connect(m->c->net.ssl, m->c->net.socket);
 				if (rc == 1 || rc == SSL_FATAL)
 				{
-					if (rc == 1 && !m->c->cleansession && m->c->session == NULL)
-						m->c->session = SSL_get1_session(m->c->net.ssl);
 					m->rc = rc;
 					Log(TRACE_MIN, -1, "Posting connect semaphore for SSL client %s rc %d", m->c->clientID, m->rc);
 					Thread_post_sem(m->connect_sem);
@@ -703,6 +712,7 @@ void MQTTClient_closeSession(Clients* client)
 	client->ping_outstanding = 0;
 	if (client->net.socket > 0)
 	{
+		PROBE1(disconnect, client->clientID);
 		if (client->connected)
 			MQTTPacket_send_disconnect(&client->net, client->clientID);
 		Thread_lock_mutex(socket_mutex);
@@ -834,11 +844,8 @@ int MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions* o
 #if defined(OPENSSL)
 		if (m->ssl)
 		{
-			if (SSLSocket_setSocketForSSL(&m->c->net, m->c->sslopts) != MQTTCLIENT_SUCCESS)
+			if (SSLSocket_setSocketForSSL(&m->c->net, m->c->sslopts, serverURI) != MQTTCLIENT_SUCCESS)
 			{
-				if (m->c->session != NULL)
-					if ((rc = SSL_set_session(m->c->net.ssl, m->c->session)) != 1)
-						Log(TRACE_MIN, -1, "Failed to set SSL session with stored data, non critical");
 				rc = SSLSocket_connect(m->c->net.ssl, m->c->net.socket);
 				if (rc == TCPSOCKET_INTERRUPTED)
 					m->c->connect_state = 2;  /* the connect is still in progress */
@@ -856,8 +863,6 @@ int MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions* o
 						rc = SOCKET_ERROR;
 						goto exit;
 					}
-					if (!m->c->cleansession && m->c->session == NULL)
-						m->c->session = SSL_get1_session(m->c->net.ssl);
 				}
 			}
 			else
@@ -891,8 +896,6 @@ int MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions* o
 			rc = SOCKET_ERROR;
 			goto exit;
 		}
-		if(!m->c->cleansession && m->c->session == NULL)
-			m->c->session = SSL_get1_session(m->c->net.ssl);
 		m->c->connect_state = 3; /* TCP connect completed, in which case send the MQTT connect packet */
 		if (MQTTPacket_send_connect(m->c, MQTTVersion) == SOCKET_ERROR)
 		{
@@ -1005,6 +1008,8 @@ int MQTTClient_connectURI(MQTTClient handle, MQTTClient_connectOptions* options,
 			free((void*)m->c->sslopts->privateKeyPassword);
 		if (m->c->sslopts->enabledCipherSuites)
 			free((void*)m->c->sslopts->enabledCipherSuites);
+		if (m->c->sslopts->sessionCacheFile)
+			free((void*)m->c->sslopts->sessionCacheFile);
 		free(m->c->sslopts);
 		m->c->sslopts = NULL;
 	}
@@ -1024,6 +1029,10 @@ int MQTTClient_connectURI(MQTTClient handle, MQTTClient_connectOptions* options,
 		if (options->ssl->enabledCipherSuites)
 			m->c->sslopts->enabledCipherSuites = MQTTStrdup(options->ssl->enabledCipherSuites);
 		m->c->sslopts->enableServerCertAuth = options->ssl->enableServerCertAuth;
+		if (options->ssl->struct_version >= 1 && options->ssl->sessionCacheFile)
+			m->c->sslopts->sessionCacheFile = MQTTStrdup(options->ssl->sessionCacheFile);
+		if (options->ssl->struct_version >= 2)
+			m->c->sslopts->enableKernelTLS = options->ssl->enableKernelTLS;
 	}
 #endif
 
@@ -1084,7 +1093,7 @@ int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 #if defined(OPENSSL)
 	if (options->struct_version != 0 && options->ssl) /* check validity of SSL options structure */
 	{
-		if (strncmp(options->ssl->struct_id, "MQTS", 4) != 0 || options->ssl->struct_version != 0)
+		if (strncmp(options->ssl->struct_id, "MQTS", 4) != 0 || options->ssl->struct_version < 0 || options->ssl->struct_version > 2)
 		{
 			rc = MQTTCLIENT_BAD_STRUCTURE;
 			goto exit;
@@ -1239,6 +1248,111 @@ int MQTTClient_isConnected(MQTTClient handle)
 }
 
 
+static void MQTTClient_getHistogram(Metrics* metrics, int histogram, MQTTClient_histogram* h)
+{
+	Metrics_histogram snapshot;
+	int i;
+
+	Metrics_getHistogram(metrics, histogram, &snapshot);
+	h->count = snapshot.count;
+	h->sum = snapshot.sum;
+	h->max = snapshot.max;
+	h->p50 = Metrics_percentile(&snapshot, 0.5);
+	h->p90 = Metrics_percentile(&snapshot, 0.9);
+	h->p99 = Metrics_percentile(&snapshot, 0.99);
+	h->p999 = Metrics_percentile(&snapshot, 0.999);
+	for (i = 0; i < MQTTCLIENT_HISTOGRAM_BUCKETS; ++i)
+		h->buckets[i] = snapshot.buckets[i];
+}
+
+
+int MQTTClient_getMetrics(MQTTClient handle, MQTTClient_metrics* metrics)
+{
+	MQTTClients* m = handle;
+	Metrics* counters = NULL;
+	int gauges[METRIC_GAUGE_COUNT];
+	int rc = MQTTCLIENT_SUCCESS;
+	int i;
+
+	FUNC_ENTRY;
+	if (m == NULL || m->c == NULL)
+	{
+		rc = MQTTCLIENT_FAILURE;
+		goto exit;
+	}
+	if (metrics == NULL || strncmp(metrics->struct_id, "MQME", 4) != 0 || metrics->struct_version != 0)
+	{
+		rc = MQTTCLIENT_BAD_STRUCTURE;
+		goto exit;
+	}
+	Thread_lock_mutex(mqttclient_mutex);
+	counters = m->c->net.metrics;
+	metrics->bytes_in = Metrics_get(counters, METRIC_BYTES_IN);
+	metrics->bytes_out = Metrics_get(counters, METRIC_BYTES_OUT);
+	for (i = 0; i < 16; ++i)
+	{
+		metrics->packets_in[i] = Metrics_get(counters, METRIC_PACKETS_IN + i);
+		metrics->packets_out[i] = Metrics_get(counters, METRIC_PACKETS_OUT + i);
+	}
+	metrics->retries = Metrics_get(counters, METRIC_RETRIES);
+	metrics->partial_writes = Metrics_get(counters, METRIC_PARTIAL_WRITES);
+	Clients_getGauges(m->c, gauges);
+	metrics->pending_write_bytes = gauges[METRIC_PENDING_WRITE_BYTES];
+	metrics->queued_messages = gauges[METRIC_QUEUED_MESSAGES];
+	metrics->inflight_messages = gauges[METRIC_INFLIGHT_MESSAGES];
+	metrics->inbound_messages = gauges[METRIC_INBOUND_MESSAGES];
+	Thread_unlock_mutex(mqttclient_mutex);
+	MQTTClient_getHistogram(counters, METRIC_PERSISTENCE_PUT, &metrics->persistence_put);
+	MQTTClient_getHistogram(counters, METRIC_PERSISTENCE_REMOVE, &metrics->persistence_remove);
+	MQTTClient_getHistogram(counters, METRIC_CALLBACK, &metrics->callbacks);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTClient_getOpenMetrics(char* buffer, int buflen)
+{
+	ListElement* current = NULL;
+	Metrics_client* clients = NULL;
+	int count = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	Thread_lock_mutex(mqttclient_mutex);
+	if (handles && handles->count > 0)
+		clients = malloc(sizeof(Metrics_client) * handles->count);
+	while (clients && ListNextElement(handles, &current))
+	{
+		MQTTClients* m = (MQTTClients*)(current->content);
+
+		clients[count].clientID = m->c->clientID;
+		clients[count].metrics = m->c->net.metrics;
+		Clients_getGauges(m->c, clients[count].gauges);
+		count++;
+	}
+	rc = Metrics_format(clients, count, buffer, buflen);
+	Thread_unlock_mutex(mqttclient_mutex);
+	if (clients)
+		free(clients);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTClient_dumpTrace(const char* filename)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+
+	FUNC_ENTRY;
+	if (filename == NULL || Log_dumpTraceBinary((char*)filename) != 0)
+		rc = MQTTCLIENT_FAILURE;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+
 int MQTTClient_subscribeMany(MQTTClient handle, int count, char* const* topic, int* qos)
 {
 	MQTTClients* m = handle;
@@ -1473,7 +1587,7 @@ int MQTTClient_publish(MQTTClient handle, const char* topicName, int payloadlen,
 		goto exit;
 	}
 
-	p = malloc(sizeof(Publish));
+	p = Pool_malloc(POOL_PUBLISH, sizeof(Publish));
 
 	p->payload = payload;
 	p->payloadlen = payloadlen;
@@ -1501,7 +1615,7 @@ int MQTTClient_publish(MQTTClient handle, const char* topicName, int payloadlen,
 	if (deliveryToken && qos > 0)
 		*deliveryToken = msg->msgid;
 
-	free(p);
+	Pool_free(POOL_PUBLISH, p);
 
 	if (rc == SOCKET_ERROR)
 	{
@@ -1620,8 +1734,13 @@ MQTTPacket* MQTTClient_cycle(int* sock, unsigned long timeout, int* rc)
 						MQTTProtocol_handlePubcomps(pack, *sock) : MQTTProtocol_handlePubacks(pack, *sock);
 				if (m && m->dc)
 				{
+					long long start = Metrics_now();
+
 					Log(TRACE_MIN, -1, "Calling deliveryComplete for client %s, msgid %d", m->c->clientID, msgid);
+					PROBE2(callback__entry, m->c->clientID, "deliveryComplete");
 					(*(m->dc))(m->context, msgid);
+					PROBE2(callback__return, m->c->clientID, "deliveryComplete");
+					Metrics_record(m->c->net.metrics, METRIC_CALLBACK, start);
 				}
 			}
 			else if (pack->header.bits.type == PUBREC)
@@ -1702,11 +1821,7 @@ MQTTPacket* MQTTClient_waitfor(MQTTClient handle, int packet_type, int* rc, long
 					if (*rc == SSL_FATAL)
 						break;
 					else if (*rc == 1) /* rc == 1 means SSL connect has finished and succeeded */
-					{
-						if (!m->c->cleansession && m->c->session == NULL)
-							m->c->session = SSL_get1_session(m->c->net.ssl);
 						break;
-					}
 				}
 #endif
 				else if (m->c->connect_state == 3)
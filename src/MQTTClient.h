@@ -462,7 +462,8 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  Must be MQTS */
 	const char struct_id[4];
-	/** The version number of this structure.  Must be 0 */
+	/** The version number of this structure.  Must be 0, 1 or 2.  0 means no sessionCacheFile,
+	  * 0 or 1 means no enableKernelTLS */
 	int struct_version;	
 	
 	/** The file in PEM format containing the public digital certificates trusted by the client. */
@@ -492,10 +493,32 @@ typedef struct
 
     /** True/False option to enable verification of the server certificate **/
     int enableServerCertAuth;
+
+	/**
+	* TLS sessions are cached for each server address, so that a reconnect, or a connect to
+	* another server in the serverURIs list which has been connected to before, can use an
+	* abbreviated handshake.  The cache is shared by all the clients in the process.  If this
+	* is set, the sessions for this client are also saved to this file, and loaded from it the
+	* first time it is used, so that they survive a restart of the application.  Expired sessions
+	* are not loaded.  New sessions are saved when the connection which received them is closed.
+	* The file contains secret session keys, so must be protected like a private key.
+	*/
+	const char* sessionCacheFile;
+
+	/**
+	* True/False option to use kernel TLS on Linux.  Once the handshake is complete, the session
+	* keys are passed to the kernel, which then encrypts the data written to the socket, so packets
+	* are written straight from the client's buffers, without the copies through OpenSSL's.  Data
+	* received is still read through OpenSSL, which handles the TLS 1.3 session tickets, key updates
+	* and alerts which the kernel cannot pass on as data.  Needs OpenSSL 3.0 or later built with kTLS
+	* support, the Linux tls module, and a cipher the kernel supports, such as AES-GCM.  Falls back to
+	* OpenSSL if the keys cannot be passed to the kernel.
+	*/
+	int enableKernelTLS;
   
 } MQTTClient_SSLOptions;
 
-#define MQTTClient_SSLOptions_initializer { {'M', 'Q', 'T', 'S'}, 0, NULL, NULL, NULL, NULL, NULL, 1 }
+#define MQTTClient_SSLOptions_initializer { {'M', 'Q', 'T', 'S'}, 2, NULL, NULL, NULL, NULL, NULL, 1, NULL, 0 }
 
 /**
  * MQTTClient_connectOptions defines several settings that control the way the
@@ -920,6 +943,93 @@ DLLExport void MQTTClient_free(void* ptr);
   */
 DLLExport void MQTTClient_destroy(MQTTClient* handle);
 
+
+/** The number of buckets in a ::MQTTClient_histogram */
+#define MQTTCLIENT_HISTOGRAM_BUCKETS 144
+
+/**
+  * A latency histogram, in nanoseconds.  Values below 4 have a bucket each.  Above that,
+  * each power of two is split into 4 equal buckets, so bucket 4 holds 4, bucket 5 holds 5,
+  * bucket 8 holds 8 and 9, and so on.  Values of 2^37 nanoseconds (about 137 seconds) and
+  * more all go in the last bucket.  The percentiles are estimated from the buckets, so are
+  * accurate to within 25%.
+  */
+typedef struct
+{
+	long long count;	/**< the number of operations recorded */
+	long long sum;		/**< the total time taken by all the operations */
+	long long max;		/**< the longest time taken */
+	long long p50;		/**< the estimated median */
+	long long p90;		/**< the estimated 90th percentile */
+	long long p99;		/**< the estimated 99th percentile */
+	long long p999;		/**< the estimated 99.9th percentile */
+	long long buckets[MQTTCLIENT_HISTOGRAM_BUCKETS];	/**< the number of operations in each bucket */
+} MQTTClient_histogram;
+
+/**
+  * The runtime metrics of a client, filled in by MQTTClient_getMetrics().  The counters
+  * are cumulative from the creation of the client, and are kept across reconnections.
+  */
+typedef struct
+{
+	/** The eyecatcher for this structure.  must be MQME. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	long long bytes_in;			/**< the number of bytes of MQTT packets received */
+	long long bytes_out;		/**< the number of bytes of MQTT packets written */
+	long long packets_in[16];	/**< the number of packets received, indexed by MQTT packet type */
+	long long packets_out[16];	/**< the number of packets written, indexed by MQTT packet type */
+	long long retries;			/**< the number of PUBLISH and PUBREL packets resent */
+	long long partial_writes;	/**< the number of packets which could not be written in one go */
+	int pending_write_bytes;	/**< the bytes of a partly written packet still to be written */
+	int queued_messages;		/**< the number of messages received but not yet delivered */
+	int inflight_messages;		/**< the number of outbound QoS 1 and 2 messages not yet completed */
+	int inbound_messages;		/**< the number of inbound QoS 2 messages not yet completed */
+	MQTTClient_histogram persistence_put;		/**< the time taken to persist messages */
+	MQTTClient_histogram persistence_remove;	/**< the time taken to remove messages from persistence */
+	MQTTClient_histogram callbacks;			/**< the time spent in the message arrived and delivery complete callbacks */
+} MQTTClient_metrics;
+
+#define MQTTClient_metrics_initializer { {'M', 'Q', 'M', 'E'}, 0, }
+
+/**
+  * This function gets the runtime metrics of a client.  It can be called from any
+  * thread, at any time between MQTTClient_create() and MQTTClient_destroy().
+  * @param handle A valid client handle from a successful call to MQTTClient_create().
+  * @param metrics A pointer to an ::MQTTClient_metrics structure, initialized with
+  * ::MQTTClient_metrics_initializer, which is filled in.
+  * @return ::MQTTCLIENT_SUCCESS if the metrics were retrieved, ::MQTTCLIENT_FAILURE if the handle
+  * is not valid, or ::MQTTCLIENT_BAD_STRUCTURE if the structure is not valid.
+  */
+DLLExport int MQTTClient_getMetrics(MQTTClient handle, MQTTClient_metrics* metrics);
+
+/**
+  * This function writes the metrics of all the clients which have been created, and not
+  * yet destroyed, in the OpenMetrics text format, which can be scraped by Prometheus.
+  * Each sample is labelled with the client id.  The counters and gauges are those of
+  * ::MQTTClient_metrics, and the histograms are in seconds, with one bucket for each power of two
+  * nanoseconds.
+  * @param buffer the buffer to write the text into.  It is always null terminated if
+  * buflen is greater than 0.
+  * @param buflen the length of the buffer
+  * @return the length of the whole text, not including the null terminator.  If this is
+  * buflen or more, the text has been truncated, and the call can be repeated with a buffer
+  * of this length plus one.
+  */
+DLLExport int MQTTClient_getOpenMetrics(char* buffer, int buflen);
+
+/**
+  * This function writes the trace entries which the library keeps in memory to a file, in a
+  * compact binary form.  Each thread keeps its most recent entries, at the level set by
+  * MQTT_C_CLIENT_TRACE_LEVEL (MINIMUM by default), whether or not tracing is switched on, and
+  * they are only formatted as text when this file is decoded, by the MQTTTraceDecode program.
+  * So this can be called when a problem is detected, to see what led up to it.
+  * @param filename the name of the file to write
+  * @return ::MQTTCLIENT_SUCCESS if the file was written, otherwise ::MQTTCLIENT_FAILURE.
+  */
+DLLExport int MQTTClient_dumpTrace(const char* filename);
+
 #endif
 #ifdef __cplusplus
      }
@@ -1263,6 +1373,16 @@ int main(int argc, char* argv[])
   * to a file.  Two files are used at most, when they are full, the last one is overwritten with the
   * new trace entries.  The default size is 1000 lines.
   *
+  * Each thread also keeps its most recent trace entries in memory, in binary form, whether or
+  * not tracing is switched on.  MQTTClient_dumpTrace() writes them to a file, which the MQTTTraceDecode
+  * program turns into text:
+  * @code
+    MQTTTraceDecode [-l level] dumpfile
+  * @endcode
+  * The variable MQTT_C_CLIENT_TRACE_ENTRIES sets the size of each thread's memory, in 64 byte
+  * slots.  A function entry or exit takes one slot, and a message one or more depending on its
+  * arguments.  The default is 2000 slots.
+  *
   * ### MQTT Packet Tracing
   * 
   * A feature that can be very useful is printing the MQTT packets that are sent and received.  To 
@@ -29,6 +29,8 @@
 	#include "MQTTPersistence.h"
 #endif
 #include "Messages.h"
+#include "Pool.h"
+#include "Probes.h"
 #include "StackTrace.h"
 
 #include <stdlib.h>
@@ -86,6 +88,39 @@ pf new_packets[] =
 };
 
 
+/**
+ * The number of bytes the MQTT algorithm takes to encode a remaining length
+ * @param length the remaining length
+ * @return the number of bytes
+ */
+static int MQTTPacket_lengthBytes(size_t length)
+{
+	return (length < 128) ? 1 : (length < 16384) ? 2 : (length < 2097152) ? 3 : 4;
+}
+
+
+/**
+ * Update the metrics for a packet handed to the socket layer
+ * @param net the network handle the packet was written to
+ * @param header the MQTT header of the packet
+ * @param length the length of the whole packet
+ * @param rc the return code from writing it
+ */
+static void MQTTPacket_count(networkHandles* net, Header header, size_t length, int rc)
+{
+	if (rc == SOCKET_ERROR)
+		return;
+	Metrics_add(net->metrics, METRIC_PACKETS_OUT + header.bits.type, 1);
+	Metrics_add(net->metrics, METRIC_BYTES_OUT, (long long)length);
+	PROBE3(packet__sent, net->socket, header.bits.type, (int)length);
+	if (rc == TCPSOCKET_INTERRUPTED)
+	{
+		Metrics_add(net->metrics, METRIC_PARTIAL_WRITES, 1);
+		PROBE2(partial__write, net->socket, (int)length);
+	}
+}
+
+
 /**
  * Reads one MQTT packet from a socket.
  * @param socket a socket from which to read an MQTT packet
@@ -156,7 +191,14 @@ void* MQTTPacket_Factory(networkHandles* net, int* error)
 		}
 	}
 	if (pack)
+	{
+		int length = 1 + MQTTPacket_lengthBytes(remaining_length) + (int)remaining_length;
+
 		time(&(net->lastReceived));
+		Metrics_add(net->metrics, METRIC_PACKETS_IN + header.bits.type, 1);
+		Metrics_add(net->metrics, METRIC_BYTES_IN, length);
+		PROBE3(packet__received, net->socket, header.bits.type, length);
+	}
 exit:
 	FUNC_EXIT_RC(*error);
 	return pack;
@@ -200,6 +242,7 @@ int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buf
 		
 	if (rc == TCPSOCKET_COMPLETE)
 		time(&(net->lastSent));
+	MQTTPacket_count(net, header, buf0len + buflen, rc);
 	
 	if (rc != TCPSOCKET_INTERRUPTED)
 	  free(buf);
@@ -237,8 +280,12 @@ int MQTTPacket_sends(networkHandles* net, Header header, int count, char** buffe
 		int msgId = readInt(&ptraux);
 		rc = MQTTPersistence_put(net->socket, buf, buf0len, count, buffers, buflens,
 			header.bits.type, msgId, 0);
+		if (net->stamps)
+			net->stamps[STAGE_PERSISTED] = Metrics_now();
 	}
 #endif
+	if (net->stamps)
+		net->stamps[STAGE_WRITE_STARTED] = Metrics_now();
 #if defined(OPENSSL)
 	if (net->ssl)
 		rc = SSLSocket_putdatas(net->ssl, net->socket, buf, buf0len, count, buffers, buflens, frees);
@@ -247,7 +294,12 @@ int MQTTPacket_sends(networkHandles* net, Header header, int count, char** buffe
 		rc = Socket_putdatas(net->socket, buf, buf0len, count, buffers, buflens, frees);
 		
 	if (rc == TCPSOCKET_COMPLETE)
+	{
 		time(&(net->lastSent));
+		if (net->stamps)
+			net->stamps[STAGE_WRITTEN] = Metrics_now();
+	}
+	MQTTPacket_count(net, header, buf0len + total, rc);
 	
 	if (rc != TCPSOCKET_INTERRUPTED)
 	  free(buf);
@@ -481,7 +533,7 @@ int MQTTPacket_send_disconnect(networkHandles *net, const char* clientID)
  */
 void* MQTTPacket_publish(unsigned char aHeader, char* data, size_t datalen)
 {
-	Publish* pack = malloc(sizeof(Publish));
+	Publish* pack = Pool_malloc(POOL_PUBLISH, sizeof(Publish));
 	char* curdata = data;
 	char* enddata = &data[datalen];
 
@@ -489,7 +541,7 @@ void* MQTTPacket_publish(unsigned char aHeader, char* data, size_t datalen)
 	pack->header.byte = aHeader;
 	if ((pack->topic = readUTFlen(&curdata, enddata, &pack->topiclen)) == NULL) /* Topic name on which to publish */
 	{
-		free(pack);
+		Pool_free(POOL_PUBLISH, pack);
 		pack = NULL;
 		goto exit;
 	}
@@ -514,7 +566,7 @@ void MQTTPacket_freePublish(Publish* pack)
 	FUNC_ENTRY;
 	if (pack->topic != NULL)
 		free(pack->topic);
-	free(pack);
+	Pool_free(POOL_PUBLISH, pack);
 	FUNC_EXIT;
 }
 
@@ -648,7 +700,7 @@ int MQTTPacket_send_pubcomp(int msgid, networkHandles* net, const char* clientID
  */
 void* MQTTPacket_ack(unsigned char aHeader, char* data, size_t datalen)
 {
-	Ack* pack = malloc(sizeof(Ack));
+	Ack* pack = Pool_malloc(POOL_ACK, sizeof(Ack));
 	char* curdata = data;
 
 	FUNC_ENTRY;
@@ -732,6 +784,9 @@ void MQTTPacket_free_packet(MQTTPacket* pack)
 		MQTTPacket_freeSubscribe((Subscribe*)pack, 1);
 	else if (pack->header.type == UNSUBSCRIBE)
 		MQTTPacket_freeUnsubscribe((Unsubscribe*)pack);*/
+	else if ((pack->header.bits.type >= PUBACK && pack->header.bits.type <= PUBCOMP) ||
+			pack->header.bits.type == UNSUBACK)
+		Pool_free(POOL_ACK, pack);
 	else
 		free(pack);
 	FUNC_EXIT;
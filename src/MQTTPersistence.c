@@ -28,6 +28,9 @@
 #include "MQTTPersistence.h"
 #include "MQTTPersistenceDefault.h"
 #include "MQTTProtocolClient.h"
+#include "Compress.h"
+#include "Pool.h"
+#include "Probes.h"
 #include "Heap.h"
 
 
@@ -231,7 +234,7 @@ int MQTTPersistence_restore(Clients *c)
 						sprintf(key, "%s%d", PERSISTENCE_PUBLISH_SENT, pubrel->msgId);
 						if ( c->persistence->pcontainskey(c->phandle, key) != 0 )
 							rc = c->persistence->premove(c->phandle, msgkeys[i]);
-						free(pubrel);
+						Pool_free(POOL_ACK, pubrel);
 						free(key);
 					}
 				}
@@ -342,6 +345,7 @@ int MQTTPersistence_put(int socket, char* buf0, size_t buf0len, int count,
 	int* lens = NULL;
 	char** bufs = NULL;
 	char *key;
+	long long start;
 	Clients* client = NULL;
 
 	FUNC_ENTRY;
@@ -371,7 +375,11 @@ int MQTTPersistence_put(int socket, char* buf0, size_t buf0len, int count,
 		if ( scr == 1 )  /* receiving PUBLISH QoS2 */
 			sprintf(key, "%s%d", PERSISTENCE_PUBLISH_RECEIVED, msgId);
 
+		start = Metrics_now();
+		PROBE1(persistence__put__entry, key);
 		rc = client->persistence->pput(client->phandle, key, nbufs, bufs, lens);
+		PROBE2(persistence__put__return, key, rc);
+		Metrics_record(client->net.metrics, METRIC_PERSISTENCE_PUT, start);
 
 		free(key);
 		free(lens);
@@ -400,18 +408,27 @@ int MQTTPersistence_remove(Clients* c, char *type, int qos, int msgId)
 	if (c->persistence != NULL)
 	{
 		char *key = malloc(MESSAGE_FILENAME_LENGTH + 1);
+		long long start = Metrics_now();
+
 		if ( (strcmp(type,PERSISTENCE_PUBLISH_SENT) == 0) && qos == 2 )
 		{
 			sprintf(key, "%s%d", PERSISTENCE_PUBLISH_SENT, msgId) ;
+			PROBE1(persistence__remove__entry, key);
 			rc = c->persistence->premove(c->phandle, key);
+			PROBE2(persistence__remove__return, key, rc);
 			sprintf(key, "%s%d", PERSISTENCE_PUBREL, msgId) ;
+			PROBE1(persistence__remove__entry, key);
 			rc = c->persistence->premove(c->phandle, key);
+			PROBE2(persistence__remove__return, key, rc);
 		}
 		else /* PERSISTENCE_PUBLISH_SENT && qos == 1 */
 		{    /* or PERSISTENCE_PUBLISH_RECEIVED */
 			sprintf(key, "%s%d", type, msgId) ;
+			PROBE1(persistence__remove__entry, key);
 			rc = c->persistence->premove(c->phandle, key);
+			PROBE2(persistence__remove__return, key, rc);
 		}
+		Metrics_record(c->net.metrics, METRIC_PERSISTENCE_REMOVE, start);
 		free(key);
 	}
 
@@ -466,15 +483,131 @@ void MQTTPersistence_wrapMsgID(Clients *client)
 
 
 #if !defined(NO_PERSISTENCE)
+/**
+ * Marker at the start of a compressed record.  Read as an int, it is negative on any
+ * platform, so it can't be mistaken for the first field of an uncompressed record, which
+ * is always a payload length or a command type.
+ */
+static const char compressed_record_id[4] = {'\xF5', 'Z', 'L', '\xF4'};
+
+/** compressed record header: the marker followed by the uncompressed length */
+#define COMPRESSED_HEADER_LENGTH (sizeof(compressed_record_id) + sizeof(int))
+
+
+/**
+ * Write a record made up of several buffers to persistence.  If the client has
+ * compression enabled, the buffers are gathered and compressed into one record
+ * with a header, unless that would not save any space.
+ * @param c the client
+ * @param key the persistence key
+ * @param nbufs the number of buffers
+ * @param bufs the buffers making up the record
+ * @param lens the lengths of the buffers
+ * @return the return code from the persistence pput function
+ */
+int MQTTPersistence_putRecord(Clients* c, char* key, int nbufs, char** bufs, int* lens)
+{
+	int rc = 0;
+	int written = 0;
+	long long start = Metrics_now();
+
+	FUNC_ENTRY;
+	PROBE1(persistence__put__entry, key);
+	if (c->compressPersistence)
+	{
+		int i, total = 0;
+
+		for (i = 0; i < nbufs; ++i)
+			total += lens[i];
+		if (total >= PERSISTENCE_COMPRESS_MIN_LENGTH)
+		{
+			char* raw = malloc(total);
+			int bound = Compress_bound(total);
+			char* record = malloc(COMPRESSED_HEADER_LENGTH + bound);
+			char* ptr = raw;
+			int clen;
+
+			for (i = 0; i < nbufs; ++i)
+			{
+				memcpy(ptr, bufs[i], lens[i]);
+				ptr += lens[i];
+			}
+			clen = Compress_encode(raw, total, &record[COMPRESSED_HEADER_LENGTH], bound);
+			if (clen > 0 && clen + (int)COMPRESSED_HEADER_LENGTH < total)
+			{
+				int reclen = clen + (int)COMPRESSED_HEADER_LENGTH;
+
+				memcpy(record, compressed_record_id, sizeof(compressed_record_id));
+				memcpy(&record[sizeof(compressed_record_id)], &total, sizeof(int));
+				Log(TRACE_MINIMUM, -1, "Persisting record %s compressed from %d to %d bytes", key, total, reclen);
+				rc = c->persistence->pput(c->phandle, key, 1, &record, &reclen);
+				written = 1;
+			}
+			free(record);
+			free(raw);
+		}
+	}
+	if (!written)
+		rc = c->persistence->pput(c->phandle, key, nbufs, bufs, lens);
+	PROBE2(persistence__put__return, key, rc);
+	Metrics_record(c->net.metrics, METRIC_PERSISTENCE_PUT, start);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Decompress a record read from persistence, if it was written compressed by
+ * MQTTPersistence_putRecord.  Uncompressed records are left untouched.
+ * @param buffer pointer to the record buffer; replaced by the decompressed data if needed
+ * @param buflen pointer to the record length; updated if the record is decompressed
+ * @return 0 if successful, MQTTCLIENT_PERSISTENCE_ERROR if the record is corrupt
+ */
+int MQTTPersistence_decodeRecord(char** buffer, int* buflen)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (*buflen >= (int)COMPRESSED_HEADER_LENGTH &&
+		memcmp(*buffer, compressed_record_id, sizeof(compressed_record_id)) == 0)
+	{
+		int rawlen;
+		char* raw = NULL;
+
+		memcpy(&rawlen, &(*buffer)[sizeof(compressed_record_id)], sizeof(int));
+		if (rawlen <= 0 || (raw = malloc(rawlen)) == NULL ||
+			Compress_decode(&(*buffer)[COMPRESSED_HEADER_LENGTH], *buflen - (int)COMPRESSED_HEADER_LENGTH, raw, rawlen) != 0)
+		{
+			Log(LOG_ERROR, -1, "Error decompressing persisted record");
+			if (raw)
+				free(raw);
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+		else
+		{
+			free(*buffer);
+			*buffer = raw;
+			*buflen = rawlen;
+		}
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 int MQTTPersistence_unpersistQueueEntry(Clients* client, MQTTPersistence_qEntry* qe)
 {
 	int rc = 0;
 	char key[PERSISTENCE_MAX_KEY_LENGTH + 1];
+	long long start = Metrics_now();
 	
 	FUNC_ENTRY;
 	sprintf(key, "%s%d", PERSISTENCE_QUEUE_KEY, qe->seqno);
+	PROBE1(persistence__remove__entry, key);
 	if ((rc = client->persistence->premove(client->phandle, key)) != 0)
 		Log(LOG_ERROR, 0, "Error %d removing qEntry from persistence", rc);
+	PROBE2(persistence__remove__return, key, rc);
+	Metrics_record(client->net.metrics, METRIC_PERSISTENCE_REMOVE, start);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -520,7 +653,7 @@ int MQTTPersistence_persistQueueEntry(Clients* aclient, MQTTPersistence_qEntry*
 	sprintf(key, "%s%d", PERSISTENCE_QUEUE_KEY, ++aclient->qentry_seqno);	
 	qe->seqno = aclient->qentry_seqno;
 
-	if ((rc = aclient->persistence->pput(aclient->phandle, key, nbufs, (char**)bufs, lens)) != 0)
+	if ((rc = MQTTPersistence_putRecord(aclient, key, nbufs, (char**)bufs, lens)) != 0)
 		Log(LOG_ERROR, 0, "Error persisting queue entry, rc %d", rc);
 
 	free(lens);
@@ -618,16 +751,18 @@ int MQTTPersistence_restoreMessageQueue(Clients* c)
 				;
 			else if ((rc = c->persistence->pget(c->phandle, msgkeys[i], &buffer, &buflen)) == 0)
 			{
-				MQTTPersistence_qEntry* qe = MQTTPersistence_restoreQueueEntry(buffer, buflen);
+				MQTTPersistence_qEntry* qe = NULL;
 				
+				if (MQTTPersistence_decodeRecord(&buffer, &buflen) == 0)
+					qe = MQTTPersistence_restoreQueueEntry(buffer, buflen);
 				if (qe)
 				{	
 					qe->seqno = atoi(msgkeys[i]+2);
 					MQTTPersistence_insertInSeqOrder(c->messageQueue, qe, sizeof(MQTTPersistence_qEntry));
-					free(buffer);
 					c->qentry_seqno = max(c->qentry_seqno, qe->seqno);
 					entries_restored++;
 				}
+				free(buffer);
 			}
 			if (msgkeys[i])
 				free(msgkeys[i]);
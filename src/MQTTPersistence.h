@@ -33,6 +33,8 @@
 /** Stem of the key for an async client message queue */
 #define PERSISTENCE_QUEUE_KEY "q-"
 #define PERSISTENCE_MAX_KEY_LENGTH 8
+/** Records shorter than this are never compressed */
+#define PERSISTENCE_COMPRESS_MIN_LENGTH 64
 
 int MQTTPersistence_create(MQTTClient_persistence** per, int type, void* pcontext);
 int MQTTPersistence_initialize(Clients* c, const char* serverURI);
@@ -45,6 +47,8 @@ int MQTTPersistence_put(int socket, char* buf0, size_t buf0len, int count,
 								 char** buffers, size_t* buflens, int htype, int msgId, int scr);
 int MQTTPersistence_remove(Clients* c, char* type, int qos, int msgId);
 void MQTTPersistence_wrapMsgID(Clients *c);
+int MQTTPersistence_putRecord(Clients* c, char* key, int nbufs, char** bufs, int* lens);
+int MQTTPersistence_decodeRecord(char** buffer, int* buflen);
 
 typedef struct
 {
@@ -64,6 +68,7 @@ typedef struct
 	char* topicName;
 	int topicLen;
 	unsigned int seqno; /* only used on restore */
+	ListElement link; /* for the messageQueue list.  Must match the qEntry structures in MQTTClient.c and MQTTAsync.c */
 } MQTTPersistence_qEntry;
 
 int MQTTPersistence_unpersistQueueEntry(Clients* client, MQTTPersistence_qEntry* qe);
@@ -508,12 +508,15 @@ int clearUnix(char *dirname)
 	{
 		while((dir_entry = readdir(dp)) != NULL && rc == 0)
 		{
-			lstat(dir_entry->d_name, &stat_info);
-			if(S_ISREG(stat_info.st_mode))
+			char* file = malloc(strlen(dirname) + strlen(dir_entry->d_name) + 2);
+
+			sprintf(file, "%s/%s", dirname, dir_entry->d_name);
+			if (lstat(file, &stat_info) == 0 && S_ISREG(stat_info.st_mode))
 			{
-				if ( remove(dir_entry->d_name) != 0 )
+				if (remove(file) != 0 && errno != ENOENT)
 					rc = MQTTCLIENT_PERSISTENCE_ERROR;
 			}
+			free(file);
 		}
 		closedir(dp);
 	} else
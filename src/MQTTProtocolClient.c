@@ -34,6 +34,7 @@
 #include "MQTTPersistence.h"
 #endif
 #include "SocketBuffer.h"
+#include "Pool.h"
 #include "StackTrace.h"
 #include "Heap.h"
 
@@ -170,7 +171,7 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
  */
 Messages* MQTTProtocol_createMessage(Publish* publish, Messages **mm, int qos, int retained)
 {
-	Messages* m = malloc(sizeof(Messages));
+	Messages* m = Pool_malloc(POOL_MESSAGES, sizeof(Messages));
 
 	FUNC_ENTRY;
 	m->len = sizeof(Messages);
@@ -205,7 +206,7 @@ Messages* MQTTProtocol_createMessage(Publish* publish, Messages **mm, int qos, i
  */
 Publications* MQTTProtocol_storePublication(Publish* publish, int* len)
 {
-	Publications* p = malloc(sizeof(Publications));
+	Publications* p = Pool_malloc(POOL_PUBLICATIONS, sizeof(Publications));
 
 	FUNC_ENTRY;
 	p->refcount = 1;
@@ -242,7 +243,8 @@ void MQTTProtocol_removePublication(Publications* p)
 	{
 		free(p->payload);
 		free(p->topic);
-		ListRemove(&(state.publications), p);
+		ListDetach(&(state.publications), p);
+		Pool_free(POOL_PUBLICATIONS, p);
 	}
 	FUNC_EXIT;
 }
@@ -280,7 +282,7 @@ int MQTTProtocol_handlePublishes(void* pack, int sock)
 		/* store publication in inbound list */
 		int len;
 		ListElement* listElem = NULL;
-		Messages* m = malloc(sizeof(Messages));
+		Messages* m = Pool_malloc(POOL_MESSAGES, sizeof(Messages));
 		Publications* p = MQTTProtocol_storePublication(publish, &len);
 		m->publish = p;
 		m->msgid = publish->msgId;
@@ -292,7 +294,8 @@ int MQTTProtocol_handlePublishes(void* pack, int sock)
 			Messages* msg = (Messages*)(listElem->content);
 			MQTTProtocol_removePublication(msg->publish);
 			ListInsert(client->inboundMsgs, m, sizeof(Messages) + len, listElem);
-			ListRemove(client->inboundMsgs, msg);
+			ListDetach(client->inboundMsgs, msg);
+			Pool_free(POOL_MESSAGES, msg);
 		} else
 			ListAppend(client->inboundMsgs, m, sizeof(Messages) + len);
 		rc = MQTTPacket_send_pubrec(publish->msgId, &client->net, client->clientID);
@@ -334,10 +337,11 @@ int MQTTProtocol_handlePubacks(void* pack, int sock)
 				rc = MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_SENT, m->qos, puback->msgId);
 			#endif
 			MQTTProtocol_removePublication(m->publish);
-			ListRemove(client->outboundMsgs, m);
+			ListDetach(client->outboundMsgs, m);
+			Pool_free(POOL_MESSAGES, m);
 		}
 	}
-	free(pack);
+	Pool_free(POOL_ACK, pack);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -386,7 +390,7 @@ int MQTTProtocol_handlePubrecs(void* pack, int sock)
 			time(&(m->lastTouch));
 		}
 	}
-	free(pack);
+	Pool_free(POOL_ACK, pack);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -441,12 +445,14 @@ int MQTTProtocol_handlePubrels(void* pack, int sock)
 			#if !defined(NO_PERSISTENCE)
 				rc += MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_RECEIVED, m->qos, pubrel->msgId);
 			#endif
-			ListRemove(&(state.publications), m->publish);
-			ListRemove(client->inboundMsgs, m);
+			ListDetach(&(state.publications), m->publish);
+			Pool_free(POOL_PUBLICATIONS, m->publish);
+			ListDetach(client->inboundMsgs, m);
+			Pool_free(POOL_MESSAGES, m);
 			++(state.msgs_received);
 		}
 	}
-	free(pack);
+	Pool_free(POOL_ACK, pack);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -490,12 +496,13 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock)
 					rc = MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_SENT, m->qos, pubcomp->msgId);
 				#endif
 				MQTTProtocol_removePublication(m->publish);
-				ListRemove(client->outboundMsgs, m);
+				ListDetach(client->outboundMsgs, m);
+				Pool_free(POOL_MESSAGES, m);
 				(++state.msgs_sent);
 			}
 		}
 	}
-	free(pack);
+	Pool_free(POOL_ACK, pack);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -574,6 +581,7 @@ void MQTTProtocol_retries(time_t now, Clients* client, int regardless)
 				int rc;
 
 				Log(TRACE_MIN, 7, NULL, "PUBLISH", client->clientID, client->net.socket, m->msgid);
+				Metrics_add(client->net.metrics, METRIC_RETRIES, 1);
 				publish.msgId = m->msgid;
 				publish.topic = m->publish->topic;
 				publish.payload = m->publish->payload;
@@ -597,6 +605,7 @@ void MQTTProtocol_retries(time_t now, Clients* client, int regardless)
 			else if (m->qos && m->nextMessageType == PUBCOMP)
 			{
 				Log(TRACE_MIN, 7, NULL, "PUBREL", client->clientID, client->net.socket, m->msgid);
+				Metrics_add(client->net.metrics, METRIC_RETRIES, 1);
 				if (MQTTPacket_send_pubrel(m->msgid, 0, &client->net, client->clientID) != TCPSOCKET_COMPLETE)
 				{
 					client->good = 0;
@@ -683,6 +692,7 @@ void MQTTProtocol_freeClient(Clients* client)
 		free(client->sslopts);
 	}
 #endif
+	Metrics_free(client->net.metrics);
 	/* don't free the client structure itself... this is done elsewhere */
 	FUNC_EXIT;
 }
@@ -694,13 +704,13 @@ void MQTTProtocol_freeClient(Clients* client)
  */
 void MQTTProtocol_emptyMessageList(List* msgList)
 {
-	ListElement* current = NULL;
+	Messages* m = NULL;
 
 	FUNC_ENTRY;
-	while (ListNextElement(msgList, &current))
+	while ((m = ListDetachHead(msgList)) != NULL)
 	{
-		Messages* m = (Messages*)(current->content);
 		MQTTProtocol_removePublication(m->publish);
+		Pool_free(POOL_MESSAGES, m);
 	}
 	ListEmpty(msgList);
 	FUNC_EXIT;
@@ -29,6 +29,9 @@
 #include <stdlib.h>
 
 #include "MQTTProtocolOut.h"
+#include "Resolver.h"
+#include "Pool.h"
+#include "Probes.h"
 #include "StackTrace.h"
 #include "Heap.h"
 
@@ -74,6 +77,29 @@ char* MQTTProtocol_addressPort(const char* uri, int* port)
 }
 
 
+/**
+ * Look up the host name of a server, without blocking.  When this returns
+ * TCPSOCKET_INTERRUPTED, call it again after the resolver's completion callback.
+ * @param ip_address the TCP address:port to connect to
+ * @return 0 if the connect can be started now, TCPSOCKET_INTERRUPTED if the
+ * lookup is in progress, SOCKET_ERROR if it failed
+ */
+int MQTTProtocol_resolve(const char* ip_address)
+{
+	Resolver_addresses addresses;
+	int rc, port;
+	char* addr;
+
+	FUNC_ENTRY;
+	addr = MQTTProtocol_addressPort(ip_address, &port);
+	rc = Resolver_lookup((addr[0] == '[') ? addr + 1 : addr, &addresses);
+	if (addr != ip_address)
+		free(addr);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * MQTT outgoing connect processing for a client
  * @param ip_address the TCP address:port to connect to
@@ -93,6 +119,7 @@ int MQTTProtocol_connect(const char* ip_address, Clients* aClient, int MQTTVersi
 
 	FUNC_ENTRY;
 	aClient->good = 1;
+	PROBE2(connect, aClient->clientID, ip_address);
 
 	addr = MQTTProtocol_addressPort(ip_address, &port);
 	rc = Socket_new(addr, port, &(aClient->net.socket));
@@ -103,11 +130,15 @@ int MQTTProtocol_connect(const char* ip_address, Clients* aClient, int MQTTVersi
 #if defined(OPENSSL)
 		if (ssl)
 		{
-			if (SSLSocket_setSocketForSSL(&aClient->net, aClient->sslopts) == 1)
+			if (SSLSocket_setSocketForSSL(&aClient->net, aClient->sslopts, ip_address) == 1)
 			{
 				rc = SSLSocket_connect(aClient->net.ssl, aClient->net.socket);
-				if (rc == -1)
+				if (rc == TCPSOCKET_INTERRUPTED)
 					aClient->connect_state = 2; /* SSL connect called - wait for completion */
+				else if (rc == 1)
+					rc = 0; /* the handshake has already completed */
+				else
+					rc = SOCKET_ERROR;
 			}
 			else
 				rc = SOCKET_ERROR;
@@ -224,7 +255,7 @@ int MQTTProtocol_handleUnsubacks(void* pack, int sock)
 	FUNC_ENTRY;
 	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
 	Log(LOG_PROTOCOL, 24, NULL, sock, client->clientID, unsuback->msgId);
-	free(unsuback);
+	Pool_free(POOL_ACK, unsuback);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -30,6 +30,7 @@
 #define DEFAULT_PORT 1883
 
 void MQTTProtocol_reconnect(const char* ip_address, Clients* client);
+int MQTTProtocol_resolve(const char* ip_address);
 #if defined(OPENSSL)
 int MQTTProtocol_connect(const char* ip_address, Clients* acClients, int ssl, int MQTTVersion);
 #else
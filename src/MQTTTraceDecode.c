@@ -0,0 +1,192 @@
+/*******************************************************************************
+ * Copyright (c) 2012, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+/**
+ *
+ * @file
+ * \brief MQTTTraceDecode - turn a binary trace dump into text.
+ *
+ * Binary trace dumps are written by MQTTClient_dumpTrace and MQTTAsync_dumpTrace.  The text is
+ * the same as that written when tracing is switched on, with the times in the local time zone
+ * of the machine on which it is decoded.
+ *
+ *   MQTTTraceDecode [-l level] [dumpfile]
+ *
+ * reads standard input if no file is given.  The level, one of MAXIMUM, MEDIUM, MINIMUM,
+ * PROTOCOL, ERROR, SEVERE or FATAL, leaves out the entries below it.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(WIN32) || defined(WIN64)
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "TraceRecord.h"
+
+static const char* levels[] = {"MAXIMUM", "MEDIUM", "MINIMUM", "PROTOCOL", "ERROR", "SEVERE", "FATAL"};
+
+
+void usage(void)
+{
+	fprintf(stderr, "usage: MQTTTraceDecode [-l MAXIMUM|MEDIUM|MINIMUM|PROTOCOL|ERROR|SEVERE|FATAL] [dumpfile]\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/**
+ * Read the whole of a file.
+ * @param file the file
+ * @param len set to the length read
+ * @return the contents, or NULL if they could not be read
+ */
+unsigned char* readAll(FILE* file, size_t* len)
+{
+	unsigned char* buf = NULL;
+	size_t size = 0;
+	size_t n;
+
+	*len = 0;
+	do
+	{
+		if (*len == size)
+		{
+			unsigned char* newbuf = realloc(buf, size = size ? size * 2 : 65536);
+
+			if (newbuf == NULL)
+			{
+				free(buf);
+				return NULL;
+			}
+			buf = newbuf;
+		}
+		n = fread(&buf[*len], 1, size - *len, file);
+		*len += n;
+	} while (n > 0);
+	return buf;
+}
+
+
+int main(int argc, char** argv)
+{
+	FILE* file = stdin;
+	unsigned char* buf = NULL;
+	char** strings = NULL;
+	unsigned int string_count = 0;
+	long long start_seconds;
+	long start_micros;
+	size_t len, pos;
+	int min_level = 0;
+	int i, rc = EXIT_FAILURE;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+	{
+		if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+		{
+			for (min_level = 0; min_level < 7 && strcmp(argv[i + 1], levels[min_level]) != 0; ++min_level)
+				;
+			if (min_level++ == 7)
+				usage();
+			++i;
+		}
+		else
+			usage();
+	}
+	if (i < argc - 1)
+		usage();
+#if defined(WIN32) || defined(WIN64)
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	if (i == argc - 1 && (file = fopen(argv[i], "rb")) == NULL)
+	{
+		fprintf(stderr, "Unable to open %s\n", argv[i]);
+		exit(EXIT_FAILURE);
+	}
+	buf = readAll(file, &len);
+	if (file != stdin)
+		fclose(file);
+	if (buf == NULL || len < TRACE_FILE_HEADER_LENGTH || memcmp(buf, TRACE_FILE_MAGIC, TRACE_FILE_MAGIC_LENGTH) != 0)
+	{
+		fprintf(stderr, "Not a binary trace dump\n");
+		goto exit;
+	}
+	start_seconds = (long long)TraceRecord_readInt(&buf[TRACE_FILE_MAGIC_LENGTH], 8);
+	start_micros = (long)TraceRecord_readInt(&buf[TRACE_FILE_MAGIC_LENGTH + 8], 4);
+
+	for (pos = TRACE_FILE_HEADER_LENGTH; pos < len; )
+	{
+		if (buf[pos] == TRACE_RECORD_STRING && pos + 7 <= len)
+		{
+			unsigned int id = (unsigned int)TraceRecord_readInt(&buf[pos + 1], 4);
+			size_t slen = (size_t)TraceRecord_readInt(&buf[pos + 5], 2);
+			char** new_strings = NULL;
+
+			if (id != string_count || pos + 7 + slen > len ||
+					(new_strings = realloc(strings, (string_count + 1) * sizeof(char*))) == NULL)
+				break;
+			strings = new_strings;
+			if ((strings[string_count] = malloc(slen + 1)) == NULL)
+				break;
+			memcpy(strings[string_count], &buf[pos + 7], slen);
+			strings[string_count++][slen] = '\0';
+			pos += 7 + slen;
+		}
+		else if (buf[pos] == TRACE_RECORD_ENTRY && pos + TRACE_ENTRY_LENGTH <= len)
+		{
+			unsigned char* entry = &buf[pos];
+			unsigned int format_id = (unsigned int)TraceRecord_readInt(&entry[27], 4);
+			unsigned int name_id = (unsigned int)TraceRecord_readInt(&entry[31], 4);
+			TraceRecord record;
+			char msg_buf[512];
+			int msg_len;
+
+			record.args_len = (int)TraceRecord_readInt(&entry[35], 2);
+			if (pos + TRACE_ENTRY_LENGTH + record.args_len > len)
+				break;
+			pos += TRACE_ENTRY_LENGTH + record.args_len;
+			if (entry[2] < min_level)
+				continue;
+			record.has_rc = entry[1];
+			record.thread_id = (int)TraceRecord_readInt(&entry[11], 4);
+			record.depth = (int)TraceRecord_readInt(&entry[15], 4);
+			record.line = (int)TraceRecord_readInt(&entry[19], 4);
+			record.rc = (int)TraceRecord_readInt(&entry[23], 4);
+			record.format = (format_id < string_count) ? strings[format_id] : NULL;
+			record.name = (name_id < string_count) ? strings[name_id] : "";
+			record.args = &entry[TRACE_ENTRY_LENGTH];
+			msg_len = TraceRecord_formatTime(start_seconds, start_micros,
+					(long long)TraceRecord_readInt(&entry[3], 8), msg_buf, sizeof(msg_buf));
+			TraceRecord_format(&record, &msg_buf[msg_len], sizeof(msg_buf) - msg_len);
+			printf("%s\n", msg_buf);
+		}
+		else
+			break;
+	}
+	if (pos < len)
+		fprintf(stderr, "The trace dump is damaged at offset %lu\n", (unsigned long)pos);
+	else
+		rc = EXIT_SUCCESS;
+
+exit:
+	while (string_count > 0)
+		free(strings[--string_count]);
+	free(strings);
+	free(buf);
+	return rc;
+}
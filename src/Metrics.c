@@ -0,0 +1,485 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Counters and latency histograms for each client
+ *
+ * Counters are updated on the library's hot paths, so each thread updates a copy of its own
+ * where it can: each thread is given one of METRICS_SLOTS cache line aligned slots, round
+ * robin, the first time it updates a counter, and the copies are summed when they are read.
+ * Threads which share a slot still count correctly, as the updates are atomic, but they
+ * contend for the cache line.
+ *
+ * Histograms are shared by all threads and log-linear: see METRICS_BUCKETS.
+ */
+
+#include "Metrics.h"
+#include "MQTTPacket.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(WIN32) || defined(WIN64)
+#include <windows.h>
+#define thread_local __declspec(thread)
+#define Metrics_atomicAdd(p, v) InterlockedExchangeAdd64((p), (v))
+#define Metrics_atomicCas(p, old, new) (InterlockedCompareExchange64((p), (new), (old)) == (old))
+#else
+#include <sys/time.h>
+#define thread_local __thread
+#if defined(__ATOMIC_RELAXED)
+#define Metrics_atomicAdd(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#else
+#define Metrics_atomicAdd(p, v) __sync_fetch_and_add((p), (v))
+#endif
+#define Metrics_atomicCas(p, old, new) __sync_bool_compare_and_swap((p), (old), (new))
+#endif
+
+#include "Heap.h"
+
+static thread_local int thread_slot = -1;
+static volatile long next_slot = 0;
+
+
+/**
+ * Allocate the metrics for a client, all zero
+ * @return the metrics, or NULL if there is no memory
+ */
+Metrics* Metrics_create(void)
+{
+	char* block = malloc(sizeof(Metrics) + METRICS_CACHE_LINE);
+	Metrics* metrics = NULL;
+
+	if (block)
+	{
+		metrics = (Metrics*)(block + METRICS_CACHE_LINE - ((size_t)block % METRICS_CACHE_LINE));
+		memset(metrics, '\0', sizeof(Metrics));
+		metrics->allocated = block;
+	}
+	return metrics;
+}
+
+
+/**
+ * Free the metrics for a client
+ * @param metrics the metrics, or NULL
+ */
+void Metrics_free(Metrics* metrics)
+{
+	if (metrics)
+		free(metrics->allocated);
+}
+
+
+static int Metrics_threadSlot(void)
+{
+	if (thread_slot == -1)
+#if defined(WIN32) || defined(WIN64)
+		thread_slot = (InterlockedIncrement(&next_slot) - 1) % METRICS_SLOTS;
+#else
+		thread_slot = (int)(__sync_fetch_and_add(&next_slot, 1) % METRICS_SLOTS);
+#endif
+	return thread_slot;
+}
+
+
+/**
+ * Add to a counter
+ * @param metrics the client's metrics, or NULL if there are none
+ * @param counter one of METRIC_COUNTERS
+ * @param value the amount to add
+ */
+void Metrics_add(Metrics* metrics, int counter, long long value)
+{
+	if (metrics)
+		Metrics_atomicAdd(&metrics->slots[Metrics_threadSlot()].counters[counter], value);
+}
+
+
+/**
+ * Get the value of a counter, summed over all the threads
+ * @param metrics the client's metrics
+ * @param counter one of METRIC_COUNTERS
+ * @return the value
+ */
+long long Metrics_get(Metrics* metrics, int counter)
+{
+	long long total = 0;
+	int i;
+
+	for (i = 0; metrics && i < METRICS_SLOTS; ++i)
+		total += metrics->slots[i].counters[counter];
+	return total;
+}
+
+
+/**
+ * Get the time from a monotonic clock, to start a latency measurement
+ * @return the time in nanoseconds from an arbitrary start point
+ */
+long long Metrics_now(void)
+{
+#if defined(WIN32) || defined(WIN64)
+	static LARGE_INTEGER frequency = {0};
+	LARGE_INTEGER now;
+
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+	return (long long)(now.QuadPart * (1000000000.0 / frequency.QuadPart));
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (long long)now.tv_sec * 1000000000 + now.tv_usec * 1000;
+#endif
+}
+
+
+static int Metrics_bucket(long long value)
+{
+	int bucket, msb = 0;
+
+	if (value < 4)
+		return (value < 0) ? 0 : (int)value;
+	while ((value >> msb) > 1)
+		msb++;
+	/* the power of two, and the next two bits below it */
+	bucket = (msb - 1) * 4 + (int)((value >> (msb - 2)) & 3);
+	return (bucket >= METRICS_BUCKETS) ? METRICS_BUCKETS - 1 : bucket;
+}
+
+
+/**
+ * The upper limit of a histogram bucket
+ * @param bucket the bucket
+ * @return the lowest value which is above the bucket
+ */
+long long Metrics_bucketLimit(int bucket)
+{
+	if (bucket < 4)
+		return bucket + 1;
+	return (long long)(4 + bucket % 4 + 1) << (bucket / 4 - 1);
+}
+
+
+/**
+ * Record the time taken by an operation in a histogram
+ * @param metrics the client's metrics, or NULL if there are none
+ * @param histogram one of METRIC_HISTOGRAMS
+ * @param start the value of Metrics_now when the operation started
+ */
+void Metrics_record(Metrics* metrics, int histogram, long long start)
+{
+	if (metrics)
+		Metrics_recordValue(metrics, histogram, Metrics_now() - start);
+}
+
+
+/**
+ * Record a time in a histogram
+ * @param metrics the client's metrics, or NULL if there are none
+ * @param histogram one of METRIC_HISTOGRAMS
+ * @param value the time in nanoseconds
+ */
+void Metrics_recordValue(Metrics* metrics, int histogram, long long value)
+{
+	Metrics_histogram* h = NULL;
+	long long max;
+
+	if (metrics == NULL)
+		return;
+	h = &metrics->histograms[histogram];
+	Metrics_atomicAdd(&h->buckets[Metrics_bucket(value)], 1);
+	Metrics_atomicAdd(&h->sum, value);
+	Metrics_atomicAdd(&h->count, 1);
+	while (value > (max = h->max) && !Metrics_atomicCas(&h->max, max, value))
+		;
+}
+
+
+/**
+ * Record the stages of a completed publication in the stage histograms.  Stages which
+ * were not reached, such as the acknowledgement of a QoS 0 message, have a time of 0 and
+ * are skipped.
+ * @param metrics the client's metrics, or NULL if there are none
+ * @param stamps the time of each of the STAGE_COUNT stages, from Metrics_now
+ */
+void Metrics_recordStages(Metrics* metrics, long long* stamps)
+{
+	int i, previous = STAGE_ENQUEUED;
+
+	for (i = STAGE_DEQUEUED; i < STAGE_COUNT; ++i)
+	{
+		if (stamps[i] == 0)
+			continue;
+		Metrics_recordValue(metrics, METRIC_STAGE + i, stamps[i] - stamps[previous]);
+		previous = i;
+	}
+	Metrics_recordValue(metrics, METRIC_STAGE + STAGE_ENQUEUED, stamps[STAGE_CALLBACK] - stamps[STAGE_ENQUEUED]);
+}
+
+
+/**
+ * Copy a histogram.  Updates can be in progress, so the copy may be inconsistent by
+ * the few operations being recorded while it is taken.
+ * @param metrics the client's metrics
+ * @param histogram one of METRIC_HISTOGRAMS
+ * @param snapshot the copy
+ */
+void Metrics_getHistogram(Metrics* metrics, int histogram, Metrics_histogram* snapshot)
+{
+	int i;
+
+	memset(snapshot, '\0', sizeof(Metrics_histogram));
+	if (metrics == NULL)
+		return;
+	for (i = 0; i < METRICS_BUCKETS; ++i)
+	{
+		snapshot->buckets[i] = metrics->histograms[histogram].buckets[i];
+		snapshot->count += snapshot->buckets[i];
+	}
+	snapshot->sum = metrics->histograms[histogram].sum;
+	snapshot->max = metrics->histograms[histogram].max;
+}
+
+
+/**
+ * Estimate a percentile from a histogram, as the upper limit of the bucket it is in
+ * @param histogram the histogram
+ * @param fraction the percentile, from 0 to 1
+ * @return the value in nanoseconds, or 0 if the histogram is empty
+ */
+long long Metrics_percentile(Metrics_histogram* histogram, double fraction)
+{
+	long long target = (long long)(fraction * histogram->count + 0.5), seen = 0;
+	int i;
+
+	if (histogram->count == 0)
+		return 0;
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < METRICS_BUCKETS; ++i)
+	{
+		if ((seen += histogram->buckets[i]) >= target)
+			return (Metrics_bucketLimit(i) < histogram->max) ? Metrics_bucketLimit(i) : histogram->max;
+	}
+	return histogram->max;
+}
+
+
+/** Text being written into a caller's buffer, which keeps counting when the buffer is full */
+typedef struct
+{
+	char* buffer;
+	int buflen;
+	int len;	/**< the length of the whole text so far */
+} Metrics_text;
+
+
+static void Metrics_print(Metrics_text* text, const char* format, ...)
+{
+	va_list args;
+	int rc;
+	int space = (text->len < text->buflen) ? text->buflen - text->len : 0;
+
+	va_start(args, format);
+	rc = vsnprintf(space ? &text->buffer[text->len] : NULL, space, format, args);
+	va_end(args);
+	if (rc > 0)
+		text->len += rc;
+}
+
+
+/**
+ * Write a client id as an OpenMetrics label, escaping backslashes, quotes and newlines
+ * @param text the text to add to
+ * @param clientID the client id
+ */
+static void Metrics_printLabel(Metrics_text* text, const char* clientID)
+{
+	Metrics_print(text, "{client_id=\"");
+	for (; *clientID; ++clientID)
+	{
+		if (*clientID == '\\' || *clientID == '"')
+			Metrics_print(text, "\\%c", *clientID);
+		else if (*clientID == '\n')
+			Metrics_print(text, "\\n");
+		else
+			Metrics_print(text, "%c", *clientID);
+	}
+	Metrics_print(text, "\"");
+}
+
+
+static void Metrics_printFamily(Metrics_text* text, const char* name, const char* type, const char* help)
+{
+	Metrics_print(text, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+
+/**
+ * Write the samples of one client's histogram, merging the buckets so that each power
+ * of two nanoseconds is one OpenMetrics bucket
+ * @param text the text to add to
+ * @param name the name of the metric family
+ * @param client the client
+ * @param stage the value of a stage label, or NULL for none
+ * @param histogram one of METRIC_HISTOGRAMS
+ */
+static void Metrics_printHistogram(Metrics_text* text, const char* name, Metrics_client* client,
+		const char* stage, int histogram)
+{
+	Metrics_histogram snapshot;
+	long long cumulative = 0;
+	int i;
+
+	Metrics_getHistogram(client->metrics, histogram, &snapshot);
+	for (i = 0; i <= METRICS_BUCKETS; ++i)
+	{
+		if (i < METRICS_BUCKETS)
+		{
+			cumulative += snapshot.buckets[i];
+			if (i % 4 != 3 || i == METRICS_BUCKETS - 1)
+				continue;
+		}
+		Metrics_print(text, "%s_bucket", name);
+		Metrics_printLabel(text, client->clientID);
+		if (stage)
+			Metrics_print(text, ",stage=\"%s\"", stage);
+		if (i < METRICS_BUCKETS)
+			Metrics_print(text, ",le=\"%.9g\"} %lld\n", Metrics_bucketLimit(i) / 1e9, cumulative);
+		else
+			Metrics_print(text, ",le=\"+Inf\"} %lld\n", snapshot.count);
+	}
+	Metrics_print(text, "%s_count", name);
+	Metrics_printLabel(text, client->clientID);
+	Metrics_print(text, (stage) ? ",stage=\"%s\"} %lld\n" : "%s} %lld\n", (stage) ? stage : "", snapshot.count);
+	Metrics_print(text, "%s_sum", name);
+	Metrics_printLabel(text, client->clientID);
+	Metrics_print(text, (stage) ? ",stage=\"%s\"} %.9f\n" : "%s} %.9f\n", (stage) ? stage : "", snapshot.sum / 1e9);
+}
+
+
+/**
+ * Write the metrics of a set of clients in the OpenMetrics text format.  Histogram buckets
+ * are merged so that each power of two nanoseconds is one OpenMetrics bucket.
+ * @param clients the clients
+ * @param count the number of clients
+ * @param buffer the buffer to write the text into
+ * @param buflen the length of the buffer.  The text is truncated if it does not fit, and
+ * is always null terminated if buflen > 0.
+ * @return the length of the whole text, not including the null terminator
+ */
+int Metrics_format(Metrics_client* clients, int count, char* buffer, int buflen)
+{
+	static const struct { int counter; const char* name; const char* help; } counters[] =
+	{
+		{METRIC_BYTES_IN, "paho_mqtt_received_bytes", "Bytes of MQTT packets received."},
+		{METRIC_BYTES_OUT, "paho_mqtt_sent_bytes", "Bytes of MQTT packets written to the socket."},
+		{METRIC_RETRIES, "paho_mqtt_retries", "PUBLISH and PUBREL packets resent."},
+		{METRIC_PARTIAL_WRITES, "paho_mqtt_partial_writes", "Packets which could not be written to the socket in one go."},
+	};
+	static const struct { int gauge; const char* name; const char* help; } gauges[] =
+	{
+		{METRIC_QUEUED_MESSAGES, "paho_mqtt_queued_messages", "Messages received but not yet delivered to the application."},
+		{METRIC_INFLIGHT_MESSAGES, "paho_mqtt_inflight_messages", "Outbound QoS 1 and 2 messages not yet completed."},
+		{METRIC_INBOUND_MESSAGES, "paho_mqtt_inbound_messages", "Inbound QoS 2 messages not yet completed."},
+		{METRIC_PENDING_WRITE_BYTES, "paho_mqtt_pending_write_bytes", "Bytes of a partly written packet still to be written."},
+		{METRIC_QUEUED_COMMANDS, "paho_mqtt_queued_commands", "API calls waiting to be sent."},
+	};
+	static const char* stage_names[] =
+		{"total", "dequeued", "persisted", "write_started", "written", "acknowledged", "callback"};
+	static const struct { int histogram; const char* name; const char* help; } histograms[] =
+	{
+		{METRIC_PERSISTENCE_PUT, "paho_mqtt_persistence_put_seconds", "Time taken to persist messages."},
+		{METRIC_PERSISTENCE_REMOVE, "paho_mqtt_persistence_remove_seconds", "Time taken to remove messages from persistence."},
+		{METRIC_CALLBACK, "paho_mqtt_callback_seconds", "Time spent in the message arrived and delivery complete callbacks."},
+	};
+	Metrics_text text = {buffer, buflen, 0};
+	int i, j, k;
+
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+	{
+		Metrics_printFamily(&text, counters[i].name, "counter", counters[i].help);
+		for (j = 0; j < count; ++j)
+		{
+			Metrics_print(&text, "%s_total", counters[i].name);
+			Metrics_printLabel(&text, clients[j].clientID);
+			Metrics_print(&text, "} %lld\n", Metrics_get(clients[j].metrics, counters[i].counter));
+		}
+	}
+
+	for (i = 0; i < 2; ++i)
+	{
+		const char* name = (i == 0) ? "paho_mqtt_received_packets" : "paho_mqtt_sent_packets";
+
+		Metrics_printFamily(&text, name, "counter", (i == 0) ? "MQTT packets received." : "MQTT packets written to the socket.");
+		for (j = 0; j < count; ++j)
+		{
+			for (k = CONNECT; k <= DISCONNECT; ++k)
+			{
+				Metrics_print(&text, "%s_total", name);
+				Metrics_printLabel(&text, clients[j].clientID);
+				Metrics_print(&text, ",type=\"%s\"} %lld\n", MQTTPacket_name(k),
+					Metrics_get(clients[j].metrics, ((i == 0) ? METRIC_PACKETS_IN : METRIC_PACKETS_OUT) + k));
+			}
+		}
+	}
+
+	for (i = 0; i < sizeof(gauges) / sizeof(gauges[0]); ++i)
+	{
+		Metrics_printFamily(&text, gauges[i].name, "gauge", gauges[i].help);
+		for (j = 0; j < count; ++j)
+		{
+			if (clients[j].gauges[gauges[i].gauge] < 0)
+				continue;
+			Metrics_print(&text, "%s", gauges[i].name);
+			Metrics_printLabel(&text, clients[j].clientID);
+			Metrics_print(&text, "} %d\n", clients[j].gauges[gauges[i].gauge]);
+		}
+	}
+
+	for (i = 0; i < sizeof(histograms) / sizeof(histograms[0]); ++i)
+	{
+		Metrics_printFamily(&text, histograms[i].name, "histogram", histograms[i].help);
+		for (j = 0; j < count; ++j)
+			Metrics_printHistogram(&text, histograms[i].name, &clients[j], NULL, histograms[i].histogram);
+	}
+
+	/* the stage histograms are only written for clients which trace latency */
+	Metrics_printFamily(&text, "paho_mqtt_publish_stage_seconds", "histogram",
+		"Time taken to reach each stage of a publication from the previous one, and in total.");
+	for (j = 0; j < count; ++j)
+	{
+		if (clients[j].metrics == NULL || clients[j].metrics->histograms[METRIC_STAGE + STAGE_ENQUEUED].count == 0)
+			continue;
+		for (k = 0; k < STAGE_COUNT; ++k)
+			Metrics_printHistogram(&text, "paho_mqtt_publish_stage_seconds", &clients[j], stage_names[k], METRIC_STAGE + k);
+	}
+
+	Metrics_print(&text, "# EOF\n");
+	return text.len;
+}
@@ -0,0 +1,126 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#if !defined(METRICS_H)
+#define METRICS_H
+
+/** the counters kept for each client */
+enum METRIC_COUNTERS
+{
+	METRIC_BYTES_IN,
+	METRIC_BYTES_OUT,
+	METRIC_RETRIES,			/**< PUBLISH and PUBREL packets resent by MQTTProtocol_retries */
+	METRIC_PARTIAL_WRITES,	/**< packets which could not be written to the socket in one go */
+	METRIC_PACKETS_IN,		/**< the first of 16, one for each packet type */
+	METRIC_PACKETS_OUT = METRIC_PACKETS_IN + 16,
+	METRIC_COUNTER_COUNT = METRIC_PACKETS_OUT + 16
+};
+
+/**
+ * The stages of a publication which are timed when latency tracing is on.  These must match
+ * MQTTASYNC_PUBLISH_STAGES in MQTTAsync.h.
+ */
+enum METRIC_STAGES
+{
+	STAGE_ENQUEUED,
+	STAGE_DEQUEUED,
+	STAGE_PERSISTED,
+	STAGE_WRITE_STARTED,
+	STAGE_WRITTEN,
+	STAGE_ACKNOWLEDGED,
+	STAGE_CALLBACK,
+	STAGE_COUNT
+};
+
+/** the latency histograms kept for each client */
+enum METRIC_HISTOGRAMS
+{
+	METRIC_PERSISTENCE_PUT,
+	METRIC_PERSISTENCE_REMOVE,
+	METRIC_CALLBACK,		/**< time spent in the application's callbacks */
+	/** the first of STAGE_COUNT: the time to each stage of a publication from the previous one
+	 * recorded, except for STAGE_ENQUEUED, which is the time from enqueue to callback */
+	METRIC_STAGE,
+	METRIC_HISTOGRAM_COUNT = METRIC_STAGE + STAGE_COUNT
+};
+
+/** the gauges reported for each client, which are read from its state when they are needed */
+enum METRIC_GAUGES
+{
+	METRIC_QUEUED_MESSAGES,		/**< messages received but not yet delivered to the application */
+	METRIC_INFLIGHT_MESSAGES,	/**< outbound QoS 1 and 2 messages not yet completed */
+	METRIC_INBOUND_MESSAGES,	/**< inbound QoS 2 messages not yet completed */
+	METRIC_PENDING_WRITE_BYTES,	/**< the bytes of a partly written packet still to be written */
+	METRIC_QUEUED_COMMANDS,		/**< MQTTAsync API calls waiting to be sent, or -1 for MQTTClient */
+	METRIC_GAUGE_COUNT
+};
+
+/** the number of per-thread copies of the counters */
+#define METRICS_SLOTS 8
+
+#define METRICS_CACHE_LINE 64
+
+/**
+ * The number of histogram buckets.  Values below 4 have a bucket each.  Above that, each
+ * power of two is split into 4 buckets, so a value is placed to within 25%, up to 2^37
+ * nanoseconds (about 137 seconds), beyond which everything goes in the last bucket.
+ */
+#define METRICS_BUCKETS 144
+
+/** One thread's copy of the counters, a whole number of cache lines long */
+typedef union
+{
+	volatile long long counters[METRIC_COUNTER_COUNT];
+	char pad[(METRIC_COUNTER_COUNT * sizeof(long long) + METRICS_CACHE_LINE - 1) / METRICS_CACHE_LINE * METRICS_CACHE_LINE];
+} Metrics_slot;
+
+typedef struct
+{
+	volatile long long count;
+	volatile long long sum;		/**< nanoseconds */
+	volatile long long max;		/**< nanoseconds */
+	volatile long long buckets[METRICS_BUCKETS];
+} Metrics_histogram;
+
+typedef struct
+{
+	Metrics_slot slots[METRICS_SLOTS];
+	Metrics_histogram histograms[METRIC_HISTOGRAM_COUNT];
+	void* allocated;		/**< the block to free, of which this is the cache line aligned part */
+} Metrics;
+
+/** A client's metrics, as passed to Metrics_format */
+typedef struct
+{
+	const char* clientID;
+	Metrics* metrics;
+	int gauges[METRIC_GAUGE_COUNT];
+} Metrics_client;
+
+Metrics* Metrics_create(void);
+void Metrics_free(Metrics* metrics);
+void Metrics_add(Metrics* metrics, int counter, long long value);
+long long Metrics_get(Metrics* metrics, int counter);
+long long Metrics_now(void);
+void Metrics_record(Metrics* metrics, int histogram, long long start);
+void Metrics_recordValue(Metrics* metrics, int histogram, long long value);
+void Metrics_recordStages(Metrics* metrics, long long* stamps);
+void Metrics_getHistogram(Metrics* metrics, int histogram, Metrics_histogram* snapshot);
+long long Metrics_bucketLimit(int bucket);
+long long Metrics_percentile(Metrics_histogram* histogram, double fraction);
+int Metrics_format(Metrics_client* clients, int count, char* buffer, int buflen);
+
+#endif
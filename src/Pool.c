@@ -0,0 +1,255 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Pools of fixed size structures, to avoid a malloc and free for each message
+ *
+ * Each pool hands out items of one structure type from slabs, which are allocated
+ * as needed and kept until the library is terminated, so once the number of messages
+ * in flight has levelled off, allocating and freeing these structures no longer
+ * touches the heap.
+ *
+ * Pools are off until Pool_enable is called.  Until then Pool_malloc just calls malloc.
+ * Pool_free works out from the address whether an item came from a pool, so items
+ * allocated before the pools were enabled can be freed the same way.
+ */
+
+#include "Pool.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Thread.h"
+
+#include <string.h>
+
+#include "Heap.h"
+
+#define POOL_FIRST_SLAB_ITEMS 64
+#define POOL_MAX_SLAB_ITEMS 4096
+
+/** Free items are chained through their first bytes */
+typedef struct pool_item_s
+{
+	struct pool_item_s* next;
+} pool_item;
+
+/** A slab is a single allocation holding this header followed by the items */
+typedef struct pool_slab_s
+{
+	struct pool_slab_s* next;
+	char* start;	/**< the first item */
+	char* end;		/**< just past the last item */
+} pool_slab;
+
+typedef struct
+{
+	mutex_type mutex;
+	size_t size;			/**< item size, fixed by the first allocation */
+	pool_item* free_items;
+	pool_slab* slabs;
+	int next_slab_items;	/**< number of items to put in the next slab */
+	pool_info info;
+} pool;
+
+#if defined(WIN32) || defined(WIN64)
+static pool pools[POOL_TYPE_COUNT];
+#else
+static pthread_mutex_t pool_mutexes[POOL_TYPE_COUNT] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+static pool pools[POOL_TYPE_COUNT] =
+{
+	{&pool_mutexes[POOL_LISTELEMENT]}, {&pool_mutexes[POOL_MESSAGES]}, {&pool_mutexes[POOL_PUBLICATIONS]},
+	{&pool_mutexes[POOL_PUBLISH]}, {&pool_mutexes[POOL_ACK]}, {&pool_mutexes[POOL_COMMAND]}
+};
+#endif
+
+static int enabled = 0;
+
+
+/**
+ * Pool initialization.
+ */
+void Pool_initialize(void)
+{
+#if defined(WIN32) || defined(WIN64)
+	int i;
+
+	for (i = 0; i < POOL_TYPE_COUNT; ++i)
+	{
+		if (pools[i].mutex == NULL)
+			pools[i].mutex = CreateMutex(NULL, 0, NULL);
+	}
+#endif
+}
+
+
+/**
+ * Start allocating from the pools.  They stay on until Pool_terminate.
+ */
+void Pool_enable(void)
+{
+	enabled = 1;
+}
+
+
+/**
+ * Pool termination.  The slabs are freed, unless some of their items have not been.
+ */
+void Pool_terminate(void)
+{
+	int i;
+
+	FUNC_ENTRY;
+	enabled = 0;
+	for (i = 0; i < POOL_TYPE_COUNT; ++i)
+	{
+		pool* p = &pools[i];
+
+		if (p->info.in_use > 0)
+		{
+			Log(LOG_ERROR, -1, "%d items of pool type %d not freed at shutdown, possible memory leak", p->info.in_use, i);
+			continue;
+		}
+		while (p->slabs)
+		{
+			pool_slab* slab = p->slabs;
+			p->slabs = slab->next;
+			free(slab);
+		}
+		p->free_items = NULL;
+		p->next_slab_items = 0;
+		memset(&p->info, '\0', sizeof(p->info));
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Add a slab of free items to a pool.  The pool must be locked.
+ * @param p the pool
+ * @return 0 on success, -1 if the slab could not be allocated
+ */
+static int Pool_grow(pool* p)
+{
+	pool_slab* slab = NULL;
+	size_t header = (sizeof(pool_slab) + p->size - 1) / p->size * p->size; /* keep the items aligned */
+	int i, rc = -1;
+
+	if (p->next_slab_items == 0)
+		p->next_slab_items = POOL_FIRST_SLAB_ITEMS;
+	if ((slab = malloc(header + p->next_slab_items * p->size)) == NULL)
+		goto exit;
+	slab->start = ((char*)slab) + header;
+	slab->end = slab->start + p->next_slab_items * p->size;
+	slab->next = p->slabs;
+	p->slabs = slab;
+	for (i = p->next_slab_items - 1; i >= 0; --i)
+	{
+		pool_item* item = (pool_item*)(slab->start + i * p->size);
+		item->next = p->free_items;
+		p->free_items = item;
+	}
+	p->info.capacity += p->next_slab_items;
+	p->info.slabs++;
+	if (p->next_slab_items < POOL_MAX_SLAB_ITEMS)
+		p->next_slab_items *= 2;
+	rc = 0;
+exit:
+	return rc;
+}
+
+
+/**
+ * Allocate an item, from its pool if the pools are enabled.
+ * @param type the pool type, one of ::POOL_TYPES
+ * @param size the size of the structure
+ * @return pointer to the item, or NULL if there was an error
+ */
+void* Pool_malloc(int type, size_t size)
+{
+	pool* p = &pools[type];
+	void* rc = NULL;
+
+	if (!enabled)
+		return malloc(size);
+
+	Thread_lock_mutex(p->mutex);
+	if (p->size == 0)
+	{
+		/* big enough and aligned for the free chain, a pointer or a double */
+		size_t align = (sizeof(double) > sizeof(void*)) ? sizeof(double) : sizeof(void*);
+		p->size = (size + align - 1) / align * align;
+	}
+	if (size <= p->size && (p->free_items != NULL || Pool_grow(p) == 0))
+	{
+		rc = p->free_items;
+		p->free_items = p->free_items->next;
+		p->info.in_use++;
+	}
+	Thread_unlock_mutex(p->mutex);
+	if (rc == NULL)
+		rc = malloc(size); /* not a fatal problem: Pool_free can tell the difference */
+	return rc;
+}
+
+
+/**
+ * Free an item allocated with Pool_malloc, returning it to its pool if it came from one.
+ * @param type the pool type, one of ::POOL_TYPES
+ * @param item pointer to the item
+ */
+void Pool_free(int type, void* item)
+{
+	pool* p = &pools[type];
+	pool_slab* slab = NULL;
+
+	if (item == NULL)
+		return;
+	if (p->slabs != NULL) /* slabs are only ever added while in use, or removed at termination */
+	{
+		Thread_lock_mutex(p->mutex);
+		for (slab = p->slabs; slab; slab = slab->next)
+		{
+			if ((char*)item >= slab->start && (char*)item < slab->end)
+			{
+				pool_item* pi = (pool_item*)item;
+
+				pi->next = p->free_items;
+				p->free_items = pi;
+				p->info.in_use--;
+				break;
+			}
+		}
+		Thread_unlock_mutex(p->mutex);
+	}
+	if (slab == NULL)
+		free(item);
+}
+
+
+/**
+ * Get the statistics for a pool
+ * @param type the pool type, one of ::POOL_TYPES
+ * @param info the structure to copy the statistics into
+ */
+void Pool_get_info(int type, pool_info* info)
+{
+	pool* p = &pools[type];
+
+	Thread_lock_mutex(p->mutex);
+	*info = p->info;
+	Thread_unlock_mutex(p->mutex);
+}
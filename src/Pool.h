@@ -0,0 +1,53 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#if !defined(POOL_H)
+#define POOL_H
+
+#include <stdlib.h>
+
+/**
+ * The structures which can be allocated from pools.  Each has its own pool.
+ */
+enum POOL_TYPES
+{
+	POOL_LISTELEMENT,	/**< ListElement */
+	POOL_MESSAGES,		/**< Messages */
+	POOL_PUBLICATIONS,	/**< Publications */
+	POOL_PUBLISH,		/**< Publish packets */
+	POOL_ACK,			/**< Ack packets: Puback, Pubrec, Pubrel, Pubcomp, Unsuback */
+	POOL_COMMAND,		/**< MQTTAsync_queuedCommand */
+	POOL_TYPE_COUNT
+};
+
+/**
+ * Pool statistics for one type
+ */
+typedef struct
+{
+	int in_use;		/**< number of items currently allocated from the pool */
+	int capacity;	/**< number of items in the pool's slabs */
+	int slabs;		/**< number of slabs allocated */
+} pool_info;
+
+void Pool_initialize(void);
+void Pool_terminate(void);
+void Pool_enable(void);
+void* Pool_malloc(int type, size_t size);
+void Pool_free(int type, void* p);
+void Pool_get_info(int type, pool_info* info);
+
+#endif
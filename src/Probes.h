@@ -0,0 +1,60 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Static tracepoints for bpftrace, SystemTap and perf
+ *
+ * When the library is built with PAHO_USDT defined (make USDT=1, or cmake -DPAHO_WITH_USDT=TRUE),
+ * each PROBE macro becomes a USDT probe of the provider paho_mqtt, using sys/sdt.h.  That header
+ * only emits a nop instruction and an ELF note for each probe, so there is no runtime dependency,
+ * and a probe costs next to nothing until a tracer attaches to it.  Otherwise the macros are empty.
+ *
+ * The probes and their arguments are:
+ *
+ * - packet__received(int socket, int packet type, int length)
+ * - packet__sent(int socket, int packet type, int length), when the packet has been handed to the socket
+ * - partial__write(int socket, int length), when a packet could not be written in one go
+ * - command__queued(char* client id, int command type, int token), MQTTAsync only
+ * - command__dequeued(char* client id, int command type, int token), MQTTAsync only
+ * - persistence__put__entry(char* key) and persistence__put__return(char* key, int rc)
+ * - persistence__remove__entry(char* key) and persistence__remove__return(char* key, int rc)
+ * - connect(char* client id, char* address), when a TCP connect is started
+ * - disconnect(char* client id), when a connection is closed
+ * - callback__entry(char* client id, char* callback name) and callback__return(char* client id,
+ *   char* callback name), around the messageArrived and deliveryComplete callbacks
+ *
+ * For example:
+ *
+ *     bpftrace -e 'usdt:/usr/local/lib/libpaho-mqtt3a.so:paho_mqtt:partial__write { @[arg0] = count(); }'
+ */
+
+#if !defined(PROBES_H)
+#define PROBES_H
+
+#if defined(PAHO_USDT)
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(paho_mqtt, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(paho_mqtt, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(paho_mqtt, name, a, b, c)
+#else
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
+#endif
@@ -0,0 +1,336 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Host name resolution, away from the thread doing the network I/O
+ *
+ * getaddrinfo can block for as long as the resolver's timeout.  Resolver_lookup
+ * never does: a host name which is not in the cache is looked up on a thread of
+ * its own, and the completion callback is called when the result is in the cache,
+ * so the caller can try again.
+ *
+ * getaddrinfo does not tell us the TTLs of the DNS records, so successful results
+ * are kept for RESOLVER_TTL seconds, and failures for RESOLVER_FAILURE_TTL seconds.
+ * Numeric addresses are converted immediately and not cached.
+ */
+
+#include "Resolver.h"
+#include "LinkedList.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Heap.h"
+
+#if !defined(WIN32) && !defined(WIN64)
+#define WINAPI
+#endif
+
+enum { RESOLVING, RESOLVED, FAILED };
+
+typedef struct
+{
+	char* host;
+	int state;			/**< RESOLVING, RESOLVED or FAILED */
+	time_t expires;		/**< when a RESOLVED or FAILED entry is no longer used */
+	Resolver_addresses addresses;
+} resolver_entry;
+
+static List* cache = NULL;
+static Resolver_complete* complete = NULL;
+
+#if defined(WIN32) || defined(WIN64)
+static mutex_type resolver_mutex = NULL;
+#else
+static pthread_mutex_t resolver_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type resolver_mutex = &resolver_mutex_store;
+#endif
+
+
+/**
+ * Resolver initialization.
+ */
+void Resolver_initialize(void)
+{
+#if defined(WIN32) || defined(WIN64)
+	if (resolver_mutex == NULL)
+		resolver_mutex = CreateMutex(NULL, 0, NULL);
+#endif
+}
+
+
+/**
+ * Set the function to call when a lookup started by Resolver_lookup has finished
+ * @param callback the function, called on the resolver thread
+ */
+void Resolver_setCompleteCallback(Resolver_complete* callback)
+{
+	complete = callback;
+}
+
+
+/**
+ * Call getaddrinfo for a host name
+ * @param host the host name or numeric address
+ * @param flags the getaddrinfo hints flags
+ * @param addresses the structure to put the results in
+ * @return 0 on success, otherwise the getaddrinfo return code
+ */
+static int Resolver_getaddrinfo(const char* host, int flags, Resolver_addresses* addresses)
+{
+	struct addrinfo* result = NULL;
+	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+	int rc;
+
+	hints.ai_flags = flags;
+	addresses->count = 0;
+	if ((rc = getaddrinfo(host, NULL, &hints, &result)) == 0)
+	{
+		struct addrinfo* res;
+
+		for (res = result; res && addresses->count < RESOLVER_MAX_ADDRESSES; res = res->ai_next)
+		{
+			if ((res->ai_family != AF_INET
+#if defined(AF_INET6)
+				&& res->ai_family != AF_INET6
+#endif
+				) || res->ai_addrlen > sizeof(struct sockaddr_storage))
+				continue;
+			addresses->addrs[addresses->count].family = res->ai_family;
+			addresses->addrs[addresses->count].len = (socklen_t)res->ai_addrlen;
+			memcpy(&addresses->addrs[addresses->count].addr, res->ai_addr, res->ai_addrlen);
+			addresses->count++;
+		}
+		freeaddrinfo(result);
+		if (addresses->count == 0)
+			rc = EAI_FAMILY;
+	}
+	return rc;
+}
+
+
+static char* Resolver_strdup(const char* src)
+{
+	size_t len = strlen(src) + 1;
+	char* dest = malloc(len);
+
+	memcpy(dest, src, len);
+	return dest;
+}
+
+
+static int Resolver_hostCompare(void* a, void* b)
+{
+	return strcmp(((resolver_entry*)a)->host, (char*)b) == 0;
+}
+
+
+/**
+ * Find the cache entry for a host name, removing any entries which have expired.
+ * The resolver mutex must be held.
+ * @param host the host name
+ * @return the entry, or NULL if there is none
+ */
+static resolver_entry* Resolver_find(const char* host)
+{
+	ListElement* current = NULL;
+	time_t now = time(NULL);
+
+	if (cache == NULL)
+		cache = ListInitialize();
+	current = cache->first;
+	while (current)
+	{
+		resolver_entry* entry = (resolver_entry*)(current->content);
+
+		current = current->next;
+		if (entry->state != RESOLVING && difftime(entry->expires, now) <= 0)
+		{
+			free(entry->host);
+			ListRemove(cache, entry);
+		}
+	}
+	current = ListFindItem(cache, (void*)host, Resolver_hostCompare);
+	return (current) ? (resolver_entry*)(current->content) : NULL;
+}
+
+
+/**
+ * Store the result of a lookup in its cache entry.  The resolver mutex must be held.
+ * @param entry the cache entry
+ * @param rc the getaddrinfo return code
+ * @param addresses the result of the lookup
+ */
+static void Resolver_store(resolver_entry* entry, int rc, Resolver_addresses* addresses)
+{
+	if (rc == 0)
+	{
+		entry->addresses = *addresses;
+		entry->state = RESOLVED;
+		entry->expires = time(NULL) + RESOLVER_TTL;
+	}
+	else
+	{
+		entry->state = FAILED;
+		entry->expires = time(NULL) + RESOLVER_FAILURE_TTL;
+	}
+}
+
+
+static thread_return_type WINAPI Resolver_thread(void* n)
+{
+	char* host = (char*)n;
+	Resolver_addresses addresses;
+	resolver_entry* entry = NULL;
+	int rc;
+
+	FUNC_ENTRY;
+	if ((rc = Resolver_getaddrinfo(host, 0, &addresses)) != 0)
+		Log(LOG_ERROR, -1, "getaddrinfo failed for addr %s with rc %d", host, rc);
+	Thread_lock_mutex(resolver_mutex);
+	if (cache && (entry = Resolver_find(host)) != NULL && entry->state == RESOLVING)
+		Resolver_store(entry, rc, &addresses);
+	Thread_unlock_mutex(resolver_mutex);
+	Log(TRACE_MIN, -1, "Lookup of %s complete, rc %d", host, rc);
+	free(host);
+	if (entry && complete)
+		(*complete)();
+	FUNC_EXIT;
+	return 0;
+}
+
+
+/**
+ * Get the addresses for a host name without blocking.  If they are not yet known,
+ * a lookup is started, and the completion callback will be called when it finishes.
+ * @param host the host name or numeric address
+ * @param addresses the structure to put the results in
+ * @return 0 if the addresses are known, TCPSOCKET_INTERRUPTED if the lookup
+ * is in progress, SOCKET_ERROR if the lookup failed
+ */
+int Resolver_lookup(const char* host, Resolver_addresses* addresses)
+{
+	resolver_entry* entry = NULL;
+	int rc = TCPSOCKET_INTERRUPTED;
+
+	FUNC_ENTRY;
+	if (Resolver_getaddrinfo(host, AI_NUMERICHOST, addresses) == 0)
+	{
+		rc = 0;
+		goto exit;
+	}
+	Thread_lock_mutex(resolver_mutex);
+	if ((entry = Resolver_find(host)) == NULL)
+	{
+		entry = malloc(sizeof(resolver_entry));
+		memset(entry, '\0', sizeof(resolver_entry));
+		entry->host = Resolver_strdup(host);
+		entry->state = RESOLVING;
+		ListAppend(cache, entry, sizeof(resolver_entry) + strlen(host) + 1);
+		Log(TRACE_MIN, -1, "Starting lookup of %s", host);
+		Thread_start(Resolver_thread, Resolver_strdup(host));
+	}
+	else if (entry->state == RESOLVED)
+	{
+		*addresses = entry->addresses;
+		rc = 0;
+	}
+	else if (entry->state == FAILED)
+		rc = SOCKET_ERROR;
+	Thread_unlock_mutex(resolver_mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Get the addresses for a host name, from the cache if possible, otherwise
+ * blocking until the lookup is complete
+ * @param host the host name or numeric address
+ * @param addresses the structure to put the results in
+ * @return 0 on success, SOCKET_ERROR if the lookup failed
+ */
+int Resolver_resolve(const char* host, Resolver_addresses* addresses)
+{
+	resolver_entry* entry = NULL;
+	int rc = SOCKET_ERROR;
+
+	FUNC_ENTRY;
+	if (Resolver_getaddrinfo(host, AI_NUMERICHOST, addresses) == 0)
+	{
+		rc = 0;
+		goto exit;
+	}
+	Thread_lock_mutex(resolver_mutex);
+	if ((entry = Resolver_find(host)) != NULL && entry->state != RESOLVING)
+	{
+		if (entry->state == RESOLVED)
+		{
+			*addresses = entry->addresses;
+			rc = 0;
+		}
+		Thread_unlock_mutex(resolver_mutex);
+		goto exit;
+	}
+	Thread_unlock_mutex(resolver_mutex);
+
+	if ((rc = Resolver_getaddrinfo(host, 0, addresses)) != 0)
+		Log(LOG_ERROR, -1, "getaddrinfo failed for addr %s with rc %d", host, rc);
+
+	Thread_lock_mutex(resolver_mutex);
+	if ((entry = Resolver_find(host)) == NULL)
+	{
+		entry = malloc(sizeof(resolver_entry));
+		memset(entry, '\0', sizeof(resolver_entry));
+		entry->host = Resolver_strdup(host);
+		ListAppend(cache, entry, sizeof(resolver_entry) + strlen(host) + 1);
+	}
+	Resolver_store(entry, rc, addresses);
+	Thread_unlock_mutex(resolver_mutex);
+	if (rc != 0)
+		rc = SOCKET_ERROR;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Resolver termination.  The cache is emptied.  Any lookups still in progress
+ * finish on their own threads, and their results are discarded.
+ */
+void Resolver_terminate(void)
+{
+	FUNC_ENTRY;
+	Thread_lock_mutex(resolver_mutex);
+	if (cache)
+	{
+		ListElement* current = NULL;
+
+		while (ListNextElement(cache, &current))
+			free(((resolver_entry*)(current->content))->host);
+		ListFree(cache);
+		cache = NULL;
+	}
+	Thread_unlock_mutex(resolver_mutex);
+	FUNC_EXIT;
+}
@@ -0,0 +1,62 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#if !defined(RESOLVER_H)
+#define RESOLVER_H
+
+#include "Socket.h"
+
+/** the most addresses kept for one host name */
+#define RESOLVER_MAX_ADDRESSES 8
+
+/** how long, in seconds, a successful lookup is kept in the cache */
+#if !defined(RESOLVER_TTL)
+#define RESOLVER_TTL 60
+#endif
+
+/** how long, in seconds, a failed lookup is kept in the cache */
+#if !defined(RESOLVER_FAILURE_TTL)
+#define RESOLVER_FAILURE_TTL 5
+#endif
+
+/**
+ * One address of a host.  The port is not set.
+ */
+typedef struct
+{
+	int family;						/**< AF_INET or AF_INET6 */
+	socklen_t len;					/**< the length of addr */
+	struct sockaddr_storage addr;
+} Resolver_address;
+
+/**
+ * The addresses a host name resolved to, in the order getaddrinfo returned them
+ */
+typedef struct
+{
+	int count;
+	Resolver_address addrs[RESOLVER_MAX_ADDRESSES];
+} Resolver_addresses;
+
+typedef void Resolver_complete(void);
+
+void Resolver_initialize(void);
+void Resolver_setCompleteCallback(Resolver_complete* callback);
+int Resolver_lookup(const char* host, Resolver_addresses* addresses);
+int Resolver_resolve(const char* host, Resolver_addresses* addresses);
+void Resolver_terminate(void);
+
+#endif
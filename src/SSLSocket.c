@@ -38,13 +38,80 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/crypto.h>
+#include <openssl/pem.h>
+
+#include <sys/stat.h>
+#include <time.h>
+#if !defined(WIN32) && !defined(WIN64)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 extern Sockets s;
 
 void SSLSocket_addPendingRead(int sock);
 
 static ssl_mutex_type* sslLocks = NULL;
-static ssl_mutex_type sslCoreMutex;
+
+/**
+ * An SSL_CTX shared by all the connections with the same SSL options.  Loading the
+ * certificates and keys is the most expensive part of creating a context, so the files'
+ * modification times are part of the key: a changed file gets a new context.
+ */
+typedef struct
+{
+	SSL_CTX* ctx;
+	int refcount;		/**< number of connections using ctx */
+	int stale;			/**< one of the files has changed, so free ctx when it is no longer used */
+	char* trustStore;
+	char* keyStore;
+	char* privateKey;
+	char* privateKeyPassword;
+	char* enabledCipherSuites;
+	int enableServerCertAuth;
+	time_t trustStore_mtime;
+	time_t keyStore_mtime;
+	time_t privateKey_mtime;
+} ssl_context;
+
+static List* contexts = NULL;	/**< list of ssl_context, kept until SSLSocket_terminate */
+static ssl_mutex_type contextsMutex;
+
+/**
+ * A TLS session which can be resumed by the next connection to the same server.  The key
+ * is the server address together with the options which affect the authentication of the
+ * server and the client, so that a session is never resumed with different credentials.
+ */
+typedef struct
+{
+	char* key;
+	char* file;				/**< the file the session is saved in, or NULL */
+	SSL_SESSION* session;	/**< NULL for the copy of the key attached to a connection */
+	int unsaved;			/**< for the copy attached to a connection, a new session has not been saved yet */
+} ssl_session;
+
+static List* sessions = NULL;		/**< list of ssl_session, kept until SSLSocket_terminate */
+static List* sessionFiles = NULL;	/**< the session cache files which have been loaded */
+static ssl_mutex_type sessionsMutex;
+static ssl_mutex_type sessionFilesMutex;	/**< serializes the writing of session cache files */
+static int sessionIndex = -1;		/**< SSL ex_data index of the connection's ssl_session key */
+
+/**
+ * State kept with each connection's SSL object.  OpenSSL allows different SSL objects to be
+ * used on different threads at the same time, but not one SSL object, so reads and writes
+ * are serialized per connection rather than across the library.
+ */
+typedef struct
+{
+	ssl_mutex_type mutex;	/**< held for each SSL_read and SSL_write */
+	char* stage;			/**< staging buffer for SSLSocket_putdatas, allocated on the first write */
+	unsigned int ktls_send : 1;	/**< the kernel encrypts: write with the plain socket functions */
+} ssl_connection;
+
+static int connectionIndex = -1;	/**< SSL ex_data index of the connection's ssl_connection */
+
+#define SSL_RECORD_SIZE 16384	/**< the largest amount of data in one TLS record */
+#define min(A,B) ( (A) < (B) ? (A):(B))
 
 #if defined(WIN32) || defined(WIN64)
 #define iov_len len
@@ -436,16 +503,50 @@ int SSLSocket_initialize()
 #endif
 	CRYPTO_set_locking_callback(SSLLocks_callback);
 
-	SSL_create_mutex(&sslCoreMutex);
+	SSL_create_mutex(&contextsMutex);
+	contexts = ListInitialize();
+	SSL_create_mutex(&sessionsMutex);
+	SSL_create_mutex(&sessionFilesMutex);
+	sessions = ListInitialize();
+	sessionFiles = ListInitialize();
+	if (sessionIndex == -1)
+		sessionIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if (connectionIndex == -1)
+		connectionIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
 
 exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
+void SSLSocket_freeContext(ssl_context* context);
+void SSLSocket_freeSession(ssl_session* session);
+
 void SSLSocket_terminate()
 {
 	FUNC_ENTRY;
+	if (contexts)
+	{
+		ListElement* current = NULL;
+
+		while (ListNextElement(contexts, &current))
+			SSLSocket_freeContext((ssl_context*)(current->content));
+		ListFree(contexts);
+		contexts = NULL;
+		SSL_destroy_mutex(&contextsMutex);
+	}
+	if (sessions)
+	{
+		ListElement* current = NULL;
+
+		while (ListNextElement(sessions, &current))
+			SSLSocket_freeSession((ssl_session*)(current->content));
+		ListFree(sessions);
+		ListFree(sessionFiles);
+		sessions = sessionFiles = NULL;
+		SSL_destroy_mutex(&sessionsMutex);
+		SSL_destroy_mutex(&sessionFilesMutex);
+	}
 	EVP_cleanup();
 	ERR_free_strings();
 	CRYPTO_set_locking_callback(NULL);
@@ -462,24 +563,345 @@ void SSLSocket_terminate()
 	FUNC_EXIT;
 }
 
-int SSLSocket_createContext(networkHandles* net, MQTTClient_SSLOptions* opts)
+static char* SSLSocket_strdup(const char* str)
+{
+	char* rc = NULL;
+
+	if (str && (rc = malloc(strlen(str) + 1)) != NULL)
+		strcpy(rc, str);
+	return rc;
+}
+
+
+static int SSLSocket_strequal(const char* a, const char* b)
+{
+	return (a == NULL || b == NULL) ? a == b : strcmp(a, b) == 0;
+}
+
+
+/**
+ * Get the modification time of a file, so that a cached context is not used after
+ * its certificates or keys have been changed.
+ * @param filename the name of the file, can be NULL
+ * @return the modification time, or 0 if there is no file
+ */
+static time_t SSLSocket_mtime(const char* filename)
+{
+	struct stat buf;
+
+	if (filename == NULL || stat(filename, &buf) != 0)
+		return 0;
+	return buf.st_mtime;
+}
+
+
+/**
+ * Free a cached context and its copies of the options.  The contexts mutex must be held,
+ * and the context must already have been removed from the list, if it was in it.
+ * @param context the context to free
+ */
+void SSLSocket_freeContext(ssl_context* context)
+{
+	FUNC_ENTRY;
+	SSL_CTX_free(context->ctx);
+	if (context->trustStore)
+		free(context->trustStore);
+	if (context->keyStore)
+		free(context->keyStore);
+	if (context->privateKey)
+		free(context->privateKey);
+	if (context->privateKeyPassword)
+	{
+		memset(context->privateKeyPassword, '\0', strlen(context->privateKeyPassword));
+		free(context->privateKeyPassword);
+	}
+	if (context->enabledCipherSuites)
+		free(context->enabledCipherSuites);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Free a cached session and its key.  The session must already have been removed from
+ * the list, if it was in it.
+ * @param session the session to free
+ */
+void SSLSocket_freeSession(ssl_session* session)
+{
+	if (session->session)
+		SSL_SESSION_free(session->session);
+	free(session->key);
+	if (session->file)
+		free(session->file);
+}
+
+
+/**
+ * Has a session expired, or otherwise become unusable for resumption?
+ * @param session the session
+ * @return boolean
+ */
+static int SSLSocket_sessionExpired(SSL_SESSION* session)
+{
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+	if (!SSL_SESSION_is_resumable(session))
+		return 1;
+#endif
+	return (long)time(NULL) > SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+}
+
+
+static ssl_session* SSLSocket_findSession(const char* key)
+{
+	ListElement* current = NULL;
+
+	while (ListNextElement(sessions, &current))
+	{
+		ssl_session* s = (ssl_session*)(current->content);
+
+		if (strcmp(s->key, key) == 0)
+			return s;
+	}
+	return NULL;
+}
+
+
+/**
+ * Load the sessions in a session cache file, unless it has already been loaded.  The
+ * file holds a line with the key of each session, followed by the session in PEM format.
+ * The sessions mutex must be held.
+ * @param file the name of the file
+ */
+static void SSLSocket_loadSessions(const char* file)
+{
+	ListElement* current = NULL;
+	FILE* fp = NULL;
+	char key[1024];
+	int count = 0;
+
+	FUNC_ENTRY;
+	while (ListNextElement(sessionFiles, &current))
+	{
+		if (strcmp((char*)(current->content), file) == 0)
+			goto exit;
+	}
+	ListAppend(sessionFiles, SSLSocket_strdup(file), strlen(file) + 1);
+	if ((fp = fopen(file, "r")) == NULL)
+		goto exit; /* not an error: there is no file until the first session has been saved */
+	while (fgets(key, sizeof(key), fp))
+	{
+		SSL_SESSION* session = NULL;
+		size_t len = strlen(key);
+
+		if (len > 0 && key[len - 1] == '\n')
+			key[--len] = '\0';
+		if ((session = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL)) == NULL)
+			break;
+		if (SSLSocket_sessionExpired(session) || SSLSocket_findSession(key))
+			SSL_SESSION_free(session);
+		else
+		{
+			ssl_session* s = malloc(sizeof(ssl_session));
+
+			s->key = SSLSocket_strdup(key);
+			s->file = SSLSocket_strdup(file);
+			s->session = session;
+			s->unsaved = 0;
+			ListAppend(sessions, s, sizeof(ssl_session));
+			++count;
+		}
+	}
+	fclose(fp);
+	Log(TRACE_MINIMUM, -1, "Loaded %d TLS sessions from %s", count, file);
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Save the unexpired sessions which belong to a session cache file, replacing its contents.
+ * The sessions are copied to memory with the sessions mutex held, and written after it
+ * has been released, so that the file I/O does not hold up other connections.
+ * @param file the name of the file
+ */
+static void SSLSocket_saveSessions(const char* file)
+{
+	ListElement* current = NULL;
+	char* temp = malloc(strlen(file) + 5);
+	BIO* bio = NULL;
+	char* data = NULL;
+	long len = 0L;
+	int failed = 0;
+	FILE* fp = NULL;
+#if !defined(WIN32) && !defined(WIN64)
+	int fd = -1;
+#endif
+
+	FUNC_ENTRY;
+	/* held until the file has been renamed, so that a later copy is never overwritten by an earlier one */
+	SSL_lock_mutex(&sessionFilesMutex);
+	if ((bio = BIO_new(BIO_s_mem())) == NULL)
+		goto exit;
+	SSL_lock_mutex(&sessionsMutex);
+	while (ListNextElement(sessions, &current))
+	{
+		ssl_session* s = (ssl_session*)(current->content);
+
+		if (s->file && strcmp(s->file, file) == 0 && !SSLSocket_sessionExpired(s->session))
+		{
+			BIO_printf(bio, "%s\n", s->key);
+			PEM_write_bio_SSL_SESSION(bio, s->session);
+		}
+	}
+	SSL_unlock_mutex(&sessionsMutex);
+	len = BIO_get_mem_data(bio, &data);
+
+	sprintf(temp, "%s.tmp", file);
+#if defined(WIN32) || defined(WIN64)
+	fp = fopen(temp, "w");
+#else
+	/* the file holds session keys, so only the owner may read it */
+	if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) != -1 && (fp = fdopen(fd, "w")) == NULL)
+		close(fd);
+#endif
+	if (fp == NULL)
+	{
+		Log(LOG_ERROR, -1, "Failed to open TLS session cache file %s", temp);
+		goto exit;
+	}
+	if (len > 0 && fwrite(data, (size_t)len, 1, fp) != 1)
+		failed = 1;
+	if (fclose(fp) != 0 || failed)
+		Log(LOG_ERROR, -1, "Failed to write TLS session cache file %s", temp);
+	else
+	{
+#if defined(WIN32) || defined(WIN64)
+		remove(file); /* rename does not replace an existing file */
+#endif
+		if (rename(temp, file) != 0)
+			Log(LOG_ERROR, -1, "Failed to rename TLS session cache file %s to %s", temp, file);
+	}
+exit:
+	SSL_unlock_mutex(&sessionFilesMutex);
+	if (bio)
+		BIO_free(bio);
+	free(temp);
+	FUNC_EXIT;
+}
+
+
+/**
+ * OpenSSL callback for a new session, which may arrive during or, with TLS 1.3, after
+ * the handshake.  The session replaces any cached for the same server and options.  If
+ * there is a session cache file, it is written when the connection is closed, so that the
+ * several sessions a TLS 1.3 server can send on one connection are saved together.
+ * @param ssl the connection
+ * @param session the new session
+ * @return 1 if the session is kept, in which case OpenSSL's reference is taken over
+ */
+static int SSLSocket_newSession(SSL* ssl, SSL_SESSION* session)
+{
+	ssl_session* key = SSL_get_ex_data(ssl, sessionIndex);
+	ssl_session* s = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (key == NULL)
+		goto exit;
+	SSL_lock_mutex(&sessionsMutex);
+	if ((s = SSLSocket_findSession(key->key)) != NULL)
+		SSL_SESSION_free(s->session);
+	else if ((s = malloc(sizeof(ssl_session))) != NULL)
+	{
+		s->key = SSLSocket_strdup(key->key);
+		s->file = SSLSocket_strdup(key->file);
+		s->unsaved = 0;
+		ListAppend(sessions, s, sizeof(ssl_session));
+	}
+	if (s)
+	{
+		s->session = session;
+		if (s->file == NULL && key->file)
+			s->file = SSLSocket_strdup(key->file);
+		key->unsaved = (s->file != NULL);
+		rc = 1;
+	}
+	SSL_unlock_mutex(&sessionsMutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Resume the cached session for the server a connection is for, if there is one, and
+ * attach the session key to the connection, so that a new session can be cached.
+ * @param net the network handle, with ssl created
+ * @param opts the SSL options
+ * @param address the server address, host:port
+ */
+static void SSLSocket_setSession(networkHandles* net, MQTTClient_SSLOptions* opts, const char* address)
+{
+	ssl_session* key = NULL;
+	ssl_session* s = NULL;
+
+	FUNC_ENTRY;
+	if ((key = malloc(sizeof(ssl_session))) == NULL)
+		goto exit;
+	key->key = malloc(strlen(address) + 20 + (opts->trustStore ? strlen(opts->trustStore) : 0) +
+		(opts->keyStore ? strlen(opts->keyStore) : 0) + (opts->privateKey ? strlen(opts->privateKey) : 0));
+	sprintf(key->key, "%s %d %s %s %s", address, opts->enableServerCertAuth, opts->trustStore ? opts->trustStore : "",
+		opts->keyStore ? opts->keyStore : "", opts->privateKey ? opts->privateKey : "");
+	key->file = SSLSocket_strdup(opts->sessionCacheFile);
+	key->session = NULL;
+	key->unsaved = 0;
+	SSL_set_ex_data(net->ssl, sessionIndex, key);
+
+	SSL_lock_mutex(&sessionsMutex);
+	if (key->file)
+		SSLSocket_loadSessions(key->file);
+	if ((s = SSLSocket_findSession(key->key)) != NULL)
+	{
+		if (SSLSocket_sessionExpired(s->session))
+		{
+			SSLSocket_freeSession(s);
+			ListRemove(sessions, s);
+		}
+		else if (SSL_set_session(net->ssl, s->session) != 1)
+			Log(TRACE_MIN, -1, "Failed to set SSL session with stored data, non critical");
+		else
+			Log(TRACE_MIN, -1, "Resuming TLS session for %s", address);
+	}
+	SSL_unlock_mutex(&sessionsMutex);
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Create a new SSL_CTX, loading the certificates and keys named in the SSL options.
+ * @param net the network handle, only used for error reporting
+ * @param opts the SSL options
+ * @param ctx set to the new context on success
+ * @return 1 on success, otherwise failure
+ */
+int SSLSocket_createContext(networkHandles* net, MQTTClient_SSLOptions* opts, SSL_CTX** ctx)
 {
 	int rc = 1;
 	const char* ciphers = NULL;
 	
 	FUNC_ENTRY;
-	if (net->ctx == NULL)
-		if ((net->ctx = SSL_CTX_new(SSLv23_client_method())) == NULL)	/* SSLv23 for compatibility with SSLv2, SSLv3 and TLSv1 */
-		{
-			SSLSocket_error("SSL_CTX_new", NULL, net->socket, rc);
-			goto exit;
-		}
+	if ((*ctx = SSL_CTX_new(SSLv23_client_method())) == NULL)	/* SSLv23 for compatibility with SSLv2, SSLv3 and TLSv1 */
+	{
+		SSLSocket_error("SSL_CTX_new", NULL, net->socket, rc);
+		goto exit;
+	}
 	
 	if (opts->keyStore)
 	{
 		int rc1 = 0;
 
-		if ((rc = SSL_CTX_use_certificate_chain_file(net->ctx, opts->keyStore)) != 1)
+		if ((rc = SSL_CTX_use_certificate_chain_file(*ctx, opts->keyStore)) != 1)
 		{
 			SSLSocket_error("SSL_CTX_use_certificate_chain_file", NULL, net->socket, rc);
 			goto free_ctx; /*If we can't load the certificate (chain) file then loading the privatekey won't work either as it needs a matching cert already loaded */
@@ -490,14 +912,16 @@ int SSLSocket_createContext(networkHandles* net, MQTTClient_SSLOptions* opts)
 
 		if (opts->privateKeyPassword != NULL)
 		{
-			SSL_CTX_set_default_passwd_cb(net->ctx, pem_passwd_cb);
-			SSL_CTX_set_default_passwd_cb_userdata(net->ctx, (void*)opts->privateKeyPassword);
+			SSL_CTX_set_default_passwd_cb(*ctx, pem_passwd_cb);
+			SSL_CTX_set_default_passwd_cb_userdata(*ctx, (void*)opts->privateKeyPassword);
     }
 		
 		/* support for ASN.1 == DER format? DER can contain only one certificate? */
-		rc1 = SSL_CTX_use_PrivateKey_file(net->ctx, opts->privateKey, SSL_FILETYPE_PEM);
+		rc1 = SSL_CTX_use_PrivateKey_file(*ctx, opts->privateKey, SSL_FILETYPE_PEM);
 		if (opts->privateKey == opts->keyStore)
 			opts->privateKey = NULL;
+		/* the context outlives the options it was created from, so don't keep a pointer to the password */
+		SSL_CTX_set_default_passwd_cb_userdata(*ctx, NULL);
 		if (rc1 != 1)
 		{
 			SSLSocket_error("SSL_CTX_use_PrivateKey_file", NULL, net->socket, rc);
@@ -507,13 +931,13 @@ int SSLSocket_createContext(networkHandles* net, MQTTClient_SSLOptions* opts)
 
 	if (opts->trustStore)
 	{
-		if ((rc = SSL_CTX_load_verify_locations(net->ctx, opts->trustStore, NULL)) != 1)
+		if ((rc = SSL_CTX_load_verify_locations(*ctx, opts->trustStore, NULL)) != 1)
 		{
 			SSLSocket_error("SSL_CTX_load_verify_locations", NULL, net->socket, rc);
 			goto free_ctx;
 		}                               
 	}
-	else if ((rc = SSL_CTX_set_default_verify_paths(net->ctx)) != 1)
+	else if ((rc = SSL_CTX_set_default_verify_paths(*ctx)) != 1)
 	{
 		SSLSocket_error("SSL_CTX_set_default_verify_paths", NULL, net->socket, rc);
 		goto free_ctx;
@@ -524,18 +948,25 @@ int SSLSocket_createContext(networkHandles* net, MQTTClient_SSLOptions* opts)
 	else
 		ciphers = opts->enabledCipherSuites;
 
-	if ((rc = SSL_CTX_set_cipher_list(net->ctx, ciphers)) != 1)
+	if ((rc = SSL_CTX_set_cipher_list(*ctx, ciphers)) != 1)
 	{
 		SSLSocket_error("SSL_CTX_set_cipher_list", NULL, net->socket, rc);
 		goto free_ctx;
 	}       
 	
-	SSL_CTX_set_mode(net->ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_mode(*ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	/* sessions are kept in our own cache, keyed by server, rather than in the context */
+	SSL_CTX_set_session_cache_mode(*ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(*ctx, SSLSocket_newSession);
+	SSL_CTX_set_info_callback(*ctx, SSL_CTX_info_callback);
+	SSL_CTX_set_msg_callback(*ctx, SSL_CTX_msg_callback);
+	if (opts->enableServerCertAuth) 
+		SSL_CTX_set_verify(*ctx, SSL_VERIFY_PEER, NULL);
 
 	goto exit;
 free_ctx:
-	SSL_CTX_free(net->ctx);
-	net->ctx = NULL;
+	SSL_CTX_free(*ctx);
+	*ctx = NULL;
 	
 exit:
 	FUNC_EXIT_RC(rc);
@@ -543,21 +974,155 @@ exit:
 }
 
 
-int SSLSocket_setSocketForSSL(networkHandles* net, MQTTClient_SSLOptions* opts)
+/**
+ * Get an SSL_CTX for a connection.  A context is shared by all connections, of all
+ * clients, which use the same SSL options, as long as the certificate and key files
+ * have not changed since it was created.  Otherwise a new context is created and cached.
+ * @param net the network handle, whose ctx is set on success
+ * @param opts the SSL options
+ * @return 1 on success, otherwise failure
+ */
+int SSLSocket_getContext(networkHandles* net, MQTTClient_SSLOptions* opts)
+{
+	ListElement* current = NULL;
+	ListElement* next = NULL;
+	ssl_context* context = NULL;
+	time_t trustStore_mtime = SSLSocket_mtime(opts->trustStore);
+	time_t keyStore_mtime = SSLSocket_mtime(opts->keyStore);
+	time_t privateKey_mtime = SSLSocket_mtime(opts->privateKey);
+	int rc = 1;
+
+	FUNC_ENTRY;
+	SSL_lock_mutex(&contextsMutex);
+	for (current = contexts->first; current; current = next)
+	{
+		ssl_context* c = (ssl_context*)(current->content);
+
+		next = current->next;
+		if (!SSLSocket_strequal(c->trustStore, opts->trustStore) ||
+			!SSLSocket_strequal(c->keyStore, opts->keyStore) ||
+			!SSLSocket_strequal(c->privateKey, opts->privateKey) ||
+			!SSLSocket_strequal(c->privateKeyPassword, opts->privateKeyPassword) ||
+			!SSLSocket_strequal(c->enabledCipherSuites, opts->enabledCipherSuites) ||
+			c->enableServerCertAuth != opts->enableServerCertAuth)
+			continue;
+		if (c->trustStore_mtime == trustStore_mtime && c->keyStore_mtime == keyStore_mtime &&
+				c->privateKey_mtime == privateKey_mtime)
+		{
+			context = c;
+			break;
+		}
+		c->stale = 1;
+		if (c->refcount == 0)
+		{
+			SSLSocket_freeContext(c);
+			ListRemove(contexts, c);
+		}
+	}
+
+	if (context)
+		Log(TRACE_MINIMUM, -1, "Reusing SSL context %p, used by %d other connections", context->ctx, context->refcount);
+	else
+	{
+		SSL_CTX* ctx = NULL;
+
+		if ((rc = SSLSocket_createContext(net, opts, &ctx)) != 1)
+			goto exit;
+		if ((context = malloc(sizeof(ssl_context))) == NULL)
+		{
+			SSL_CTX_free(ctx);
+			rc = -1;
+			goto exit;
+		}
+		memset(context, '\0', sizeof(ssl_context));
+		context->ctx = ctx;
+		context->trustStore = SSLSocket_strdup(opts->trustStore);
+		context->keyStore = SSLSocket_strdup(opts->keyStore);
+		context->privateKey = SSLSocket_strdup(opts->privateKey);
+		context->privateKeyPassword = SSLSocket_strdup(opts->privateKeyPassword);
+		context->enabledCipherSuites = SSLSocket_strdup(opts->enabledCipherSuites);
+		context->enableServerCertAuth = opts->enableServerCertAuth;
+		context->trustStore_mtime = trustStore_mtime;
+		context->keyStore_mtime = keyStore_mtime;
+		context->privateKey_mtime = privateKey_mtime;
+		ListAppend(contexts, context, sizeof(ssl_context));
+	}
+	context->refcount++;
+	net->ctx = context->ctx;
+exit:
+	SSL_unlock_mutex(&contextsMutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Get the state kept with an SSL object, creating it on first use.
+ * @param ssl the SSL connection
+ * @return the connection state, or NULL if it could not be allocated
+ */
+static ssl_connection* SSLSocket_connection(SSL* ssl)
+{
+	ssl_connection* conn = SSL_get_ex_data(ssl, connectionIndex);
+
+	if (conn == NULL && (conn = malloc(sizeof(ssl_connection))) != NULL)
+	{
+		SSL_create_mutex(&conn->mutex);
+		conn->stage = NULL;
+		conn->ktls_send = 0;
+		SSL_set_ex_data(ssl, connectionIndex, conn);
+	}
+	return conn;
+}
+
+
+/**
+ * Lock a connection for a read or write.
+ * @param ssl the SSL connection
+ * @return the connection state, to pass to SSLSocket_unlockConnection
+ */
+static ssl_connection* SSLSocket_lockConnection(SSL* ssl)
+{
+	ssl_connection* conn = SSLSocket_connection(ssl);
+
+	if (conn)
+		SSL_lock_mutex(&conn->mutex);
+	return conn;
+}
+
+
+static void SSLSocket_unlockConnection(ssl_connection* conn)
+{
+	if (conn)
+		SSL_unlock_mutex(&conn->mutex);
+}
+
+
+/**
+ * Create the SSL object for a connection, resuming a cached session for the server if possible.
+ * @param net the network handle
+ * @param opts the SSL options
+ * @param address the server address, host:port, which keys the session cache.  Can be NULL.
+ * @return 1 on success, otherwise failure
+ */
+int SSLSocket_setSocketForSSL(networkHandles* net, MQTTClient_SSLOptions* opts, const char* address)
 {
 	int rc = 1;
 	
 	FUNC_ENTRY;
 	
-	if (net->ctx != NULL || (rc = SSLSocket_createContext(net, opts)) == 1)
+	if (net->ctx != NULL || (rc = SSLSocket_getContext(net, opts)) == 1)
 	{
 		int i;
-		SSL_CTX_set_info_callback(net->ctx, SSL_CTX_info_callback);
-		SSL_CTX_set_msg_callback(net->ctx, SSL_CTX_msg_callback);
-   		if (opts->enableServerCertAuth) 
-			SSL_CTX_set_verify(net->ctx, SSL_VERIFY_PEER, NULL);
-	
+
 		net->ssl = SSL_new(net->ctx);
+		SSLSocket_connection(net->ssl); /* now, before the connection can be used by more than one thread */
+#if defined(SSL_OP_ENABLE_KTLS)
+		if (opts->enableKernelTLS)
+			SSL_set_options(net->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+		if (address)
+			SSLSocket_setSession(net, opts, address);
 
 		/* Log all ciphers available to the SSL sessions (loaded in ctx) */
 		for (i = 0; ;i++)
@@ -576,7 +1141,16 @@ int SSLSocket_setSocketForSSL(networkHandles* net, MQTTClient_SSLOptions* opts)
 }
 
 
-int SSLSocket_connect(SSL* ssl, int sock)      
+/**
+ * Start or continue the TLS handshake.  The socket is non-blocking, so this never waits: if
+ * OpenSSL needs to read or write more, the socket is left waiting for that in
+ * Socket_getReadySocket, and this is called again when it is ready.
+ * @param ssl the SSL connection
+ * @param sock the underlying socket
+ * @return 1 when the handshake is complete, TCPSOCKET_INTERRUPTED if it is in progress,
+ * SSL_FATAL or another value <= 0 on failure
+ */
+int SSLSocket_connect(SSL* ssl, int sock)
 {
 	int rc = 0;
 
@@ -591,7 +1165,31 @@ int SSLSocket_connect(SSL* ssl, int sock)
 			rc = error;
 		if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
 			rc = TCPSOCKET_INTERRUPTED;
+		/* the handshake is continued when the socket is ready for what OpenSSL is waiting for */
+		if (error == SSL_ERROR_WANT_WRITE)
+			Socket_addPendingConnect(sock);
+		else
+			Socket_clearPendingConnect(sock);
 	}
+	else
+		Socket_clearPendingConnect(sock);
+#if defined(SSL_OP_ENABLE_KTLS)
+	if (rc == 1 && (SSL_get_options(ssl) & SSL_OP_ENABLE_KTLS))
+	{
+		/* OpenSSL has passed the keys to the kernel if it and the cipher allow it, for each
+		 * direction separately.  Only writes bypass OpenSSL: the kernel returns an error for a
+		 * record which is not application data, such as a TLS 1.3 session ticket or key update,
+		 * unless it is read with recvmsg, so reads always go through SSL_read, which does that. */
+		ssl_connection* conn = SSLSocket_connection(ssl);
+
+		if (conn)
+		{
+			conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl)) ? 1 : 0;
+			Log(TRACE_PROTOCOL, -1, "Kernel TLS on socket %d: send %s, receive %s", sock,
+				conn->ktls_send ? "on" : "off", BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "on" : "off");
+		}
+	}
+#endif
 
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -608,14 +1206,19 @@ int SSLSocket_connect(SSL* ssl, int sock)
 int SSLSocket_getch(SSL* ssl, int socket, char* c)
 {
 	int rc = SOCKET_ERROR;
+	int err = 0;
+	ssl_connection* conn = NULL;
 
 	FUNC_ENTRY;
 	if ((rc = SocketBuffer_getQueuedChar(socket, c)) != SOCKETBUFFER_INTERRUPTED)
 		goto exit;
 
+	conn = SSLSocket_lockConnection(ssl);
 	if ((rc = SSL_read(ssl, c, (size_t)1)) < 0)
+		err = SSLSocket_error("SSL_read - getch", ssl, socket, rc);
+	SSLSocket_unlockConnection(conn);
+	if (rc < 0)
 	{
-		int err = SSLSocket_error("SSL_read - getch", ssl, socket, rc);
 		if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
 		{
 			rc = TCPSOCKET_INTERRUPTED;
@@ -647,7 +1250,9 @@ exit:
 char *SSLSocket_getdata(SSL* ssl, int socket, size_t bytes, size_t* actual_len)
 {
 	int rc;
+	int err = 0, pending = 0;
 	char* buf;
+	ssl_connection* conn = NULL;
 
 	FUNC_ENTRY;
 	if (bytes == 0)
@@ -658,10 +1263,16 @@ char *SSLSocket_getdata(SSL* ssl, int socket, size_t bytes, size_t* actual_len)
 
 	buf = SocketBuffer_getQueuedData(socket, bytes, actual_len);
 
+	conn = SSLSocket_lockConnection(ssl);
 	if ((rc = SSL_read(ssl, buf + (*actual_len), (int)(bytes - (*actual_len)))) < 0)
+		err = SSLSocket_error("SSL_read - getdata", ssl, socket, rc);
+	else if (rc > 0 && *actual_len + rc == bytes)
+		pending = SSL_pending(ssl); /* return no of bytes pending */
+	SSLSocket_unlockConnection(conn);
+
+	if (rc < 0)
 	{
-		rc = SSLSocket_error("SSL_read - getdata", ssl, socket, rc);
-		if (rc != SSL_ERROR_WANT_READ && rc != SSL_ERROR_WANT_WRITE)
+		if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
 		{
 			buf = NULL;
 			goto exit;
@@ -682,7 +1293,7 @@ char *SSLSocket_getdata(SSL* ssl, int socket, size_t bytes, size_t* actual_len)
 		isn't picked up by select.  So here we should check for any data remaining in the SSL buffer, and
 		if so, add this socket to a new "pending SSL reads" list.
 		*/
-		if (SSL_pending(ssl) > 0) /* return no of bytes pending */
+		if (pending > 0)
 			SSLSocket_addPendingRead(socket);
 	}
 	else /* we didn't read the whole packet */
@@ -695,12 +1306,38 @@ exit:
 	return buf;
 }
 
+/**
+ * Release a connection's reference to its shared context.  The context stays in the
+ * cache for later connections, unless its files have changed since it was created.
+ * @param net the network handle
+ */
 void SSLSocket_destroyContext(networkHandles* net)
 {
+	ListElement* current = NULL;
+
 	FUNC_ENTRY;
-	if (net->ctx)
-		SSL_CTX_free(net->ctx);
+	if (net->ctx == NULL)
+		goto exit;
+	SSL_lock_mutex(&contextsMutex);
+	while (ListNextElement(contexts, &current))
+	{
+		ssl_context* context = (ssl_context*)(current->content);
+
+		if (context->ctx == net->ctx)
+		{
+			if (--(context->refcount) == 0 && context->stale)
+			{
+				SSLSocket_freeContext(context);
+				ListRemove(contexts, context);
+			}
+			break;
+		}
+	}
+	SSL_unlock_mutex(&contextsMutex);
+	if (current == NULL)
+		SSL_CTX_free(net->ctx); /* not from the cache */
 	net->ctx = NULL;
+exit:
 	FUNC_EXIT;
 }
 
@@ -710,8 +1347,29 @@ int SSLSocket_close(networkHandles* net)
 	int rc = 1;
 	FUNC_ENTRY;
 	if (net->ssl) {
+		ssl_session* key = SSL_get_ex_data(net->ssl, sessionIndex);
+		ssl_connection* conn = SSL_get_ex_data(net->ssl, connectionIndex);
+
+		if (conn)
+			SSL_lock_mutex(&conn->mutex);
 		rc = SSL_shutdown(net->ssl);
+		if (conn)
+			SSL_unlock_mutex(&conn->mutex);
 		SSL_free(net->ssl);
+		if (key)
+		{
+			if (key->unsaved)
+				SSLSocket_saveSessions(key->file);
+			SSLSocket_freeSession(key);
+			free(key);
+		}
+		if (conn)
+		{
+			SSL_destroy_mutex(&conn->mutex);
+			if (conn->stage)
+				free(conn->stage);
+			free(conn);
+		}
 		net->ssl = NULL;
 	}
 	SSLSocket_destroyContext(net);
@@ -720,67 +1378,161 @@ int SSLSocket_close(networkHandles* net)
 }
 
 
-/* No SSL_writev() provided by OpenSSL. Boo. */  
-int SSLSocket_putdatas(SSL* ssl, int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees)
+/**
+ * Write one block of data with SSL_write.
+ * @param ssl the SSL connection
+ * @param socket the underlying socket, for logging
+ * @param buf the data
+ * @param len the length of the data
+ * @return TCPSOCKET_COMPLETE, TCPSOCKET_INTERRUPTED if the write must be retried with the
+ * same data, or SOCKET_ERROR
+ */
+static int SSLSocket_write(SSL* ssl, int socket, char* buf, size_t len)
 {
 	int rc = 0;
-	int i;
-	char *ptr;
-	iobuf iovec;
-	int sslerror;
 
-	FUNC_ENTRY;
-	iovec.iov_len = (ULONG)buf0len;
-	for (i = 0; i < count; i++)
-		iovec.iov_len += (ULONG)buflens[i];
+	if ((rc = SSL_write(ssl, buf, (int)len)) == (int)len)
+		rc = TCPSOCKET_COMPLETE;
+	else if (SSLSocket_error("SSL_write", ssl, socket, rc) == SSL_ERROR_WANT_WRITE)
+		rc = TCPSOCKET_INTERRUPTED;
+	else
+		rc = SOCKET_ERROR;
+	return rc;
+}
+
+
+/**
+ * Write a packet made up of several buffers.  There is no SSL_writev, and writing each
+ * buffer separately would put the header in a TLS record of its own, so small buffers are
+ * gathered into a staging buffer of one record's size, kept with the connection.  Whole
+ * records of larger buffers are written straight from the caller's memory.  Only if the
+ * write is interrupted is the rest of the packet copied, for SSLSocket_continueWrite to
+ * finish.  With kernel TLS, the buffers are written by Socket_putdatas instead.
+ * @param ssl the SSL connection
+ * @param socket the underlying socket
+ * @param buf0 the first buffer, always freed by the caller unless the write is interrupted
+ * @param buf0len the length of the first buffer
+ * @param count the number of other buffers
+ * @param buffers the other buffers
+ * @param buflens the lengths of the other buffers
+ * @param frees whether each of the other buffers is to be freed if the write is interrupted
+ * @return TCPSOCKET_COMPLETE, TCPSOCKET_INTERRUPTED or SOCKET_ERROR
+ */
+int SSLSocket_putdatas(SSL* ssl, int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees)
+{
+	int rc = TCPSOCKET_COMPLETE;
+	ssl_connection* conn = NULL;
+	char* stage = NULL;
+	size_t used = 0;	/* bytes in the staging buffer */
+	size_t direct = 0;	/* bytes being written straight from the current buffer */
+	size_t offset = 0;	/* bytes of the current buffer already staged or written */
+	int i = 0;			/* the current buffer: 0 is buf0, then buffers[i-1] */
 
-	ptr = iovec.iov_base = (char *)malloc(iovec.iov_len);  
-	memcpy(ptr, buf0, buf0len);
-	ptr += buf0len;
-	for (i = 0; i < count; i++)
+	FUNC_ENTRY;
+	if ((conn = SSLSocket_connection(ssl)) == NULL)
 	{
-		memcpy(ptr, buffers[i], buflens[i]);
-		ptr += buflens[i];
+		rc = SOCKET_ERROR;
+		goto exit;
+	}
+	SSL_lock_mutex(&conn->mutex);
+	if (conn->ktls_send)
+	{
+		/* the kernel makes the records, so the buffers can be written as they are */
+		rc = Socket_putdatas(socket, buf0, buf0len, count, buffers, buflens, frees);
+		SSL_unlock_mutex(&conn->mutex);
+		goto exit;
 	}
+	if (conn->stage == NULL && (conn->stage = malloc(SSL_RECORD_SIZE)) == NULL)
+	{
+		SSL_unlock_mutex(&conn->mutex);
+		rc = SOCKET_ERROR;
+		goto exit;
+	}
+	stage = conn->stage;
+	for (i = 0; i <= count && rc == TCPSOCKET_COMPLETE; ++i)
+	{
+		char* ptr = (i == 0) ? buf0 : buffers[i-1];
+		size_t len = (i == 0) ? buf0len : buflens[i-1];
 
-	SSL_lock_mutex(&sslCoreMutex);
-	if ((rc = SSL_write(ssl, iovec.iov_base, iovec.iov_len)) == iovec.iov_len)
-		rc = TCPSOCKET_COMPLETE;
-	else 
-	{ 
-		sslerror = SSLSocket_error("SSL_write", ssl, socket, rc);
-		
-		if (sslerror == SSL_ERROR_WANT_WRITE)
+		for (offset = 0; offset < len && rc == TCPSOCKET_COMPLETE; )
 		{
-			int* sockmem = (int*)malloc(sizeof(int));
-			int free = 1;
-
-			Log(TRACE_MIN, -1, "Partial write: incomplete write of %d bytes on SSL socket %d",
-				iovec.iov_len, socket);
-			SocketBuffer_pendingWrite(socket, ssl, 1, &iovec, &free, iovec.iov_len, 0);
-			*sockmem = socket;
-			ListAppend(s.write_pending, sockmem, sizeof(int));
-			FD_SET(socket, &(s.pending_wset));
-			rc = TCPSOCKET_INTERRUPTED;
+			size_t left = len - offset;
+
+			if (used == 0 && left >= SSL_RECORD_SIZE)
+			{
+				direct = left - (left % SSL_RECORD_SIZE);
+				if ((rc = SSLSocket_write(ssl, socket, ptr + offset, direct)) == TCPSOCKET_COMPLETE)
+				{
+					offset += direct;
+					direct = 0;
+				}
+			}
+			else
+			{
+				size_t n = min(SSL_RECORD_SIZE - used, left);
+
+				memcpy(stage + used, ptr + offset, n);
+				used += n;
+				offset += n;
+				if (used == SSL_RECORD_SIZE && (rc = SSLSocket_write(ssl, socket, stage, used)) == TCPSOCKET_COMPLETE)
+					used = 0;
+			}
 		}
-		else 
-			rc = SOCKET_ERROR;
 	}
-	SSL_unlock_mutex(&sslCoreMutex);
+	if (rc == TCPSOCKET_COMPLETE && used > 0 && (rc = SSLSocket_write(ssl, socket, stage, used)) == TCPSOCKET_COMPLETE)
+		used = 0;
 
-	if (rc != TCPSOCKET_INTERRUPTED)
-		free(iovec.iov_base);
-	else
+	if (rc == TCPSOCKET_INTERRUPTED)
+	{
+		/* The retry must start with the same data, so copy the interrupted block, which is
+		 * either in the staging buffer or at offset in buffer i, and everything after it. */
+		int* sockmem = (int*)malloc(sizeof(int));
+		int free = 1;
+		iobuf iovec;
+		char* ptr = NULL;
+		int j;
+
+		--i; /* the buffer loop had already moved on */
+		if (direct == 0 && offset == ((i == 0) ? buf0len : buflens[i-1]))
+		{
+			++i;
+			offset = 0;
+		}
+		iovec.iov_len = (ULONG)used;
+		for (j = i; j <= count; ++j)
+			iovec.iov_len += (ULONG)(((j == 0) ? buf0len : buflens[j-1]) - ((j == i) ? offset : 0));
+		ptr = iovec.iov_base = (char*)malloc(iovec.iov_len);
+		memcpy(ptr, stage, used);
+		ptr += used;
+		for (j = i; j <= count; ++j)
+		{
+			size_t skip = (j == i) ? offset : 0;
+			size_t len = ((j == 0) ? buf0len : buflens[j-1]) - skip;
+
+			memcpy(ptr, ((j == 0) ? buf0 : buffers[j-1]) + skip, len);
+			ptr += len;
+		}
+
+		Log(TRACE_MIN, -1, "Partial write: incomplete write of %d bytes on SSL socket %d",
+			iovec.iov_len, socket);
+		SocketBuffer_pendingWrite(socket, ssl, 1, &iovec, &free, iovec.iov_len, 0);
+		*sockmem = socket;
+		ListAppend(s.write_pending, sockmem, sizeof(int));
+		Socket_addPendingWrite(socket);
+	}
+	SSL_unlock_mutex(&conn->mutex);
+
+	if (rc == TCPSOCKET_INTERRUPTED)
 	{
-		int i;
 		free(buf0);
 		for (i = 0; i < count; ++i)
 		{
 			if (frees[i])
 				free(buffers[i]);
-		}	
+		}
 	}
-	FUNC_EXIT_RC(rc); 
+exit:
+	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
@@ -818,22 +1570,231 @@ int SSLSocket_getPendingRead()
 int SSLSocket_continueWrite(pending_writes* pw)
 {
 	int rc = 0; 
+	int sslerror = 0;
+	ssl_connection* conn = NULL;
 	
 	FUNC_ENTRY;
-	if ((rc = SSL_write(pw->ssl, pw->iovecs[0].iov_base, pw->iovecs[0].iov_len)) == pw->iovecs[0].iov_len)
+	/* the buffer starts with the data of the interrupted SSL_write, and may continue past it:
+	   OpenSSL allows a longer retry, and a moved buffer with SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER */
+	conn = SSLSocket_lockConnection(pw->ssl);
+	if ((rc = SSL_write(pw->ssl, pw->iovecs[0].iov_base, pw->iovecs[0].iov_len)) != pw->iovecs[0].iov_len)
+		sslerror = SSLSocket_error("SSL_write", pw->ssl, pw->socket, rc);
+	SSLSocket_unlockConnection(conn);
+
+	if (rc == pw->iovecs[0].iov_len)
 	{
 		/* topic and payload buffers are freed elsewhere, when all references to them have been removed */
 		free(pw->iovecs[0].iov_base);
 		Log(TRACE_MIN, -1, "SSL continueWrite: partial write now complete for socket %d", pw->socket);
 		rc = 1;
 	}
+	else if (sslerror == SSL_ERROR_WANT_WRITE)
+		rc = 0; /* indicate we haven't finished writing the payload yet */
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+#if defined(SSLSOCKET_UNIT_TESTS)
+
+#include <stdio.h>
+#include <netinet/in.h>
+#include <openssl/x509.h>
+
+/* Measures TLS write throughput over loopback with several connections at once.  Each
+ * connection writes MQTT sized packets with SSLSocket_putdatas on its own thread, while a
+ * thread in the same process reads them.  The numbers of connections to try are given as
+ * arguments, 1 2 4 8 by default, and the total rate is printed for each.
+ */
+
+#define BENCH_SECONDS 3
+#define BENCH_PAYLOAD 1024
+
+typedef struct
+{
+	SSL* client;
+	SSL* server;
+	int client_sock;
+	int server_sock;
+	long long bytes;
+} bench_connection;
+
+static SSL_CTX* bench_client_ctx = NULL;
+static SSL_CTX* bench_server_ctx = NULL;
+static volatile int bench_stop = 0;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/* a server context with a newly generated key and self signed certificate */
+static SSL_CTX* bench_create_server_ctx(void)
+{
+	SSL_CTX* ctx = SSL_CTX_new(SSLv23_server_method());
+	EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+	EVP_PKEY* key = NULL;
+	X509* cert = X509_new();
+
+	EVP_PKEY_keygen_init(kctx);
+	EVP_PKEY_CTX_set_rsa_keygen_bits(kctx, 2048);
+	EVP_PKEY_keygen(kctx, &key);
+	EVP_PKEY_CTX_free(kctx);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_get_notBefore(cert), 0);
+	X509_gmtime_adj(X509_get_notAfter(cert), 3600);
+	X509_set_pubkey(cert, key);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (unsigned char*)"localhost", -1, -1, 0);
+	X509_set_issuer_name(cert, X509_get_subject_name(cert));
+	X509_sign(cert, key, EVP_sha256());
+	if (SSL_CTX_use_certificate(ctx, cert) != 1 || SSL_CTX_use_PrivateKey(ctx, key) != 1)
+		ERR_print_errors_fp(stderr);
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ctx;
+}
+
+
+thread_return_type bench_reader(void* n)
+{
+	bench_connection* conn = n;
+	char buf[SSL_RECORD_SIZE];
+
+	if (SSL_accept(conn->server) == 1)
+		while (SSL_read(conn->server, buf, sizeof(buf)) > 0)
+			;
+	return 0;
+}
+
+
+thread_return_type bench_writer(void* n)
+{
+	bench_connection* conn = n;
+	char header[5] = { 0x30, (char)0x8e, 0x08, 0x00, 0x0a };
+	char* buffers[2] = { "bench/tls/", NULL };
+	size_t buflens[2] = { 10, BENCH_PAYLOAD };
+	int frees[2] = { 0, 0 };
+
+	buffers[1] = calloc(1, BENCH_PAYLOAD);
+	while (!bench_stop)
+	{
+		if (SSLSocket_putdatas(conn->client, conn->client_sock, header, sizeof(header), 2, buffers, buflens, frees) != TCPSOCKET_COMPLETE)
+		{
+			printf("SSLSocket_putdatas failed\n");
+			break;
+		}
+		conn->bytes += sizeof(header) + buflens[0] + buflens[1];
+	}
+	free(buffers[1]);
+	return 0;
+}
+
+
+static int bench_connect(int listener, bench_connection* conn)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+
+	getsockname(listener, (struct sockaddr*)&addr, &addrlen);
+	conn->client_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(conn->client_sock, (struct sockaddr*)&addr, addrlen) != 0 ||
+			(conn->server_sock = accept(listener, NULL, NULL)) < 0)
+		return -1;
+	conn->server = SSL_new(bench_server_ctx);
+	SSL_set_fd(conn->server, conn->server_sock);
+	Thread_start(bench_reader, conn);
+	conn->client = SSL_new(bench_client_ctx);
+	SSL_set_fd(conn->client, conn->client_sock);
+	conn->bytes = 0;
+	return (SSL_connect(conn->client) == 1) ? 0 : -1;
+}
+
+
+static int bench_run(int listener, int count)
+{
+	bench_connection* conns = calloc(count, sizeof(bench_connection));
+	long long start, elapsed, bytes = 0;
+	int i, rc = 0;
+
+	for (i = 0; i < count && rc == 0; ++i)
+		rc = bench_connect(listener, &conns[i]);
+	if (rc != 0)
+	{
+		printf("TLS connection %d failed\n", i);
+		ERR_print_errors_fp(stderr);
+		return rc;
+	}
+	bench_stop = 0;
+	start = now_ns();
+	for (i = 0; i < count; ++i)
+		Thread_start(bench_writer, &conns[i]);
+	sleep(BENCH_SECONDS);
+	bench_stop = 1;
+	elapsed = now_ns() - start;
+	usleep(100000); /* let the writers finish their last packet */
+	for (i = 0; i < count; ++i)
+	{
+		networkHandles net;
+
+		bytes += conns[i].bytes;
+		net.ssl = conns[i].client;
+		net.ctx = NULL;
+		SSLSocket_close(&net);
+		close(conns[i].client_sock);
+	}
+	usleep(100000); /* and the readers see the connections close */
+	for (i = 0; i < count; ++i)
+	{
+		SSL_free(conns[i].server);
+		close(conns[i].server_sock);
+	}
+	printf("%d connections: %.1f MB/s, %.0f packets/s of %d bytes\n", count, bytes / (elapsed / 1e9) / 1e6,
+			bytes / (sizeof(char) * (5 + 10 + BENCH_PAYLOAD)) / (elapsed / 1e9), 5 + 10 + BENCH_PAYLOAD);
+	free(conns);
+	return rc;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int default_counts[] = { 1, 2, 4, 8 };
+	struct sockaddr_in addr;
+	int listener, i, rc = 0;
+
+	SSLSocket_initialize();
+	bench_server_ctx = bench_create_server_ctx();
+	bench_client_ctx = SSL_CTX_new(SSLv23_client_method());
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 10) != 0)
+	{
+		printf("Could not listen on loopback\n");
+		return -1;
+	}
+	if (argc > 1)
+	{
+		for (i = 1; i < argc && rc == 0; ++i)
+			rc = bench_run(listener, atoi(argv[i]));
+	}
 	else
 	{
-		int sslerror = SSLSocket_error("SSL_write", pw->ssl, pw->socket, rc);
-		if (sslerror == SSL_ERROR_WANT_WRITE)
-			rc = 0; /* indicate we haven't finished writing the payload yet */
+		for (i = 0; i < ARRAY_SIZE(default_counts) && rc == 0; ++i)
+			rc = bench_run(listener, default_counts[i]);
 	}
-	FUNC_EXIT_RC(rc);
+	close(listener);
+	SSL_CTX_free(bench_client_ctx);
+	SSL_CTX_free(bench_server_ctx);
+	SSLSocket_terminate();
 	return rc;
 }
+
+#endif
+
 #endif
@@ -32,7 +32,7 @@
 
 int SSLSocket_initialize();
 void SSLSocket_terminate();
-int SSLSocket_setSocketForSSL(networkHandles* net, MQTTClient_SSLOptions* opts);
+int SSLSocket_setSocketForSSL(networkHandles* net, MQTTClient_SSLOptions* opts, const char* address);
 int SSLSocket_getch(SSL* ssl, int socket, char* c);
 char *SSLSocket_getdata(SSL* ssl, int socket, size_t bytes, size_t* actual_len);
 
@@ -29,11 +29,14 @@
 #include "SocketBuffer.h"
 #include "Messages.h"
 #include "StackTrace.h"
+#include "Resolver.h"
+#include "Thread.h"
 #if defined(OPENSSL)
 #include "SSLSocket.h"
 #endif
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <signal.h>
 #include <ctype.h>
@@ -42,6 +45,35 @@
 
 int Socket_close_only(int socket);
 int Socket_continueWrites(fd_set* pwset);
+#if !defined(WIN32) && !defined(WIN64)
+static void Socket_raceSets(fd_set* rset, fd_set* wset, int* maxfdp1, struct timeval* timeout);
+static void Socket_continueRaces(fd_set* wset);
+static void Socket_abandonRace(int socket);
+
+/** how long to wait, in milliseconds, before racing a connect to the next address of a host (RFC 8305) */
+#if !defined(SOCKET_CONNECT_ATTEMPT_DELAY)
+#define SOCKET_CONNECT_ATTEMPT_DELAY 250
+#endif
+
+/**
+ * A TCP connect raced across the addresses of a host.  The caller of Socket_new only knows
+ * the socket of the first attempt, so a winning connection on another socket is moved onto it.
+ */
+typedef struct
+{
+	int socket;					/**< the socket returned by Socket_new */
+	int socket_pending;			/**< whether the connect on socket is still in progress */
+	int port;					/**< the TCP port */
+	Resolver_addresses addresses;	/**< in the order to try them */
+	int next;					/**< the index of the next address to try */
+	struct timeval next_start;	/**< when to start the next attempt, if none fails before then */
+	int attempts[RESOLVER_MAX_ADDRESSES]; /**< the sockets of the other attempts in progress */
+	int attempt_count;			/**< the number of entries in attempts */
+} connect_race;
+
+static pthread_mutex_t race_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type race_mutex = &race_mutex_store;
+#endif
 
 #if defined(WIN32) || defined(WIN64)
 #define iov_len len
@@ -54,6 +86,16 @@ int Socket_continueWrites(fd_set* pwset);
 Sockets s;
 static fd_set wset;
 
+/**
+ * An entry in the clientsds list, which holds its own list element.  The socket
+ * comes first so that the list content can still be read as an int.
+ */
+typedef struct
+{
+	int socket;
+	ListElement link;
+} clientsd;
+
 /**
  * Set a socket non-blocking, OS independently
  * @param sock the socket to set non-blocking
@@ -123,14 +165,27 @@ void Socket_outInitialize()
 #endif
 
 	SocketBuffer_initialize();
-	s.clientsds = ListInitialize();
+	Resolver_initialize();
+	s.clientsds = ListInitializeIntrusive(offsetof(clientsd, link));
 	s.connect_pending = ListInitialize();
 	s.write_pending = ListInitialize();
+#if !defined(WIN32) && !defined(WIN64)
+	s.connect_races = ListInitialize();
+#endif
 	s.cur_clientsds = NULL;
 	FD_ZERO(&(s.rset));														/* Initialize the descriptor set */
 	FD_ZERO(&(s.pending_wset));
 	s.maxfdp1 = 0;
 	memcpy((void*)&(s.rset_saved), (void*)&(s.rset), sizeof(s.rset_saved));
+#if !defined(WIN32) && !defined(WIN64)
+	if (pipe(s.wakeup) == 0)
+	{
+		Socket_setnonblocking(s.wakeup[0]);
+		Socket_setnonblocking(s.wakeup[1]);
+	}
+	else
+		s.wakeup[0] = s.wakeup[1] = -1;
+#endif
 	FUNC_EXIT;
 }
 
@@ -143,8 +198,20 @@ void Socket_outTerminate()
 	FUNC_ENTRY;
 	ListFree(s.connect_pending);
 	ListFree(s.write_pending);
+#if !defined(WIN32) && !defined(WIN64)
+	ListFree(s.connect_races);
+#endif
 	ListFree(s.clientsds);
 	SocketBuffer_terminate();
+	Resolver_terminate();
+#if !defined(WIN32) && !defined(WIN64)
+	if (s.wakeup[0] != -1)
+	{
+		close(s.wakeup[0]);
+		close(s.wakeup[1]);
+		s.wakeup[0] = s.wakeup[1] = -1;
+	}
+#endif
 #if defined(WIN32) || defined(WIN64)
 	WSACleanup();
 #endif
@@ -163,12 +230,13 @@ int Socket_addSocket(int newSd)
 	FUNC_ENTRY;
 	if (ListFindItem(s.clientsds, &newSd, intcompare) == NULL) /* make sure we don't add the same socket twice */
 	{
-		int* pnewSd = (int*)malloc(sizeof(newSd));
-		*pnewSd = newSd;
-		ListAppend(s.clientsds, pnewSd, sizeof(newSd));
+		clientsd* pnewSd = malloc(sizeof(clientsd));
+		pnewSd->socket = newSd;
+		ListAppend(s.clientsds, pnewSd, sizeof(clientsd));
 		FD_SET(newSd, &(s.rset_saved));
 		s.maxfdp1 = max(s.maxfdp1, newSd + 1);
 		rc = Socket_setnonblocking(newSd);
+		Socket_wakeup();
 	}
 	else
 		Log(LOG_ERROR, -1, "addSocket: socket %d already in the list", newSd);
@@ -232,17 +300,41 @@ int Socket_getReadySocket(int more_work, struct timeval *tp)
 
 	if (s.cur_clientsds == NULL)
 	{
-		int rc1;
+		int rc1, maxfdp1 = s.maxfdp1;
 		fd_set pwset;
 
+#if !defined(WIN32) && !defined(WIN64)
+	select_again:
+#endif
 		memcpy((void*)&(s.rset), (void*)&(s.rset_saved), sizeof(s.rset));
 		memcpy((void*)&(pwset), (void*)&(s.pending_wset), sizeof(pwset));
-		if ((rc = select(s.maxfdp1, &(s.rset), &pwset, NULL, &timeout)) == SOCKET_ERROR)
+#if !defined(WIN32) && !defined(WIN64)
+		if (s.wakeup[0] != -1)
+		{
+			FD_SET(s.wakeup[0], &(s.rset));
+			maxfdp1 = max(s.maxfdp1, s.wakeup[0] + 1);
+		}
+		Socket_raceSets(&(s.rset), &pwset, &maxfdp1, &timeout);
+#endif
+		if ((rc = select(maxfdp1, &(s.rset), &pwset, NULL, &timeout)) == SOCKET_ERROR)
 		{
 			Socket_error("read select", 0);
 			goto exit;
 		}
 		Log(TRACE_MAX, -1, "Return code %d from read select", rc);
+#if !defined(WIN32) && !defined(WIN64)
+		if (s.wakeup[0] != -1 && rc > 0 && FD_ISSET(s.wakeup[0], &(s.rset)))
+		{
+			char buf[32];
+
+			while (read(s.wakeup[0], buf, sizeof(buf)) > 0)
+				;
+			FD_CLR(s.wakeup[0], &(s.rset));
+			if (--rc == 0)
+				goto select_again; /* the sockets to wait for have changed, nothing else has happened */
+		}
+		Socket_continueRaces(&pwset);
+#endif
 
 		if (Socket_continueWrites(&pwset) == SOCKET_ERROR)
 		{
@@ -251,6 +343,9 @@ int Socket_getReadySocket(int more_work, struct timeval *tp)
 		}
 
 		memcpy((void*)&wset, (void*)&(s.rset_saved), sizeof(wset));
+#if !defined(WIN32) && !defined(WIN64)
+		Socket_raceSets(NULL, &wset, NULL, NULL);
+#endif
 		if ((rc1 = select(s.maxfdp1, NULL, &(wset), NULL, &zero)) == SOCKET_ERROR)
 		{
 			Socket_error("write select", 0);
@@ -479,7 +574,7 @@ int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** bu
 #endif
 			*sockmem = socket;
 			ListAppend(s.write_pending, sockmem, sizeof(int));
-			FD_SET(socket, &(s.pending_wset));
+			Socket_addPendingWrite(socket);
 			rc = TCPSOCKET_INTERRUPTED;
 		}
 	}
@@ -498,6 +593,7 @@ exit:
 void Socket_addPendingWrite(int socket)
 {
 	FD_SET(socket, &(s.pending_wset));
+	Socket_wakeup();
 }
 
 
@@ -512,6 +608,50 @@ void Socket_clearPendingWrite(int socket)
 }
 
 
+/**
+ *  End any select in progress in Socket_getReadySocket, so that it starts again with the current
+ *  sockets.  Otherwise a socket added while another thread is in select would not be waited for
+ *  until the select timed out.
+ */
+void Socket_wakeup(void)
+{
+#if !defined(WIN32) && !defined(WIN64)
+	if (s.wakeup[1] != -1 && write(s.wakeup[1], "", 1) < 0)
+		; /* the pipe is full, so a wakeup is already pending */
+#endif
+}
+
+
+/**
+ *  Have Socket_getReadySocket return a socket as soon as it is writable, rather than when it is
+ *  readable, as it does for a TCP connect in progress.  This is used when a TLS handshake needs
+ *  to write.
+ *  @param socket the socket
+ */
+void Socket_addPendingConnect(int socket)
+{
+	if (ListFindItem(s.connect_pending, &socket, intcompare) == NULL)
+	{
+		int* pnewSd = (int*)malloc(sizeof(int));
+		*pnewSd = socket;
+		ListAppend(s.connect_pending, pnewSd, sizeof(int));
+	}
+	Socket_addPendingWrite(socket);
+}
+
+
+/**
+ *  Undo Socket_addPendingConnect, so that the socket is returned by Socket_getReadySocket when it
+ *  is readable.
+ *  @param socket the socket
+ */
+void Socket_clearPendingConnect(int socket)
+{
+	ListRemoveItem(s.connect_pending, &socket, intcompare);
+	Socket_clearPendingWrite(socket);
+}
+
+
 /**
  *  Close a socket without removing it from the select list.
  *  @param socket the socket to close
@@ -548,6 +688,9 @@ int Socket_close_only(int socket)
 void Socket_close(int socket)
 {
 	FUNC_ENTRY;
+#if !defined(WIN32) && !defined(WIN64)
+	Socket_abandonRace(socket);
+#endif
 	Socket_close_only(socket);
 	FD_CLR(socket, &(s.rset_saved));
 	if (FD_ISSET(socket, &(s.pending_wset)))
@@ -578,109 +721,368 @@ void Socket_close(int socket)
 
 
 /**
- *  Create a new socket and TCP connect to an address/port
- *  @param addr the address string
+ *  Create a non-blocking socket and start a TCP connect to one address
+ *  @param address the address to connect to
  *  @param port the TCP port
- *  @param sock returns the new socket
- *  @return completion code
+ *  @param sock returns the new socket, or -1 if the connect failed
+ *  @return 0 if the connect has completed, EINPROGRESS or EWOULDBLOCK if it is in progress, otherwise an error
  */
-int Socket_new(char* addr, int port, int* sock)
+static int Socket_startConnect(Resolver_address* address, int port, int* sock)
 {
-	int type = SOCK_STREAM;
-	struct sockaddr_in address;
+	struct sockaddr_storage sa = address->addr;
+	int rc = SOCKET_ERROR;
+
+	FUNC_ENTRY;
+	if (address->family == AF_INET)
+		((struct sockaddr_in*)&sa)->sin_port = htons(port);
 #if defined(AF_INET6)
-	struct sockaddr_in6 address6;
+	else
+		((struct sockaddr_in6*)&sa)->sin6_port = htons(port);
 #endif
-	int rc = SOCKET_ERROR;
-#if defined(WIN32) || defined(WIN64)
-	short family;
-#else
-	sa_family_t family = AF_INET;
+
+	*sock =	(int)socket(address->family, SOCK_STREAM, 0);
+	if (*sock == INVALID_SOCKET)
+	{
+		rc = Socket_error("socket", *sock);
+		*sock = -1;
+		goto exit;
+	}
+#if defined(NOSIGPIPE)
+	{
+		int opt = 1;
+
+		if (setsockopt(*sock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
+			Log(LOG_ERROR, -1, "Could not set SO_NOSIGPIPE for socket %d", *sock);
+	}
 #endif
-	struct addrinfo *result = NULL;
-	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+	if (Socket_setnonblocking(*sock) == SOCKET_ERROR)
+		rc = Socket_error("setnonblocking", *sock);
+	/* this could complete immmediately, even though we are non-blocking */
+	else if ((rc = connect(*sock, (struct sockaddr*)&sa, address->len)) == SOCKET_ERROR)
+		rc = Socket_error("connect", *sock);
+	if (rc != 0 && rc != EINPROGRESS && rc != EWOULDBLOCK)
+	{
+		Socket_close_only(*sock);
+		*sock = -1;
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
 
-	FUNC_ENTRY;
-	*sock = -1;
-	memset(&address6, '\0', sizeof(address6));
 
-	if (addr[0] == '[')
-	  ++addr;
+/**
+ *  Put the addresses of a host in the order to try them: the first IPv4 address first, as this
+ *  library always has, then alternating between the address families, as RFC 8305 describes.
+ *  @param addresses the addresses to reorder
+ */
+static void Socket_orderAddresses(Resolver_addresses* addresses)
+{
+	Resolver_addresses ordered;
+	int taken[RESOLVER_MAX_ADDRESSES];
+	int family = AF_INET; /* the family to take the next address from, while it has any left */
 
-	if ((rc = getaddrinfo(addr, NULL, &hints, &result)) == 0)
+	memset(taken, '\0', sizeof(taken));
+	ordered.count = 0;
+	while (ordered.count < addresses->count)
 	{
-		struct addrinfo* res = result;
+		int i, j;
 
-		while (res)
-		{	/* prefer ip4 addresses */
-			if (res->ai_family == AF_INET || res->ai_next == NULL)
-				break;
-			res = res->ai_next;
+		for (i = 0; i < addresses->count && (taken[i] || addresses->addrs[i].family != family); ++i)
+			;
+		if (i == addresses->count)
+		{
+			for (i = 0; taken[i]; ++i)
+				;
 		}
+		taken[i] = 1;
+		ordered.addrs[ordered.count++] = addresses->addrs[i];
 
-		if (res == NULL)
-			rc = -1;
-		else
-#if defined(AF_INET6)
-		if (res->ai_family == AF_INET6)
+		for (j = 0; j < addresses->count && (taken[j] || addresses->addrs[j].family == addresses->addrs[i].family); ++j)
+			;
+		family = (j < addresses->count) ? addresses->addrs[j].family : addresses->addrs[i].family;
+	}
+	*addresses = ordered;
+}
+
+
+#if !defined(WIN32) && !defined(WIN64)
+/**
+ *  Add milliseconds to a time
+ *  @param tv the time to add to
+ *  @param ms the number of milliseconds to add
+ */
+static void Socket_addMilliseconds(struct timeval* tv, long ms)
+{
+	tv->tv_sec += ms / 1000;
+	tv->tv_usec += (ms % 1000) * 1000;
+	if (tv->tv_usec >= 1000000L)
+	{
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000L;
+	}
+}
+
+
+/**
+ *  Start racing connects to the remaining addresses of a host against the connect in progress
+ *  on a new socket.  The next address is tried after SOCKET_CONNECT_ATTEMPT_DELAY, or as soon
+ *  as an attempt fails.  The first connect to complete is kept, and if that was not on the
+ *  original socket, it is moved onto it, so the socket the caller has is always the one which
+ *  ends up connected.  The original socket is left out of the select sets until then.
+ *  @param socket the socket returned by Socket_new
+ *  @param port the TCP port
+ *  @param addresses the addresses of the host, in the order to try them
+ *  @param next the index of the first address not tried yet
+ */
+static void Socket_startRace(int socket, int port, Resolver_addresses* addresses, int next)
+{
+	connect_race* race = malloc(sizeof(connect_race));
+
+	FUNC_ENTRY;
+	memset(race, '\0', sizeof(connect_race));
+	race->socket = socket;
+	race->socket_pending = 1;
+	race->port = port;
+	race->addresses = *addresses;
+	race->next = next;
+	gettimeofday(&race->next_start, NULL);
+	Socket_addMilliseconds(&race->next_start, SOCKET_CONNECT_ATTEMPT_DELAY);
+	Thread_lock_mutex(race_mutex);
+	ListAppend(s.connect_races, race, sizeof(connect_race));
+	Thread_unlock_mutex(race_mutex);
+	Socket_wakeup(); /* so that the select timeout allows for the next attempt */
+	FUNC_EXIT;
+}
+
+
+/**
+ *  Set up the select sets for the connects being raced.  The sockets returned by Socket_new
+ *  are always taken out of the sets.  For the select which waits, the sockets with connects
+ *  in progress are put into the write set, and the timeout is cut to the next attempt's start.
+ *  @param rset the read set, or NULL
+ *  @param wset the write set
+ *  @param maxfdp1 the select nfds value to update, or NULL if this is not the waiting select
+ *  @param timeout the select timeout to update, or NULL
+ */
+static void Socket_raceSets(fd_set* rset, fd_set* wset, int* maxfdp1, struct timeval* timeout)
+{
+	ListElement* current = NULL;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	Thread_lock_mutex(race_mutex);
+	while (ListNextElement(s.connect_races, &current))
+	{
+		connect_race* race = (connect_race*)(current->content);
+		int i;
+
+		if (rset)
+			FD_CLR(race->socket, rset);
+		FD_CLR(race->socket, wset);
+		if (maxfdp1 == NULL)
+			continue;
+		if (race->socket_pending)
+			FD_SET(race->socket, wset);
+		for (i = 0; i < race->attempt_count; ++i)
 		{
-			address6.sin6_port = htons(port);
-			address6.sin6_family = family = AF_INET6;
-			memcpy(&address6.sin6_addr, &((struct sockaddr_in6*)(res->ai_addr))->sin6_addr, sizeof(address6.sin6_addr));
+			FD_SET(race->attempts[i], wset);
+			*maxfdp1 = max(*maxfdp1, race->attempts[i] + 1);
 		}
-		else
-#endif
-		if (res->ai_family == AF_INET)
+		if (timeout && race->next < race->addresses.count)
 		{
-			address.sin_port = htons(port);
-			address.sin_family = family = AF_INET;
-			address.sin_addr = ((struct sockaddr_in*)(res->ai_addr))->sin_addr;
+			struct timeval wait = {0L, 0L};
+
+			if (timercmp(&race->next_start, &now, >))
+				timersub(&race->next_start, &now, &wait);
+			if (timercmp(&wait, timeout, <))
+				*timeout = wait;
 		}
-		else
-			rc = -1;
+	}
+	Thread_unlock_mutex(race_mutex);
+}
 
-		freeaddrinfo(result);
+
+/**
+ *  Finish a race, keeping one connection.  The race must have been removed from the list.
+ *  @param race the race
+ *  @param winner the socket which has connected, or -1 if none has
+ */
+static void Socket_endRace(connect_race* race, int winner)
+{
+	int i;
+
+	for (i = 0; i < race->attempt_count; ++i)
+	{
+		if (race->attempts[i] != winner)
+			Socket_close_only(race->attempts[i]);
 	}
-	else
-	  	Log(LOG_ERROR, -1, "getaddrinfo failed for addr %s with rc %d", addr, rc);
+	if (winner != -1 && winner != race->socket)
+	{
+		/* replace the first attempt with the winner, under the socket number the caller has */
+		if (dup2(winner, race->socket) == -1)
+			Socket_error("dup2", race->socket);
+		close(winner);
+	}
+	free(race);
+}
 
-	if (rc != 0)
-		Log(LOG_ERROR, -1, "%s is not a valid IP address", addr);
-	else
+
+/**
+ *  Check the connects being raced after a select: start the next attempts when they are due,
+ *  and finish the races which have been won, or which have no attempts left.
+ *  @param wset the write set from the select
+ */
+static void Socket_continueRaces(fd_set* wset)
+{
+	ListElement* current = NULL;
+	struct timeval now;
+
+	FUNC_ENTRY;
+	gettimeofday(&now, NULL);
+	Thread_lock_mutex(race_mutex);
+	current = s.connect_races->first;
+	while (current)
 	{
-		*sock =	(int)socket(family, type, 0);
-		if (*sock == INVALID_SOCKET)
-			rc = Socket_error("socket", *sock);
-		else
+		connect_race* race = (connect_race*)(current->content);
+		int i = 0, winner = -1;
+
+		current = current->next;
+		if (race->socket_pending && FD_ISSET(race->socket, wset))
 		{
-#if defined(NOSIGPIPE)
-			int opt = 1;
+			struct sockaddr_storage peer;
+			socklen_t len = sizeof(peer);
+
+			/* not SO_ERROR, which has to be left for the caller in case every attempt fails */
+			if (getpeername(race->socket, (struct sockaddr*)&peer, &len) == 0)
+				winner = race->socket;
+			else
+			{
+				Log(TRACE_MIN, -1, "Connect attempt on socket %d failed", race->socket);
+				race->socket_pending = 0;
+				race->next_start = now;
+			}
+		}
+		while (winner == -1 && i < race->attempt_count)
+		{
+			int attempt = race->attempts[i];
+			int error = 0;
+			socklen_t len = sizeof(error);
+
+			if (!FD_ISSET(attempt, wset))
+				++i;
+			else if (getsockopt(attempt, SOL_SOCKET, SO_ERROR, (char*)&error, &len) == 0 && error == 0)
+				winner = attempt;
+			else
+			{
+				Log(TRACE_MIN, -1, "Connect attempt on socket %d for socket %d failed: %s", attempt, race->socket, strerror(error));
+				Socket_close_only(attempt);
+				race->attempts[i] = race->attempts[--race->attempt_count];
+				race->next_start = now;
+			}
+		}
+		while (winner == -1 && race->next < race->addresses.count && !timercmp(&race->next_start, &now, >))
+		{
+			int attempt = -1;
+			int rc = Socket_startConnect(&race->addresses.addrs[race->next++], race->port, &attempt);
+
+			if (attempt == -1)
+				continue;
+			Log(TRACE_MIN, -1, "Connect attempt %d on socket %d for socket %d", race->next, attempt, race->socket);
+			race->attempts[race->attempt_count++] = attempt;
+			if (rc == 0)
+				winner = attempt;
+			race->next_start = now;
+			Socket_addMilliseconds(&race->next_start, SOCKET_CONNECT_ATTEMPT_DELAY);
+		}
+		if (winner != -1)
+		{
+			Log(TRACE_MIN, -1, "Connect race for socket %d won by socket %d", race->socket, winner);
+			ListDetach(s.connect_races, race);
+			Socket_endRace(race, winner);
+		}
+		else if (!race->socket_pending && race->attempt_count == 0 && race->next == race->addresses.count)
+		{
+			Log(TRACE_MIN, -1, "All connect attempts for socket %d failed", race->socket);
+			ListDetach(s.connect_races, race);
+			Socket_endRace(race, -1);
+		}
+	}
+	Thread_unlock_mutex(race_mutex);
+	FUNC_EXIT;
+}
 
-			if (setsockopt(*sock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
-				Log(LOG_ERROR, -1, "Could not set SO_NOSIGPIPE for socket %d", *sock);
+
+/**
+ *  Stop racing connects for a socket which is being closed
+ *  @param socket the socket returned by Socket_new
+ */
+static void Socket_abandonRace(int socket)
+{
+	ListElement* current = NULL;
+
+	Thread_lock_mutex(race_mutex);
+	while (ListNextElement(s.connect_races, &current))
+	{
+		connect_race* race = (connect_race*)(current->content);
+
+		if (race->socket == socket)
+		{
+			ListDetach(s.connect_races, race);
+			Socket_endRace(race, -1);
+			break;
+		}
+	}
+	Thread_unlock_mutex(race_mutex);
+}
 #endif
 
+
+/**
+ *  Create a new socket and TCP connect to an address/port.  When the host has more than one
+ *  address, and the connect does not complete immediately, connects to the other addresses
+ *  are raced against it (see Socket_startRace).
+ *  @param addr the address string
+ *  @param port the TCP port
+ *  @param sock returns the new socket
+ *  @return completion code
+ */
+int Socket_new(char* addr, int port, int* sock)
+{
+	int rc = SOCKET_ERROR;
+	Resolver_addresses addresses;
+
+	FUNC_ENTRY;
+	*sock = -1;
+
+	if (addr[0] == '[')
+	  ++addr;
+
+	if ((rc = Resolver_resolve(addr, &addresses)) != 0)
+		Log(LOG_ERROR, -1, "%s is not a valid IP address", addr);
+	else
+	{
+		int i = 0;
+
+		Socket_orderAddresses(&addresses);
+		/* an address which fails straight away, for want of a route say, is skipped */
+		while ((rc = Socket_startConnect(&addresses.addrs[i], port, sock)) != 0 && *sock == -1 && ++i < addresses.count)
+			;
+		if (*sock != -1)
+		{
 			Log(TRACE_MIN, -1, "New socket %d for %s, port %d",	*sock, addr, port);
 			if (Socket_addSocket(*sock) == SOCKET_ERROR)
 				rc = Socket_error("setnonblocking", *sock);
-			else
+			else if (rc == EINPROGRESS || rc == EWOULDBLOCK)
 			{
-				/* this could complete immmediately, even though we are non-blocking */
-				if (family == AF_INET)
-					rc = connect(*sock, (struct sockaddr*)&address, sizeof(address));
-	#if defined(AF_INET6)
-				else
-					rc = connect(*sock, (struct sockaddr*)&address6, sizeof(address6));
-	#endif
-				if (rc == SOCKET_ERROR)
-					rc = Socket_error("connect", *sock);
-				if (rc == EINPROGRESS || rc == EWOULDBLOCK)
-				{
-					int* pnewSd = (int*)malloc(sizeof(int));
-					*pnewSd = *sock;
-					ListAppend(s.connect_pending, pnewSd, sizeof(int));
-					Log(TRACE_MIN, 15, "Connect pending");
-				}
+				int* pnewSd = (int*)malloc(sizeof(int));
+				*pnewSd = *sock;
+				ListAppend(s.connect_pending, pnewSd, sizeof(int));
+				Log(TRACE_MIN, 15, "Connect pending");
+#if !defined(WIN32) && !defined(WIN64)
+				if (i + 1 < addresses.count)
+					Socket_startRace(*sock, port, &addresses, i + 1);
+#endif
 			}
 		}
 	}
@@ -108,6 +108,10 @@ typedef struct
 	List* connect_pending; /**< list of sockets for which a connect is pending */
 	List* write_pending; /**< list of sockets for which a write is pending */
 	fd_set pending_wset; /**< socket pending write set for select */
+#if !defined(WIN32) && !defined(WIN64)
+	int wakeup[2]; /**< pipe written to by Socket_wakeup to end a select early */
+	List* connect_races; /**< connects being raced across the addresses of a host */
+#endif
 } Sockets;
 
 
@@ -125,6 +129,9 @@ char* Socket_getpeer(int sock);
 
 void Socket_addPendingWrite(int socket);
 void Socket_clearPendingWrite(int socket);
+void Socket_wakeup(void);
+void Socket_addPendingConnect(int socket);
+void Socket_clearPendingConnect(int socket);
 
 typedef void Socket_writeComplete(int socket);
 void Socket_setWriteCompleteCallback(Socket_writeComplete*);
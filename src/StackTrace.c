@@ -14,6 +14,15 @@
  *    Ian Craggs - initial API and implementation and/or initial documentation
  *******************************************************************************/
 
+/**
+ * @file
+ * \brief Function call stacks for each thread, recorded by FUNC_ENTRY and FUNC_EXIT
+ *
+ * Each thread records its own stack, found through a thread local pointer, so no lock
+ * is needed.  Function names are recorded as pointers to the __func__ strings, which
+ * are never freed, so that other threads can print the stacks at any time.
+ */
+
 #include "StackTrace.h"
 #include "Log.h"
 #include "LinkedList.h"
@@ -27,6 +36,11 @@
 
 #if defined(WIN32) || defined(WIN64)
 #define snprintf _snprintf
+#define thread_local __declspec(thread)
+#define StackTrace_claimSlot(p) (InterlockedCompareExchange((p), 1, 0) == 0)
+#else
+#define thread_local __thread
+#define StackTrace_claimSlot(p) __sync_bool_compare_and_swap((p), 0, 1)
 #endif
 
 /*BE
@@ -40,100 +54,175 @@ defList(STACKENTRY)
 BE*/
 
 #define MAX_STACK_DEPTH 50
-#define MAX_FUNCTION_NAME_LENGTH 30
 #define MAX_THREADS 255
 
+#if !defined(min)
+#define min(A,B) ( (A) < (B) ? (A):(B))
+#endif
+
 typedef struct
 {
-	thread_id_type threadid;
-	char name[MAX_FUNCTION_NAME_LENGTH];
+	const char* name;	/**< the __func__ string, not a copy */
 	int line;
 } stackEntry;
 
 typedef struct
 {
+	volatile long in_use;	/**< claimed by a live thread? */
 	thread_id_type id;
 	int maxdepth;
-	int current_depth;
+	volatile int current_depth;
 	stackEntry callstack[MAX_STACK_DEPTH];
 } threadEntry;
 
 #include "StackTrace.h"
 
-static int thread_count = 0;
 static threadEntry threads[MAX_THREADS];
-static threadEntry *cur_thread = NULL;
+static thread_local threadEntry* cur_thread = NULL;
+static thread_local int no_slot = 0;	/**< all the slots were in use when this thread tried to claim one, or it is ending */
 
 #if defined(WIN32) || defined(WIN64)
-mutex_type stack_mutex;
+static DWORD thread_end_key = FLS_OUT_OF_INDEXES;
+static volatile long thread_end_key_state = 0; /**< 0 = not created, 1 = being created, 2 = created */
 #else
-static pthread_mutex_t stack_mutex_store = PTHREAD_MUTEX_INITIALIZER;
-static mutex_type stack_mutex = &stack_mutex_store;
+static pthread_key_t thread_end_key;
+static pthread_once_t thread_end_key_once = PTHREAD_ONCE_INIT;
 #endif
 
 
-int setStack(int create)
+/**
+ * Free the stack slot of a thread as it ends, so that another thread can use it.  Other
+ * thread end handlers may still call FUNC_ENTRY in this thread afterwards, so it is left
+ * with no slot rather than pointing at one another thread could claim.
+ * @param slot the thread's slot
+ */
+#if defined(WIN32) || defined(WIN64)
+static VOID WINAPI StackTrace_threadEnd(PVOID slot)
+#else
+static void StackTrace_threadEnd(void* slot)
+#endif
 {
-	int i = -1;
-	thread_id_type curid = Thread_getid();
+	threadEntry* entry = (threadEntry*)slot;
 
 	cur_thread = NULL;
-	for (i = 0; i < MAX_THREADS && i < thread_count; ++i)
+	no_slot = 1;
+	if (entry)
+	{
+		entry->current_depth = 0;
+		entry->in_use = 0;
+	}
+}
+
+
+#if !defined(WIN32) && !defined(WIN64)
+static void StackTrace_createKey(void)
+{
+	pthread_key_create(&thread_end_key, StackTrace_threadEnd);
+}
+#endif
+
+
+/**
+ * Arrange for StackTrace_threadEnd to be called when the calling thread ends.
+ * @param slot the thread's slot
+ */
+static void StackTrace_onThreadEnd(threadEntry* slot)
+{
+#if defined(WIN32) || defined(WIN64)
+	if (thread_end_key_state != 2)
 	{
-		if (threads[i].id == curid)
+		if (InterlockedCompareExchange(&thread_end_key_state, 1, 0) == 0)
 		{
-			cur_thread = &threads[i];
-			break;
+			thread_end_key = FlsAlloc(StackTrace_threadEnd);
+			thread_end_key_state = 2;
+		}
+		else
+		{
+			while (thread_end_key_state != 2)
+				Sleep(0);
 		}
 	}
+	if (thread_end_key != FLS_OUT_OF_INDEXES)
+		FlsSetValue(thread_end_key, slot);
+#else
+	pthread_once(&thread_end_key_once, StackTrace_createKey);
+	pthread_setspecific(thread_end_key, slot);
+#endif
+}
 
-	if (cur_thread == NULL && create && thread_count < MAX_THREADS)
+
+/**
+ * Claim a free slot in the threads table for the calling thread.  This only happens the
+ * first time a thread calls FUNC_ENTRY.
+ * @return the slot, or NULL if all are in use
+ */
+static threadEntry* setStack(void)
+{
+	int i;
+
+	if (no_slot)
+		return NULL;
+	for (i = 0; i < MAX_THREADS; ++i)
 	{
-		cur_thread = &threads[thread_count];
-		cur_thread->id = curid;
-		cur_thread->maxdepth = 0;
-		cur_thread->current_depth = 0;
-		++thread_count;
+		if (threads[i].in_use == 0 && StackTrace_claimSlot(&threads[i].in_use))
+		{
+			cur_thread = &threads[i];
+			cur_thread->id = Thread_getid();
+			cur_thread->maxdepth = 0;
+			cur_thread->current_depth = 0;
+			StackTrace_onThreadEnd(cur_thread);
+			break;
+		}
 	}
-	return cur_thread != NULL; /* good == 1 */
+	if (cur_thread == NULL)
+		no_slot = 1;
+	return cur_thread;
 }
 
+
 void StackTrace_entry(const char* name, int line, int trace_level)
 {
-	Thread_lock_mutex(stack_mutex);
-	if (!setStack(1))
-		goto exit;
+	threadEntry* cur = cur_thread;
+	int depth;
+
+	if (cur == NULL && (cur = setStack()) == NULL)
+		return;
+	depth = cur->current_depth;
 	if (trace_level != -1)
-		Log_stackTrace(trace_level, 9, (int)cur_thread->id, cur_thread->current_depth, name, line, NULL);
-	strncpy(cur_thread->callstack[cur_thread->current_depth].name, name, sizeof(cur_thread->callstack[0].name)-1);
-	cur_thread->callstack[(cur_thread->current_depth)++].line = line;
-	if (cur_thread->current_depth > cur_thread->maxdepth)
-		cur_thread->maxdepth = cur_thread->current_depth;
-	if (cur_thread->current_depth >= MAX_STACK_DEPTH)
+		Log_stackTrace(trace_level, 9, (int)cur->id, depth, name, line, NULL);
+	if (depth < MAX_STACK_DEPTH)
+	{
+		cur->callstack[depth].name = name;
+		cur->callstack[depth].line = line;
+	}
+	cur->current_depth = ++depth;
+	if (depth > cur->maxdepth)
+		cur->maxdepth = depth;
+	if (depth >= MAX_STACK_DEPTH)
 		Log(LOG_FATAL, -1, "Max stack depth exceeded");
-exit:
-	Thread_unlock_mutex(stack_mutex);
 }
 
 
 void StackTrace_exit(const char* name, int line, void* rc, int trace_level)
 {
-	Thread_lock_mutex(stack_mutex);
-	if (!setStack(0))
-		goto exit;
-	if (--(cur_thread->current_depth) < 0)
-		Log(LOG_FATAL, -1, "Minimum stack depth exceeded for thread %lu", cur_thread->id);
-	if (strncmp(cur_thread->callstack[cur_thread->current_depth].name, name, sizeof(cur_thread->callstack[0].name)-1) != 0)
-		Log(LOG_FATAL, -1, "Stack mismatch. Entry:%s Exit:%s\n", cur_thread->callstack[cur_thread->current_depth].name, name);
+	threadEntry* cur = cur_thread;
+	int depth;
+
+	if (cur == NULL)
+		return;
+	depth = --(cur->current_depth);
+	if (depth < 0)
+		Log(LOG_FATAL, -1, "Minimum stack depth exceeded for thread %lu", cur->id);
+	else if (depth < MAX_STACK_DEPTH && cur->callstack[depth].name != name &&
+			strcmp(cur->callstack[depth].name, name) != 0)
+		Log(LOG_FATAL, -1, "Stack mismatch. Entry:%s Exit:%s\n", cur->callstack[depth].name, name);
 	if (trace_level != -1)
 	{
 		if (rc == NULL)
-			Log_stackTrace(trace_level, 10, (int)cur_thread->id, cur_thread->current_depth, name, line, NULL);
+			Log_stackTrace(trace_level, 10, (int)cur->id, depth, name, line, NULL);
 		else
-			Log_stackTrace(trace_level, 11, (int)cur_thread->id, cur_thread->current_depth, name, line, (int*)rc);
+			Log_stackTrace(trace_level, 11, (int)cur->id, depth, name, line, (int*)rc);
 	}
-exit:
-	Thread_unlock_mutex(stack_mutex);
 }
 
 
@@ -144,13 +233,13 @@ void StackTrace_printStack(FILE* dest)
 
 	if (dest)
 		file = dest;
-	for (t = 0; t < thread_count; ++t)
+	for (t = 0; t < MAX_THREADS; ++t)
 	{
 		threadEntry *cur_thread = &threads[t];
 
-		if (cur_thread->id > 0)
+		if (cur_thread->in_use)
 		{
-			int i = cur_thread->current_depth - 1;
+			int i = min(cur_thread->current_depth, MAX_STACK_DEPTH) - 1;
 
 			fprintf(file, "=========== Start of stack trace for thread %lu ==========\n", (unsigned long)cur_thread->id);
 			if (i >= 0)
@@ -176,13 +265,13 @@ char* StackTrace_get(thread_id_type threadid)
 	if ((buf = malloc(bufsize)) == NULL)
 		goto exit;
 	buf[0] = '\0';
-	for (t = 0; t < thread_count; ++t)
+	for (t = 0; t < MAX_THREADS; ++t)
 	{
 		threadEntry *cur_thread = &threads[t];
 
-		if (cur_thread->id == threadid)
+		if (cur_thread->in_use && cur_thread->id == threadid)
 		{
-			int i = cur_thread->current_depth - 1;
+			int i = min(cur_thread->current_depth, MAX_STACK_DEPTH) - 1;
 			int curpos = 0;
 
 			if (i >= 0)
@@ -34,32 +34,29 @@
 #define FUNC_EXIT_MED_RC(x)
 #define FUNC_EXIT_MAX_RC(x)
 #else
+/* Trace levels below PAHO_TRACE_MIN_LEVEL become -1, which still records the call stack for FFDC but logs nothing */
+#if defined(PAHO_TRACE_MIN_LEVEL)
+#define StackTrace_level(level) (Log_compiledIn(level) ? (level) : -1)
+#else
+#define StackTrace_level(level) (level)
+#endif
 #if defined(WIN32) || defined(WIN64)
 #define inline __inline
-#define FUNC_ENTRY StackTrace_entry(__FUNCTION__, __LINE__, TRACE_MINIMUM)
-#define FUNC_ENTRY_NOLOG StackTrace_entry(__FUNCTION__, __LINE__, -1)
-#define FUNC_ENTRY_MED StackTrace_entry(__FUNCTION__, __LINE__, TRACE_MEDIUM)
-#define FUNC_ENTRY_MAX StackTrace_entry(__FUNCTION__, __LINE__, TRACE_MAXIMUM)
-#define FUNC_EXIT StackTrace_exit(__FUNCTION__, __LINE__, NULL, TRACE_MINIMUM)
-#define FUNC_EXIT_NOLOG StackTrace_exit(__FUNCTION__, __LINE__, -1)
-#define FUNC_EXIT_MED StackTrace_exit(__FUNCTION__, __LINE__, NULL, TRACE_MEDIUM)
-#define FUNC_EXIT_MAX StackTrace_exit(__FUNCTION__, __LINE__, NULL, TRACE_MAXIMUM)
-#define FUNC_EXIT_RC(x) StackTrace_exit(__FUNCTION__, __LINE__, &x, TRACE_MINIMUM)
-#define FUNC_EXIT_MED_RC(x) StackTrace_exit(__FUNCTION__, __LINE__, &x, TRACE_MEDIUM)
-#define FUNC_EXIT_MAX_RC(x) StackTrace_exit(__FUNCTION__, __LINE__, &x, TRACE_MAXIMUM)
+#define StackTrace_name __FUNCTION__
 #else
-#define FUNC_ENTRY StackTrace_entry(__func__, __LINE__, TRACE_MINIMUM)
-#define FUNC_ENTRY_NOLOG StackTrace_entry(__func__, __LINE__, -1)
-#define FUNC_ENTRY_MED StackTrace_entry(__func__, __LINE__, TRACE_MEDIUM)
-#define FUNC_ENTRY_MAX StackTrace_entry(__func__, __LINE__, TRACE_MAXIMUM)
-#define FUNC_EXIT StackTrace_exit(__func__, __LINE__, NULL, TRACE_MINIMUM)
-#define FUNC_EXIT_NOLOG StackTrace_exit(__func__, __LINE__, NULL, -1)
-#define FUNC_EXIT_MED StackTrace_exit(__func__, __LINE__, NULL, TRACE_MEDIUM)
-#define FUNC_EXIT_MAX StackTrace_exit(__func__, __LINE__, NULL, TRACE_MAXIMUM)
-#define FUNC_EXIT_RC(x) StackTrace_exit(__func__, __LINE__, &x, TRACE_MINIMUM)
-#define FUNC_EXIT_MED_RC(x) StackTrace_exit(__func__, __LINE__, &x, TRACE_MEDIUM)
-#define FUNC_EXIT_MAX_RC(x) StackTrace_exit(__func__, __LINE__, &x, TRACE_MAXIMUM)
+#define StackTrace_name __func__
 #endif
+#define FUNC_ENTRY StackTrace_entry(StackTrace_name, __LINE__, StackTrace_level(TRACE_MINIMUM))
+#define FUNC_ENTRY_NOLOG StackTrace_entry(StackTrace_name, __LINE__, -1)
+#define FUNC_ENTRY_MED StackTrace_entry(StackTrace_name, __LINE__, StackTrace_level(TRACE_MEDIUM))
+#define FUNC_ENTRY_MAX StackTrace_entry(StackTrace_name, __LINE__, StackTrace_level(TRACE_MAXIMUM))
+#define FUNC_EXIT StackTrace_exit(StackTrace_name, __LINE__, NULL, StackTrace_level(TRACE_MINIMUM))
+#define FUNC_EXIT_NOLOG StackTrace_exit(StackTrace_name, __LINE__, NULL, -1)
+#define FUNC_EXIT_MED StackTrace_exit(StackTrace_name, __LINE__, NULL, StackTrace_level(TRACE_MEDIUM))
+#define FUNC_EXIT_MAX StackTrace_exit(StackTrace_name, __LINE__, NULL, StackTrace_level(TRACE_MAXIMUM))
+#define FUNC_EXIT_RC(x) StackTrace_exit(StackTrace_name, __LINE__, &x, StackTrace_level(TRACE_MINIMUM))
+#define FUNC_EXIT_MED_RC(x) StackTrace_exit(StackTrace_name, __LINE__, &x, StackTrace_level(TRACE_MEDIUM))
+#define FUNC_EXIT_MAX_RC(x) StackTrace_exit(StackTrace_name, __LINE__, &x, StackTrace_level(TRACE_MAXIMUM))
 #endif
 
 void StackTrace_entry(const char* name, int line, int trace);
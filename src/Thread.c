@@ -43,6 +43,11 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <time.h>
+#endif
+#if defined(USE_FUTEX_SEMAPHORES)
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #endif
 #include <memory.h>
 #include <stdlib.h>
@@ -190,6 +195,33 @@ static struct
 #endif
 
 
+#if defined(USE_FUTEX_SEMAPHORES)
+/**
+ * Block until the value at addr is no longer val, it is woken, or the timeout expires.
+ * @param addr the futex
+ * @param val the value the futex is expected to hold
+ * @param timeout the maximum time to wait, relative, measured on CLOCK_MONOTONIC
+ * @return 0 if woken, -1 otherwise (errno is EAGAIN if the value had already changed)
+ */
+static int Thread_futex_wait(volatile int* addr, int val, struct timespec* timeout)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+
+/**
+ * Wake up to count threads waiting on a futex
+ * @param addr the futex
+ * @param count the maximum number of threads to wake
+ * @return the number of threads woken, or -1 on error
+ */
+static int Thread_futex_wake(volatile int* addr, int count)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#endif
+
+
 /**
  * Create a new semaphore
  * @return the new condition variable
@@ -228,6 +260,9 @@ sem_type Thread_create_sem()
     			}
     		}
     	}
+	#elif defined(USE_FUTEX_SEMAPHORES)
+		if ((sem = calloc(1, sizeof(sem_type_struct))) == NULL)
+			rc = -1;
 	#else
 		sem = malloc(sizeof(sem_t));
 		rc = sem_init(sem, 0, 0);
@@ -241,29 +276,30 @@ sem_type Thread_create_sem()
  * Wait for a semaphore to be posted, or timeout.
  * @param sem the semaphore
  * @param timeout the maximum time to wait, in milliseconds
- * @return completion code
+ * @return completion code, 0 if the semaphore was taken
  */
 int Thread_wait_sem(sem_type sem, int timeout)
 {
 /* sem_timedwait is the obvious call to use, but seemed not to work on the Viper,
  * so I've used trywait in a loop instead. Ian Craggs 23/7/2010
+ *
+ * The trywait loop is now only used for named semaphores, where there is no
+ * sem_timedwait on OS X.  Elsewhere the wait blocks, so that a post wakes the
+ * waiter straight away rather than at the next 10ms poll.
  */
 	int rc = -1;
-#if !defined(WIN32) && !defined(WIN64)
-#define USE_TRYWAIT
-#if defined(USE_TRYWAIT)
+#if defined(USE_NAMED_SEMAPHORES)
 	int i = 0;
 	int interval = 10000; /* 10000 microseconds: 10 milliseconds */
 	int count = (1000 * timeout) / interval; /* how many intervals in timeout period */
-#else
+#elif !defined(WIN32) && !defined(WIN64)
 	struct timespec ts;
-#endif
 #endif
 
 	FUNC_ENTRY;
 	#if defined(WIN32) || defined(WIN64)
 		rc = WaitForSingleObject(sem, timeout);
-	#elif defined(USE_TRYWAIT)
+	#elif defined(USE_NAMED_SEMAPHORES)
 		while (++i < count && (rc = sem_trywait(sem)) != 0)
 		{
 			if (rc == -1 && ((rc = errno) != EAGAIN))
@@ -273,11 +309,68 @@ int Thread_wait_sem(sem_type sem, int timeout)
 			}
 			usleep(interval); /* microseconds - .1 of a second */
 		}
+	#elif defined(USE_FUTEX_SEMAPHORES)
+		if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+			rc = errno;
+		else
+		{
+			struct timespec deadline = ts;
+
+			deadline.tv_sec += timeout / 1000;
+			deadline.tv_nsec += (timeout % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			while (1)
+			{
+				int value = sem->value;
+				struct timespec remaining;
+
+				if (value > 0)
+				{
+					if (__sync_bool_compare_and_swap(&sem->value, value, value - 1))
+					{
+						rc = 0;
+						break;
+					}
+					continue; /* another thread took it first */
+				}
+				clock_gettime(CLOCK_MONOTONIC, &ts);
+				remaining.tv_sec = deadline.tv_sec - ts.tv_sec;
+				remaining.tv_nsec = deadline.tv_nsec - ts.tv_nsec;
+				if (remaining.tv_nsec < 0)
+				{
+					remaining.tv_sec--;
+					remaining.tv_nsec += 1000000000L;
+				}
+				if (remaining.tv_sec < 0)
+				{
+					rc = ETIMEDOUT;
+					break;
+				}
+				/* the waiter count is raised before the value is checked by the kernel, and Thread_post_sem
+				 * raises the value before it reads the count, so either the post wakes us or we don't sleep */
+				__sync_fetch_and_add(&sem->waiters, 1);
+				Thread_futex_wait(&sem->value, 0, &remaining);
+				__sync_fetch_and_sub(&sem->waiters, 1);
+			}
+		}
 	#else
 		if (clock_gettime(CLOCK_REALTIME, &ts) != -1)
 		{
-			ts.tv_sec += timeout;
-			rc = sem_timedwait(sem, &ts);
+			ts.tv_sec += timeout / 1000;
+			ts.tv_nsec += (timeout % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			while ((rc = sem_timedwait(sem, &ts)) == -1 && errno == EINTR)
+				;
+			if (rc == -1)
+				rc = errno;
 		}
 	#endif
 
@@ -295,6 +388,8 @@ int Thread_check_sem(sem_type sem)
 {
 #if defined(WIN32) || defined(WIN64)
 	return WaitForSingleObject(sem, 0) == WAIT_OBJECT_0;
+#elif defined(USE_FUTEX_SEMAPHORES)
+	return sem->value > 0;
 #else
 	int semval = -1;
 	sem_getvalue(sem, &semval);
@@ -316,6 +411,10 @@ int Thread_post_sem(sem_type sem)
 	#if defined(WIN32) || defined(WIN64)
 		if (SetEvent(sem) == 0)
 			rc = GetLastError();
+	#elif defined(USE_FUTEX_SEMAPHORES)
+		__sync_fetch_and_add(&sem->value, 1);
+		if (sem->waiters > 0 && Thread_futex_wake(&sem->value, 1) == -1)
+			rc = errno;
 	#else
 		if (sem_post(sem) == -1)
 			rc = errno;
@@ -350,6 +449,8 @@ int Thread_destroy_sem(sem_type sem)
     		}
     	}
     	named_semaphore_count--;
+	#elif defined(USE_FUTEX_SEMAPHORES)
+		free(sem);
 	#else
 		rc = sem_destroy(sem);
 		free(sem);
@@ -360,6 +461,35 @@ int Thread_destroy_sem(sem_type sem)
 
 
 #if !defined(WIN32) && !defined(WIN64)
+#if defined(__linux__)
+#define THREAD_COND_CLOCK CLOCK_MONOTONIC /**< timed waits are not affected by changes to the system time */
+#endif
+
+/**
+ * Initialize a condition variable structure, which need not have been allocated by
+ * Thread_create_cond
+ * @param condvar the condition variable struct
+ * @param attr the attributes for the mutex, or NULL for the defaults
+ * @return completion code
+ */
+int Thread_init_cond(cond_type condvar, pthread_mutexattr_t* attr)
+{
+	pthread_condattr_t condattr;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	pthread_condattr_init(&condattr);
+#if defined(THREAD_COND_CLOCK)
+	pthread_condattr_setclock(&condattr, THREAD_COND_CLOCK);
+#endif
+	if ((rc = pthread_cond_init(&condvar->cond, &condattr)) == 0)
+		rc = pthread_mutex_init(&condvar->mutex, attr);
+	pthread_condattr_destroy(&condattr);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Create a new condition variable
  * @return the condition variable struct
@@ -371,8 +501,7 @@ cond_type Thread_create_cond()
 
 	FUNC_ENTRY;
 	condvar = malloc(sizeof(cond_type_struct));
-	rc = pthread_cond_init(&condvar->cond, NULL);
-	rc = pthread_mutex_init(&condvar->mutex, NULL);
+	rc = Thread_init_cond(condvar, NULL);
 
 	FUNC_EXIT_RC(rc);
 	return condvar;
@@ -402,12 +531,17 @@ int Thread_wait_cond(cond_type condvar, int timeout)
 	FUNC_ENTRY;
 	int rc = 0;
 	struct timespec cond_timeout;
+#if defined(THREAD_COND_CLOCK)
+	clock_gettime(THREAD_COND_CLOCK, &cond_timeout);
+	cond_timeout.tv_sec += timeout;
+#else
 	struct timeval cur_time;
 
 	gettimeofday(&cur_time, NULL);
 
 	cond_timeout.tv_sec = cur_time.tv_sec + timeout;
 	cond_timeout.tv_nsec = cur_time.tv_usec * 1000;
+#endif
 
 	pthread_mutex_lock(&condvar->mutex);
 	rc = pthread_cond_timedwait(&condvar->cond, &condvar->mutex, &cond_timeout);
@@ -438,59 +572,122 @@ int Thread_destroy_cond(cond_type condvar)
 
 #include <stdio.h>
 
-thread_return_type secondary(void* n)
+/* Measures the wake to run latency of the semaphore and condition variable calls:
+ * the time from one thread posting or signalling until the waiting thread runs.
+ * The distribution is printed in microseconds.
+ */
+
+#define SAMPLES 1000
+
+static volatile long long posted_at = 0;
+static long long latencies[SAMPLES];
+static volatile int done = 0;
+
+static long long now_ns(void)
 {
-	int rc = 0;
+	struct timespec ts;
 
-	/*
-	cond_type cond = n;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-	printf("Secondary thread about to wait\n");
-	rc = Thread_wait_cond(cond);
-	printf("Secondary thread returned from wait %d\n", rc);*/
 
+thread_return_type sem_waiter(void* n)
+{
 	sem_type sem = n;
+	int i;
 
-	printf("Secondary thread about to wait\n");
-	rc = Thread_wait_sem(sem);
-	printf("Secondary thread returned from wait %d\n", rc);
+	for (i = 0; i < SAMPLES; ++i)
+	{
+		if (Thread_wait_sem(sem, 5000) != 0)
+		{
+			printf("Semaphore wait %d timed out\n", i);
+			break;
+		}
+		latencies[i] = now_ns() - posted_at;
+	}
+	done = 1;
+	return 0;
+}
 
-	printf("Secondary thread about to wait\n");
-	rc = Thread_wait_sem(sem);
-	printf("Secondary thread returned from wait %d\n", rc);
-	printf("Secondary check sem %d\n", Thread_check_sem(sem));
 
+thread_return_type cond_waiter(void* n)
+{
+	cond_type cond = n;
+	int i;
+
+	for (i = 0; i < SAMPLES; ++i)
+	{
+		pthread_mutex_lock(&cond->mutex);
+		while (posted_at == 0)
+			pthread_cond_wait(&cond->cond, &cond->mutex);
+		latencies[i] = now_ns() - posted_at;
+		posted_at = 0;
+		pthread_mutex_unlock(&cond->mutex);
+	}
+	done = 1;
 	return 0;
 }
 
 
-int main(int argc, char *argv[])
+static int compare_latency(const void* a, const void* b)
 {
-	int rc = 0;
+	long long la = *(const long long*)a, lb = *(const long long*)b;
 
-	sem_type sem = Thread_create_sem();
+	return (la < lb) ? -1 : (la > lb);
+}
 
-	printf("check sem %d\n", Thread_check_sem(sem));
 
-	printf("post secondary\n");
-	rc = Thread_post_sem(sem);
-	printf("posted secondary %d\n", rc);
+static void print_latencies(const char* name)
+{
+	qsort(latencies, SAMPLES, sizeof(latencies[0]), compare_latency);
+	printf("%s wake to run latency (us): min %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n", name,
+			latencies[0] / 1000.0, latencies[SAMPLES / 2] / 1000.0, latencies[SAMPLES * 9 / 10] / 1000.0,
+			latencies[SAMPLES * 99 / 100] / 1000.0, latencies[SAMPLES - 1] / 1000.0);
+}
 
-	printf("check sem %d\n", Thread_check_sem(sem));
 
-	printf("Starting secondary thread\n");
-	Thread_start(secondary, (void*)sem);
+int main(int argc, char *argv[])
+{
+	int i, rc = 0;
+	sem_type sem = Thread_create_sem();
+	cond_type cond = Thread_create_cond();
 
-	sleep(3);
 	printf("check sem %d\n", Thread_check_sem(sem));
-
-	printf("post secondary\n");
-	rc = Thread_post_sem(sem);
-	printf("posted secondary %d\n", rc);
-
-	sleep(3);
-
-	printf("Main thread ending\n");
+	Thread_post_sem(sem);
+	printf("check sem after post %d\n", Thread_check_sem(sem));
+	printf("wait for posted sem %d\n", Thread_wait_sem(sem, 100));
+	printf("wait for unposted sem %d\n", Thread_wait_sem(sem, 100));
+	printf("wait for cond %d\n", Thread_wait_cond(cond, 1));
+
+	Thread_start(sem_waiter, (void*)sem);
+	for (i = 0; i < SAMPLES && !done; ++i)
+	{
+		usleep(1000); /* let the waiter block */
+		posted_at = now_ns();
+		Thread_post_sem(sem);
+	}
+	while (!done)
+		usleep(1000);
+	print_latencies("semaphore");
+
+	done = 0;
+	Thread_start(cond_waiter, (void*)cond);
+	for (i = 0; i < SAMPLES && !done; ++i)
+	{
+		usleep(1000);
+		pthread_mutex_lock(&cond->mutex);
+		posted_at = now_ns();
+		pthread_cond_signal(&cond->cond);
+		pthread_mutex_unlock(&cond->mutex);
+	}
+	while (!done)
+		usleep(1000);
+	print_latencies("condition variable");
+
+	Thread_destroy_sem(sem);
+	Thread_destroy_cond(cond);
+	return rc;
 }
 
 #endif
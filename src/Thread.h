@@ -38,9 +38,17 @@
 	#define mutex_type pthread_mutex_t*
 	typedef struct { pthread_cond_t cond; pthread_mutex_t mutex; } cond_type_struct;
 	typedef cond_type_struct *cond_type;
-	typedef sem_t *sem_type;
+	#if defined(__linux__) && !defined(USE_NAMED_SEMAPHORES)
+		#define USE_FUTEX_SEMAPHORES
+		/** a counting semaphore which waits on a futex, so there is no need for a polling loop */
+		typedef struct { volatile int value; volatile int waiters; } sem_type_struct;
+		typedef sem_type_struct *sem_type;
+	#else
+		typedef sem_t *sem_type;
+	#endif
 
 	cond_type Thread_create_cond();
+	int Thread_init_cond(cond_type condvar, pthread_mutexattr_t* attr);
 	int Thread_signal_cond(cond_type);
 	int Thread_wait_cond(cond_type condvar, int timeout);
 	int Thread_destroy_cond(cond_type);
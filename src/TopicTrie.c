@@ -0,0 +1,385 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A trie of topic filters, to find the filter matching a topic in one walk
+ *
+ * There is a node for each level of the filters added.  The literal next levels of a node
+ * are kept in a tree ordered by level, and the + and # next levels are kept separately,
+ * so matching a topic takes one tree lookup per level rather than a comparison with every filter.
+ *
+ * When more than one filter matches a topic, the most specific is found: at each level
+ * from the first, a literal level is preferred to +, and + to #.
+ *
+ * The trie has no locking of its own.
+ */
+
+#include "TopicTrie.h"
+#include "StackTrace.h"
+
+#include <string.h>
+
+#include "Heap.h"
+
+/** A level of a topic, which is not nul terminated */
+typedef struct
+{
+	const char* level;
+	size_t len;
+} TopicTrie_key;
+
+
+/**
+ * Compare the level of a node with another node's, or with a key.
+ * @param a the node
+ * @param b the other node, or a TopicTrie_key
+ * @param content whether b is a node
+ * @return less than, equal to or greater than 0, as for strcmp
+ */
+static int TopicTrie_compare(void* a, void* b, int content)
+{
+	const char* level = ((TopicTrie_node*)a)->level;
+	TopicTrie_key* key = (TopicTrie_key*)b;
+	int rc;
+
+	if (content)
+		return strcmp(level, ((TopicTrie_node*)b)->level);
+	if ((rc = strncmp(level, key->level, key->len)) == 0 && level[key->len] != '\0')
+		rc = 1;
+	return rc;
+}
+
+
+/**
+ * Allocates and initializes a new, empty trie.
+ * @return the trie
+ */
+TopicTrie* TopicTrie_initialize(void)
+{
+	TopicTrie* trie = malloc(sizeof(TopicTrie));
+
+	memset(trie, '\0', sizeof(TopicTrie));
+	return trie;
+}
+
+
+/**
+ * Find the next level of a node, optionally adding it.
+ * @param node the node
+ * @param level the start of the level
+ * @param len the length of the level
+ * @param add whether to add the level if it isn't there
+ * @return the node for the level, or NULL if it isn't there and add is 0
+ */
+static TopicTrie_node* TopicTrie_child(TopicTrie_node* node, const char* level, size_t len, int add)
+{
+	TopicTrie_node** wildcard = NULL;
+	TopicTrie_node* child = NULL;
+
+	if (len == 1 && level[0] == '+')
+		wildcard = &node->plus;
+	else if (len == 1 && level[0] == '#')
+		wildcard = &node->hash;
+
+	if (wildcard)
+		child = *wildcard;
+	else if (node->children)
+	{
+		TopicTrie_key key;
+		Node* found;
+
+		key.level = level;
+		key.len = len;
+		if ((found = TreeFind(node->children, &key)) != NULL)
+			child = (TopicTrie_node*)(found->content);
+	}
+
+	if (child == NULL && add)
+	{
+		child = malloc(sizeof(TopicTrie_node));
+		memset(child, '\0', sizeof(TopicTrie_node));
+		child->parent = node;
+		child->level = malloc(len + 1);
+		memcpy(child->level, level, len);
+		child->level[len] = '\0';
+		if (wildcard)
+			*wildcard = child;
+		else
+		{
+			if (node->children == NULL)
+				node->children = TreeInitialize(TopicTrie_compare);
+			TreeAdd(node->children, child, sizeof(TopicTrie_node) + len + 1);
+		}
+	}
+	return child;
+}
+
+
+/**
+ * Find the node at which a filter ends, optionally adding the nodes on the way.
+ * @param trie the trie
+ * @param filter the topic filter
+ * @param add whether to add missing levels
+ * @return the node, or NULL if the filter isn't in the trie and add is 0
+ */
+static TopicTrie_node* TopicTrie_find(TopicTrie* trie, const char* filter, int add)
+{
+	TopicTrie_node* node = &trie->root;
+	const char* level = filter;
+
+	while (node)
+	{
+		const char* end = strchr(level, '/');
+
+		node = TopicTrie_child(node, level, end ? (size_t)(end - level) : strlen(level), add);
+		if (end == NULL)
+			break;
+		level = end + 1;
+	}
+	return node;
+}
+
+
+/**
+ * Add a topic filter, or replace the content of one already added.
+ * @param trie the trie
+ * @param filter the topic filter
+ * @param content the content of the filter, which must not be NULL
+ * @return the content replaced, or NULL if the filter was not already in the trie
+ */
+void* TopicTrie_add(TopicTrie* trie, const char* filter, void* content)
+{
+	TopicTrie_node* node = NULL;
+	void* rc = NULL;
+
+	FUNC_ENTRY;
+	node = TopicTrie_find(trie, filter, 1);
+	if ((rc = node->content) == NULL)
+		++(trie->count);
+	node->content = content;
+	FUNC_EXIT;
+	return rc;
+}
+
+
+/**
+ * Free a node which has been unlinked from its parent.
+ * @param node the node
+ */
+static void TopicTrie_freeNode(TopicTrie_node* node)
+{
+	free(node->level);
+	free(node);
+}
+
+
+/**
+ * Remove a topic filter, and the nodes which were only there for it.
+ * @param trie the trie
+ * @param filter the topic filter
+ * @return the content of the filter, or NULL if it was not in the trie
+ */
+void* TopicTrie_remove(TopicTrie* trie, const char* filter)
+{
+	TopicTrie_node* node = NULL;
+	void* rc = NULL;
+
+	FUNC_ENTRY;
+	if ((node = TopicTrie_find(trie, filter, 0)) == NULL || (rc = node->content) == NULL)
+		goto exit;
+	node->content = NULL;
+	--(trie->count);
+
+	while (node != &trie->root && node->content == NULL && node->children == NULL &&
+			node->plus == NULL && node->hash == NULL)
+	{
+		TopicTrie_node* parent = node->parent;
+
+		if (parent->plus == node)
+			parent->plus = NULL;
+		else if (parent->hash == node)
+			parent->hash = NULL;
+		else
+		{
+			TreeRemove(parent->children, node);
+			if (parent->children->count == 0)
+			{
+				TreeFree(parent->children);
+				parent->children = NULL;
+			}
+		}
+		TopicTrie_freeNode(node);
+		node = parent;
+	}
+exit:
+	FUNC_EXIT;
+	return rc;
+}
+
+
+/**
+ * Free the levels after a node, and their contents.
+ * @param node the node
+ */
+static void TopicTrie_freeLevels(TopicTrie_node* node)
+{
+	TopicTrie_node* wildcards[2];
+	int i;
+
+	if (node->children)
+	{
+		Node* child = NULL;
+
+		while ((child = TreeNextElement(node->children, NULL)) != NULL)
+		{
+			TopicTrie_node* next = (TopicTrie_node*)TreeRemove(node->children, child->content);
+
+			TopicTrie_freeLevels(next);
+			TopicTrie_freeNode(next);
+		}
+		TreeFree(node->children);
+	}
+	wildcards[0] = node->plus;
+	wildcards[1] = node->hash;
+	for (i = 0; i < 2; ++i)
+	{
+		if (wildcards[i])
+		{
+			TopicTrie_freeLevels(wildcards[i]);
+			TopicTrie_freeNode(wildcards[i]);
+		}
+	}
+	if (node->content)
+		free(node->content);
+}
+
+
+/**
+ * Free a trie, and the contents of its filters.
+ * @param trie the trie
+ */
+void TopicTrie_free(TopicTrie* trie)
+{
+	FUNC_ENTRY;
+	TopicTrie_freeLevels(&trie->root);
+	free(trie);
+	FUNC_EXIT;
+}
+
+
+static void* TopicTrie_matchLevel(TopicTrie_node* node, const char* level, int first);
+
+/**
+ * Carry on matching a topic after a node has matched one of its levels.
+ * @param node the node which matched
+ * @param end the end of the level matched
+ * @return the content of the most specific filter matching, or NULL
+ */
+static void* TopicTrie_matchNext(TopicTrie_node* node, const char* end)
+{
+	void* rc = NULL;
+
+	if (end)
+		rc = TopicTrie_matchLevel(node, end + 1, 0);
+	else if ((rc = node->content) == NULL && node->hash)
+		rc = node->hash->content; /* a/# matches a */
+	return rc;
+}
+
+
+/**
+ * Match a level of a topic against the next levels of a node.
+ * @param node the node
+ * @param level the start of the level
+ * @param first whether this is the first level of the topic
+ * @return the content of the most specific filter matching, or NULL
+ */
+static void* TopicTrie_matchLevel(TopicTrie_node* node, const char* level, int first)
+{
+	const char* end = strchr(level, '/');
+	void* rc = NULL;
+
+	if (node->children)
+	{
+		TopicTrie_key key;
+		Node* found;
+
+		key.level = level;
+		key.len = end ? (size_t)(end - level) : strlen(level);
+		if ((found = TreeFind(node->children, &key)) != NULL)
+			rc = TopicTrie_matchNext((TopicTrie_node*)(found->content), end);
+	}
+	if (!first || level[0] != '$') /* wildcards don't match a first level starting with $ */
+	{
+		if (rc == NULL && node->plus)
+			rc = TopicTrie_matchNext(node->plus, end);
+		if (rc == NULL && node->hash)
+			rc = node->hash->content;
+	}
+	return rc;
+}
+
+
+/**
+ * Find the most specific filter matching a topic.
+ * @param trie the trie
+ * @param topic the topic
+ * @return the content of the filter, or NULL if none matches
+ */
+void* TopicTrie_match(TopicTrie* trie, const char* topic)
+{
+	return TopicTrie_matchLevel(&trie->root, topic, 1);
+}
+
+
+/**
+ * Match a topic against a single topic filter, without a trie.
+ * @param filter the topic filter
+ * @param topic the topic
+ * @return 1 if the filter matches the topic, otherwise 0
+ */
+int TopicTrie_matches(const char* filter, const char* topic)
+{
+	int rc = 0;
+
+	if ((filter[0] == '+' || filter[0] == '#') && topic[0] == '$')
+		return 0;
+	while (1)
+	{
+		const char* filter_end = strchr(filter, '/');
+		const char* topic_end = strchr(topic, '/');
+		size_t filter_len = filter_end ? (size_t)(filter_end - filter) : strlen(filter);
+		size_t topic_len = topic_end ? (size_t)(topic_end - topic) : strlen(topic);
+
+		if (filter_len == 1 && filter[0] == '#' && filter_end == NULL)
+		{
+			rc = 1;
+			break;
+		}
+		if (!(filter_len == 1 && filter[0] == '+') &&
+				(filter_len != topic_len || strncmp(filter, topic, filter_len) != 0))
+			break;
+		if (filter_end == NULL || topic_end == NULL)
+		{
+			rc = (filter_end == NULL && topic_end == NULL) || (topic_end == NULL && strcmp(filter_end, "/#") == 0);
+			break;
+		}
+		filter = filter_end + 1;
+		topic = topic_end + 1;
+	}
+	return rc;
+}
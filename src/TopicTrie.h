@@ -0,0 +1,51 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#if !defined(TOPICTRIE_H)
+#define TOPICTRIE_H
+
+#include "Tree.h"
+
+/**
+ * A node of the trie, one for each topic level of the filters added.
+ */
+typedef struct TopicTrie_node_s
+{
+	char* level;						/**< this level of the filter, as a string */
+	struct TopicTrie_node_s* parent;	/**< the node for the level before, NULL for the root */
+	Tree* children;						/**< the nodes for literal next levels, created when first needed */
+	struct TopicTrie_node_s* plus;		/**< the node for a + next level */
+	struct TopicTrie_node_s* hash;		/**< the node for a # next level */
+	void* content;						/**< the content of the filter ending at this level, if any */
+} TopicTrie_node;
+
+/**
+ * A set of topic filters, each with its content.
+ */
+typedef struct
+{
+	TopicTrie_node root;	/**< the node before the first level, which has no level or content of its own */
+	int count;				/**< the number of filters */
+} TopicTrie;
+
+TopicTrie* TopicTrie_initialize(void);
+void TopicTrie_free(TopicTrie* trie);
+void* TopicTrie_add(TopicTrie* trie, const char* filter, void* content);
+void* TopicTrie_remove(TopicTrie* trie, const char* filter);
+void* TopicTrie_match(TopicTrie* trie, const char* topic);
+int TopicTrie_matches(const char* filter, const char* topic);
+
+#endif
@@ -0,0 +1,484 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Binary trace records
+ *
+ * The arguments of a trace message are stored as they are passed, and only formatted when the
+ * message is output, or the trace is dumped.  The format string is walked to find the type of
+ * each argument, which is stored with a one byte tag:
+ *
+ * - 'i': 4 byte int, for integers with no length modifier, or h or hh, and * widths and precisions
+ * - 'l': 8 byte integer, for l, ll, j, z and t
+ * - 'f': 8 byte double
+ * - 'p': 8 byte pointer
+ * - 's': 2 byte length then the characters, with no terminator
+ *
+ * This is used by the libraries, and by the MQTTTraceDecode program to read binary trace dumps,
+ * so it must not use any other part of the libraries.
+ */
+
+#include "TraceRecord.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(WIN32) || defined(WIN64)
+#define snprintf _snprintf
+#endif
+
+#define TRACE_INTEGER_CONVERSIONS "diouxXc"
+#define TRACE_FLOAT_CONVERSIONS "eEfFgGaA"
+#define TRACE_FLAGS "-+ #0"
+#define TRACE_MAX_SPEC_LENGTH 40
+
+
+/**
+ * Write an integer in little endian order.
+ * @param dest where to write it
+ * @param value the value
+ * @param bytes the number of bytes to write
+ */
+void TraceRecord_writeInt(unsigned char* dest, unsigned long long value, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; ++i)
+	{
+		dest[i] = (unsigned char)(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+
+/**
+ * Read an integer written by TraceRecord_writeInt.
+ * @param src where to read it from
+ * @param bytes the number of bytes
+ * @return the value
+ */
+unsigned long long TraceRecord_readInt(const unsigned char* src, int bytes)
+{
+	unsigned long long value = 0;
+
+	while (bytes-- > 0)
+		value = (value << 8) | src[bytes];
+	return value;
+}
+
+
+/**
+ * Add one tagged argument to an encoding.
+ * @param buf the encoding
+ * @param buflen the length of buf
+ * @param len the length used so far, updated
+ * @param tag the argument's tag
+ * @param value the value of the argument
+ * @param bytes the number of bytes of value to store
+ * @return 1 if it fitted, otherwise 0
+ */
+static int TraceRecord_put(unsigned char* buf, int buflen, int* len, char tag, unsigned long long value, int bytes)
+{
+	if (*len + 1 + bytes > buflen)
+		return 0;
+	buf[(*len)++] = (unsigned char)tag;
+	TraceRecord_writeInt(&buf[*len], value, bytes);
+	*len += bytes;
+	return 1;
+}
+
+
+/**
+ * Add a string argument to an encoding, truncating it to fit.
+ * @param buf the encoding
+ * @param buflen the length of buf
+ * @param len the length used so far, updated
+ * @param str the string
+ * @param precision the most characters to read from str, or -1 for no limit.  The string need not
+ * be terminated if it is no longer than this.
+ * @return 1 if it fitted, otherwise 0
+ */
+static int TraceRecord_putString(unsigned char* buf, int buflen, int* len, const char* str, int precision)
+{
+	int limit = buflen - *len - 3;
+	int slen = 0;
+
+	if (limit < 0)
+		return 0;
+	if (str == NULL)
+		str = "(null)";
+	if (limit > TRACE_MAX_STRING_LENGTH)
+		limit = TRACE_MAX_STRING_LENGTH;
+	if (precision >= 0 && precision < limit)
+		limit = precision;
+	while (slen < limit && str[slen])
+		++slen;
+	TraceRecord_put(buf, buflen, len, 's', (unsigned long long)slen, 2);
+	memcpy(&buf[*len], str, slen);
+	*len += slen;
+	return 1;
+}
+
+
+/**
+ * Store the arguments of a trace message, finding their types from the format string.  If they
+ * do not all fit, the ones before the first that does not are kept.
+ * @param format the printf format string of the message
+ * @param args the arguments of the message, which are consumed
+ * @param buf where to store them
+ * @param buflen the length of buf
+ * @return the number of bytes used
+ */
+int TraceRecord_encodeArgs(const char* format, va_list* args, unsigned char* buf, int buflen)
+{
+	const char* p = format;
+	int len = 0;
+
+	while ((p = strchr(p, '%')) != NULL)
+	{
+		int precision = -1;
+		int longs = 0;
+		int fits = 1;
+		char length = '\0';
+		char conversion;
+
+		if (*++p == '%')
+		{
+			++p;
+			continue;
+		}
+		p += strspn(p, TRACE_FLAGS);
+		if (*p == '*')
+		{
+			fits = TraceRecord_put(buf, buflen, &len, 'i', (unsigned int)va_arg(*args, int), 4);
+			++p;
+		}
+		else
+			p += strspn(p, "0123456789");
+		if (fits && *p == '.')
+		{
+			if (*++p == '*')
+			{
+				precision = va_arg(*args, int);
+				fits = TraceRecord_put(buf, buflen, &len, 'i', (unsigned int)precision, 4);
+				++p;
+			}
+			else
+			{
+				for (precision = 0; *p >= '0' && *p <= '9'; ++p)
+					precision = precision * 10 + *p - '0';
+			}
+		}
+		for (; *p && strchr("hlLqjzt", *p); ++p)
+		{
+			if (*p == 'l')
+				++longs;
+			else if (*p != 'h')
+				length = *p;
+		}
+		if (!fits || (conversion = *p++) == '\0')
+			break;
+
+		if (strchr(TRACE_INTEGER_CONVERSIONS, conversion))
+		{
+			int is_signed = (conversion == 'd' || conversion == 'i');
+
+			if (longs >= 2 || length == 'q' || length == 'L' || length == 'j')
+				fits = TraceRecord_put(buf, buflen, &len, 'l', (unsigned long long)va_arg(*args, long long), 8);
+			else if (length == 'z' || length == 't')
+				fits = TraceRecord_put(buf, buflen, &len, 'l', (unsigned long long)va_arg(*args, size_t), 8);
+			else if (longs == 1)
+				fits = TraceRecord_put(buf, buflen, &len, 'l', is_signed ?
+					(unsigned long long)va_arg(*args, long) : (unsigned long long)va_arg(*args, unsigned long), 8);
+			else
+				fits = TraceRecord_put(buf, buflen, &len, 'i', (unsigned int)va_arg(*args, int), 4);
+		}
+		else if (strchr(TRACE_FLOAT_CONVERSIONS, conversion))
+		{
+			double value = (length == 'L') ? (double)va_arg(*args, long double) : va_arg(*args, double);
+			unsigned long long bits;
+
+			memcpy(&bits, &value, sizeof(bits));
+			fits = TraceRecord_put(buf, buflen, &len, 'f', bits, 8);
+		}
+		else if (conversion == 's')
+			fits = TraceRecord_putString(buf, buflen, &len, va_arg(*args, const char*), precision);
+		else if (conversion == 'p')
+			fits = TraceRecord_put(buf, buflen, &len, 'p', (unsigned long long)(size_t)va_arg(*args, void*), 8);
+		else if (conversion == 'n')
+			(void)va_arg(*args, void*);
+		else
+			break; /* we can not tell the type of any more arguments */
+		if (!fits)
+			break;
+	}
+	return len;
+}
+
+
+/**
+ * Add characters to a formatted message, as far as they fit.
+ * @param buf the message
+ * @param buflen the length of buf
+ * @param pos the length of the message so far, updated
+ * @param text the characters to add
+ * @param len the number of characters
+ */
+static void TraceRecord_append(char* buf, int buflen, int* pos, const char* text, int len)
+{
+	if (len > buflen - 1 - *pos)
+		len = buflen - 1 - *pos;
+	if (len > 0)
+	{
+		memcpy(&buf[*pos], text, len);
+		*pos += len;
+	}
+}
+
+
+/**
+ * Account for the output of snprintf to a formatted message, as far as it fits.
+ * @param buflen the length of the message buffer
+ * @param pos the length of the message so far, updated
+ * @param rc the return code of snprintf
+ */
+static void TraceRecord_appended(int buflen, int* pos, int rc)
+{
+	/* C99 snprintf returns the untruncated length, _snprintf -1 if it truncates */
+	if (rc < 0 || rc > buflen - 1 - *pos)
+		*pos = buflen - 1;
+	else
+		*pos += rc;
+}
+
+
+/**
+ * Format a message from its format string and the arguments stored by TraceRecord_encodeArgs.
+ * Each argument is checked against the type expected by the format, so that a damaged trace dump
+ * can not lead to the wrong type being passed to snprintf.  If the arguments run out, or do not
+ * match, the message is ended with "...".
+ * @param format the format string
+ * @param args the stored arguments
+ * @param args_len the length of args
+ * @param buf the buffer to format into
+ * @param buflen the length of buf
+ * @return the length of the message, which is always null terminated
+ */
+static int TraceRecord_formatArgs(const char* format, const unsigned char* args, int args_len, char* buf, int buflen)
+{
+	const char* p = format;
+	int pos = 0;
+	int used = 0;
+
+	if (buflen <= 0)
+		return 0;
+	while (*p && pos < buflen - 1)
+	{
+		char spec[TRACE_MAX_SPEC_LENGTH];
+		int speclen, n, precision = -1;
+		char conversion;
+		char tag;
+
+		if (*p != '%')
+		{
+			const char* next = strchr(p, '%');
+
+			n = (next == NULL) ? (int)strlen(p) : (int)(next - p);
+			TraceRecord_append(buf, buflen, &pos, p, n);
+			p += n;
+			continue;
+		}
+		if (p[1] == '%')
+		{
+			TraceRecord_append(buf, buflen, &pos, "%", 1);
+			p += 2;
+			continue;
+		}
+
+		/* rebuild the conversion specification, with the values of any * widths and precisions */
+		++p;
+		speclen = 1;
+		spec[0] = '%';
+		n = (int)strspn(p, TRACE_FLAGS);
+		if (n > 5)
+			goto truncated;
+		memcpy(&spec[speclen], p, n);
+		speclen += n;
+		p += n;
+		if (*p == '*')
+		{
+			if (used + 5 > args_len || args[used] != 'i')
+				goto truncated;
+			speclen += sprintf(&spec[speclen], "%d", (int)TraceRecord_readInt(&args[used + 1], 4));
+			used += 5;
+			++p;
+		}
+		else
+		{
+			for (n = 0; *p >= '0' && *p <= '9' && n < 6; ++n)
+				spec[speclen++] = *p++;
+		}
+		if (*p == '.')
+		{
+			if (*++p == '*')
+			{
+				if (used + 5 > args_len || args[used] != 'i')
+					goto truncated;
+				precision = (int)TraceRecord_readInt(&args[used + 1], 4);
+				used += 5;
+				++p;
+			}
+			else
+			{
+				for (precision = 0; *p >= '0' && *p <= '9' && precision < 100000; ++p)
+					precision = precision * 10 + *p - '0';
+			}
+		}
+		p += strspn(p, "hlLqjzt");
+		if ((conversion = *p++) == '\0' || used >= args_len)
+			goto truncated;
+		tag = (char)args[used];
+
+		if (strchr(TRACE_INTEGER_CONVERSIONS, conversion) && (tag == 'i' || tag == 'l'))
+		{
+			if (precision >= 0)
+				speclen += sprintf(&spec[speclen], ".%d", precision);
+			if (tag == 'i' && used + 5 <= args_len)
+			{
+				sprintf(&spec[speclen], "%c", conversion);
+				TraceRecord_appended(buflen, &pos, snprintf(&buf[pos], buflen - pos, spec,
+						(int)TraceRecord_readInt(&args[used + 1], 4)));
+				used += 5;
+			}
+			else if (tag == 'l' && used + 9 <= args_len)
+			{
+				sprintf(&spec[speclen], "ll%c", conversion);
+				TraceRecord_appended(buflen, &pos, snprintf(&buf[pos], buflen - pos, spec,
+						(long long)TraceRecord_readInt(&args[used + 1], 8)));
+				used += 9;
+			}
+			else
+				goto truncated;
+		}
+		else if (strchr(TRACE_FLOAT_CONVERSIONS, conversion) && tag == 'f' && used + 9 <= args_len)
+		{
+			unsigned long long bits = TraceRecord_readInt(&args[used + 1], 8);
+			double value;
+
+			memcpy(&value, &bits, sizeof(value));
+			if (precision >= 0)
+				speclen += sprintf(&spec[speclen], ".%d", precision);
+			sprintf(&spec[speclen], "%c", conversion);
+			TraceRecord_appended(buflen, &pos, snprintf(&buf[pos], buflen - pos, spec, value));
+			used += 9;
+		}
+		else if (conversion == 's' && tag == 's' && used + 3 <= args_len)
+		{
+			int slen = (int)TraceRecord_readInt(&args[used + 1], 2);
+
+			if (used + 3 + slen > args_len)
+				goto truncated;
+			if (precision < 0 || precision > slen)
+				precision = slen;
+			sprintf(&spec[speclen], ".%ds", precision);
+			TraceRecord_appended(buflen, &pos, snprintf(&buf[pos], buflen - pos, spec, (const char*)&args[used + 3]));
+			used += 3 + slen;
+		}
+		else if (conversion == 'p' && tag == 'p' && used + 9 <= args_len)
+		{
+			sprintf(&spec[speclen], "p");
+			TraceRecord_appended(buflen, &pos, snprintf(&buf[pos], buflen - pos, spec,
+					(void*)(size_t)TraceRecord_readInt(&args[used + 1], 8)));
+			used += 9;
+		}
+		else if (conversion == 'n')
+			continue;
+		else
+			goto truncated;
+	}
+	buf[pos] = '\0';
+	return pos;
+
+truncated:
+	TraceRecord_append(buf, buflen, &pos, "...", 3);
+	buf[pos] = '\0';
+	return pos;
+}
+
+
+/**
+ * Format the time of a trace entry, as "yyyymmdd hhmmss.mmm ".
+ * @param start_seconds the wall clock time, in seconds since the epoch, at which tracing started
+ * @param start_micros the microseconds part of that time
+ * @param elapsed the nanoseconds from then to the entry
+ * @param buf the buffer to format into, which should be at least 24 characters long
+ * @param buflen the length of buf
+ * @return the length of the text
+ */
+int TraceRecord_formatTime(long long start_seconds, long start_micros, long long elapsed, char* buf, int buflen)
+{
+	time_t seconds = (time_t)(start_seconds + elapsed / 1000000000);
+	long micros = start_micros + (long)((elapsed % 1000000000) / 1000);
+	struct tm* timeinfo;
+	int len = 0;
+
+	if (micros >= 1000000L)
+	{
+		seconds++;
+		micros -= 1000000L;
+	}
+	if ((timeinfo = localtime(&seconds)) != NULL)
+		len = (int)strftime(buf, buflen, "%Y%m%d %H%M%S", timeinfo);
+	TraceRecord_appended(buflen, &len, snprintf(&buf[len], buflen - len, ".%.3ld ", micros / 1000L));
+	buf[len] = '\0';
+	return len;
+}
+
+
+/**
+ * Format the text of a trace entry, without its time.
+ * @param record the entry
+ * @param buf the buffer to format into
+ * @param buflen the length of buf
+ * @return the length of the text, which is always null terminated
+ */
+int TraceRecord_format(TraceRecord* record, char* buf, int buflen)
+{
+	unsigned char args[40 + TRACE_MAX_STRING_LENGTH];
+	int len = 0;
+
+	if (record->format == NULL)
+	{
+		if (buflen > 0)
+			buf[0] = '\0';
+		return 0;
+	}
+	if (record->has_rc == 2)
+		return TraceRecord_formatArgs(record->format, record->args, record->args_len, buf, buflen);
+
+	/* function entries and exits have the same arguments, and an rc for some exits */
+	TraceRecord_put(args, sizeof(args), &len, 'l', (unsigned long long)(unsigned int)record->thread_id, 8);
+	TraceRecord_put(args, sizeof(args), &len, 'i', (unsigned int)record->depth, 4);
+	TraceRecord_putString(args, sizeof(args), &len, "", -1);
+	TraceRecord_put(args, sizeof(args), &len, 'i', (unsigned int)record->depth, 4);
+	TraceRecord_putString(args, sizeof(args), &len, record->name, -1);
+	TraceRecord_put(args, sizeof(args), &len, 'i', (unsigned int)record->line, 4);
+	if (record->has_rc == 1)
+		TraceRecord_put(args, sizeof(args), &len, 'i', (unsigned int)record->rc, 4);
+	return TraceRecord_formatArgs(record->format, args, len, buf, buflen);
+}
@@ -0,0 +1,67 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#if !defined(TRACERECORD_H)
+#define TRACERECORD_H
+
+#include <stdarg.h>
+
+/*
+ * Binary trace dumps, as written by Log_dumpTraceBinary and read by MQTTTraceDecode.  All integers
+ * are little endian.  The file starts with TRACE_FILE_MAGIC, then the wall clock time at which
+ * tracing started: 8 bytes of seconds and 4 of microseconds.  That is followed by records,
+ * each starting with its type:
+ *
+ * TRACE_RECORD_STRING: 4 byte id, 2 byte length, the characters.  A string is written once, before
+ *   the first entry which refers to it by its id.
+ * TRACE_RECORD_ENTRY: 1 byte has_rc, 1 byte level, 8 bytes of nanoseconds since tracing started,
+ *   4 byte thread id, depth, line and rc, 4 byte string ids of the format and name (0xFFFFFFFF
+ *   for none), 2 byte length of the arguments, the arguments as encoded by TraceRecord_encodeArgs.
+ */
+#define TRACE_FILE_MAGIC "PAHOTRC1"
+#define TRACE_FILE_MAGIC_LENGTH 8
+#define TRACE_FILE_HEADER_LENGTH (TRACE_FILE_MAGIC_LENGTH + 12)
+#define TRACE_RECORD_STRING 'S'
+#define TRACE_RECORD_ENTRY 'E'
+#define TRACE_ENTRY_LENGTH 37	/**< the length of an entry record, from its type to its arguments */
+#define TRACE_NO_STRING 0xFFFFFFFF
+
+/** the most bytes of arguments kept for one trace entry */
+#define TRACE_MAX_ARGS_LENGTH 392
+/** the most characters of a string argument kept */
+#define TRACE_MAX_STRING_LENGTH 160
+
+/** A trace entry, to be formatted as text */
+typedef struct
+{
+	int has_rc;				/**< 0 for a function entry or exit, 1 for an exit with a return code, 2 for a message */
+	int thread_id;
+	int depth;
+	int line;
+	int rc;
+	const char* format;		/**< the format of a message or of a function entry or exit */
+	const char* name;		/**< the function name */
+	const unsigned char* args;	/**< the arguments of a message, from TraceRecord_encodeArgs */
+	int args_len;
+} TraceRecord;
+
+void TraceRecord_writeInt(unsigned char* dest, unsigned long long value, int bytes);
+unsigned long long TraceRecord_readInt(const unsigned char* src, int bytes);
+int TraceRecord_encodeArgs(const char* format, va_list* args, unsigned char* buf, int buflen);
+int TraceRecord_formatTime(long long start_seconds, long start_micros, long long elapsed, char* buf, int buflen);
+int TraceRecord_format(TraceRecord* record, char* buf, int buflen);
+
+#endif
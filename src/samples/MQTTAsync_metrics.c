@@ -0,0 +1,186 @@
+/*******************************************************************************
+ * Copyright (c) 2012, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *   http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial contribution
+ *******************************************************************************/
+
+/*
+ * Publishes a message a second to a topic it is subscribed to, and serves the client
+ * library's metrics in the OpenMetrics text format, for Prometheus to scrape:
+ *
+ *   MQTTAsync_metrics [serverURI [http port]]
+ *   curl http://localhost:9883/metrics
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "MQTTAsync.h"
+
+#if !defined(WIN32)
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#define closesocket close
+#else
+#include <winsock2.h>
+#include <windows.h>
+#endif
+
+#define ADDRESS     "tcp://localhost:1883"
+#define CLIENTID    "ExampleClientMetrics"
+#define TOPIC       "MQTT Examples"
+#define PAYLOAD     "Hello World!"
+#define QOS         1
+#define HTTP_PORT   9883
+
+int connected = 0;
+
+
+void connlost(void *context, char *cause)
+{
+	MQTTAsync client = (MQTTAsync)context;
+	MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+	int rc;
+
+	printf("\nConnection lost\n");
+	printf("     cause: %s\n", cause);
+
+	printf("Reconnecting\n");
+	connected = 0;
+	conn_opts.keepAliveInterval = 20;
+	conn_opts.cleansession = 1;
+	if ((rc = MQTTAsync_connect(client, &conn_opts)) != MQTTASYNC_SUCCESS)
+		printf("Failed to start connect, return code %d\n", rc);
+}
+
+
+int msgarrvd(void *context, char *topicName, int topicLen, MQTTAsync_message *message)
+{
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void onConnectFailure(void* context, MQTTAsync_failureData* response)
+{
+	printf("Connect failed, rc %d\n", response ? response->code : 0);
+}
+
+
+void onConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync client = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	printf("Successful connection\n");
+	if ((rc = MQTTAsync_subscribe(client, TOPIC, QOS, &opts)) != MQTTASYNC_SUCCESS)
+		printf("Failed to start subscribe, return code %d\n", rc);
+	connected = 1;
+}
+
+
+/*
+ * Answer one HTTP request with the metrics.  The request itself is not parsed, so any
+ * path will do.
+ */
+void serve(int sock)
+{
+	static char* buffer = NULL;
+	static int buflen = 0;
+	char header[200];
+	char request[1024];
+	int len;
+
+	recv(sock, request, sizeof(request), 0);
+	while ((len = MQTTAsync_getOpenMetrics(buffer, buflen)) >= buflen)
+	{
+		buflen = len + 1;
+		buffer = realloc(buffer, buflen);
+	}
+	len = sprintf(header, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		"Content-Length: %d\r\n\r\n", len);
+	send(sock, header, len, 0);
+	send(sock, buffer, (int)strlen(buffer), 0);
+	closesocket(sock);
+}
+
+
+int main(int argc, char* argv[])
+{
+	MQTTAsync client;
+	MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+	struct sockaddr_in addr;
+	char* address = (argc > 1) ? argv[1] : ADDRESS;
+	int port = (argc > 2) ? atoi(argv[2]) : HTTP_PORT;
+	int listener, on = 1;
+	int rc;
+
+#if defined(WIN32)
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+	listener = (int)socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on));
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 5) != 0)
+	{
+		printf("Failed to listen on port %d\n", port);
+		exit(EXIT_FAILURE);
+	}
+
+	MQTTAsync_create(&client, address, CLIENTID, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+
+	MQTTAsync_setCallbacks(client, client, connlost, msgarrvd, NULL);
+
+	conn_opts.keepAliveInterval = 20;
+	conn_opts.cleansession = 1;
+	conn_opts.onSuccess = onConnect;
+	conn_opts.onFailure = onConnectFailure;
+	conn_opts.context = client;
+	if ((rc = MQTTAsync_connect(client, &conn_opts)) != MQTTASYNC_SUCCESS)
+	{
+		printf("Failed to start connect, return code %d\n", rc);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Serving metrics on http://localhost:%d/metrics\n", port);
+	pubmsg.payload = PAYLOAD;
+	pubmsg.payloadlen = (int)strlen(PAYLOAD);
+	pubmsg.qos = QOS;
+	for (;;)
+	{
+		struct timeval timeout = {1, 0};
+		fd_set readset;
+
+		FD_ZERO(&readset);
+		FD_SET(listener, &readset);
+		if (select(listener + 1, &readset, NULL, NULL, &timeout) > 0)
+			serve((int)accept(listener, NULL, NULL));
+		else if (connected)
+			MQTTAsync_sendMessage(client, TOPIC, &pubmsg, NULL);
+	}
+
+	MQTTAsync_destroy(&client);
+	closesocket(listener);
+ 	return rc;
+}
@@ -0,0 +1,733 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+
+/**
+ * @file
+ * Micro-benchmarks for the containers and codec in the client's hot paths
+ *
+ * This is linked with the library's own source files rather than the shared libraries,
+ * whose internal functions are hidden, and is built with the same compiler flags.
+ *
+ * Each benchmark is set up, run a number of times to warm up, then run --reps times.
+ * Every run times --ops operations (or the benchmark's own default), and the time per
+ * operation of each run is one sample.  The defaults keep a run to tens of milliseconds,
+ * so that all the benchmarks take well under a minute.  The minimum, median, mean, standard
+ * deviation and maximum of the samples are reported, as a table or, with --json, as JSON.
+ */
+
+
+#include "Tree.h"
+#include "TopicTrie.h"
+#include "LinkedList.h"
+#include "MQTTPacket.h"
+#include "MQTTProtocolClient.h"
+#include "SocketBuffer.h"
+#include "Socket.h"
+#include "Pool.h"
+#include "Log.h"
+#include "utf-8.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "Heap.h"
+
+void usage(void)
+{
+	printf("usage: microbench [--filter name] [--reps 20] [--warmup 3] [--ops n] [--json] [--list]\n");
+	exit(-1);
+}
+
+struct Options
+{
+	char* filter;	/**< only run benchmarks whose names contain this */
+	int reps;
+	int warmup;
+	long ops;		/**< operations per run, 0 for each benchmark's default */
+	int json;
+	int list;
+} options =
+{
+	NULL,
+	20,
+	3,
+	0,
+	0,
+	0,
+};
+
+
+void getopts(int argc, char** argv)
+{
+	int count = 1;
+
+	while (count < argc)
+	{
+		if (strcmp(argv[count], "--filter") == 0 && ++count < argc)
+			options.filter = argv[count];
+		else if (strcmp(argv[count], "--reps") == 0 && ++count < argc)
+			options.reps = atoi(argv[count]);
+		else if (strcmp(argv[count], "--warmup") == 0 && ++count < argc)
+			options.warmup = atoi(argv[count]);
+		else if (strcmp(argv[count], "--ops") == 0 && ++count < argc)
+			options.ops = atol(argv[count]);
+		else if (strcmp(argv[count], "--json") == 0)
+			options.json = 1;
+		else if (strcmp(argv[count], "--list") == 0)
+			options.list = 1;
+		else
+			usage();
+		count++;
+	}
+	if (options.reps < 1 || options.warmup < 0 || options.ops < 0)
+		usage();
+}
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/** Something for the compiler not to optimize away */
+static volatile long sink = 0;
+
+
+/*
+ * Tree
+ */
+
+static Tree* tree = NULL;
+static int* keys = NULL;
+
+/** Keys in a random order, without duplicates */
+static void make_keys(long n)
+{
+	long i;
+
+	keys = malloc(sizeof(int) * n);
+	for (i = 0; i < n; ++i)
+		keys[i] = (int)i;
+	srand(1);
+	for (i = n - 1; i > 0; --i)
+	{
+		long j = rand() % (i + 1);
+		int t = keys[i];
+
+		keys[i] = keys[j];
+		keys[j] = t;
+	}
+}
+
+static void tree_setup(long n)
+{
+	make_keys(n);
+	tree = TreeInitialize(TreeIntCompare);
+}
+
+static void tree_setup_full(long n)
+{
+	long i;
+
+	tree_setup(n);
+	for (i = 0; i < n; ++i)
+		TreeAdd(tree, &keys[i], sizeof(int));
+}
+
+static void tree_teardown(void)
+{
+	TreeFree(tree);
+	tree = NULL;
+	free(keys);
+	keys = NULL;
+}
+
+static void tree_add(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+		TreeAdd(tree, &keys[i], sizeof(int));
+}
+
+static void tree_find(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+		sink += (TreeFind(tree, &keys[i]) != NULL);
+}
+
+static void tree_remove(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+		sink += (TreeRemove(tree, &keys[i]) != NULL);
+}
+
+
+/*
+ * LinkedList
+ */
+
+#define LIST_LENGTH 100
+
+static List* list = NULL;
+static int list_keys[LIST_LENGTH];
+
+static void list_setup(long n)
+{
+	list = ListInitialize();
+}
+
+static void list_setup_full(long n)
+{
+	int i;
+
+	list = ListInitialize();
+	for (i = 0; i < LIST_LENGTH; ++i)
+	{
+		list_keys[i] = i;
+		ListAppend(list, &list_keys[i], sizeof(int));
+	}
+}
+
+static void list_teardown(void)
+{
+	ListFreeNoContent(list);
+	list = NULL;
+}
+
+static void list_append(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+		ListAppend(list, &list_keys[i % LIST_LENGTH], sizeof(int));
+}
+
+/** Find every element of a 100 element list in turn */
+static void list_find(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+		sink += (ListFindItem(list, &list_keys[i % LIST_LENGTH], intcompare) != NULL);
+}
+
+/** Remove the head of the list and put it back at the end */
+static void list_remove_append(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+	{
+		void* content = list->first->content;
+
+		ListRemove(list, content);
+		ListAppend(list, content, sizeof(int));
+	}
+}
+
+
+/*
+ * MQTTPacket
+ */
+
+static size_t lengths[] = {100, 10000, 1000000, 100000000};
+#define LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+static void packet_encode(long n)
+{
+	char buf[4];
+	long i;
+
+	for (i = 0; i < n; ++i)
+		sink += MQTTPacket_encode(buf, lengths[i % LENGTHS]);
+}
+
+static int sockets[2] = {-1, -1};
+static char* encoded = NULL;
+static size_t encoded_len = 0;
+
+/** Remaining lengths, encoded, for MQTTPacket_decode to read from a socket */
+static void packet_decode_setup(long n)
+{
+	int bufsize = 0;
+	socklen_t optlen = sizeof(bufsize);
+	long i;
+
+	SocketBuffer_initialize();
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+	{
+		perror("socketpair");
+		exit(1);
+	}
+	encoded = malloc(n * 4);
+	for (i = 0, encoded_len = 0; i < n; ++i)
+		encoded_len += MQTTPacket_encode(&encoded[encoded_len], lengths[i % LENGTHS]);
+	bufsize = (int)encoded_len;
+	setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &bufsize, optlen);
+	setsockopt(sockets[1], SOL_SOCKET, SO_RCVBUF, &bufsize, optlen);
+}
+
+static void packet_decode_teardown(void)
+{
+	close(sockets[0]);
+	close(sockets[1]);
+	free(encoded);
+	encoded = NULL;
+	SocketBuffer_terminate();
+}
+
+/**
+ * Decode remaining lengths, one socket read per byte as in MQTTPacket_Factory.  The
+ * encoded lengths are written in batches which fit in the socket buffers, and only the
+ * time taken to decode is counted.
+ */
+static double packet_decode(long n)
+{
+	networkHandles net;
+	double elapsed = 0;
+	long i = 0;
+	size_t pos = 0;
+
+	memset(&net, '\0', sizeof(net));
+	net.socket = sockets[1];
+	while (i < n)
+	{
+		size_t batch = 0;
+		long count = 0;
+		double start;
+
+		while (i + count < n && batch < 16384)
+		{
+			size_t value = lengths[(i + count) % LENGTHS];
+
+			batch += (value < 128) ? 1 : (value < 16384) ? 2 : (value < 2097152) ? 3 : 4;
+			count++;
+		}
+		if (write(sockets[0], &encoded[pos], batch) != (ssize_t)batch)
+		{
+			perror("write");
+			exit(1);
+		}
+		pos += batch;
+		start = now_ns();
+		while (count-- > 0)
+		{
+			size_t value = 0;
+
+			MQTTPacket_decode(&net, &value);
+			SocketBuffer_complete(net.socket);
+			sink += (long)value;
+			i++;
+		}
+		elapsed += now_ns() - start;
+	}
+	return elapsed;
+}
+
+static char* publish_data = NULL;
+static size_t publish_datalen = 0;
+
+/** The body of a QoS 1 PUBLISH packet with a 32 character topic and a 64 byte payload */
+static void packet_publish_setup(long n)
+{
+	const char* topic = "paho/microbench/publish/topic/00";
+	char* ptr = NULL;
+	int topiclen = (int)strlen(topic);
+
+	publish_datalen = 2 + topiclen + 2 + 64;
+	ptr = publish_data = calloc(1, publish_datalen);
+	writeUTF(&ptr, topic);
+	writeInt(&ptr, 1);
+}
+
+static void packet_publish_teardown(void)
+{
+	free(publish_data);
+	publish_data = NULL;
+}
+
+static void packet_publish(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+	{
+		Publish* pack = MQTTPacket_publish(PUBLISH << 4 | 1 << 1, publish_data, publish_datalen);
+
+		sink += pack->payloadlen;
+		MQTTPacket_freePublish(pack);
+	}
+}
+
+static void read_utf(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+	{
+		char* ptr = publish_data;
+		char* string = readUTF(&ptr, &publish_data[publish_datalen]);
+
+		sink += (string != NULL);
+		free(string);
+	}
+}
+
+
+/*
+ * utf-8
+ */
+
+#define UTF8_BYTES (256 * 1024)	/**< bytes validated per run, so the default ops depend on the string length */
+
+static char* utf8 = NULL;
+static int utf8_len = 0;
+
+static void utf8_setup(const char* unit, int len)
+{
+	int unitlen = (int)strlen(unit), i;
+
+	utf8_len = len;
+	utf8 = malloc(len + 1);
+	for (i = 0; i + unitlen <= len; i += unitlen)
+		memcpy(&utf8[i], unit, unitlen);
+	while (i < len)
+		utf8[i++] = 'x';
+	utf8[len] = '\0';
+}
+
+static void utf8_setup_ascii_32(long n)
+{
+	utf8_setup("paho/microbench/topic/", 32);
+}
+
+static void utf8_setup_ascii_1024(long n)
+{
+	utf8_setup("paho/microbench/topic/", 1024);
+}
+
+static void utf8_setup_mixed_1024(long n)
+{
+	utf8_setup("topic/\xc3\xa9t\xc3\xa9/\xe6\x97\xa5\xe6\x9c\xac/\xf0\x9f\x98\x80/", 1024);
+}
+
+static void utf8_teardown(void)
+{
+	free(utf8);
+	utf8 = NULL;
+}
+
+static void utf8_validate(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+		sink += UTF8_validate(utf8_len, utf8);
+}
+
+
+/*
+ * TopicTrie
+ */
+
+#define TOPICS 1024
+
+static int filter_count = 0;
+static char** filters = NULL;
+static char* topics[TOPICS];
+static TopicTrie* trie = NULL;
+
+/**
+ * Topic filters, a quarter each of the forms site/N/+/temperature, site/N/device/#,
+ * site/N/device/status and site/+/N/alarm, and topics of which three quarters match one
+ * of the filters.
+ */
+static void filters_setup(int count)
+{
+	char buf[64];
+	int i;
+
+	filter_count = count;
+	filters = malloc(sizeof(char*) * count);
+	for (i = 0; i < count; ++i)
+	{
+		if (i % 4 == 0)
+			snprintf(buf, sizeof(buf), "site/%d/+/temperature", i);
+		else if (i % 4 == 1)
+			snprintf(buf, sizeof(buf), "site/%d/device/#", i);
+		else if (i % 4 == 2)
+			snprintf(buf, sizeof(buf), "site/%d/device/status", i);
+		else
+			snprintf(buf, sizeof(buf), "site/+/%d/alarm", i);
+		filters[i] = MQTTStrdup(buf);
+	}
+	srand(1);
+	for (i = 0; i < TOPICS; ++i)
+	{
+		int n = rand() % count;
+
+		if (i % 4 == 3)
+			snprintf(buf, sizeof(buf), "other/%d/device/status", n);
+		else if (n % 4 == 0)
+			snprintf(buf, sizeof(buf), "site/%d/room%d/temperature", n, i);
+		else if (n % 4 == 1)
+			snprintf(buf, sizeof(buf), "site/%d/device/firmware/version", n);
+		else if (n % 4 == 2)
+			snprintf(buf, sizeof(buf), "site/%d/device/status", n);
+		else
+			snprintf(buf, sizeof(buf), "site/%d/%d/alarm", i, n);
+		topics[i] = MQTTStrdup(buf);
+	}
+}
+
+static void trie_setup(int count)
+{
+	int i;
+
+	filters_setup(count);
+	trie = TopicTrie_initialize();
+	for (i = 0; i < count; ++i)
+		TopicTrie_add(trie, filters[i], MQTTStrdup(filters[i]));
+}
+
+static void trie_setup_10(long n)
+{
+	trie_setup(10);
+}
+
+static void trie_setup_100(long n)
+{
+	trie_setup(100);
+}
+
+static void trie_setup_10000(long n)
+{
+	trie_setup(10000);
+}
+
+static void filters_setup_10(long n)
+{
+	filters_setup(10);
+}
+
+static void filters_setup_100(long n)
+{
+	filters_setup(100);
+}
+
+static void filters_setup_10000(long n)
+{
+	filters_setup(10000);
+}
+
+static void filters_teardown(void)
+{
+	int i;
+
+	if (trie)
+		TopicTrie_free(trie);
+	trie = NULL;
+	for (i = 0; i < filter_count; ++i)
+		free(filters[i]);
+	free(filters);
+	filters = NULL;
+	for (i = 0; i < TOPICS; ++i)
+		free(topics[i]);
+}
+
+/** Find the most specific filter matching each topic with one walk of the trie */
+static void trie_match(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+		sink += (TopicTrie_match(trie, topics[i % TOPICS]) != NULL);
+}
+
+/**
+ * Match each topic against the filters in turn, as an application with a single messageArrived
+ * callback would, stopping at the first match rather than looking for the most specific.
+ */
+static void linear_match(long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+	{
+		const char* topic = topics[i % TOPICS];
+		int j;
+
+		for (j = 0; j < filter_count && !TopicTrie_matches(filters[j], topic); ++j)
+			;
+		sink += (j < filter_count);
+	}
+}
+
+
+/*
+ * The harness
+ */
+
+typedef struct
+{
+	const char* name;
+	long ops;						/**< default operations per run */
+	void (*setup)(long ops);		/**< called before each run */
+	void (*run)(long ops);			/**< the operations to time */
+	double (*timed_run)(long ops);	/**< or, for benchmarks which time themselves, returns the nanoseconds taken */
+	void (*teardown)(void);			/**< called after each run */
+} benchmark;
+
+static benchmark benchmarks[] =
+{
+	{"TreeAdd", 100000, tree_setup, tree_add, NULL, tree_teardown},
+	{"TreeFind", 100000, tree_setup_full, tree_find, NULL, tree_teardown},
+	{"TreeRemove", 100000, tree_setup_full, tree_remove, NULL, tree_teardown},
+	{"ListAppend", 100000, list_setup, list_append, NULL, list_teardown},
+	{"ListFindItem/100", 100000, list_setup_full, list_find, NULL, list_teardown},
+	{"ListRemove+ListAppend", 100000, list_setup_full, list_remove_append, NULL, list_teardown},
+	{"MQTTPacket_encode", 1000000, NULL, packet_encode, NULL, NULL},
+	{"MQTTPacket_decode", 10000, packet_decode_setup, NULL, packet_decode, packet_decode_teardown},
+	{"MQTTPacket_publish", 100000, packet_publish_setup, packet_publish, NULL, packet_publish_teardown},
+	{"readUTF", 100000, packet_publish_setup, read_utf, NULL, packet_publish_teardown},
+	{"UTF8_validate/ascii/32", UTF8_BYTES / 32, utf8_setup_ascii_32, utf8_validate, NULL, utf8_teardown},
+	{"UTF8_validate/ascii/1024", UTF8_BYTES / 1024, utf8_setup_ascii_1024, utf8_validate, NULL, utf8_teardown},
+	{"UTF8_validate/mixed/1024", UTF8_BYTES / 1024, utf8_setup_mixed_1024, utf8_validate, NULL, utf8_teardown},
+	{"TopicTrie_match/10", 100000, trie_setup_10, trie_match, NULL, filters_teardown},
+	{"TopicTrie_match/100", 100000, trie_setup_100, trie_match, NULL, filters_teardown},
+	{"TopicTrie_match/10000", 100000, trie_setup_10000, trie_match, NULL, filters_teardown},
+	{"linear match/10", 100000, filters_setup_10, linear_match, NULL, filters_teardown},
+	{"linear match/100", 10000, filters_setup_100, linear_match, NULL, filters_teardown},
+	{"linear match/10000", 100, filters_setup_10000, linear_match, NULL, filters_teardown},
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+
+/**
+ * Run a benchmark once
+ * @return the nanoseconds per operation
+ */
+static double run_once(benchmark* b, long ops)
+{
+	double elapsed;
+
+	if (b->setup)
+		(*b->setup)(ops);
+	if (b->timed_run)
+		elapsed = (*b->timed_run)(ops);
+	else
+	{
+		double start = now_ns();
+
+		(*b->run)(ops);
+		elapsed = now_ns() - start;
+	}
+	if (b->teardown)
+		(*b->teardown)();
+	return elapsed / ops;
+}
+
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+
+int main(int argc, char** argv)
+{
+	double* samples = NULL;
+	int i, first = 1;
+
+	getopts(argc, argv);
+	if (options.list)
+	{
+		for (i = 0; i < ARRAY_SIZE(benchmarks); ++i)
+			printf("%s\n", benchmarks[i].name);
+		return 0;
+	}
+
+	Heap_initialize();
+	Pool_initialize();
+	Log_initialize(NULL);
+	samples = malloc(sizeof(double) * options.reps);
+
+	if (options.json)
+		printf("{\"reps\": %d, \"warmup\": %d, \"results\": [", options.reps, options.warmup);
+	else
+		printf("%-26s %10s %10s %10s %10s %10s %10s %6s\n", "benchmark", "ops/run",
+			"min ns", "median ns", "mean ns", "stddev", "max ns", "rsd%");
+	for (i = 0; i < ARRAY_SIZE(benchmarks); ++i)
+	{
+		benchmark* b = &benchmarks[i];
+		long ops = (options.ops > 0) ? options.ops : b->ops;
+		double mean = 0, var = 0, median;
+		int r;
+
+		if (options.filter && strstr(b->name, options.filter) == NULL)
+			continue;
+		for (r = 0; r < options.warmup; ++r)
+			run_once(b, ops);
+		for (r = 0; r < options.reps; ++r)
+		{
+			samples[r] = run_once(b, ops);
+			mean += samples[r];
+		}
+		mean /= options.reps;
+		for (r = 0; r < options.reps; ++r)
+			var += (samples[r] - mean) * (samples[r] - mean);
+		var = (options.reps > 1) ? var / (options.reps - 1) : 0;
+		qsort(samples, options.reps, sizeof(double), compare_double);
+		median = (options.reps % 2) ? samples[options.reps / 2] :
+			(samples[options.reps / 2 - 1] + samples[options.reps / 2]) / 2;
+
+		if (options.json)
+			printf("%s\n  {\"name\": \"%s\", \"ops_per_run\": %ld, \"min_ns\": %.3f, \"median_ns\": %.3f, "
+				"\"mean_ns\": %.3f, \"stddev_ns\": %.3f, \"max_ns\": %.3f}", first ? "" : ",",
+				b->name, ops, samples[0], median, mean, sqrt(var), samples[options.reps - 1]);
+		else
+			printf("%-26s %10ld %10.2f %10.2f %10.2f %10.2f %10.2f %6.1f\n", b->name, ops, samples[0],
+				median, mean, sqrt(var), samples[options.reps - 1], (mean > 0) ? 100 * sqrt(var) / mean : 0);
+		fflush(stdout);
+		first = 0;
+	}
+	if (options.json)
+		printf("\n]}\n");
+
+	free(samples);
+	Log_terminate();
+	Pool_terminate();
+	Heap_terminate();
+	return 0;
+}
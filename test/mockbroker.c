@@ -0,0 +1,838 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+/**
+ * @file
+ * A small MQTT 3.1.1 broker on the loopback interface, for benchmarks and tests
+ *
+ * It is meant to be fast enough that the client, not the broker, is what gets measured,
+ * so it does as little as it can:
+ * - QoS 0, 1 and 2 publications are forwarded to matching subscriptions at the lower of
+ *   the two QoS values.  QoS 2 publications are forwarded on receipt of the PUBLISH,
+ *   not of the PUBREL.
+ * - every session is clean: there are no retained messages, wills, or stored messages,
+ *   and nothing is ever retried.
+ * - acks can be delayed, with jitter, to stand in for a remote broker, and connections
+ *   can be dropped after a number of publications, to exercise reconnection.
+ *
+ * It runs either as a program of its own, or in the process of a benchmark which is
+ * compiled with this file and MOCKBROKER_NO_MAIN defined, using the functions in mockbroker.h.
+ */
+
+#include "mockbroker.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define CONNECT 1
+#define CONNACK 2
+#define PUBLISH 3
+#define PUBACK 4
+#define PUBREC 5
+#define PUBREL 6
+#define PUBCOMP 7
+#define SUBSCRIBE 8
+#define SUBACK 9
+#define UNSUBSCRIBE 10
+#define UNSUBACK 11
+#define PINGREQ 12
+#define PINGRESP 13
+#define DISCONNECT 14
+
+#define READ_BUFFER_SIZE 65536
+
+/** An ack waiting for its delay to pass */
+typedef struct delayed_ack_s
+{
+	struct delayed_ack_s* next;
+	struct timeval due;
+	int len;
+	unsigned char packet[5];
+} delayed_ack;
+
+typedef struct connection_s
+{
+	struct connection_s* next;
+	int socket;
+	pthread_t reader;
+	pthread_t writer;				/**< sends the delayed acks, if acks are delayed */
+	pthread_mutex_t write_mutex;	/**< one packet at a time on the socket */
+	pthread_cond_t delayed_cond;	/**< signalled when delayed changes, with write_mutex */
+	delayed_ack* delayed;			/**< in order of due time */
+	int stopping;
+	unsigned int seed;				/**< for the ack jitter */
+	unsigned short next_msgid;		/**< for publications sent to this connection */
+	int publishes;					/**< the number of PUBLISH packets received */
+	unsigned char* buf;				/**< buffer for incoming data */
+	size_t buflen, start, end;
+} connection;
+
+typedef struct subscription_s
+{
+	struct subscription_s* next;
+	connection* conn;
+	char* filter;
+	int qos;
+} subscription;
+
+static mockbroker_options options;
+static int listener = -1;
+static pthread_t listener_thread;
+static pthread_mutex_t connections_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connections_cond = PTHREAD_COND_INITIALIZER;
+static connection* connections = NULL;
+static pthread_rwlock_t subscriptions_lock = PTHREAD_RWLOCK_INITIALIZER;
+static subscription* subscriptions = NULL;
+static mockbroker_stats stats;
+
+
+/**
+ * Send a whole packet, or fail
+ * @param c the connection
+ * @param iov the pieces of the packet, which are updated
+ * @param count the number of pieces
+ * @return 0 on success, -1 on failure
+ */
+static int mockbroker_sendv(connection* c, struct iovec* iov, int count)
+{
+	struct msghdr msg;
+	int rc = 0;
+
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	pthread_mutex_lock(&c->write_mutex);
+	while (msg.msg_iovlen > 0)
+	{
+		ssize_t n = sendmsg(c->socket, &msg, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			rc = -1;
+			break;
+		}
+		while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov[0].iov_len)
+		{
+			n -= msg.msg_iov[0].iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0)
+		{
+			msg.msg_iov[0].iov_base = (char*)msg.msg_iov[0].iov_base + n;
+			msg.msg_iov[0].iov_len -= n;
+		}
+	}
+	pthread_mutex_unlock(&c->write_mutex);
+	return rc;
+}
+
+
+static int mockbroker_send(connection* c, const void* data, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void*)data;
+	iov.iov_len = len;
+	return mockbroker_sendv(c, &iov, 1);
+}
+
+
+/**
+ * Encode the remaining length of a packet
+ * @param buf where to write the length, which needs up to 4 bytes
+ * @param r the remaining length
+ * @return the number of bytes written
+ */
+static size_t mockbroker_encodeLength(unsigned char* buf, size_t r)
+{
+	size_t len = 0;
+
+	do
+	{
+		buf[len] = r % 128;
+		r /= 128;
+		if (r > 0)
+			buf[len] |= 128;
+		len++;
+	} while (r > 0);
+	return len;
+}
+
+
+/**
+ * Send a four byte ack (or SUBACK with one return code, which is five), straight away or after
+ * the configured delay
+ * @param c the connection
+ * @param packet the packet
+ * @param len its length
+ */
+static void mockbroker_ack(connection* c, const unsigned char* packet, int len)
+{
+	delayed_ack* ack = NULL;
+	delayed_ack** pos = NULL;
+	long delay = options.ack_delay;
+
+	if (options.ack_delay == 0 && options.ack_jitter == 0)
+	{
+		mockbroker_send(c, packet, len);
+		return;
+	}
+	ack = malloc(sizeof(delayed_ack));
+	ack->len = len;
+	memcpy(ack->packet, packet, len);
+	pthread_mutex_lock(&c->write_mutex);
+	if (options.ack_jitter > 0)
+		delay += rand_r(&c->seed) % (options.ack_jitter + 1);
+	gettimeofday(&ack->due, NULL);
+	ack->due.tv_sec += delay / 1000;
+	ack->due.tv_usec += (delay % 1000) * 1000;
+	if (ack->due.tv_usec >= 1000000L)
+	{
+		ack->due.tv_sec++;
+		ack->due.tv_usec -= 1000000L;
+	}
+	for (pos = &c->delayed; *pos && !timercmp(&ack->due, &(*pos)->due, <); pos = &(*pos)->next)
+		;
+	ack->next = *pos;
+	*pos = ack;
+	pthread_cond_signal(&c->delayed_cond);
+	pthread_mutex_unlock(&c->write_mutex);
+}
+
+
+static void* mockbroker_writer(void* arg)
+{
+	connection* c = arg;
+
+	pthread_mutex_lock(&c->write_mutex);
+	while (!c->stopping)
+	{
+		struct timeval now;
+		delayed_ack* ack = c->delayed;
+
+		if (ack == NULL)
+		{
+			pthread_cond_wait(&c->delayed_cond, &c->write_mutex);
+			continue;
+		}
+		gettimeofday(&now, NULL);
+		if (timercmp(&ack->due, &now, >))
+		{
+			struct timespec until;
+
+			until.tv_sec = ack->due.tv_sec;
+			until.tv_nsec = ack->due.tv_usec * 1000L;
+			pthread_cond_timedwait(&c->delayed_cond, &c->write_mutex, &until);
+			continue;
+		}
+		c->delayed = ack->next;
+		if (send(c->socket, ack->packet, ack->len, MSG_NOSIGNAL) != ack->len)
+			shutdown(c->socket, SHUT_RDWR);
+		free(ack);
+	}
+	pthread_mutex_unlock(&c->write_mutex);
+	return NULL;
+}
+
+
+/**
+ * Read the next packet from a connection
+ * @param c the connection
+ * @param header returns the first byte of the fixed header
+ * @param data returns the rest of the packet after the fixed header, valid until the next call
+ * @param len returns the remaining length
+ * @return 0 on success, -1 if the connection has ended
+ */
+static int mockbroker_read(connection* c, unsigned char* header, unsigned char** data, size_t* len)
+{
+	for (;;)
+	{
+		size_t avail = c->end - c->start;
+
+		if (avail >= 2)
+		{
+			unsigned char* p = c->buf + c->start;
+			size_t remaining = 0, multiplier = 1, i = 1;
+
+			do
+			{
+				remaining += (p[i] & 127) * multiplier;
+				multiplier *= 128;
+			} while ((p[i++] & 128) && i < avail && i <= 4);
+			if (!(p[i - 1] & 128) && avail >= i + remaining)
+			{
+				*header = p[0];
+				*data = p + i;
+				*len = remaining;
+				c->start += i + remaining;
+				return 0;
+			}
+			if (c->start + i + remaining > c->buflen)
+			{	/* make room for the whole packet */
+				memmove(c->buf, p, avail);
+				c->start = 0;
+				c->end = avail;
+				if (i + remaining > c->buflen)
+				{
+					c->buflen = i + remaining;
+					c->buf = realloc(c->buf, c->buflen);
+				}
+			}
+		}
+		else if (c->start > 0)
+		{
+			memmove(c->buf, c->buf + c->start, avail);
+			c->start = 0;
+			c->end = avail;
+		}
+		{
+			ssize_t n = recv(c->socket, c->buf + c->end, c->buflen - c->end, 0);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -1;
+			c->end += n;
+		}
+	}
+}
+
+
+/**
+ * Does a topic name match a subscription's topic filter?
+ * @param filter the topic filter, which may contain the wildcards + and #
+ * @param topic the topic name
+ * @param topiclen the length of the topic name
+ * @return 1 if it matches, otherwise 0
+ */
+static int mockbroker_matches(const char* filter, const char* topic, size_t topiclen)
+{
+	const char* end = topic + topiclen;
+
+	while (*filter && topic < end)
+	{
+		if (*filter == '#')
+			return 1;
+		if (*filter == '+')
+		{
+			while (topic < end && *topic != '/')
+				++topic;
+			++filter;
+		}
+		else if (*filter++ != *topic++)
+			return 0;
+	}
+	if (topic == end)
+	{
+		if (*filter == '\0')
+			return 1;
+		/* "a/#" matches "a", and "a/+" does not */
+		if (filter[0] == '/' && filter[1] == '#' && filter[2] == '\0')
+			return 1;
+		if (filter[0] == '#' && filter[1] == '\0')
+			return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Send a publication to all the connections with matching subscriptions
+ * @param topic the topic name
+ * @param topiclen the length of the topic name
+ * @param payload the payload
+ * @param payloadlen the length of the payload
+ * @param qos the QoS it was published with
+ */
+static void mockbroker_forward(const char* topic, size_t topiclen, const unsigned char* payload, size_t payloadlen, int qos)
+{
+	subscription* sub = NULL;
+
+	pthread_rwlock_rdlock(&subscriptions_lock);
+	for (sub = subscriptions; sub; sub = sub->next)
+	{
+		subscription* other = NULL;
+		int subqos = -1;
+
+		if (!mockbroker_matches(sub->filter, topic, topiclen))
+			continue;
+		/* deliver once per connection, at the highest QoS of its matching subscriptions */
+		for (other = subscriptions; other != sub; other = other->next)
+		{
+			if (other->conn == sub->conn && mockbroker_matches(other->filter, topic, topiclen))
+				break;
+		}
+		if (other != sub)
+			continue;
+		for (other = sub; other; other = other->next)
+		{
+			if (other->conn == sub->conn && other->qos > subqos && mockbroker_matches(other->filter, topic, topiclen))
+				subqos = other->qos;
+		}
+		{
+			connection* c = sub->conn;
+			int outqos = (qos < subqos) ? qos : subqos;
+			size_t r = 2 + topiclen + ((outqos > 0) ? 2 : 0) + payloadlen;
+			unsigned char header[8], msgid[2];
+			size_t hlen = 1;
+			struct iovec iov[4];
+			int count = 0;
+
+			header[0] = (PUBLISH << 4) | (outqos << 1);
+			hlen += mockbroker_encodeLength(&header[1], r);
+			header[hlen++] = (unsigned char)(topiclen >> 8);
+			header[hlen++] = (unsigned char)(topiclen & 0xFF);
+			iov[count].iov_base = header;
+			iov[count++].iov_len = hlen;
+			iov[count].iov_base = (void*)topic;
+			iov[count++].iov_len = topiclen;
+			if (outqos > 0)
+			{
+				unsigned short id;
+
+				while ((id = __sync_add_and_fetch(&c->next_msgid, 1)) == 0)
+					;
+				msgid[0] = id >> 8;
+				msgid[1] = id & 0xFF;
+				iov[count].iov_base = msgid;
+				iov[count++].iov_len = 2;
+			}
+			iov[count].iov_base = (void*)payload;
+			iov[count++].iov_len = payloadlen;
+			mockbroker_sendv(c, iov, count);
+			__sync_fetch_and_add(&stats.publishes_out, 1);
+		}
+	}
+	pthread_rwlock_unlock(&subscriptions_lock);
+}
+
+
+static int mockbroker_readInt(unsigned char** p)
+{
+	int value = ((*p)[0] << 8) | (*p)[1];
+
+	*p += 2;
+	return value;
+}
+
+
+/**
+ * Handle a SUBSCRIBE or UNSUBSCRIBE packet
+ * @param c the connection
+ * @param data the packet after the fixed header
+ * @param len the remaining length
+ * @param subscribe 1 for SUBSCRIBE, 0 for UNSUBSCRIBE
+ */
+static void mockbroker_subscribe(connection* c, unsigned char* data, size_t len, int subscribe)
+{
+	unsigned char* p = data;
+	unsigned char* end = data + len;
+	unsigned char header[7];
+	unsigned char* codes = malloc(len / 3 + 1); /* each filter takes at least three bytes */
+	int msgid = mockbroker_readInt(&p);
+	size_t hlen = 1, count = 0;
+
+	pthread_rwlock_wrlock(&subscriptions_lock);
+	while (p + 2 <= end)
+	{
+		int topiclen = mockbroker_readInt(&p);
+		subscription** pos = NULL;
+
+		if (p + topiclen + subscribe > end)
+			break;
+		/* a new subscription to the same filter replaces the old one */
+		for (pos = &subscriptions; *pos; pos = &(*pos)->next)
+		{
+			if ((*pos)->conn == c && strlen((*pos)->filter) == (size_t)topiclen && memcmp((*pos)->filter, p, topiclen) == 0)
+			{
+				subscription* old = *pos;
+
+				*pos = old->next;
+				free(old->filter);
+				free(old);
+				break;
+			}
+		}
+		if (subscribe)
+		{
+			subscription* sub = malloc(sizeof(subscription));
+
+			sub->conn = c;
+			sub->filter = malloc(topiclen + 1);
+			memcpy(sub->filter, p, topiclen);
+			sub->filter[topiclen] = '\0';
+			sub->qos = p[topiclen] & 0x03;
+			sub->next = subscriptions;
+			subscriptions = sub;
+			codes[count++] = sub->qos;
+			p++;
+		}
+		p += topiclen;
+	}
+	pthread_rwlock_unlock(&subscriptions_lock);
+
+	header[0] = (subscribe ? SUBACK : UNSUBACK) << 4;
+	hlen += mockbroker_encodeLength(&header[1], 2 + count);
+	header[hlen++] = msgid >> 8;
+	header[hlen++] = msgid & 0xFF;
+	if (subscribe && count == 1)
+	{
+		header[hlen++] = codes[0];
+		mockbroker_ack(c, header, (int)hlen);
+	}
+	else
+	{
+		struct iovec iov[2];
+
+		iov[0].iov_base = header;
+		iov[0].iov_len = hlen;
+		iov[1].iov_base = codes;
+		iov[1].iov_len = count;
+		mockbroker_sendv(c, iov, count > 0 ? 2 : 1);
+	}
+	free(codes);
+}
+
+
+/**
+ * Remove all the subscriptions of a connection
+ * @param c the connection
+ */
+static void mockbroker_unsubscribeAll(connection* c)
+{
+	subscription** pos = &subscriptions;
+
+	pthread_rwlock_wrlock(&subscriptions_lock);
+	while (*pos)
+	{
+		subscription* sub = *pos;
+
+		if (sub->conn == c)
+		{
+			*pos = sub->next;
+			free(sub->filter);
+			free(sub);
+		}
+		else
+			pos = &sub->next;
+	}
+	pthread_rwlock_unlock(&subscriptions_lock);
+}
+
+
+static void* mockbroker_reader(void* arg)
+{
+	connection* c = arg;
+	unsigned char header;
+	unsigned char* data = NULL;
+	size_t len = 0;
+
+	while (mockbroker_read(c, &header, &data, &len) == 0)
+	{
+		int type = header >> 4;
+		unsigned char ack[4];
+
+		if (type == CONNECT)
+		{
+			unsigned char connack[4] = {CONNACK << 4, 2, 0, 0};
+
+			mockbroker_send(c, connack, sizeof(connack));
+		}
+		else if (type == PUBLISH)
+		{
+			unsigned char* p = data;
+			int qos = (header >> 1) & 0x03;
+			int topiclen = mockbroker_readInt(&p);
+			char* topic = (char*)p;
+			int msgid = 0;
+
+			p += topiclen;
+			if (qos > 0)
+				msgid = mockbroker_readInt(&p);
+			__sync_fetch_and_add(&stats.publishes_in, 1);
+			mockbroker_forward(topic, topiclen, p, data + len - p, qos);
+			if (qos > 0)
+			{
+				ack[0] = ((qos == 1) ? PUBACK : PUBREC) << 4;
+				ack[1] = 2;
+				ack[2] = msgid >> 8;
+				ack[3] = msgid & 0xFF;
+				mockbroker_ack(c, ack, 4);
+			}
+			if (options.disconnect_after > 0 && ++c->publishes >= options.disconnect_after)
+			{
+				if (options.verbose)
+					printf("mockbroker: dropping connection on socket %d after %d publications\n", c->socket, c->publishes);
+				break;
+			}
+		}
+		else if (type == PUBREL || type == PUBREC)
+		{
+			/* PUBREL from a publisher gets a PUBCOMP, PUBREC from a subscriber gets a PUBREL */
+			ack[0] = (type == PUBREL) ? (PUBCOMP << 4) : ((PUBREL << 4) | 0x02);
+			ack[1] = 2;
+			ack[2] = data[0];
+			ack[3] = data[1];
+			if (type == PUBREL)
+				mockbroker_ack(c, ack, 4);
+			else
+				mockbroker_send(c, ack, 4);
+		}
+		else if (type == SUBSCRIBE || type == UNSUBSCRIBE)
+			mockbroker_subscribe(c, data, len, type == SUBSCRIBE);
+		else if (type == PINGREQ)
+		{
+			unsigned char pingresp[2] = {PINGRESP << 4, 0};
+
+			mockbroker_send(c, pingresp, sizeof(pingresp));
+		}
+		else if (type == DISCONNECT)
+			break;
+		/* PUBACK and PUBCOMP from subscribers need nothing */
+	}
+
+	mockbroker_unsubscribeAll(c);
+	shutdown(c->socket, SHUT_RDWR);
+	if (options.ack_delay > 0 || options.ack_jitter > 0)
+	{
+		pthread_mutex_lock(&c->write_mutex);
+		c->stopping = 1;
+		pthread_cond_signal(&c->delayed_cond);
+		pthread_mutex_unlock(&c->write_mutex);
+		pthread_join(c->writer, NULL);
+	}
+	while (c->delayed)
+	{
+		delayed_ack* ack = c->delayed;
+
+		c->delayed = ack->next;
+		free(ack);
+	}
+	if (options.verbose)
+		printf("mockbroker: connection on socket %d ended\n", c->socket);
+
+	pthread_mutex_lock(&connections_mutex);
+	{
+		connection** pos = NULL;
+
+		for (pos = &connections; *pos != c; pos = &(*pos)->next)
+			;
+		*pos = c->next;
+	}
+	close(c->socket);
+	pthread_cond_signal(&connections_cond);
+	pthread_mutex_unlock(&connections_mutex);
+	pthread_mutex_destroy(&c->write_mutex);
+	pthread_cond_destroy(&c->delayed_cond);
+	free(c->buf);
+	free(c);
+	return NULL;
+}
+
+
+static void* mockbroker_listener(void* arg)
+{
+	for (;;)
+	{
+		int sock = accept(listener, NULL, NULL);
+		int opt = 1;
+		connection* c = NULL;
+		pthread_attr_t attr;
+
+		if (sock < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break; /* the listener has been shut down */
+		}
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+		c = calloc(1, sizeof(connection));
+		c->socket = sock;
+		c->seed = (unsigned int)sock;
+		c->buflen = READ_BUFFER_SIZE;
+		c->buf = malloc(c->buflen);
+		pthread_mutex_init(&c->write_mutex, NULL);
+		pthread_cond_init(&c->delayed_cond, NULL);
+		__sync_fetch_and_add(&stats.connections, 1);
+		if (options.verbose)
+			printf("mockbroker: new connection on socket %d\n", sock);
+
+		pthread_mutex_lock(&connections_mutex);
+		c->next = connections;
+		connections = c;
+		pthread_mutex_unlock(&connections_mutex);
+
+		if (options.ack_delay > 0 || options.ack_jitter > 0)
+			pthread_create(&c->writer, NULL, mockbroker_writer, c);
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_create(&c->reader, &attr, mockbroker_reader, c);
+		pthread_attr_destroy(&attr);
+	}
+	return NULL;
+}
+
+
+/**
+ * Start the broker, listening on 127.0.0.1
+ * @param opts the options.  If the port is 0, the port chosen is returned in it.
+ * @return 0 on success, -1 if the broker could not listen on the port
+ */
+int mockbroker_start(mockbroker_options* opts)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int opt = 1;
+
+	options = *opts;
+	memset(&stats, '\0', sizeof(stats));
+	if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(options.port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0 ||
+		getsockname(listener, (struct sockaddr*)&addr, &addrlen) != 0)
+	{
+		close(listener);
+		listener = -1;
+		return -1;
+	}
+	opts->port = options.port = ntohs(addr.sin_port);
+	pthread_create(&listener_thread, NULL, mockbroker_listener, NULL);
+	return 0;
+}
+
+
+/**
+ * Drop every connection, as a broker restart or network failure would
+ */
+void mockbroker_disconnect_all(void)
+{
+	connection* c = NULL;
+
+	pthread_mutex_lock(&connections_mutex);
+	for (c = connections; c; c = c->next)
+		shutdown(c->socket, SHUT_RDWR);
+	pthread_mutex_unlock(&connections_mutex);
+}
+
+
+void mockbroker_get_stats(mockbroker_stats* s)
+{
+	s->connections = __sync_fetch_and_add(&stats.connections, 0);
+	s->publishes_in = __sync_fetch_and_add(&stats.publishes_in, 0);
+	s->publishes_out = __sync_fetch_and_add(&stats.publishes_out, 0);
+}
+
+
+/**
+ * Stop listening, drop every connection, and wait for them to be cleaned up
+ */
+void mockbroker_stop(void)
+{
+	if (listener == -1)
+		return;
+	shutdown(listener, SHUT_RDWR);
+	pthread_join(listener_thread, NULL);
+	close(listener);
+	listener = -1;
+	pthread_mutex_lock(&connections_mutex);
+	while (connections)
+	{
+		connection* c = NULL;
+
+		for (c = connections; c; c = c->next)
+			shutdown(c->socket, SHUT_RDWR);
+		pthread_cond_wait(&connections_cond, &connections_mutex);
+	}
+	pthread_mutex_unlock(&connections_mutex);
+}
+
+
+#if !defined(MOCKBROKER_NO_MAIN)
+
+void usage(void)
+{
+	printf("usage: mockbroker [--port 1883] [--ack_delay ms] [--ack_jitter ms] [--disconnect_after publications] [--verbose]\n");
+	exit(-1);
+}
+
+
+int main(int argc, char** argv)
+{
+	mockbroker_options opts = mockbroker_options_initializer;
+	mockbroker_stats s;
+	sigset_t signals;
+	int count = 1, sig = 0;
+
+	opts.port = 1883;
+	while (count < argc)
+	{
+		if (strcmp(argv[count], "--port") == 0 && ++count < argc)
+			opts.port = atoi(argv[count]);
+		else if (strcmp(argv[count], "--ack_delay") == 0 && ++count < argc)
+			opts.ack_delay = atoi(argv[count]);
+		else if (strcmp(argv[count], "--ack_jitter") == 0 && ++count < argc)
+			opts.ack_jitter = atoi(argv[count]);
+		else if (strcmp(argv[count], "--disconnect_after") == 0 && ++count < argc)
+			opts.disconnect_after = atoi(argv[count]);
+		else if (strcmp(argv[count], "--verbose") == 0)
+			opts.verbose = 1;
+		else
+			usage();
+		count++;
+	}
+
+	/* wait for a signal to stop, with the signals blocked in every broker thread */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	if (mockbroker_start(&opts) != 0)
+	{
+		printf("mockbroker: could not listen on port %d: %s\n", opts.port, strerror(errno));
+		return 1;
+	}
+	printf("mockbroker: listening on 127.0.0.1:%d\n", opts.port);
+	fflush(stdout);
+	sigwait(&signals, &sig);
+
+	mockbroker_stop();
+	mockbroker_get_stats(&s);
+	printf("mockbroker: %ld connections, %ld publications received, %ld sent\n", s.connections, s.publishes_in, s.publishes_out);
+	return 0;
+}
+
+#endif
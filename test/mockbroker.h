@@ -0,0 +1,49 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#if !defined(MOCKBROKER_H)
+#define MOCKBROKER_H
+
+/**
+ * Options for the mock broker
+ */
+typedef struct
+{
+	int port;				/**< the TCP port to listen on, on 127.0.0.1.  0 picks a free port, which is returned here */
+	int ack_delay;			/**< milliseconds to wait before sending each PUBACK, PUBREC, PUBCOMP and SUBACK */
+	int ack_jitter;			/**< up to this many milliseconds, chosen at random, are added to ack_delay */
+	int disconnect_after;	/**< close each connection after it has sent this many PUBLISH packets, 0 for never */
+	int verbose;			/**< print connections and disconnections */
+} mockbroker_options;
+
+#define mockbroker_options_initializer { 0, 0, 0, 0, 0 }
+
+/**
+ * Message counts since the broker was started
+ */
+typedef struct
+{
+	long connections;		/**< connections accepted */
+	long publishes_in;		/**< PUBLISH packets received */
+	long publishes_out;		/**< PUBLISH packets sent to subscribers */
+} mockbroker_stats;
+
+int mockbroker_start(mockbroker_options* options);
+void mockbroker_disconnect_all(void);
+void mockbroker_get_stats(mockbroker_stats* stats);
+void mockbroker_stop(void);
+
+#endif
@@ -0,0 +1,727 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+
+/**
+ * @file
+ * Publish throughput and latency benchmarks for MQTTClient and MQTTAsync
+ *
+ * Every combination of the API, QoS, payload size, in-flight window, publisher threads
+ * per connection and connection count given on the command line is run in turn.  Each
+ * publication carries the time it was published and a sequence number, and a subscriber
+ * on a connection of its own takes the end-to-end latency of each.  The subscriber always
+ * uses MQTTAsync: an MQTTClient with a message callback has a background thread, and while
+ * it runs, MQTTClient_yield sleeps for 100ms instead of reading the socket, which would
+ * hold up every synchronous publisher in the process.
+ *
+ * The results are written to stdout as one JSON document, with progress on stderr.
+ *
+ * Unless --connection is given, the mock broker in mockbroker.c is run in a child
+ * process, so that the CPU time reported is the client's alone.
+ */
+
+
+#include "MQTTClient.h"
+#include "MQTTAsync.h"
+#include "mockbroker.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define MAX_VALUES 16
+#define HEADER_LEN 16		/**< the timestamp and sequence number at the start of each payload */
+#define DRAIN_TIMEOUT 10	/**< seconds to wait for the last publications to arrive */
+
+void usage(void)
+{
+	printf("usage: paho_bench [options]\n"
+		"  --connection URI    broker to use, instead of starting the mock broker\n"
+		"  --apis list         sync, async or both (default sync,async)\n"
+		"  --qos list          default 0,1,2\n"
+		"  --sizes list        payload sizes in bytes, 16 to 1048576 (default 16,1024,65536,1048576)\n"
+		"  --inflight list     publications each publisher thread leaves unacknowledged (default 10)\n"
+		"  --threads list      publisher threads per connection (default 1)\n"
+		"  --connections list  publishing connections (default 1)\n"
+		"  --count n           publications per run (default 10000)\n"
+		"  --max_bytes n       payload bytes per run, reducing count for large payloads (default 67108864)\n"
+		"  --ack_delay ms      delay the mock broker's acks\n");
+	exit(-1);
+}
+
+enum { API_SYNC, API_ASYNC };
+static const char* api_names[] = { "sync", "async" };
+
+struct Options
+{
+	char* connection;
+	int apis[MAX_VALUES]; int napis;
+	int qos[MAX_VALUES]; int nqos;
+	int sizes[MAX_VALUES]; int nsizes;
+	int inflight[MAX_VALUES]; int ninflight;
+	int threads[MAX_VALUES]; int nthreads;
+	int connections[MAX_VALUES]; int nconnections;
+	int count;
+	long max_bytes;
+	int ack_delay;
+} options =
+{
+	NULL,
+	{API_SYNC, API_ASYNC}, 2,
+	{0, 1, 2}, 3,
+	{16, 1024, 65536, 1048576}, 4,
+	{10}, 1,
+	{1}, 1,
+	{1}, 1,
+	10000,
+	64 * 1024 * 1024,
+	0,
+};
+
+
+/**
+ * Parse a comma separated list of numbers, or of API names
+ * @return the number of values
+ */
+int getlist(char* arg, int* values, int min, int max)
+{
+	int count = 0;
+	char* tok = strtok(arg, ",");
+
+	while (tok)
+	{
+		int value;
+
+		if (count == MAX_VALUES)
+			usage();
+		if (max == -1) /* API names */
+		{
+			if (strcmp(tok, "sync") == 0)
+				value = API_SYNC;
+			else if (strcmp(tok, "async") == 0)
+				value = API_ASYNC;
+			else
+				usage();
+		}
+		else if ((value = atoi(tok)) < min || value > max)
+			usage();
+		values[count++] = value;
+		tok = strtok(NULL, ",");
+	}
+	if (count == 0)
+		usage();
+	return count;
+}
+
+
+void getopts(int argc, char** argv)
+{
+	int count = 1;
+
+	while (count < argc)
+	{
+		char* arg = argv[count];
+
+		if (++count >= argc)
+			usage();
+		if (strcmp(arg, "--connection") == 0)
+			options.connection = argv[count];
+		else if (strcmp(arg, "--apis") == 0)
+			options.napis = getlist(argv[count], options.apis, 0, -1);
+		else if (strcmp(arg, "--qos") == 0)
+			options.nqos = getlist(argv[count], options.qos, 0, 2);
+		else if (strcmp(arg, "--sizes") == 0)
+			options.nsizes = getlist(argv[count], options.sizes, HEADER_LEN, 256 * 1024 * 1024);
+		else if (strcmp(arg, "--inflight") == 0)
+			options.ninflight = getlist(argv[count], options.inflight, 1, 65535);
+		else if (strcmp(arg, "--threads") == 0)
+			options.nthreads = getlist(argv[count], options.threads, 1, 1024);
+		else if (strcmp(arg, "--connections") == 0)
+			options.nconnections = getlist(argv[count], options.connections, 1, 1024);
+		else if (strcmp(arg, "--count") == 0)
+			options.count = atoi(argv[count]);
+		else if (strcmp(arg, "--max_bytes") == 0)
+			options.max_bytes = atol(argv[count]);
+		else if (strcmp(arg, "--ack_delay") == 0)
+			options.ack_delay = atoi(argv[count]);
+		else
+			usage();
+		count++;
+	}
+	if (options.count < 1 || options.max_bytes < 1)
+		usage();
+}
+
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static double cpu_seconds(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+
+/** One combination of the parameters */
+typedef struct
+{
+	int api;
+	int qos;
+	int size;
+	int inflight;
+	int threads;
+	int connections;
+	int count;
+} bench_run;
+
+/** A publishing connection */
+typedef struct
+{
+	void* client;		/**< an MQTTClient or MQTTAsync */
+	volatile int connected;
+	volatile int failed;
+} bench_connection;
+
+/** A publisher thread */
+typedef struct
+{
+	bench_connection* conn;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int outstanding;			/**< async publications not yet complete */
+	volatile int failed;
+} bench_publisher;
+
+static bench_run run;
+static char* uri = NULL;
+static char topic[64];
+static volatile int next_seq = 0;
+static volatile int received = 0;
+static int64_t* latencies = NULL;	/**< indexed by sequence number, -1 until received */
+static volatile int64_t last_received = 0;
+static bench_connection subscriber;
+
+
+/**
+ * Take the latency of a publication from its payload
+ */
+static void bench_arrived(void* payload, int payloadlen)
+{
+	int64_t sent, now = now_ns();
+	uint32_t seq;
+
+	if (payloadlen < HEADER_LEN)
+		return;
+	memcpy(&sent, payload, sizeof(sent));
+	memcpy(&seq, (char*)payload + sizeof(sent), sizeof(seq));
+	if (seq < (uint32_t)run.count && latencies[seq] == -1)
+	{
+		latencies[seq] = now - sent;
+		last_received = now;
+		__sync_fetch_and_add(&received, 1);
+	}
+}
+
+
+/**
+ * Fill in the header of the next publication
+ * @return 0, or -1 when all the publications of this run have been made
+ */
+static int bench_stamp(char* payload)
+{
+	int64_t sent;
+	uint32_t seq = (uint32_t)__sync_fetch_and_add(&next_seq, 1);
+
+	if (seq >= (uint32_t)run.count)
+		return -1;
+	memcpy(payload + sizeof(sent), &seq, sizeof(seq));
+	sent = now_ns();
+	memcpy(payload, &sent, sizeof(sent));
+	return 0;
+}
+
+
+/* MQTTClient */
+
+static int sync_connect(bench_connection* conn, char* clientid)
+{
+	MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer;
+	int rc;
+
+	if ((rc = MQTTClient_create(&conn->client, uri, clientid, MQTTCLIENT_PERSISTENCE_NONE, NULL)) != MQTTCLIENT_SUCCESS)
+		return rc;
+	opts.keepAliveInterval = 60;
+	opts.cleansession = 1;
+	opts.reliable = (run.inflight == 1); /* otherwise up to 10 messages can be in flight */
+	rc = MQTTClient_connect(conn->client, &opts);
+	conn->connected = (rc == MQTTCLIENT_SUCCESS);
+	return rc;
+}
+
+
+static void sync_disconnect(bench_connection* conn)
+{
+	if (conn->connected)
+		MQTTClient_disconnect(conn->client, 1000);
+	MQTTClient_destroy(&conn->client);
+}
+
+
+/**
+ * Publish with MQTTClient, waiting for the oldest delivery token when the window is full.
+ * MQTTClient itself allows no more than 10 QoS 1 and 2 messages in flight, and each wait
+ * for acks takes at least the 100ms of one MQTTClient_yield.
+ */
+static void* sync_publisher(void* arg)
+{
+	bench_publisher* pub = arg;
+	MQTTClient_deliveryToken* tokens = calloc(run.inflight, sizeof(MQTTClient_deliveryToken));
+	char* payload = calloc(1, run.size);
+	int head = 0, outstanding = 0;
+
+	while (bench_stamp(payload) == 0)
+	{
+		MQTTClient_deliveryToken token = 0;
+		int rc;
+
+		if ((rc = MQTTClient_publish(pub->conn->client, topic, run.size, payload, run.qos, 0, &token)) != MQTTCLIENT_SUCCESS)
+		{
+			pub->failed = rc;
+			break;
+		}
+		if (run.qos == 0)
+			continue;
+		tokens[(head + outstanding++) % run.inflight] = token;
+		if (outstanding == run.inflight)
+		{
+			MQTTClient_waitForCompletion(pub->conn->client, tokens[head], 10000L);
+			head = (head + 1) % run.inflight;
+			outstanding--;
+		}
+	}
+	while (outstanding > 0)
+	{
+		MQTTClient_waitForCompletion(pub->conn->client, tokens[head], 10000L);
+		head = (head + 1) % run.inflight;
+		outstanding--;
+	}
+	free(payload);
+	free(tokens);
+	return NULL;
+}
+
+
+/* MQTTAsync */
+
+int async_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* m)
+{
+	bench_arrived(m->payload, m->payloadlen);
+	MQTTAsync_freeMessage(&m);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void async_connectionLost(void* context, char* cause)
+{
+	fprintf(stderr, "paho_bench: connection lost\n");
+}
+
+
+void async_onFailure(void* context, MQTTAsync_failureData* response)
+{
+	((bench_connection*)context)->failed = 1;
+}
+
+
+void async_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	((bench_connection*)context)->connected = 1;
+}
+
+
+void async_onConnect(void* context, MQTTAsync_successData* response)
+{
+	bench_connection* conn = context;
+
+	if (conn == &subscriber)
+	{
+		MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+
+		opts.onSuccess = async_onSubscribe;
+		opts.onFailure = async_onFailure;
+		opts.context = conn;
+		if (MQTTAsync_subscribe(conn->client, topic, run.qos, &opts) != MQTTASYNC_SUCCESS)
+			conn->failed = 1;
+	}
+	else
+		conn->connected = 1;
+}
+
+
+static int async_connect(bench_connection* conn, char* clientid)
+{
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	int rc, i;
+
+	if ((rc = MQTTAsync_create(&conn->client, uri, clientid, MQTTCLIENT_PERSISTENCE_NONE, NULL)) != MQTTASYNC_SUCCESS)
+		return rc;
+	MQTTAsync_setCallbacks(conn->client, NULL, async_connectionLost, (conn == &subscriber) ? async_messageArrived : NULL, NULL);
+	opts.keepAliveInterval = 60;
+	opts.cleansession = 1;
+	opts.maxInflight = (run.inflight * run.threads > 65535) ? 65535 : run.inflight * run.threads;
+	opts.onSuccess = async_onConnect;
+	opts.onFailure = async_onFailure;
+	opts.context = conn;
+	if ((rc = MQTTAsync_connect(conn->client, &opts)) != MQTTASYNC_SUCCESS)
+		return rc;
+	for (i = 0; i < 1000 && !conn->connected && !conn->failed; ++i)
+		usleep(10000L);
+	return conn->connected ? MQTTASYNC_SUCCESS : MQTTASYNC_FAILURE;
+}
+
+
+void async_onDisconnect(void* context, MQTTAsync_successData* response)
+{
+	((bench_connection*)context)->connected = 0;
+}
+
+
+static void async_disconnect(bench_connection* conn)
+{
+	if (conn->connected)
+	{
+		MQTTAsync_disconnectOptions opts = MQTTAsync_disconnectOptions_initializer;
+		int i;
+
+		opts.onSuccess = async_onDisconnect;
+		opts.context = conn;
+		MQTTAsync_disconnect(conn->client, &opts);
+		for (i = 0; i < 100 && conn->connected; ++i)
+			usleep(10000L);
+	}
+	MQTTAsync_destroy(&conn->client);
+}
+
+
+static void async_published(bench_publisher* pub)
+{
+	pthread_mutex_lock(&pub->mutex);
+	pub->outstanding--;
+	pthread_cond_signal(&pub->cond);
+	pthread_mutex_unlock(&pub->mutex);
+}
+
+
+void async_onPublish(void* context, MQTTAsync_successData* response)
+{
+	async_published(context);
+}
+
+
+void async_onPublishFailure(void* context, MQTTAsync_failureData* response)
+{
+	((bench_publisher*)context)->failed = (response) ? response->code : MQTTASYNC_FAILURE;
+	async_published(context);
+}
+
+
+/**
+ * Publish with MQTTAsync, waiting for a publication to complete when the window is full
+ */
+static void* async_publisher(void* arg)
+{
+	bench_publisher* pub = arg;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	char* payload = calloc(1, run.size);
+
+	opts.onSuccess = async_onPublish;
+	opts.onFailure = async_onPublishFailure;
+	opts.context = pub;
+	while (!pub->failed)
+	{
+		pthread_mutex_lock(&pub->mutex);
+		while (pub->outstanding >= run.inflight)
+			pthread_cond_wait(&pub->cond, &pub->mutex);
+		pub->outstanding++;
+		pthread_mutex_unlock(&pub->mutex);
+
+		if (bench_stamp(payload) != 0 ||
+			MQTTAsync_send(pub->conn->client, topic, run.size, payload, run.qos, 0, &opts) != MQTTASYNC_SUCCESS)
+		{
+			pthread_mutex_lock(&pub->mutex);
+			pub->outstanding--;
+			pthread_mutex_unlock(&pub->mutex);
+			break;
+		}
+	}
+	pthread_mutex_lock(&pub->mutex);
+	while (pub->outstanding > 0)
+		pthread_cond_wait(&pub->cond, &pub->mutex);
+	pthread_mutex_unlock(&pub->mutex);
+	free(payload);
+	return NULL;
+}
+
+
+static int compare_latency(const void* a, const void* b)
+{
+	int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+
+static double percentile(int64_t* sorted, int count, double p)
+{
+	int index = (int)(p * count);
+
+	if (count == 0)
+		return 0;
+	if (index >= count)
+		index = count - 1;
+	return sorted[index] / 1000.0;
+}
+
+
+/**
+ * Run one combination of the parameters, and write its JSON object
+ * @return 0 on success, -1 if the clients could not connect
+ */
+int bench(int first)
+{
+	bench_connection* conns = calloc(run.connections, sizeof(bench_connection));
+	bench_publisher* pubs = calloc(run.connections * run.threads, sizeof(bench_publisher));
+	int (*connect)(bench_connection*, char*) = (run.api == API_SYNC) ? sync_connect : async_connect;
+	void (*disconnect)(bench_connection*) = (run.api == API_SYNC) ? sync_disconnect : async_disconnect;
+	void* (*publisher)(void*) = (run.api == API_SYNC) ? sync_publisher : async_publisher;
+	int npubs = run.connections * run.threads;
+	int64_t start, end;
+	double cpu_start, cpu;
+	int i, rc = -1, last = -1, errors = 0;
+	char clientid[64];
+
+	snprintf(topic, sizeof(topic), "paho_bench/%s/%d/%d", api_names[run.api], run.qos, run.size);
+	latencies = malloc(sizeof(int64_t) * run.count);
+	for (i = 0; i < run.count; ++i)
+		latencies[i] = -1;
+	next_seq = received = 0;
+	last_received = 0;
+	memset(&subscriber, '\0', sizeof(subscriber));
+
+	if (async_connect(&subscriber, "paho_bench_sub") != 0)
+	{
+		fprintf(stderr, "paho_bench: subscriber could not connect to %s\n", uri);
+		goto exit;
+	}
+	for (i = 0; i < run.connections; ++i)
+	{
+		snprintf(clientid, sizeof(clientid), "paho_bench_pub_%d", i);
+		if (connect(&conns[i], clientid) != 0)
+		{
+			fprintf(stderr, "paho_bench: publisher could not connect to %s\n", uri);
+			goto exit;
+		}
+	}
+
+	cpu_start = cpu_seconds();
+	start = now_ns();
+	for (i = 0; i < npubs; ++i)
+	{
+		pubs[i].conn = &conns[i / run.threads];
+		pthread_mutex_init(&pubs[i].mutex, NULL);
+		pthread_cond_init(&pubs[i].cond, NULL);
+		pthread_create(&pubs[i].thread, NULL, publisher, &pubs[i]);
+	}
+	for (i = 0; i < npubs; ++i)
+		pthread_join(pubs[i].thread, NULL);
+
+	/* wait for the rest of the publications to arrive, as long as some are still arriving */
+	end = now_ns();
+	while (received < run.count && (now_ns() - end) / 1000000000 < DRAIN_TIMEOUT)
+	{
+		if (received != last)
+		{
+			last = received;
+			end = now_ns();
+		}
+		usleep(1000L);
+	}
+	end = (received > 0) ? last_received : now_ns();
+	cpu = cpu_seconds() - cpu_start;
+
+	for (i = 0; i < npubs; ++i)
+	{
+		if (pubs[i].failed)
+		{
+			fprintf(stderr, "paho_bench: a publish failed with rc %d\n", pubs[i].failed);
+			errors++;
+		}
+		pthread_mutex_destroy(&pubs[i].mutex);
+		pthread_cond_destroy(&pubs[i].cond);
+	}
+
+	{
+		int count = 0;
+		double elapsed = (end - start) / 1000000000.0;
+
+		for (i = 0; i < run.count; ++i)
+			if (latencies[i] != -1)
+				latencies[count++] = latencies[i];
+		qsort(latencies, count, sizeof(int64_t), compare_latency);
+		printf("%s\n    {\"api\": \"%s\", \"qos\": %d, \"payload_size\": %d, \"inflight\": %d, "
+			"\"threads\": %d, \"connections\": %d,\n"
+			"     \"published\": %d, \"received\": %d, \"elapsed_s\": %.6f, "
+			"\"msgs_per_sec\": %.1f, \"mbytes_per_sec\": %.3f,\n"
+			"     \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}, "
+			"\"cpu_us_per_msg\": %.3f, \"failed_publishers\": %d}",
+			first ? "" : ",", api_names[run.api], run.qos, run.size, run.inflight, run.threads, run.connections,
+			(next_seq > run.count) ? run.count : next_seq, count, elapsed,
+			(elapsed > 0) ? count / elapsed : 0.0, (elapsed > 0) ? (double)count * run.size / elapsed / 1000000 : 0.0,
+			percentile(latencies, count, 0.50), percentile(latencies, count, 0.99),
+			percentile(latencies, count, 0.999), percentile(latencies, count, 1.0),
+			(count > 0) ? cpu * 1000000 / count : 0.0, errors);
+		fflush(stdout);
+		fprintf(stderr, "paho_bench: %s qos %d size %d inflight %d threads %d connections %d: %.0f msgs/s, p99 %.0f us\n",
+			api_names[run.api], run.qos, run.size, run.inflight, run.threads, run.connections,
+			(elapsed > 0) ? count / elapsed : 0.0, percentile(latencies, count, 0.99));
+	}
+	rc = 0;
+
+exit:
+	for (i = 0; i < run.connections; ++i)
+		if (conns[i].client)
+			disconnect(&conns[i]);
+	if (subscriber.client)
+		async_disconnect(&subscriber);
+	free(latencies);
+	latencies = NULL;
+	free(pubs);
+	free(conns);
+	return rc;
+}
+
+
+/**
+ * Start the mock broker in a child process
+ * @return the child's pid, or -1 on failure
+ */
+pid_t start_broker(int* port)
+{
+	mockbroker_options opts = mockbroker_options_initializer;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) != 0)
+		return -1;
+	opts.ack_delay = options.ack_delay;
+	if ((pid = fork()) == 0)
+	{
+		close(fds[0]);
+		if (mockbroker_start(&opts) != 0)
+			opts.port = -1;
+		if (write(fds[1], &opts.port, sizeof(opts.port)) != sizeof(opts.port) || opts.port == -1)
+			_exit(1);
+		for (;;)
+			pause();
+	}
+	close(fds[1]);
+	if (pid == -1 || read(fds[0], port, sizeof(*port)) != sizeof(*port) || *port == -1)
+	{
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
+		pid = -1;
+	}
+	close(fds[0]);
+	return pid;
+}
+
+
+int main(int argc, char** argv)
+{
+	int a, q, s, w, t, c, first = 1, rc = 0;
+	pid_t broker = -1;
+	char address[64];
+
+	getopts(argc, argv);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (options.connection)
+		uri = options.connection;
+	else
+	{
+		int port = 0;
+
+		if ((broker = start_broker(&port)) == -1)
+		{
+			fprintf(stderr, "paho_bench: could not start the mock broker\n");
+			return 1;
+		}
+		snprintf(address, sizeof(address), "tcp://127.0.0.1:%d", port);
+		uri = address;
+	}
+
+	printf("{\"broker\": \"%s\", \"mock_broker\": %s, \"ack_delay_ms\": %d,\n  \"results\": [",
+		uri, (broker == -1) ? "false" : "true", options.ack_delay);
+	for (a = 0; a < options.napis; ++a)
+	for (q = 0; q < options.nqos; ++q)
+	for (s = 0; s < options.nsizes; ++s)
+	for (w = 0; w < options.ninflight; ++w)
+	for (t = 0; t < options.nthreads; ++t)
+	for (c = 0; c < options.nconnections && rc == 0; ++c)
+	{
+		run.api = options.apis[a];
+		run.qos = options.qos[q];
+		run.size = options.sizes[s];
+		run.inflight = options.inflight[w];
+		run.threads = options.threads[t];
+		run.connections = options.connections[c];
+		run.count = options.count;
+		if (options.max_bytes / run.size < run.count)
+			run.count = (int)(options.max_bytes / run.size);
+		if (run.count < 1)
+			run.count = 1;
+		rc = bench(first);
+		first = 0;
+	}
+	printf("\n  ]\n}\n");
+
+	if (broker != -1)
+	{
+		kill(broker, SIGKILL);
+		waitpid(broker, NULL, 0);
+	}
+	return (rc == 0) ? 0 : 1;
+}
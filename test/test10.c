@@ -0,0 +1,580 @@
+/*******************************************************************************
+ * Copyright (c) 2012, 2016 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution. 
+ *
+ * The Eclipse Public License is available at 
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at 
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+
+/**
+ * @file
+ * Allocation count tests for the MQ Telemetry Asynchronous MQTT C client
+ *
+ * Counts the heap allocations made while publishing a steady stream of QoS 1
+ * messages, with and without the memory pools enabled by the useMemoryPools
+ * global init option, and checks that persisted packets restored into the pools
+ * are freed back to them.
+ */
+
+
+#include "MQTTAsync.h"
+#include <string.h>
+#include <stdlib.h>
+#include "Thread.h"
+
+#if !defined(_WINDOWS)
+	#include <sys/time.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#else
+#include <windows.h>
+#include <direct.h>
+#endif
+
+char unique[50]; // unique suffix/prefix to add to clientid/topic etc
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+void usage()
+{
+	printf("help!!\n");
+	exit(-1);
+}
+
+struct Options
+{
+	char* connection;            /**< connection to system under test. */
+	int verbose;
+	int test_no;
+	int messages;                /**< number of messages to count allocations for */
+} options =
+{
+	"iot.eclipse.org:1883",
+	0,
+	0,
+	1000,
+};
+
+void getopts(int argc, char** argv)
+{
+	int count = 1;
+
+	while (count < argc)
+	{
+		if (strcmp(argv[count], "--test_no") == 0)
+		{
+			if (++count < argc)
+				options.test_no = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--connection") == 0)
+		{
+			if (++count < argc)
+				options.connection = argv[count];
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--messages") == 0)
+		{
+			if (++count < argc)
+				options.messages = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--verbose") == 0)
+			options.verbose = 1;
+		count++;
+	}
+}
+
+
+#define LOGA_DEBUG 0
+#define LOGA_INFO 1
+#include <stdarg.h>
+#include <time.h>
+#include <sys/timeb.h>
+void MyLog(int LOGA_level, char* format, ...)
+{
+	static char msg_buf[256];
+	va_list args;
+	struct timeb ts;
+
+	struct tm *timeinfo;
+
+	if (LOGA_level == LOGA_DEBUG && options.verbose == 0)
+		return;
+
+	ftime(&ts);
+	timeinfo = localtime(&ts.time);
+	strftime(msg_buf, 80, "%Y%m%d %H%M%S", timeinfo);
+
+	sprintf(&msg_buf[strlen(msg_buf)], ".%.3hu ", ts.millitm);
+
+	va_start(args, format);
+	vsnprintf(&msg_buf[strlen(msg_buf)], sizeof(msg_buf) - strlen(msg_buf),
+			format, args);
+	va_end(args);
+
+	printf("%s\n", msg_buf);
+	fflush(stdout);
+}
+
+void MySleep(long milliseconds)
+{
+#if defined(WIN32) || defined(WIN64)
+	Sleep(milliseconds);
+#else
+	usleep(milliseconds*1000);
+#endif
+}
+
+#if defined(WIN32) || defined(_WINDOWS)
+#define START_TIME_TYPE DWORD
+START_TIME_TYPE start_clock(void)
+{
+	return GetTickCount();
+}
+#else
+#define START_TIME_TYPE struct timeval
+START_TIME_TYPE start_clock(void)
+{
+	struct timeval start_time;
+	gettimeofday(&start_time, NULL);
+	return start_time;
+}
+#endif
+
+#if defined(WIN32)
+long elapsed(START_TIME_TYPE start_time)
+{
+	return GetTickCount() - start_time;
+}
+#else
+long elapsed(START_TIME_TYPE start_time)
+{
+	struct timeval now, res;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &start_time, &res);
+	return (res.tv_sec) * 1000 + (res.tv_usec) / 1000;
+}
+#endif
+
+#define assert(a, b, c, d) myassert(__FILE__, __LINE__, a, b, c, d)
+#define assert1(a, b, c, d, e) myassert(__FILE__, __LINE__, a, b, c, d, e)
+
+int tests = 0;
+int failures = 0;
+FILE* xml;
+START_TIME_TYPE global_start_time;
+char output[3000];
+char* cur_output = output;
+
+
+void write_test_result()
+{
+	long duration = elapsed(global_start_time);
+
+	fprintf(xml, " time=\"%ld.%.3ld\" >\n", duration / 1000, duration % 1000);
+	if (cur_output != output)
+	{
+		fprintf(xml, "%s", output);
+		cur_output = output;
+	}
+	fprintf(xml, "</testcase>\n");
+}
+
+void myassert(char* filename, int lineno, char* description, int value,
+		char* format, ...)
+{
+	++tests;
+	if (!value)
+	{
+		va_list args;
+
+		++failures;
+		MyLog(LOGA_INFO, "Assertion failed, file %s, line %d, description: %s", filename,
+				lineno, description);
+
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+
+		cur_output += sprintf(cur_output, "<failure type=\"%s\">file %s, line %d </failure>\n",
+                        description, filename, lineno);
+	}
+	else
+		MyLog(LOGA_DEBUG, "Assertion succeeded, file %s, line %d, description: %s",
+				filename, lineno, description);
+}
+
+
+/*********************************************************************
+
+ Allocation counting.  With glibc, malloc and friends are replaced here
+ by wrappers which count calls and pass them on to the glibc versions.
+ Elsewhere no counts are available and the tests are skipped.
+
+ *********************************************************************/
+
+#if defined(__GLIBC__)
+#define COUNT_ALLOCATIONS 1
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static volatile long allocations = 0;
+
+void* malloc(size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr)
+{
+	__libc_free(ptr);
+}
+
+long get_allocations(void)
+{
+	return __sync_fetch_and_add(&allocations, 0);
+}
+#endif
+
+
+/*********************************************************************
+
+ Tests: allocations per message
+
+ 1. publish QoS 1 messages without memory pools
+ 2. publish QoS 1 messages with memory pools, which should need fewer
+    allocations per message than without them
+ 3. restore an orphaned PUBREL from persistence with memory pools
+
+ *********************************************************************/
+
+typedef struct
+{
+	MQTTAsync client;
+	volatile int connected;
+	volatile int failed;
+	volatile int published;
+} test_context;
+
+void onConnect(void* context, MQTTAsync_successData* response)
+{
+	test_context* tc = (test_context*)context;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback");
+	tc->connected = 1;
+}
+
+void onConnectFailure(void* context, MQTTAsync_failureData* response)
+{
+	test_context* tc = (test_context*)context;
+
+	MyLog(LOGA_INFO, "In connect onFailure callback, rc %d", response ? response->code : 0);
+	tc->failed = 1;
+}
+
+void onPublish(void* context, MQTTAsync_successData* response)
+{
+	test_context* tc = (test_context*)context;
+
+	++tc->published;
+}
+
+void onPublishFailure(void* context, MQTTAsync_failureData* response)
+{
+	test_context* tc = (test_context*)context;
+
+	tc->failed = 1;
+}
+
+int messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* m)
+{
+	MQTTAsync_freeMessage(&m);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+/**
+ * Publish a batch of QoS 1 messages one after the other, each waiting for the
+ * previous one to be acknowledged, so the number of messages in flight stays steady.
+ * @return 0 on success
+ */
+int publish_batch(test_context* tc, char* topic, int count)
+{
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	char payload[] = "allocation count test payload";
+	int i, rc = MQTTASYNC_SUCCESS;
+
+	opts.onSuccess = onPublish;
+	opts.onFailure = onPublishFailure;
+	opts.context = tc;
+	for (i = 0; i < count && rc == MQTTASYNC_SUCCESS; ++i)
+	{
+		START_TIME_TYPE start = start_clock();
+		int target = tc->published + 1;
+
+		rc = MQTTAsync_send(tc->client, topic, sizeof(payload), payload, 1, 0, &opts);
+		while (rc == MQTTASYNC_SUCCESS && tc->published < target && !tc->failed && elapsed(start) < 10000)
+			MySleep(1);
+		if (tc->published < target)
+			rc = MQTTASYNC_FAILURE;
+	}
+	return rc;
+}
+
+
+/**
+ * Count the allocations made per message, once the client is in a steady state.
+ * @param useMemoryPools the value of the global init option
+ * @param per_message set to the number of allocations per message
+ * @return 0 on success
+ */
+int count_allocations(int useMemoryPools, double* per_message)
+{
+	MQTTAsync_init_options inits = MQTTAsync_init_options_initializer;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_disconnectOptions dopts = MQTTAsync_disconnectOptions_initializer;
+	test_context tc;
+	char clientid[70];
+	char topic[100];
+	int rc = 0;
+
+	memset(&tc, '\0', sizeof(tc));
+	sprintf(clientid, "paho-test10-%d-%s", useMemoryPools, unique);
+	sprintf(topic, "paho-test10/%s", unique);
+	inits.useMemoryPools = useMemoryPools;
+	MQTTAsync_global_init(&inits);
+	rc = MQTTAsync_create(&tc.client, options.connection, clientid, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	MQTTAsync_setCallbacks(tc.client, &tc, NULL, messageArrived, NULL);
+	opts.cleansession = 1;
+	opts.onSuccess = onConnect;
+	opts.onFailure = onConnectFailure;
+	opts.context = &tc;
+	rc = MQTTAsync_connect(tc.client, &opts);
+	assert("good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto destroy;
+	while (!tc.connected && !tc.failed)
+		MySleep(100);
+	assert("connected", tc.connected, "connect failed\n", NULL);
+	if (!tc.connected)
+		goto destroy;
+
+	/* warm up, so that pools, lists and buffers have reached their working size */
+	rc = publish_batch(&tc, topic, 100);
+	assert("good rc from warm up publish", rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc == MQTTASYNC_SUCCESS)
+	{
+		long start_count = get_allocations();
+
+		rc = publish_batch(&tc, topic, options.messages);
+		*per_message = (double)(get_allocations() - start_count) / options.messages;
+		assert("good rc from publish", rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+		MyLog(LOGA_INFO, "useMemoryPools %d: %.2f allocations per message", useMemoryPools, *per_message);
+	}
+
+	rc = MQTTAsync_disconnect(tc.client, &dopts);
+	assert("good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	MySleep(500);
+destroy:
+	MQTTAsync_destroy(&tc.client);
+exit:
+	return rc;
+}
+
+
+int test1(struct Options options)
+{
+	char* testname = "test1";
+	double per_message = -1;
+
+	MyLog(LOGA_INFO, "Starting test 1 - allocations per message without memory pools");
+	fprintf(xml, "<testcase classname=\"test10\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+#if defined(COUNT_ALLOCATIONS)
+	count_allocations(0, &per_message);
+#else
+	MyLog(LOGA_INFO, "Allocations cannot be counted on this platform, skipping");
+#endif
+
+	MyLog(LOGA_INFO, "TEST1: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+int test2(struct Options options)
+{
+	char* testname = "test2";
+	double per_message = -1, unpooled_per_message = -1;
+	int rc = 0;
+
+	MyLog(LOGA_INFO, "Starting test 2 - allocations per message with memory pools");
+	fprintf(xml, "<testcase classname=\"test10\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+#if defined(COUNT_ALLOCATIONS)
+	rc = count_allocations(0, &unpooled_per_message);
+	if (rc == MQTTASYNC_SUCCESS)
+		rc = count_allocations(1, &per_message);
+	if (rc == MQTTASYNC_SUCCESS)
+		assert1("fewer allocations with memory pools", per_message < unpooled_per_message,
+				"%.2f allocations per message with pools, %.2f without\n", per_message, unpooled_per_message);
+#else
+	MyLog(LOGA_INFO, "Allocations cannot be counted on this platform, skipping");
+#endif
+
+	MyLog(LOGA_INFO, "TEST2: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+int test3_heapErrors = 0;
+
+/* With heap tracking, freeing memory which did not come from malloc is reported as an error */
+void test3_traceCallback(enum MQTTASYNC_TRACE_LEVELS level, char* message)
+{
+	if (strstr(message, "Failed to remove heap item") != NULL)
+		test3_heapErrors++;
+}
+
+
+int test3(struct Options options)
+{
+	char* testname = "test3";
+	MQTTAsync_init_options inits = MQTTAsync_init_options_initializer;
+	MQTTAsync c;
+	char pubrel[] = {0x62, 0x02, 0x00, 0x01}; /* PUBREL for message id 1 */
+	char clientid[70];
+	char dir[100];
+	char file[120];
+	FILE* f = NULL;
+	int rc = 0;
+
+	MyLog(LOGA_INFO, "Starting test 3 - restore an orphaned PUBREL with memory pools");
+	fprintf(xml, "<testcase classname=\"test10\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	/* a PUBREL with no matching sent PUBLISH, in the directory the default persistence uses */
+	sprintf(clientid, "paho-test10-restore-%s", unique);
+	sprintf(dir, "%s-localhost-1883", clientid);
+	sprintf(file, "%s/sc-1.msg", dir);
+#if defined(_WINDOWS)
+	_mkdir(dir);
+#else
+	mkdir(dir, 0755);
+#endif
+	if ((f = fopen(file, "wb")) != NULL)
+	{
+		fwrite(pubrel, 1, sizeof(pubrel), f);
+		fclose(f);
+	}
+	assert("persisted PUBREL written", f != NULL, "could not write %s\n", file);
+
+	/* the restored PUBREL comes from the ack pool, and is removed because it is orphaned */
+	test3_heapErrors = 0;
+	MQTTAsync_setTraceCallback(test3_traceCallback);
+	inits.useMemoryPools = 1;
+	MQTTAsync_global_init(&inits);
+	rc = MQTTAsync_create(&c, "tcp://localhost:1883", clientid, MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
+	MQTTAsync_setTraceCallback(NULL);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	assert("PUBREL freed to its pool", test3_heapErrors == 0, "%d heap errors\n", test3_heapErrors);
+	if (rc == MQTTASYNC_SUCCESS)
+	{
+		f = fopen(file, "rb");
+		assert("orphaned PUBREL removed", f == NULL, "%s still exists\n", file);
+		if (f)
+			fclose(f);
+		MQTTAsync_destroy(&c);
+	}
+	remove(file);
+#if defined(_WINDOWS)
+	_rmdir(dir);
+#else
+	rmdir(dir);
+#endif
+
+	MyLog(LOGA_INFO, "TEST3: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+int main(int argc, char** argv)
+{
+	int* numtests = &tests;
+	int rc = 0;
+	int (*tests[])() = { NULL, test1, test2, test3 };
+
+	sprintf(unique, "%u", rand());
+	MyLog(LOGA_INFO, "Random prefix/suffix is %s", unique);
+
+	xml = fopen("TEST-test10.xml", "w");
+	fprintf(xml, "<testsuite name=\"test10\" tests=\"%lu\">\n", ARRAY_SIZE(tests) - 1);
+
+	getopts(argc, argv);
+
+	if (options.test_no == 0)
+	{ /* run all the tests */
+		for (options.test_no = 1; options.test_no < ARRAY_SIZE(tests); ++options.test_no)
+		{
+			failures = 0;
+			MQTTAsync_setTraceLevel(MQTTASYNC_TRACE_ERROR);
+			rc += tests[options.test_no](options); /* return number of failures.  0 = test succeeded */
+		}
+	}
+	else
+	{
+		MQTTAsync_setTraceLevel(MQTTASYNC_TRACE_ERROR);
+		rc = tests[options.test_no](options); /* run just the selected test */
+	}
+
+	MyLog(LOGA_INFO, "Total tests run: %d", *numtests);
+	if (rc == 0)
+		MyLog(LOGA_INFO, "verdict pass");
+	else
+		MyLog(LOGA_INFO, "verdict fail");
+
+	fprintf(xml, "</testsuite>\n");
+	fclose(xml);
+
+	return rc;
+}
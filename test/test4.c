@@ -1687,6 +1687,1053 @@ exit:
 
 
 
+/*********************************************************************
+
+Test9: Metrics
+
+*********************************************************************/
+
+char* test9_topic = "C client test9";
+int test9_messageCount = 0;
+int test9_subscribed = 0;
+int test9_deliveryCount = 0;
+
+void test9_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback %p granted qos %d", c, response->alt.qos);
+	test9_subscribed = 1;
+}
+
+
+void test9_onConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback, context %p", context);
+	opts.onSuccess = test9_onSubscribe;
+	opts.context = c;
+
+	rc = MQTTAsync_subscribe(c, test9_topic, 1, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		test_finished = 1;
+}
+
+
+void test9_onDisconnect(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In onDisconnect callback %p", context);
+	test_finished = 1;
+}
+
+
+int test9_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	test9_messageCount++;
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void test9_deliveryComplete(void* context, MQTTAsync_token token)
+{
+	test9_deliveryCount++;
+}
+
+
+int test9(struct Options options)
+{
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+	MQTTAsync_disconnectOptions dopts = MQTTAsync_disconnectOptions_initializer;
+	MQTTAsync_metrics metrics = MQTTAsync_metrics_initializer;
+	MQTTAsync_metrics bad = MQTTAsync_metrics_initializer;
+	int msg_count = 10;
+	char small[20];
+	char* text = NULL;
+	int len = 0;
+	int rc = 0;
+	int i;
+
+	MyLog(LOGA_INFO, "Starting test 9 - metrics");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"metrics\"");
+	global_start_time = start_clock();
+	test_finished = test9_subscribed = test9_messageCount = test9_deliveryCount = 0;
+
+	rc = MQTTAsync_getMetrics(NULL, &metrics);
+	assert("Failure rc from getMetrics with no client", rc == MQTTASYNC_FAILURE, "rc was %d", rc);
+
+	rc = MQTTAsync_create(&c, options.connection, "async_test9",
+			MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	bad.struct_version = 2;
+	rc = MQTTAsync_getMetrics(c, &bad);
+	assert("Bad structure rc from getMetrics", rc == MQTTASYNC_BAD_STRUCTURE, "rc was %d", rc);
+
+	rc = MQTTAsync_setCallbacks(c, c, NULL, test9_messageArrived, test9_deliveryComplete);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test9_onConnect;
+	opts.context = c;
+
+	MyLog(LOGA_DEBUG, "Connecting");
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto destroy;
+
+	while (!test9_subscribed && !test_finished)
+		#if defined(WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+
+	pubmsg.payload = "a test9 message";
+	pubmsg.payloadlen = 15;
+	pubmsg.qos = 1;
+	for (i = 0; i < msg_count; ++i)
+	{
+		rc = MQTTAsync_sendMessage(c, test9_topic, &pubmsg, NULL);
+		assert("Good rc from sendMessage", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+
+	for (i = 0; i < 1000 && (test9_messageCount < msg_count || test9_deliveryCount < msg_count); ++i)
+		#if defined(WIN32)
+			Sleep(10);
+		#else
+			usleep(10000L);
+		#endif
+
+	rc = MQTTAsync_getMetrics(c, &metrics);
+	assert("Good rc from getMetrics", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	assert("PUBLISH packets written", metrics.packets_out[3] == msg_count,
+			"packets_out[PUBLISH] was %lld", metrics.packets_out[3]);
+	assert("PUBLISH packets received", metrics.packets_in[3] == msg_count,
+			"packets_in[PUBLISH] was %lld", metrics.packets_in[3]);
+	assert("PUBACK packets received", metrics.packets_in[4] == msg_count,
+			"packets_in[PUBACK] was %lld", metrics.packets_in[4]);
+	assert("CONNECT packet written", metrics.packets_out[1] == 1,
+			"packets_out[CONNECT] was %lld", metrics.packets_out[1]);
+	assert("bytes written", metrics.bytes_out > msg_count * (pubmsg.payloadlen + (int)strlen(test9_topic)),
+			"bytes_out was %lld", metrics.bytes_out);
+	assert("bytes received", metrics.bytes_in > msg_count * (pubmsg.payloadlen + (int)strlen(test9_topic)),
+			"bytes_in was %lld", metrics.bytes_in);
+	assert("no messages in flight", metrics.inflight_messages == 0,
+			"inflight_messages was %d", metrics.inflight_messages);
+	assert("callbacks timed", metrics.callbacks.count == 2 * msg_count,
+			"callbacks.count was %lld", metrics.callbacks.count);
+	assert("callback percentiles ordered", metrics.callbacks.p50 <= metrics.callbacks.p99 &&
+			metrics.callbacks.p99 <= metrics.callbacks.max, "p99 was %lld", metrics.callbacks.p99);
+	assert("persistence puts timed", metrics.persistence_put.count >= msg_count,
+			"persistence_put.count was %lld", metrics.persistence_put.count);
+	assert("persistence removes timed", metrics.persistence_remove.count >= msg_count,
+			"persistence_remove.count was %lld", metrics.persistence_remove.count);
+
+	len = MQTTAsync_getOpenMetrics(NULL, 0);
+	assert("OpenMetrics length", len > 0, "len was %d", len);
+	text = malloc(len + 1);
+	rc = MQTTAsync_getOpenMetrics(text, len + 1);
+	assert("OpenMetrics length consistent", rc == len, "rc was %d", rc);
+	assert("OpenMetrics text complete", strcmp(&text[len - 6], "# EOF\n") == 0, "text ends %s", &text[len - 6]);
+	assert("OpenMetrics has client", strstr(text, "paho_mqtt_sent_packets_total{client_id=\"async_test9\",type=\"PUBLISH\"} 10\n") != NULL,
+			"text was %s", text);
+	free(text);
+	rc = MQTTAsync_getOpenMetrics(small, sizeof(small));
+	assert("OpenMetrics truncated", rc == len && strlen(small) == sizeof(small) - 1, "rc was %d", rc);
+
+	dopts.onSuccess = test9_onDisconnect;
+	dopts.context = c;
+	test_finished = 0;
+	rc = MQTTAsync_disconnect(c, &dopts);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	while (!test_finished)
+		#if defined(WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+
+destroy:
+	MQTTAsync_destroy(&c);
+
+exit:
+	MyLog(LOGA_INFO, "TEST9: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+
+/*********************************************************************
+
+Test10: Publish latency tracing
+
+*********************************************************************/
+
+char* test10_topic = "C client test10";
+int test10_subscribed = 0;
+int test10_published = 0;
+int test10_badStages = 0;
+
+void test10_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	test10_subscribed = 1;
+}
+
+
+void test10_onConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	opts.onSuccess = test10_onSubscribe;
+	opts.context = c;
+	rc = MQTTAsync_subscribe(c, test10_topic, 2, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		test_finished = 1;
+}
+
+
+void test10_onPublish(void* context, MQTTAsync_successData* response)
+{
+	long long* stages = response->alt.pub.stages;
+	int qos = response->alt.pub.message.qos;
+	int i, previous = MQTTASYNC_STAGE_ENQUEUED;
+
+	MyLog(LOGA_DEBUG, "In publish onSuccess callback, qos %d", qos);
+	if (stages == NULL)
+		test10_badStages++;
+	else
+	{
+		for (i = MQTTASYNC_STAGE_DEQUEUED; i < MQTTASYNC_STAGE_COUNT; ++i)
+		{
+			int expected = (qos > 0 || (i != MQTTASYNC_STAGE_PERSISTED && i != MQTTASYNC_STAGE_ACKNOWLEDGED));
+
+			if ((stages[i] != 0) != expected || (stages[i] && stages[i] < stages[previous]))
+			{
+				MyLog(LOGA_INFO, "qos %d stage %d was %lld, previous %lld", qos, i, stages[i], stages[previous]);
+				test10_badStages++;
+			}
+			if (stages[i])
+				previous = i;
+		}
+	}
+	test10_published++;
+}
+
+
+void test10_onDisconnect(void* context, MQTTAsync_successData* response)
+{
+	test_finished = 1;
+}
+
+
+int test10(struct Options options)
+{
+	MQTTAsync c;
+	MQTTAsync_createOptions createOpts = MQTTAsync_createOptions_initializer;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+	MQTTAsync_responseOptions ropts = MQTTAsync_responseOptions_initializer;
+	MQTTAsync_disconnectOptions dopts = MQTTAsync_disconnectOptions_initializer;
+	MQTTAsync_metrics metrics = MQTTAsync_metrics_initializer;
+	int msg_count = 9;
+	int rc = 0;
+	int i;
+
+	MyLog(LOGA_INFO, "Starting test 10 - publish latency tracing");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"publish latency tracing\"");
+	global_start_time = start_clock();
+	test_finished = test10_subscribed = test10_published = test10_badStages = 0;
+
+	createOpts.traceLatency = 1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, "async_test10",
+			MQTTCLIENT_PERSISTENCE_DEFAULT, NULL, &createOpts);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test10_onConnect;
+	opts.context = c;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto destroy;
+
+	while (!test10_subscribed && !test_finished)
+		#if defined(WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+
+	pubmsg.payload = "a test10 message";
+	pubmsg.payloadlen = 16;
+	ropts.onSuccess = test10_onPublish;
+	ropts.context = c;
+	for (i = 0; i < msg_count; ++i)
+	{
+		pubmsg.qos = i % 3;
+		rc = MQTTAsync_sendMessage(c, test10_topic, &pubmsg, &ropts);
+		assert("Good rc from sendMessage", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+
+	for (i = 0; i < 1000 && test10_published < msg_count; ++i)
+		#if defined(WIN32)
+			Sleep(10);
+		#else
+			usleep(10000L);
+		#endif
+	assert("All publications completed", test10_published == msg_count, "test10_published was %d", test10_published);
+	assert("Stages in order", test10_badStages == 0, "test10_badStages was %d", test10_badStages);
+
+	rc = MQTTAsync_getMetrics(c, &metrics);
+	assert("Good rc from getMetrics", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	assert("Total times recorded", metrics.stages[MQTTASYNC_STAGE_ENQUEUED].count == msg_count,
+			"count was %lld", metrics.stages[MQTTASYNC_STAGE_ENQUEUED].count);
+	assert("Write times recorded", metrics.stages[MQTTASYNC_STAGE_WRITTEN].count == msg_count,
+			"count was %lld", metrics.stages[MQTTASYNC_STAGE_WRITTEN].count);
+	assert("Acknowledgement times recorded", metrics.stages[MQTTASYNC_STAGE_ACKNOWLEDGED].count == 2 * msg_count / 3,
+			"count was %lld", metrics.stages[MQTTASYNC_STAGE_ACKNOWLEDGED].count);
+
+	dopts.onSuccess = test10_onDisconnect;
+	dopts.context = c;
+	test_finished = 0;
+	rc = MQTTAsync_disconnect(c, &dopts);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	while (!test_finished)
+		#if defined(WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+
+destroy:
+	MQTTAsync_destroy(&c);
+
+exit:
+	MyLog(LOGA_INFO, "TEST10: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+
+void trace_callback(enum MQTTASYNC_TRACE_LEVELS level, char* message);
+
+int test11_connected = 0;
+int test11_traced = 0;
+
+void test11_onConnect(void* context, MQTTAsync_successData* response)
+{
+	test11_connected = 1;
+}
+
+
+void test11_traceCallback(enum MQTTASYNC_TRACE_LEVELS level, char* message)
+{
+	if (strstr(message, "async_test11 -> CONNECT cleansession: 1"))
+		test11_traced = 1;
+}
+
+
+/* find a string in a block of bytes, which may contain nulls */
+int test11_find(char* buf, size_t len, char* str)
+{
+	size_t slen = strlen(str);
+	size_t i;
+
+	for (i = 0; i + slen <= len; ++i)
+	{
+		if (memcmp(&buf[i], str, slen) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+
+int test11(struct Options options)
+{
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	char* filename = "async_test11.trc";
+	char* buf = NULL;
+	size_t len = 0;
+	FILE* file = NULL;
+	int rc = 0;
+	int i;
+
+	MyLog(LOGA_INFO, "Starting test 11 - binary trace dump");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"binary trace dump\"");
+	global_start_time = start_clock();
+	test11_connected = test11_traced = 0;
+
+	rc = MQTTAsync_create(&c, options.connection, "async_test11", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	/* trace messages are formatted from their stored arguments when they are output */
+	MQTTAsync_setTraceCallback(test11_traceCallback);
+	MQTTAsync_setTraceLevel(MQTTASYNC_TRACE_PROTOCOL);
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test11_onConnect;
+	opts.context = c;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	for (i = 0; i < 500 && !test11_connected; ++i)
+		#if defined(WIN32)
+			Sleep(10);
+		#else
+			usleep(10000L);
+		#endif
+	MQTTAsync_setTraceLevel(MQTTASYNC_TRACE_ERROR);
+	MQTTAsync_setTraceCallback(trace_callback);
+	assert("Connected", test11_connected, "test11_connected was %d", test11_connected);
+	assert("CONNECT traced", test11_traced, "test11_traced was %d", test11_traced);
+
+	rc = MQTTAsync_dumpTrace(NULL);
+	assert("Bad rc from dumpTrace with no file name", rc == MQTTASYNC_FAILURE, "rc was %d", rc);
+	rc = MQTTAsync_dumpTrace(filename);
+	assert("Good rc from dumpTrace", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if ((file = fopen(filename, "rb")) != NULL)
+	{
+		fseek(file, 0, SEEK_END);
+		len = ftell(file);
+		rewind(file);
+		if ((buf = malloc(len)) != NULL)
+			len = fread(buf, 1, len, file);
+		fclose(file);
+	}
+	remove(filename);
+	assert("Trace dump written", buf && len > 8 && memcmp(buf, "PAHOTRC1", 8) == 0, "len was %d", (int)len);
+	assert("Function names dumped", test11_find(buf, len, "MQTTAsync_connect"), "len was %d", (int)len);
+	assert("Message formats dumped", test11_find(buf, len, "%d %s -> CONNECT cleansession: %d (%d)"), "len was %d", (int)len);
+	assert("Message arguments dumped", test11_find(buf, len, "async_test11"), "len was %d", (int)len);
+	if (buf)
+		free(buf);
+
+	MQTTAsync_disconnect(c, NULL);
+	MQTTAsync_destroy(&c);
+
+exit:
+	MyLog(LOGA_INFO, "TEST11: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+
+int test12_connected = 0;
+int test12_subscribed = 0;
+int test12_unsubscribed = 0;
+int test12_subscribeFailed = 0;
+int test12_global = 0;
+int test12_first = 0;
+int test12_second = 0;
+int test12_badContext = 0;
+char* test12_firstContext = "first";
+char* test12_secondContext = "second";
+
+void test12_onConnect(void* context, MQTTAsync_successData* response)
+{
+	test12_connected = 1;
+}
+
+
+void test12_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	test12_subscribed++;
+}
+
+
+void test12_onSubscribeFailure(void* context, MQTTAsync_failureData* response)
+{
+	test12_subscribeFailed++;
+}
+
+
+void test12_onUnsubscribe(void* context, MQTTAsync_successData* response)
+{
+	test12_unsubscribed++;
+}
+
+
+int test12_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	MyLog(LOGA_DEBUG, "Global callback, topic %s", topicName);
+	test12_global++;
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+int test12_onFirst(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	MyLog(LOGA_DEBUG, "First subscription callback, topic %s", topicName);
+	if (context != test12_firstContext)
+		test12_badContext++;
+	test12_first++;
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+int test12_onSecond(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	MyLog(LOGA_DEBUG, "Second subscription callback, topic %s", topicName);
+	if (context != test12_secondContext)
+		test12_badContext++;
+	test12_second++;
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void test12_waitFor(int* count, int value)
+{
+	int i;
+
+	for (i = 0; i < 500 && *count < value; ++i)
+		#if defined(WIN32)
+			Sleep(10);
+		#else
+			usleep(10000L);
+		#endif
+}
+
+
+int test12(struct Options options)
+{
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_responseOptions ropts = MQTTAsync_responseOptions_initializer;
+	MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+	char* topics[] = {"C client test12/+/temperature", "C client test12/+/humidity"};
+	int qoss[] = {1, 1};
+	int rc = 0;
+
+	MyLog(LOGA_INFO, "Starting test 12 - subscription callbacks");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"subscription callbacks\"");
+	global_start_time = start_clock();
+	test12_connected = test12_subscribed = test12_unsubscribed = test12_global = test12_first = test12_second = test12_badContext = 0;
+	test12_subscribeFailed = 0;
+
+	rc = MQTTAsync_create(&c, options.connection, "async_test12", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	rc = MQTTAsync_setCallbacks(c, NULL, NULL, test12_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test12_onConnect;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto destroy;
+	test12_waitFor(&test12_connected, 1);
+	assert("Connected", test12_connected, "test12_connected was %d", test12_connected);
+
+	ropts.onSuccess = test12_onSubscribe;
+	rc = MQTTAsync_subscribe(c, "C client test12/#", 1, &ropts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	ropts.onMessage = test12_onFirst;
+	ropts.onMessageContext = test12_firstContext;
+	rc = MQTTAsync_subscribe(c, "C client test12/a/temperature", 1, &ropts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	ropts.onMessage = test12_onSecond;
+	ropts.onMessageContext = test12_secondContext;
+	rc = MQTTAsync_subscribeMany(c, 2, topics, qoss, &ropts);
+	assert("Good rc from subscribeMany", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test12_waitFor(&test12_subscribed, 3);
+	assert("All subscribed", test12_subscribed == 3, "test12_subscribed was %d", test12_subscribed);
+
+	/* each message goes to the callback of the most specific filter matching it */
+	pubmsg.payload = "a test12 message";
+	pubmsg.payloadlen = 16;
+	pubmsg.qos = 1;
+	MQTTAsync_sendMessage(c, "C client test12/a/temperature", &pubmsg, NULL);
+	MQTTAsync_sendMessage(c, "C client test12/b/temperature", &pubmsg, NULL);
+	MQTTAsync_sendMessage(c, "C client test12/b/humidity", &pubmsg, NULL);
+	MQTTAsync_sendMessage(c, "C client test12/b/pressure", &pubmsg, NULL);
+	test12_waitFor(&test12_global, 1);
+	test12_waitFor(&test12_first, 1);
+	test12_waitFor(&test12_second, 2);
+	assert("First callback called", test12_first == 1, "test12_first was %d", test12_first);
+	assert("Second callback called", test12_second == 2, "test12_second was %d", test12_second);
+	assert("Global callback called", test12_global == 1, "test12_global was %d", test12_global);
+
+	/* once a filter is unsubscribed from, its callback is not called */
+	ropts.onSuccess = test12_onUnsubscribe;
+	ropts.onMessage = NULL;
+	ropts.onMessageContext = NULL;
+	rc = MQTTAsync_unsubscribe(c, "C client test12/a/temperature", &ropts);
+	assert("Good rc from unsubscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test12_waitFor(&test12_unsubscribed, 1);
+	MQTTAsync_sendMessage(c, "C client test12/a/temperature", &pubmsg, NULL);
+	test12_waitFor(&test12_second, 3);
+	assert("Second callback called after unsubscribe", test12_second == 3, "test12_second was %d", test12_second);
+	assert("First callback not called after unsubscribe", test12_first == 1, "test12_first was %d", test12_first);
+
+	/* the callback of a filter the broker refuses is removed, so a message matching it
+	 * through another subscription goes to that subscription's callback */
+	ropts.onSuccess = test12_onSubscribe;
+	ropts.onFailure = test12_onSubscribeFailure;
+	ropts.onMessage = test12_onFirst;
+	ropts.onMessageContext = test12_firstContext;
+	rc = MQTTAsync_subscribe(c, "nosubscribe", 1, &ropts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test12_waitFor(&test12_subscribeFailed, 1);
+	assert("Subscribe refused", test12_subscribeFailed == 1, "test12_subscribeFailed was %d", test12_subscribeFailed);
+	ropts.onMessage = NULL;
+	ropts.onMessageContext = NULL;
+	rc = MQTTAsync_subscribe(c, "+", 1, &ropts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test12_waitFor(&test12_subscribed, 4);
+	MQTTAsync_sendMessage(c, "nosubscribe", &pubmsg, NULL);
+	test12_waitFor(&test12_global, 2);
+	assert("Global callback called for refused filter", test12_global == 2, "test12_global was %d", test12_global);
+	assert("First callback not called after refused subscribe", test12_first == 1, "test12_first was %d", test12_first);
+	assert("Callback contexts", test12_badContext == 0, "test12_badContext was %d", test12_badContext);
+
+	MQTTAsync_disconnect(c, NULL);
+destroy:
+	MQTTAsync_destroy(&c);
+
+exit:
+	MyLog(LOGA_INFO, "TEST12: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+
+/*********************************************************************
+
+Test13: connect to a host name which can't be resolved
+
+The lookup is done off the send thread, so its failure has to be noticed when it
+completes: the connect should fail, or go on to the next server URI.
+
+*********************************************************************/
+
+int test13_connected = 0;
+int test13_connectFailed = 0;
+int test13_disconnected = 0;
+
+void test13_onConnect(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback, server %s", response->alt.connect.serverURI);
+	test13_connected++;
+}
+
+
+void test13_onConnectFailure(void* context, MQTTAsync_failureData* response)
+{
+	MyLog(LOGA_DEBUG, "In connect onFailure callback, message %s", (response && response->message) ? response->message : "none");
+	test13_connectFailed++;
+}
+
+
+void test13_onDisconnect(void* context, MQTTAsync_successData* response)
+{
+	test13_disconnected = 1;
+}
+
+
+void test13_waitForConnect(void)
+{
+	int i;
+
+	for (i = 0; i < 1000 && test13_connected == 0 && test13_connectFailed == 0; ++i)
+		#if defined(WIN32)
+			Sleep(10);
+		#else
+			usleep(10000L);
+		#endif
+}
+
+
+int test13(struct Options options)
+{
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_disconnectOptions dopts = MQTTAsync_disconnectOptions_initializer;
+	char* serverURIs[2] = {"tcp://nonexistent.invalid:1883", NULL};
+	int rc = 0;
+
+	MyLog(LOGA_INFO, "Starting test 13 - connect to an unresolvable host");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"connect to an unresolvable host\"");
+	global_start_time = start_clock();
+	test13_disconnected = 0;
+
+	rc = MQTTAsync_create(&c, serverURIs[0], "async_test13", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.connectTimeout = 30; /* longer than the test waits, so a timeout doesn't hide a hang */
+	opts.onSuccess = test13_onConnect;
+	opts.onFailure = test13_onConnectFailure;
+	test13_connected = test13_connectFailed = 0;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test13_waitForConnect();
+	assert("Connect failure callback called", test13_connectFailed == 1,
+			"test13_connectFailed was %d", test13_connectFailed);
+	assert("Connect success callback not called", test13_connected == 0,
+			"test13_connected was %d", test13_connected);
+
+	/* the next server URI is tried after the lookup of the first fails */
+	serverURIs[1] = options.connection;
+	opts.serverURIs = serverURIs;
+	opts.serverURIcount = 2;
+	test13_connected = test13_connectFailed = 0;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test13_waitForConnect();
+	assert("Connected to the second server URI", test13_connected == 1,
+			"test13_connected was %d", test13_connected);
+	assert("Connect failure callback not called", test13_connectFailed == 0,
+			"test13_connectFailed was %d", test13_connectFailed);
+
+	dopts.onSuccess = test13_onDisconnect;
+	rc = MQTTAsync_disconnect(c, &dopts);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test12_waitFor(&test13_disconnected, 1);
+
+	/* and when the lookups of all the server URIs fail, the connect fails */
+	serverURIs[1] = "tcp://nonexistent2.invalid:1883";
+	test13_connected = test13_connectFailed = 0;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test13_waitForConnect();
+	assert("Connect failure callback called", test13_connectFailed == 1,
+			"test13_connectFailed was %d", test13_connectFailed);
+	assert("Connect success callback not called", test13_connected == 0,
+			"test13_connected was %d", test13_connected);
+
+	/* the same, with the MQTT version set rather than negotiated */
+	serverURIs[1] = options.connection;
+	opts.MQTTVersion = MQTTVERSION_3_1_1;
+	test13_connected = test13_connectFailed = 0;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test13_waitForConnect();
+	assert("Connected to the second server URI", test13_connected == 1,
+			"test13_connected was %d", test13_connected);
+	assert("Connect failure callback not called", test13_connectFailed == 0,
+			"test13_connectFailed was %d", test13_connectFailed);
+
+	MQTTAsync_disconnect(c, NULL);
+	MQTTAsync_destroy(&c);
+
+exit:
+	MyLog(LOGA_INFO, "TEST13: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+
+/*********************************************************************
+
+Test14: compressed persistence is restored intact
+
+Publications are buffered while a client can't connect, so they are persisted as
+commands.  The first run compresses them and the second doesn't, then a third run
+restores both kinds and sends them.
+
+*********************************************************************/
+
+#define TEST14_MESSAGES 8
+
+char* test14_topic = "C client test14";
+int test14_subscribed = 0;
+int test14_connectFailed = 0;
+int test14_connected = 0;
+int test14_received[TEST14_MESSAGES];
+int test14_corrupt = 0;
+
+/**
+ * Build the payload of one of the test messages.  Most are long and repetitive,
+ * so they are compressed, but every fourth is too short to be worth compressing.
+ */
+int test14_payload(char* buf, int i)
+{
+	int len = sprintf(buf, "%d:", i);
+
+	if (i % 4 == 3)
+		len += sprintf(&buf[len], " short");
+	else
+	{
+		int j;
+
+		for (j = 0; j < 20; ++j)
+			len += sprintf(&buf[len], " test14 message %d part %d", i, j);
+	}
+	return len;
+}
+
+
+void test14_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	test14_subscribed = 1;
+}
+
+
+void test14_onConnect(void* context, MQTTAsync_successData* response)
+{
+	test14_connected = 1;
+}
+
+
+void test14_onConnectFailure(void* context, MQTTAsync_failureData* response)
+{
+	test14_connectFailed = 1;
+}
+
+
+int test14_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	char expected[1024];
+	int i = atoi((char*)message->payload);
+
+	MyLog(LOGA_DEBUG, "Test14: received message %d, length %d", i, message->payloadlen);
+	if (i < 0 || i >= TEST14_MESSAGES || test14_payload(expected, i) != message->payloadlen ||
+			memcmp(expected, message->payload, message->payloadlen) != 0)
+		test14_corrupt++;
+	else
+		test14_received[i]++;
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void test14_waitFor(int* flag)
+{
+	int i;
+
+	for (i = 0; i < 500 && *flag == 0; ++i)
+		#if defined(WIN32)
+			Sleep(10);
+		#else
+			usleep(10000L);
+		#endif
+}
+
+
+/**
+ * Create the publishing client and buffer some messages in its persistence, by
+ * publishing after a connect to a server which isn't listening has failed.
+ * @param options the test options
+ * @param compress whether to compress the persisted commands
+ * @param first the index of the first message
+ * @param count the number of messages
+ */
+void test14_buffer(struct Options options, int compress, int first, int count)
+{
+	MQTTAsync c;
+	MQTTAsync_createOptions createOpts = MQTTAsync_createOptions_initializer;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	char* serverURIs[] = {"tcp://127.0.0.1:1"};
+	char payload[1024];
+	int i, rc;
+
+	createOpts.sendWhileDisconnected = 1;
+	createOpts.compressPersistence = compress;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, "async_test14",
+			MQTTCLIENT_PERSISTENCE_DEFAULT, NULL, &createOpts);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		return;
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 0;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.serverURIs = serverURIs;
+	opts.serverURIcount = 1;
+	opts.onFailure = test14_onConnectFailure;
+	test14_connectFailed = 0;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test14_waitFor(&test14_connectFailed);
+	assert("Connect failed", test14_connectFailed, "test14_connectFailed was %d", test14_connectFailed);
+
+	for (i = first; i < first + count; ++i)
+	{
+		rc = MQTTAsync_send(c, test14_topic, test14_payload(payload, i), payload, (i % 2) + 1, 0, NULL);
+		assert("Good rc from send", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+	MQTTAsync_destroy(&c); /* leave the messages in persistence */
+}
+
+
+int test14(struct Options options)
+{
+	MQTTAsync c, d;
+	MQTTAsync_createOptions createOpts = MQTTAsync_createOptions_initializer;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_responseOptions ropts = MQTTAsync_responseOptions_initializer;
+	int rc = 0;
+	int i, received = 0;
+
+	MyLog(LOGA_INFO, "Starting test 14 - compressed persistence");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"compressed persistence\"");
+	global_start_time = start_clock();
+	test14_subscribed = test14_corrupt = 0;
+	memset(test14_received, '\0', sizeof(test14_received));
+
+	rc = MQTTAsync_create(&d, options.connection, "async_test14_sub", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&d);
+		goto exit;
+	}
+
+	/* connect the publisher with a clean session first, to remove anything left by an earlier run */
+	rc = MQTTAsync_create(&c, options.connection, "async_test14", MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto destroy;
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test14_onConnect;
+	test14_connected = 0;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test14_waitFor(&test14_connected);
+	assert("Connected", test14_connected, "test14_connected was %d", test14_connected);
+	MQTTAsync_disconnect(c, NULL);
+	MQTTAsync_destroy(&c);
+
+	rc = MQTTAsync_setCallbacks(d, NULL, NULL, test14_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test14_connected = 0;
+	rc = MQTTAsync_connect(d, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test14_waitFor(&test14_connected);
+	ropts.onSuccess = test14_onSubscribe;
+	rc = MQTTAsync_subscribe(d, test14_topic, 2, &ropts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	test14_waitFor(&test14_subscribed);
+	assert("Subscribed", test14_subscribed, "test14_subscribed was %d", test14_subscribed);
+
+	/* persist half the messages compressed, and half not */
+	test14_buffer(options, 1, 0, TEST14_MESSAGES / 2);
+	test14_buffer(options, 0, TEST14_MESSAGES / 2, TEST14_MESSAGES / 2);
+
+	/* restore them all, and send them */
+	createOpts.sendWhileDisconnected = 1;
+	createOpts.compressPersistence = 1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, "async_test14",
+			MQTTCLIENT_PERSISTENCE_DEFAULT, NULL, &createOpts);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto destroy;
+	opts.cleansession = 0;
+	test14_connected = 0;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	for (i = 0; i < 500 && received < TEST14_MESSAGES; ++i)
+	{
+		int j;
+
+		#if defined(WIN32)
+			Sleep(10);
+		#else
+			usleep(10000L);
+		#endif
+		for (j = received = 0; j < TEST14_MESSAGES; ++j)
+			received += (test14_received[j] > 0);
+	}
+	assert("All messages restored", received == TEST14_MESSAGES, "received was %d", received);
+	assert("No corrupt messages", test14_corrupt == 0, "test14_corrupt was %d", test14_corrupt);
+	for (i = 0; i < TEST14_MESSAGES; ++i)
+		assert1("Message received once", test14_received[i] == 1, "test14_received[%d] was %d", i, test14_received[i]);
+
+	/* clean up the publisher's session and persistence */
+	MQTTAsync_disconnect(c, NULL);
+	MQTTAsync_destroy(&c);
+	rc = MQTTAsync_create(&c, options.connection, "async_test14", MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
+	if (rc == MQTTASYNC_SUCCESS)
+	{
+		opts.cleansession = 1;
+		test14_connected = 0;
+		MQTTAsync_connect(c, &opts);
+		test14_waitFor(&test14_connected);
+		MQTTAsync_disconnect(c, NULL);
+	}
+	MQTTAsync_destroy(&c);
+
+	MQTTAsync_disconnect(d, NULL);
+destroy:
+	MQTTAsync_destroy(&d);
+
+exit:
+	MyLog(LOGA_INFO, "TEST14: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+
 void trace_callback(enum MQTTASYNC_TRACE_LEVELS level, char* message)
 {
 	printf("Trace : %d, %s\n", level, message);
@@ -1698,7 +2745,7 @@ void trace_callback(enum MQTTASYNC_TRACE_LEVELS level, char* message)
 int main(int argc, char** argv)
 {
 	int rc = 0;
- 	int (*tests[])() = {NULL, test1, test2, test3, test4, test5, test6, test7, test8}; /* indexed starting from 1 */
+ 	int (*tests[])() = {NULL, test1, test2, test3, test4, test5, test6, test7, test8, test9, test10, test11, test12, test13, test14}; /* indexed starting from 1 */
 	MQTTAsync_nameValue* info;
 	int i;
 
@@ -34,6 +34,8 @@
 #if !defined(_WINDOWS)
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
 #else
@@ -2026,9 +2028,204 @@ int test7(struct Options options)
 	return failures;
 }
 
+/*********************************************************************
+
+ Test8: kernel TLS
+
+ With enableKernelTLS set, messages of several sizes must round trip intact,
+ including after the TLS 1.3 session tickets the server sends once the
+ handshake is complete.  If the kernel has the tls module, the send side
+ must have been passed to it.
+
+ *********************************************************************/
+
+#define TEST8_MSGS 3
+int test8_sizes[TEST8_MSGS] = { 10, 1000, 100000 };
+char* test8_payload = NULL;
+int test8_received = 0;
+int test8_ktls = -1; /* from the trace: 1 if the send side was passed to the kernel, 0 if not */
+
+/**
+ * Does the kernel have the tls module?  Setting it on an unconnected socket fails with
+ * ENOTCONN if it does, and with ENOENT if it does not.
+ */
+int test8_kernelHasTLS(void)
+{
+	int rc = 0;
+#if defined(TCP_ULP)
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (s != -1)
+	{
+		rc = setsockopt(s, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 || errno != ENOENT;
+		close(s);
+	}
+#endif
+	return rc;
+}
+
+void test8OnFailure(void* context, MQTTAsync_failureData* response)
+{
+	AsyncTestClient* tc = (AsyncTestClient*) context;
+	MyLog(LOGA_DEBUG, "In test8OnFailure callback, %s", tc->clientid);
+
+	assert("There should be no failures in this test. ", 0, "test8OnFailure callback was called, rc %d\n",
+			response ? response->code : 0);
+	tc->testFinished = 1;
+}
+
+int test8MessageArrived(void* context, char* topicName, int topicLen,
+		MQTTAsync_message* message)
+{
+	AsyncTestClient* tc = (AsyncTestClient*) context;
+	int size = test8_sizes[test8_received % TEST8_MSGS];
+
+	MyLog(LOGA_DEBUG, "In test8MessageArrived callback %p, %d bytes", tc, message->payloadlen);
+	assert("Message size correct", message->payloadlen == size,
+			"message size was %d", message->payloadlen);
+	if (message->payloadlen == size)
+		assert("Message contents correct", memcmp(message->payload, test8_payload, size) == 0,
+				"message %d content differs", test8_received);
+	if (++test8_received == TEST8_MSGS)
+	{
+		MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+		int rc;
+
+		opts.onSuccess = asyncTestOnUnsubscribe;
+		opts.onFailure = test8OnFailure;
+		opts.context = tc;
+		rc = MQTTAsync_unsubscribe(tc->client, tc->topic, &opts);
+		assert("Unsubscribe successful", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+void test8OnSubscribe(void* context, MQTTAsync_successData* response)
+{
+	AsyncTestClient* tc = (AsyncTestClient*) context;
+	int i;
+
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback %p", tc);
+	for (i = 0; i < TEST8_MSGS; ++i)
+	{
+		int rc = MQTTAsync_send(tc->client, tc->topic, test8_sizes[i], test8_payload, i, 0, NULL);
+
+		assert("Good rc from send", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+}
+
+void test8OnConnect(void* context, MQTTAsync_successData* response)
+{
+	AsyncTestClient* tc = (AsyncTestClient*) context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback, context %p", context);
+	opts.onSuccess = test8OnSubscribe;
+	opts.onFailure = test8OnFailure;
+	opts.context = tc;
+
+	rc = MQTTAsync_subscribe(tc->client, tc->topic, 2, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		tc->testFinished = 1;
+}
+
+int test8(struct Options options)
+{
+	char* testname = "test8";
+	AsyncTestClient tc = AsyncTestClient_initializer;
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_SSLOptions sslopts = MQTTAsync_SSLOptions_initializer;
+	int kernelHasTLS = test8_kernelHasTLS();
+	int rc = 0, i, count = 0;
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 8 - kernel TLS, the kernel %s the tls module",
+			kernelHasTLS ? "has" : "does not have");
+	fprintf(xml, "<testcase classname=\"test5\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	test8_payload = malloc(test8_sizes[TEST8_MSGS - 1]);
+	for (i = 0; i < test8_sizes[TEST8_MSGS - 1]; ++i)
+		test8_payload[i] = (char)(i * 31);
+	test8_received = 0;
+	test8_ktls = -1;
+	MQTTAsync_setTraceLevel(MQTTASYNC_TRACE_PROTOCOL); /* for the kernel TLS trace */
+
+	rc = MQTTAsync_create(&c, options.server_auth_connection, "async_test_8", MQTTCLIENT_PERSISTENCE_NONE,
+			NULL);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	rc = MQTTAsync_setCallbacks(c, &tc, NULL, test8MessageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	tc.client = c;
+	sprintf(tc.clientid, "%s", testname);
+	sprintf(tc.topic, "C client SSL test8");
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.onSuccess = test8OnConnect;
+	opts.onFailure = test8OnFailure;
+	opts.context = &tc;
+
+	opts.ssl = &sslopts;
+	if (options.server_key_file != NULL)
+		opts.ssl->trustStore = options.server_key_file; /*file of certificates trusted by client*/
+	opts.ssl->keyStore = options.client_key_file; /*file of certificate for client to present to server*/
+	if (options.client_key_pass != NULL)
+		opts.ssl->privateKeyPassword = options.client_key_pass;
+	opts.ssl->enableKernelTLS = 1;
+
+	MyLog(LOGA_DEBUG, "Connecting");
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	while (!tc.testFinished && ++count < 30000)
+#if defined(WIN32)
+		Sleep(1);
+#else
+		usleep(1000L);
+#endif
+
+	assert("All messages received", test8_received == TEST8_MSGS, "%d messages were received", test8_received);
+	if (kernelHasTLS && test8_ktls != -1) /* -1 when the library was built without kernel TLS support */
+		assert("Send side passed to the kernel", test8_ktls == 1, "test8_ktls was %d", test8_ktls);
+	MyLog(LOGA_INFO, "Kernel TLS send side %s", test8_ktls == 1 ? "on" : (test8_ktls == 0 ? "off" : "not tried"));
+
+	MQTTAsync_destroy(&c);
+
+exit:
+	MQTTAsync_setTraceLevel(MQTTASYNC_TRACE_ERROR);
+	free(test8_payload);
+	test8_payload = NULL;
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
 void handleTrace(enum MQTTASYNC_TRACE_LEVELS level, char* message)
 {
-	printf("%s\n", message);
+	if (strstr(message, "Kernel TLS on socket"))
+		test8_ktls = strstr(message, "send on") ? 1 : 0;
+	if (level >= MQTTASYNC_TRACE_ERROR)
+		printf("%s\n", message);
 }
 
 int main(int argc, char** argv)
@@ -2037,7 +2234,7 @@ int main(int argc, char** argv)
 	int rc = 0;
 	int (*tests[])() =
 	{ NULL, test1, test2a, test2b, test2c, test3a, test3b, test4, /* test5a,
-			test5b, test5c, */ test6, test7 };
+			test5b, test5c, */ test6, test7, test8 };
 
 	xml = fopen("TEST-test5.xml", "w");
 	fprintf(xml, "<testsuite name=\"test5\" tests=\"%lu\">\n", ARRAY_SIZE(tests) - 1);